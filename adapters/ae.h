@@ -40,6 +40,7 @@ typedef struct mongoAeEvents {
     aeEventLoop *loop;
     int fd;
     int reading, writing;
+    long long timer_id; /* -1 when no timer is pending */
 } mongoAeEvents;
 
 static void mongoAeReadEvent(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -92,11 +93,31 @@ static void mongoAeDelWrite(void *privdata) {
     }
 }
 
+static int mongoAeTimeout(aeEventLoop *el, long long id, void *privdata) {
+    ((void)el); ((void)id);
+
+    mongoAeEvents *e = (mongoAeEvents*)privdata;
+    e->timer_id = -1;
+    mongoAsyncHandleTimeout(e->context);
+    return AE_NOMORE;
+}
+
+static void mongoAeScheduleTimer(void *privdata, struct timeval tv) {
+    mongoAeEvents *e = (mongoAeEvents*)privdata;
+    long long ms = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+
+    if (e->timer_id != -1)
+        aeDeleteTimeEvent(e->loop,e->timer_id);
+    e->timer_id = aeCreateTimeEvent(e->loop,ms,mongoAeTimeout,e,NULL);
+}
+
 static void mongoAeCleanup(void *privdata) {
     mongoAeEvents *e = (mongoAeEvents*)privdata;
     mongoAeDelRead(privdata);
     mongoAeDelWrite(privdata);
-    free(e);
+    if (e->timer_id != -1)
+        aeDeleteTimeEvent(e->loop,e->timer_id);
+    mongo_free(e);
 }
 
 static int mongoAeAttach(aeEventLoop *loop, mongoAsyncContext *ac) {
@@ -108,11 +129,12 @@ static int mongoAeAttach(aeEventLoop *loop, mongoAsyncContext *ac) {
         return MONGO_ERR;
 
     /* Create container for context and r/w events */
-    e = (mongoAeEvents*)malloc(sizeof(*e));
+    e = (mongoAeEvents*)mongo_malloc(sizeof(*e));
     e->context = ac;
     e->loop = loop;
     e->fd = c->fd;
     e->reading = e->writing = 0;
+    e->timer_id = -1;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = mongoAeAddRead;
@@ -120,6 +142,7 @@ static int mongoAeAttach(aeEventLoop *loop, mongoAsyncContext *ac) {
     ac->ev.addWrite = mongoAeAddWrite;
     ac->ev.delWrite = mongoAeDelWrite;
     ac->ev.cleanup = mongoAeCleanup;
+    ac->ev.scheduleTimer = mongoAeScheduleTimer;
     ac->ev.data = e;
 
     return MONGO_OK;
@@ -0,0 +1,634 @@
+#ifndef __HIMONGO_IOURING_H__
+#define __HIMONGO_IOURING_H__
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "../himongo.h"
+#include "../async.h"
+
+/* io_uring event loop for async contexts, which run in completion mode (see
+ * MONGO_COMPLETION): the ring does the reads and writes and the contexts get
+ * their results. One loop drives any number of connections from a single
+ * thread. Requests of all connections are queued during a loop iteration and
+ * submitted together by the next io_uring_enter(2), which also reaps the
+ * completions.
+ *
+ * Connections receive with a multishot recv into a ring of buffers registered
+ * with the kernel and shared by all connections, so a single request keeps
+ * delivering replies. On kernels without it, each connection receives into a
+ * buffer of its own, and the receive is linked behind the send of the
+ * requests when possible so both go out as one submission.
+ *
+ *   mongoUringLoop *loop = mongoUringLoopCreate(4096);
+ *   mongoUringAttach(loop, ac);
+ *   mongoUringLoopRun(loop);
+ */
+
+#define MONGO_URING_BUFS 256 /* shared receive buffers, a power of 2 */
+#define MONGO_URING_BUF_SIZE (16*1024)
+#define MONGO_URING_BGID 0
+
+/* Operations of a connection, kept in the low bits of the user_data of its
+ * requests. Requests with a user_data of 0 complete silently. */
+#define MONGO_URING_RECV 1
+#define MONGO_URING_SEND 2
+#define MONGO_URING_POLL 3
+#define MONGO_URING_TIMEOUT 4
+#define MONGO_URING_OPMASK 7
+
+typedef struct mongoUringLoop {
+    int fd;
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned tail; /* next sqe to fill */
+    unsigned to_submit;
+
+    /* Shared receive buffers, NULL when they could not be registered. */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned short br_tail;
+    int multishot; /* receive into them with multishot recv */
+
+    struct mongoUringEvents *dirty; /* connections with I/O to start */
+    unsigned long nr_events; /* attached connections not freed yet */
+} mongoUringLoop;
+
+typedef struct mongoUringEvents {
+    mongoAsyncContext *context; /* NULL once the context is gone */
+    mongoUringLoop *loop;
+    int fd;
+    int refs; /* attachment, requests in flight and the dirty list */
+    int reading, writing, connecting, timer;
+    int want_read, want_write, want_timer, want_cancel; /* to start */
+    struct mongoUringEvents *next_dirty;
+    int dirty;
+    sds wbuf; /* output being sent */
+    size_t wpos;
+    char *rbuf; /* receive buffer without the shared ones */
+    struct __kernel_timespec ts;
+} mongoUringEvents;
+
+static inline __u64 mongoUringTag(mongoUringEvents *e, int op) {
+    return (__u64)(uintptr_t)e | (__u64)op;
+}
+
+static int mongoUringEnter(mongoUringLoop *loop, unsigned min_complete) {
+    int ret;
+
+    ret = (int)syscall(__NR_io_uring_enter,loop->fd,loop->to_submit,min_complete,
+                       min_complete ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    if (ret < 0)
+        return errno == EINTR || errno == EBUSY || errno == EAGAIN ? 0 : -1;
+    loop->to_submit -= (unsigned)ret < loop->to_submit ? (unsigned)ret : loop->to_submit;
+    return 0;
+}
+
+static int mongoUringRoom(mongoUringLoop *loop, unsigned n) {
+    return loop->tail - __atomic_load_n(loop->sq_head,__ATOMIC_ACQUIRE) + n <= loop->sq_entries;
+}
+
+/* Whether n sqes are free, submitting the queued ones first when they are
+ * not. This does not wait for room: while the kernel holds completions the
+ * ring had no space for it refuses submissions (EBUSY) until they are reaped,
+ * so the caller puts the connection back on the dirty list and the next
+ * iteration tries again, after handling the completions. */
+static int mongoUringHasRoom(mongoUringLoop *loop, unsigned n) {
+    if (mongoUringRoom(loop,n))
+        return 1;
+    return mongoUringEnter(loop,0) == 0 && mongoUringRoom(loop,n);
+}
+
+/* A zeroed sqe, NULL when the ring is full. */
+static struct io_uring_sqe *mongoUringGetSqe(mongoUringLoop *loop) {
+    struct io_uring_sqe *sqe;
+
+    if (!mongoUringHasRoom(loop,1))
+        return NULL;
+    sqe = &loop->sqes[loop->tail & loop->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static void mongoUringQueue(mongoUringLoop *loop) {
+    loop->tail++;
+    loop->to_submit++;
+    __atomic_store_n(loop->sq_tail,loop->tail,__ATOMIC_RELEASE);
+}
+
+static void mongoUringRelease(mongoUringEvents *e) {
+    if (--e->refs > 0)
+        return;
+    e->loop->nr_events--;
+    sdsfree(e->wbuf);
+    mongo_free(e->rbuf);
+    mongo_free(e);
+}
+
+static void mongoUringPutBuf(mongoUringLoop *loop, int bid) {
+    struct io_uring_buf *b = &loop->br->bufs[loop->br_tail & (MONGO_URING_BUFS - 1)];
+
+    /* Only the fields of the entry, the ring's tail overlays the first one. */
+    b->addr = (__u64)(uintptr_t)(loop->bufs + (size_t)bid * MONGO_URING_BUF_SIZE);
+    b->len = MONGO_URING_BUF_SIZE;
+    b->bid = (__u16)bid;
+    loop->br_tail++;
+    __atomic_store_n(&loop->br->tail,loop->br_tail,__ATOMIC_RELEASE);
+}
+
+static void mongoUringMarkDirty(mongoUringEvents *e) {
+    if (e->dirty)
+        return;
+    e->dirty = 1;
+    e->refs++;
+    e->next_dirty = e->loop->dirty;
+    e->loop->dirty = e;
+}
+
+static int mongoUringPrepRecv(mongoUringEvents *e, struct io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = e->fd;
+    sqe->user_data = mongoUringTag(e,MONGO_URING_RECV);
+    if (e->loop->multishot) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = MONGO_URING_BGID;
+    } else {
+        if (e->rbuf == NULL && (e->rbuf = mongo_malloc(MONGO_URING_BUF_SIZE)) == NULL)
+            return -1;
+        sqe->addr = (__u64)(uintptr_t)e->rbuf;
+        sqe->len = MONGO_URING_BUF_SIZE;
+    }
+    e->reading = 1;
+    e->refs++;
+    return 0;
+}
+
+/* Send the rest of the output being written, with the receive linked behind
+ * it when one is wanted and the shared buffers are not available. Both are
+ * queued or neither, a link flag must not end up on the last sqe. */
+static void mongoUringSubmitSend(mongoUringEvents *e) {
+    mongoUringLoop *loop = e->loop;
+    struct io_uring_sqe *sqe, *rsqe;
+    int link = e->want_read && !e->reading && !loop->multishot;
+
+    if (!mongoUringHasRoom(loop,link ? 2 : 1)) {
+        e->writing = 0;
+        mongoUringMarkDirty(e);
+        return;
+    }
+    if (link && e->rbuf == NULL && (e->rbuf = mongo_malloc(MONGO_URING_BUF_SIZE)) == NULL)
+        link = 0;
+    sqe = mongoUringGetSqe(loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = e->fd;
+    sqe->addr = (__u64)(uintptr_t)(e->wbuf + e->wpos);
+    sqe->len = (__u32)(sdslen(e->wbuf) - e->wpos);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = mongoUringTag(e,MONGO_URING_SEND);
+    e->writing = 1;
+    e->refs++;
+    if (link)
+        sqe->flags |= IOSQE_IO_LINK;
+    mongoUringQueue(loop);
+
+    if (link) {
+        rsqe = mongoUringGetSqe(loop);
+        mongoUringPrepRecv(e,rsqe);
+        mongoUringQueue(loop);
+    }
+}
+
+/* Wait for connect(2) to complete. */
+static void mongoUringSubmitPoll(mongoUringEvents *e) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = mongoUringGetSqe(e->loop)) == NULL) {
+        e->want_write = 1;
+        mongoUringMarkDirty(e);
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = e->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = mongoUringTag(e,MONGO_URING_POLL);
+    e->want_write = 0;
+    e->connecting = 1;
+    e->refs++;
+    mongoUringQueue(e->loop);
+}
+
+static void mongoUringSubmitTimer(mongoUringEvents *e) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = mongoUringGetSqe(e->loop)) == NULL) {
+        e->want_timer = 1;
+        mongoUringMarkDirty(e);
+        return;
+    }
+    e->want_timer = 0;
+    if (e->timer) {
+        /* Move the pending one. When it fired already, its completion
+         * reschedules. */
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = mongoUringTag(e,MONGO_URING_TIMEOUT);
+        sqe->addr2 = (__u64)(uintptr_t)&e->ts;
+        sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+    } else {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (__u64)(uintptr_t)&e->ts;
+        sqe->len = 1;
+        sqe->user_data = mongoUringTag(e,MONGO_URING_TIMEOUT);
+        e->timer = 1;
+        e->refs++;
+    }
+    mongoUringQueue(e->loop);
+}
+
+/* Cancel the requests of a connection whose context is gone, except a send
+ * that is still writing out the last requests. */
+static void mongoUringSubmitCancel(mongoUringEvents *e) {
+    struct io_uring_sqe *sqe;
+    int io = e->reading || e->connecting;
+
+    if (!mongoUringHasRoom(e->loop,(unsigned)(io + e->timer))) {
+        e->want_cancel = 1;
+        mongoUringMarkDirty(e);
+        return;
+    }
+    e->want_cancel = 0;
+    if (io) {
+        sqe = mongoUringGetSqe(e->loop);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = mongoUringTag(e,e->reading ? MONGO_URING_RECV : MONGO_URING_POLL);
+        mongoUringQueue(e->loop);
+    }
+    if (e->timer) {
+        sqe = mongoUringGetSqe(e->loop);
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = mongoUringTag(e,MONGO_URING_TIMEOUT);
+        mongoUringQueue(e->loop);
+    }
+}
+
+/* Start the I/O asked for since the last iteration: one send with all the
+ * output of the connection and the receive, and what found the ring full
+ * before. What finds it full now goes on a new list, for the next one. */
+static void mongoUringFlushDirty(mongoUringLoop *loop) {
+    mongoUringEvents *e, *next = loop->dirty;
+    struct io_uring_sqe *sqe;
+    mongoAsyncContext *ac;
+
+    loop->dirty = NULL;
+    while ((e = next) != NULL) {
+        next = e->next_dirty;
+        e->dirty = 0;
+        ac = e->context;
+        if (ac == NULL && e->want_cancel)
+            mongoUringSubmitCancel(e);
+        if (ac != NULL && e->want_timer)
+            mongoUringSubmitTimer(e);
+        if (ac != NULL && e->want_write && !(ac->c.flags & MONGO_CONNECTED)) {
+            if (!e->connecting)
+                mongoUringSubmitPoll(e);
+        } else if (!e->writing && (e->wbuf != NULL || (ac != NULL && e->want_write))) {
+            if (e->wbuf == NULL) {
+                /* Not a send that found the ring full. */
+                e->want_write = 0;
+                e->wbuf = mongoAsyncTakeOutput(ac);
+                e->wpos = 0;
+            }
+            if (e->wbuf != NULL) {
+                mongoUringSubmitSend(e);
+            } else if (ac->c.err) {
+                /* The output could not be taken. */
+                mongoAsyncHandleWritten(ac,-ENOMEM);
+                ac = e->context;
+            }
+        }
+        if (ac != NULL && e->want_read && !e->reading) {
+            if ((sqe = mongoUringGetSqe(loop)) == NULL)
+                mongoUringMarkDirty(e);
+            else if (mongoUringPrepRecv(e,sqe) == 0)
+                mongoUringQueue(loop);
+        }
+        mongoUringRelease(e);
+    }
+}
+
+static void mongoUringHandleRecv(mongoUringEvents *e, struct io_uring_cqe *cqe) {
+    mongoUringLoop *loop = e->loop;
+    const char *buf = e->rbuf;
+    int bid = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        buf = loop->bufs + (size_t)bid * MONGO_URING_BUF_SIZE;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        e->reading = 0;
+
+    if (cqe->res == -EINVAL && bid == -1 && loop->multishot) {
+        /* No multishot receive on this kernel, use plain receives. */
+        loop->multishot = 0;
+    } else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+        /* Out of shared buffers, or the send it was linked to failed. */
+    } else if (e->context != NULL) {
+        mongoAsyncHandleData(e->context,buf,cqe->res);
+    }
+    if (bid != -1)
+        mongoUringPutBuf(loop,bid);
+
+    /* Keep receiving. */
+    if (e->context != NULL && !e->reading) {
+        e->want_read = 1;
+        mongoUringMarkDirty(e);
+    }
+}
+
+static void mongoUringHandleSend(mongoUringEvents *e, struct io_uring_cqe *cqe) {
+    if (cqe->res > 0)
+        e->wpos += (size_t)cqe->res;
+    if (e->context != NULL)
+        mongoAsyncHandleWritten(e->context,cqe->res);
+
+    if (cqe->res >= 0 && e->wpos < sdslen(e->wbuf) && e->context != NULL) {
+        /* Short write, send the rest. */
+        mongoUringSubmitSend(e);
+        return;
+    }
+    e->writing = 0;
+    sdsfree(e->wbuf);
+    e->wbuf = NULL;
+    if (e->context != NULL && e->want_write)
+        mongoUringMarkDirty(e);
+}
+
+static void mongoUringHandleCqe(struct io_uring_cqe *cqe) {
+    mongoUringEvents *e;
+    int op, final = !(cqe->flags & IORING_CQE_F_MORE);
+
+    if (cqe->user_data == 0)
+        return;
+    op = (int)(cqe->user_data & MONGO_URING_OPMASK);
+    e = (mongoUringEvents *)(uintptr_t)(cqe->user_data & ~(__u64)MONGO_URING_OPMASK);
+
+    /* The context may free itself from a callback, e stays valid until the
+     * completion was handled. */
+    e->refs++;
+    switch (op) {
+    case MONGO_URING_RECV:
+        mongoUringHandleRecv(e,cqe);
+        break;
+    case MONGO_URING_SEND:
+        mongoUringHandleSend(e,cqe);
+        break;
+    case MONGO_URING_POLL:
+        e->connecting = 0;
+        if (e->context != NULL)
+            mongoAsyncHandleWrite(e->context);
+        break;
+    case MONGO_URING_TIMEOUT:
+        e->timer = 0;
+        if (e->context != NULL && cqe->res != -ECANCELED)
+            mongoAsyncHandleTimeout(e->context);
+        break;
+    }
+    if (final)
+        mongoUringRelease(e);
+    mongoUringRelease(e);
+}
+
+/* Submit the queued requests and handle the completions, waiting for one
+ * when wait is set. Returns the number of completions or -1 on error. */
+static int mongoUringLoopRunOnce(mongoUringLoop *loop, int wait) {
+    struct io_uring_cqe cqe;
+    unsigned head;
+    int n = 0;
+
+    /* Don't wait with work left over for lack of room. */
+    mongoUringFlushDirty(loop);
+    if (mongoUringEnter(loop,wait && loop->dirty == NULL ? 1 : 0) != 0)
+        return -1;
+
+    head = *loop->cq_head;
+    while (head != __atomic_load_n(loop->cq_tail,__ATOMIC_ACQUIRE)) {
+        cqe = loop->cqes[head & loop->cq_mask];
+        head++;
+        __atomic_store_n(loop->cq_head,head,__ATOMIC_RELEASE);
+        mongoUringHandleCqe(&cqe);
+        n++;
+    }
+    return n;
+}
+
+/* Run until all the attached contexts are gone. */
+static int mongoUringLoopRun(mongoUringLoop *loop) {
+    while (loop->nr_events > 0) {
+        if (mongoUringLoopRunOnce(loop,1) == -1)
+            return MONGO_ERR;
+    }
+    return MONGO_OK;
+}
+
+static void mongoUringAddRead(void *privdata) {
+    mongoUringEvents *e = (mongoUringEvents*)privdata;
+
+    if (e->reading || !(e->context->c.flags & MONGO_CONNECTED))
+        return;
+    e->want_read = 1;
+    mongoUringMarkDirty(e);
+}
+
+static void mongoUringDelRead(void *privdata) {
+    mongoUringEvents *e = (mongoUringEvents*)privdata;
+    e->want_read = 0;
+}
+
+static void mongoUringAddWrite(void *privdata) {
+    mongoUringEvents *e = (mongoUringEvents*)privdata;
+
+    if (e->context->c.flags & MONGO_CONNECTED) {
+        e->want_write = 1;
+        mongoUringMarkDirty(e);
+    } else if (!e->connecting) {
+        mongoUringSubmitPoll(e);
+    }
+}
+
+static void mongoUringDelWrite(void *privdata) {
+    ((void)privdata);
+}
+
+static void mongoUringScheduleTimer(void *privdata, struct timeval tv) {
+    mongoUringEvents *e = (mongoUringEvents*)privdata;
+
+    e->ts.tv_sec = tv.tv_sec;
+    e->ts.tv_nsec = tv.tv_usec * 1000LL;
+    mongoUringSubmitTimer(e);
+}
+
+static void mongoUringCleanup(void *privdata) {
+    mongoUringEvents *e = (mongoUringEvents*)privdata;
+
+    e->context = NULL;
+    mongoUringSubmitCancel(e);
+    mongoUringRelease(e);
+}
+
+static int mongoUringAttach(mongoUringLoop *loop, mongoAsyncContext *ac) {
+    mongoContext *c = &(ac->c);
+    mongoUringEvents *e;
+
+    /* Nothing should be attached when something is already attached */
+    if (ac->ev.data != NULL)
+        return MONGO_ERR;
+
+    /* Create container for context and r/w events */
+    e = (mongoUringEvents*)mongo_calloc(1,sizeof(*e));
+    if (e == NULL)
+        return MONGO_ERR;
+    e->context = ac;
+    e->loop = loop;
+    e->fd = c->fd;
+    e->refs = 1;
+    loop->nr_events++;
+
+    /* Register functions to start/stop listening for events */
+    ac->ev.addRead = mongoUringAddRead;
+    ac->ev.delRead = mongoUringDelRead;
+    ac->ev.addWrite = mongoUringAddWrite;
+    ac->ev.delWrite = mongoUringDelWrite;
+    ac->ev.cleanup = mongoUringCleanup;
+    ac->ev.scheduleTimer = mongoUringScheduleTimer;
+    ac->ev.data = e;
+    c->flags |= MONGO_COMPLETION;
+
+    return MONGO_OK;
+}
+
+/* Register the shared receive buffers, leaving them off when the kernel
+ * does not support it. */
+static void mongoUringSetupBufs(mongoUringLoop *loop) {
+    struct io_uring_buf_reg reg;
+    size_t ring_sz = MONGO_URING_BUFS * sizeof(struct io_uring_buf);
+    void *br;
+
+    br = mmap(NULL,ring_sz,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (br == MAP_FAILED)
+        return;
+    loop->bufs = mongo_malloc((size_t)MONGO_URING_BUFS * MONGO_URING_BUF_SIZE);
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (__u64)(uintptr_t)br;
+    reg.ring_entries = MONGO_URING_BUFS;
+    reg.bgid = MONGO_URING_BGID;
+    if (loop->bufs == NULL ||
+        syscall(__NR_io_uring_register,loop->fd,IORING_REGISTER_PBUF_RING,&reg,1) != 0) {
+        munmap(br,ring_sz);
+        mongo_free(loop->bufs);
+        loop->bufs = NULL;
+        return;
+    }
+    loop->br = (struct io_uring_buf_ring *)br;
+    loop->br_tail = 0;
+    loop->multishot = 1;
+    for (int i = 0; i < MONGO_URING_BUFS; i++)
+        mongoUringPutBuf(loop,i);
+}
+
+static void mongoUringLoopFree(mongoUringLoop *loop) {
+    if (loop == NULL)
+        return;
+    if (loop->sqes != NULL)
+        munmap(loop->sqes,loop->sqes_sz);
+    if (loop->cq_ring != NULL && loop->cq_ring != loop->sq_ring)
+        munmap(loop->cq_ring,loop->cq_ring_sz);
+    if (loop->sq_ring != NULL)
+        munmap(loop->sq_ring,loop->sq_ring_sz);
+    if (loop->fd != -1)
+        close(loop->fd);
+    if (loop->br != NULL)
+        munmap(loop->br,MONGO_URING_BUFS * sizeof(struct io_uring_buf));
+    mongo_free(loop->bufs);
+    mongo_free(loop);
+}
+
+/* Create a loop whose ring holds the given number of requests. Returns NULL
+ * when io_uring is not available. */
+static mongoUringLoop *mongoUringLoopCreate(unsigned entries) {
+    struct io_uring_params p;
+    mongoUringLoop *loop;
+    unsigned *array;
+    char *sq, *cq;
+
+    loop = (mongoUringLoop*)mongo_calloc(1,sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+    memset(&p,0,sizeof(p));
+    loop->fd = (int)syscall(__NR_io_uring_setup,entries,&p);
+    if (loop->fd < 0) {
+        loop->fd = -1;
+        goto error;
+    }
+
+    loop->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    loop->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_ring_sz > loop->sq_ring_sz)
+            loop->sq_ring_sz = loop->cq_ring_sz;
+        loop->cq_ring_sz = loop->sq_ring_sz;
+    }
+    sq = mmap(NULL,loop->sq_ring_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+              loop->fd,IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto error;
+    loop->sq_ring = sq;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL,loop->cq_ring_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                  loop->fd,IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto error;
+    }
+    loop->cq_ring = cq;
+    loop->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL,loop->sqes_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                      loop->fd,IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        loop->sqes = NULL;
+        goto error;
+    }
+
+    loop->sq_head = (unsigned *)(sq + p.sq_off.head);
+    loop->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    loop->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    loop->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+    loop->cq_head = (unsigned *)(cq + p.cq_off.head);
+    loop->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    loop->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    loop->tail = *loop->sq_tail;
+
+    /* Slot i of the submission array always points at sqe i. */
+    array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < loop->sq_entries; i++)
+        array[i] = i;
+
+    mongoUringSetupBufs(loop);
+    return loop;
+
+error:
+    mongoUringLoopFree(loop);
+    return NULL;
+}
+#endif
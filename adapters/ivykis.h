@@ -43,7 +43,7 @@ static void mongoIvykisCleanup(void *privdata) {
     mongoIvykisEvents *e = (mongoIvykisEvents*)privdata;
 
     iv_fd_unregister(&e->fd);
-    free(e);
+    mongo_free(e);
 }
 
 static int mongoIvykisAttach(mongoAsyncContext *ac) {
@@ -55,7 +55,7 @@ static int mongoIvykisAttach(mongoAsyncContext *ac) {
         return MONGO_ERR;
 
     /* Create container for context and r/w events */
-    e = (mongoIvykisEvents*)malloc(sizeof(*e));
+    e = (mongoIvykisEvents*)mongo_malloc(sizeof(*e));
     e->context = ac;
 
     /* Register functions to start/stop listening for events */
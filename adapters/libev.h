@@ -41,6 +41,7 @@ typedef struct mongoLibevEvents {
     struct ev_loop *loop;
     int reading, writing;
     ev_io rev, wev;
+    ev_timer timer;
 } mongoLibevEvents;
 
 static void mongoLibevReadEvent(EV_P_ ev_io *watcher, int revents) {
@@ -63,6 +64,16 @@ static void mongoLibevWriteEvent(EV_P_ ev_io *watcher, int revents) {
     mongoAsyncHandleWrite(e->context);
 }
 
+static void mongoLibevTimeout(EV_P_ ev_timer *timer, int revents) {
+#if EV_MULTIPLICITY
+    ((void)loop);
+#endif
+    ((void)revents);
+
+    mongoLibevEvents *e = (mongoLibevEvents*)timer->data;
+    mongoAsyncHandleTimeout(e->context);
+}
+
 static void mongoLibevAddRead(void *privdata) {
     mongoLibevEvents *e = (mongoLibevEvents*)privdata;
     struct ev_loop *loop = e->loop;
@@ -103,11 +114,23 @@ static void mongoLibevDelWrite(void *privdata) {
     }
 }
 
+static void mongoLibevScheduleTimer(void *privdata, struct timeval tv) {
+    mongoLibevEvents *e = (mongoLibevEvents*)privdata;
+    struct ev_loop *loop = e->loop;
+    ((void)loop);
+    ev_timer_stop(EV_A_ &e->timer);
+    ev_timer_set(&e->timer,tv.tv_sec + tv.tv_usec / 1000000.0,0);
+    ev_timer_start(EV_A_ &e->timer);
+}
+
 static void mongoLibevCleanup(void *privdata) {
     mongoLibevEvents *e = (mongoLibevEvents*)privdata;
+    struct ev_loop *loop = e->loop;
+    ((void)loop);
     mongoLibevDelRead(privdata);
     mongoLibevDelWrite(privdata);
-    free(e);
+    ev_timer_stop(EV_A_ &e->timer);
+    mongo_free(e);
 }
 
 static int mongoLibevAttach(EV_P_ mongoAsyncContext *ac) {
@@ -119,7 +142,7 @@ static int mongoLibevAttach(EV_P_ mongoAsyncContext *ac) {
         return MONGO_ERR;
 
     /* Create container for context and r/w events */
-    e = (mongoLibevEvents*)malloc(sizeof(*e));
+    e = (mongoLibevEvents*)mongo_malloc(sizeof(*e));
     e->context = ac;
 #if EV_MULTIPLICITY
     e->loop = loop;
@@ -129,6 +152,7 @@ static int mongoLibevAttach(EV_P_ mongoAsyncContext *ac) {
     e->reading = e->writing = 0;
     e->rev.data = e;
     e->wev.data = e;
+    e->timer.data = e;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = mongoLibevAddRead;
@@ -136,11 +160,13 @@ static int mongoLibevAttach(EV_P_ mongoAsyncContext *ac) {
     ac->ev.addWrite = mongoLibevAddWrite;
     ac->ev.delWrite = mongoLibevDelWrite;
     ac->ev.cleanup = mongoLibevCleanup;
+    ac->ev.scheduleTimer = mongoLibevScheduleTimer;
     ac->ev.data = e;
 
     /* Initialize read/write events */
     ev_io_init(&e->rev,mongoLibevReadEvent,c->fd,EV_READ);
     ev_io_init(&e->wev,mongoLibevWriteEvent,c->fd,EV_WRITE);
+    ev_timer_init(&e->timer,mongoLibevTimeout,0,0);
     return MONGO_OK;
 }
 
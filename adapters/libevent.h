@@ -36,7 +36,7 @@
 
 typedef struct mongoLibeventEvents {
     mongoAsyncContext *context;
-    struct event *rev, *wev;
+    struct event *rev, *wev, *tev;
 } mongoLibeventEvents;
 
 static void mongoLibeventReadEvent(int fd, short event, void *arg) {
@@ -51,6 +51,12 @@ static void mongoLibeventWriteEvent(int fd, short event, void *arg) {
     mongoAsyncHandleWrite(e->context);
 }
 
+static void mongoLibeventTimeout(int fd, short event, void *arg) {
+    ((void)fd); ((void)event);
+    mongoLibeventEvents *e = (mongoLibeventEvents*)arg;
+    mongoAsyncHandleTimeout(e->context);
+}
+
 static void mongoLibeventAddRead(void *privdata) {
     mongoLibeventEvents *e = (mongoLibeventEvents*)privdata;
     event_add(e->rev,NULL);
@@ -71,11 +77,17 @@ static void mongoLibeventDelWrite(void *privdata) {
     event_del(e->wev);
 }
 
+static void mongoLibeventScheduleTimer(void *privdata, struct timeval tv) {
+    mongoLibeventEvents *e = (mongoLibeventEvents*)privdata;
+    evtimer_add(e->tev,&tv);
+}
+
 static void mongoLibeventCleanup(void *privdata) {
     mongoLibeventEvents *e = (mongoLibeventEvents*)privdata;
     event_free(e->rev);
     event_free(e->wev);
-    free(e);
+    event_free(e->tev);
+    mongo_free(e);
 }
 
 static int mongoLibeventAttach(mongoAsyncContext *ac, struct event_base *base) {
@@ -87,7 +99,7 @@ static int mongoLibeventAttach(mongoAsyncContext *ac, struct event_base *base) {
         return MONGO_ERR;
 
     /* Create container for context and r/w events */
-    e = (mongoLibeventEvents*)malloc(sizeof(*e));
+    e = (mongoLibeventEvents*)mongo_malloc(sizeof(*e));
     e->context = ac;
 
     /* Register functions to start/stop listening for events */
@@ -96,11 +108,13 @@ static int mongoLibeventAttach(mongoAsyncContext *ac, struct event_base *base) {
     ac->ev.addWrite = mongoLibeventAddWrite;
     ac->ev.delWrite = mongoLibeventDelWrite;
     ac->ev.cleanup = mongoLibeventCleanup;
+    ac->ev.scheduleTimer = mongoLibeventScheduleTimer;
     ac->ev.data = e;
 
     /* Initialize and install read/write events */
     e->rev = event_new(base, c->fd, EV_READ, mongoLibeventReadEvent, e);
     e->wev = event_new(base, c->fd, EV_WRITE, mongoLibeventWriteEvent, e);
+    e->tev = evtimer_new(base, mongoLibeventTimeout, e);
     event_add(e->rev, NULL);
     event_add(e->wev, NULL);
     return MONGO_OK;
@@ -9,7 +9,9 @@
 typedef struct mongoLibuvEvents {
   mongoAsyncContext* context;
   uv_poll_t          handle;
+  uv_timer_t         timer;
   int                events;
+  int                handles; // still open, p is freed when both are closed
 } mongoLibuvEvents;
 
 
@@ -73,10 +75,29 @@ static void mongoLibuvDelWrite(void *privdata) {
 }
 
 
+static void mongoLibuvTimeout(uv_timer_t* timer) {
+  mongoLibuvEvents* p = (mongoLibuvEvents*)timer->data;
+
+  if (p->context != NULL) {
+    mongoAsyncHandleTimeout(p->context);
+  }
+}
+
+
+static void mongoLibuvScheduleTimer(void *privdata, struct timeval tv) {
+  mongoLibuvEvents* p = (mongoLibuvEvents*)privdata;
+  uint64_t ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+  uv_timer_start(&p->timer, mongoLibuvTimeout, ms, 0);
+}
+
+
 static void on_close(uv_handle_t* handle) {
   mongoLibuvEvents* p = (mongoLibuvEvents*)handle->data;
 
-  free(p);
+  if (--p->handles == 0) {
+    mongo_free(p);
+  }
 }
 
 
@@ -85,6 +106,7 @@ static void mongoLibuvCleanup(void *privdata) {
 
   p->context = NULL; // indicate that context might no longer exist
   uv_close((uv_handle_t*)&p->handle, on_close);
+  uv_close((uv_handle_t*)&p->timer, on_close);
 }
 
 
@@ -100,8 +122,9 @@ static int mongoLibuvAttach(mongoAsyncContext* ac, uv_loop_t* loop) {
   ac->ev.addWrite = mongoLibuvAddWrite;
   ac->ev.delWrite = mongoLibuvDelWrite;
   ac->ev.cleanup  = mongoLibuvCleanup;
+  ac->ev.scheduleTimer = mongoLibuvScheduleTimer;
 
-  mongoLibuvEvents* p = (mongoLibuvEvents*)malloc(sizeof(*p));
+  mongoLibuvEvents* p = (mongoLibuvEvents*)mongo_malloc(sizeof(*p));
 
   if (!p) {
     return MONGO_ERR;
@@ -112,9 +135,12 @@ static int mongoLibuvAttach(mongoAsyncContext* ac, uv_loop_t* loop) {
   if (uv_poll_init(loop, &p->handle, c->fd) != 0) {
     return MONGO_ERR;
   }
+  uv_timer_init(loop, &p->timer);
 
   ac->ev.data    = p;
   p->handle.data = p;
+  p->timer.data  = p;
+  p->handles     = 2;
   p->context     = ac;
 
   return MONGO_OK;
@@ -27,7 +27,7 @@ static int freeMongoRunLoop(MongoRunLoop* mongoRunLoop) {
             CFSocketInvalidate(mongoRunLoop->socketRef);
             CFRelease(mongoRunLoop->socketRef);
         }
-        free(mongoRunLoop);
+        mongo_free(mongoRunLoop);
     }
     return MONGO_ERR;
 }
@@ -80,7 +80,7 @@ static int mongoMacOSAttach(mongoAsyncContext *mongoAsyncCtx, CFRunLoopRef runLo
     /* Nothing should be attached when something is already attached */
     if( mongoAsyncCtx->ev.data != NULL ) return MONGO_ERR;
 
-    MongoRunLoop* mongoRunLoop = (MongoRunLoop*) calloc(1, sizeof(MongoRunLoop));
+    MongoRunLoop* mongoRunLoop = (MongoRunLoop*) mongo_calloc(1, sizeof(MongoRunLoop));
     if( !mongoRunLoop ) return MONGO_ERR;
 
     /* Setup mongo stuff */
@@ -0,0 +1,53 @@
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "libbson/src/bson/bson.h"
+
+mongoAllocFuncs mongoAllocFns = {
+    malloc,
+    calloc,
+    realloc,
+    free,
+};
+
+/* Route the allocations of the library and of libbson through fns, which
+ * must have all four functions set. This has to happen before the first
+ * context is created or the first document is built, memory can't be
+ * freed by another allocator than the one it came from. Returns the
+ * functions that were in use. */
+mongoAllocFuncs mongoSetAllocators(const mongoAllocFuncs *fns) {
+    mongoAllocFuncs orig = mongoAllocFns;
+    bson_mem_vtable_t vtable;
+
+    mongoAllocFns = *fns;
+    memset(&vtable, 0, sizeof(vtable));
+    vtable.malloc = fns->mallocFn;
+    vtable.calloc = fns->callocFn;
+    vtable.realloc = fns->reallocFn;
+    vtable.free = fns->freeFn;
+    bson_mem_set_vtable(&vtable);
+    return orig;
+}
+
+/* Go back to the allocators of libc. */
+void mongoResetAllocators(void) {
+    mongoAllocFns = (mongoAllocFuncs) {
+        malloc,
+        calloc,
+        realloc,
+        free,
+    };
+    bson_mem_restore_vtable();
+}
+
+char *mongo_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *p = mongo_malloc(len);
+
+    if (p == NULL)
+        return NULL;
+    memcpy(p, str, len);
+    return p;
+}
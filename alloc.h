@@ -0,0 +1,45 @@
+#ifndef __HIMONGO_ALLOC_H
+#define __HIMONGO_ALLOC_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The functions every allocation of the library goes through. They default
+ * to the ones of libc. */
+typedef struct mongoAllocFuncs {
+    void *(*mallocFn)(size_t);
+    void *(*callocFn)(size_t, size_t);
+    void *(*reallocFn)(void *, size_t);
+    void (*freeFn)(void *);
+} mongoAllocFuncs;
+
+mongoAllocFuncs mongoSetAllocators(const mongoAllocFuncs *fns);
+void mongoResetAllocators(void);
+
+extern mongoAllocFuncs mongoAllocFns;
+
+static inline void *mongo_malloc(size_t size) {
+    return mongoAllocFns.mallocFn(size);
+}
+
+static inline void *mongo_calloc(size_t nmemb, size_t size) {
+    return mongoAllocFns.callocFn(nmemb, size);
+}
+
+static inline void *mongo_realloc(void *ptr, size_t size) {
+    return mongoAllocFns.reallocFn(ptr, size);
+}
+
+static inline void mongo_free(void *ptr) {
+    mongoAllocFns.freeFn(ptr);
+}
+
+char *mongo_strdup(const char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
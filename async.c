@@ -1,4 +1,5 @@
 #include "fmacros.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -7,9 +8,14 @@
 #include <errno.h>
 #include "async.h"
 #include "net.h"
+#include "alloc.h"
 #include "sds.h"
 #include "proto.h"
 #include "utils.h"
+#include "endianconv.h"
+
+/* Defined in himongo.c */
+void __mongoSetError(mongoContext *c, int type, const char *str);
 
 #define _EL_ADD_READ(ctx) do { \
         if ((ctx)->ev.addRead) (ctx)->ev.addRead((ctx)->ev.data); \
@@ -26,12 +32,226 @@
 #define _EL_CLEANUP(ctx) do { \
         if ((ctx)->ev.cleanup) (ctx)->ev.cleanup((ctx)->ev.data); \
     } while(0);
+#define _EL_SCHEDULE_TIMER(ctx, tv) do { \
+        if ((ctx)->ev.scheduleTimer) (ctx)->ev.scheduleTimer((ctx)->ev.data, (tv)); \
+    } while(0)
+
+/* Caller of a coalesced insert that asked for the reply, and where its
+ * documents are in the message. */
+typedef struct mongoBatchCaller {
+    mongoCallbackFn *fn;
+    void *privdata;
+    int first; /* Index of its first document */
+    int count;
+} mongoBatchCaller;
+
+/* Inserts to one namespace waiting to be sent as a single message, see
+ * mongoAsyncSetInsertCoalescing. */
+typedef struct mongoInsertBatch {
+    sds db;
+    sds col;
+    int32_t flags;
+    sds docs; /* copies of the documents, back to back */
+    int nr_docs;
+    int nr_callers;
+    int cap_callers;
+    mongoBatchCaller *callers;
+} mongoInsertBatch;
+
+static mongoInsertBatch *__mongoBatchCreate(const char *db, const char *col, int32_t flags) {
+    mongoInsertBatch *b;
+
+    b = mongo_calloc(1,sizeof(*b));
+    if (b == NULL)
+        return NULL;
+    b->db = sdsnew(db);
+    b->col = sdsnew(col);
+    b->docs = sdsempty();
+    b->flags = flags;
+    if (b->db == NULL || b->col == NULL || b->docs == NULL) {
+        sdsfree(b->db);
+        sdsfree(b->col);
+        sdsfree(b->docs);
+        mongo_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void __mongoBatchFree(mongoInsertBatch *b) {
+    sdsfree(b->db);
+    sdsfree(b->col);
+    sdsfree(b->docs);
+    mongo_free(b->callers);
+    mongo_free(b);
+}
+
+/* Copy the write errors of the documents of one caller out of the insert
+ * command reply of the whole message, with their index counted from the
+ * first document of the caller. *stop is set to the index where an ordered
+ * insert stopped, INT32_MAX when it didn't. Returns the number copied. */
+static int32_t __mongoBatchCallerErrors(mongoInsertBatch *b, mongoBatchCaller *bc,
+                                        bson_t *doc, bson_t *errors, int32_t *stop)
+{
+    bson_iter_t it, list, err;
+    bson_t entry;
+    int32_t idx, nr = 0;
+    char key[16];
+
+    *stop = INT32_MAX;
+    if (!bson_iter_init_find(&it,doc,"writeErrors") || !BSON_ITER_HOLDS_ARRAY(&it) ||
+        !bson_iter_recurse(&it,&list))
+        return 0;
+    while (bson_iter_next(&list)) {
+        if (!BSON_ITER_HOLDS_DOCUMENT(&list) || !bson_iter_recurse(&list,&err) ||
+            !bson_iter_find(&err,"index"))
+            continue;
+        idx = (int32_t)bson_iter_as_int64(&err);
+        if (!(b->flags & INSERT_FLAG_CONT_ON_ERR) && idx < *stop)
+            *stop = idx;
+        if (idx < bc->first || idx >= bc->first + bc->count)
+            continue;
+
+        bson_init(&entry);
+        bson_iter_recurse(&list,&err);
+        while (bson_iter_next(&err)) {
+            if (strcmp(bson_iter_key(&err),"index") == 0)
+                BSON_APPEND_INT32(&entry,"index",idx - bc->first);
+            else
+                bson_append_iter(&entry,NULL,-1,&err);
+        }
+        snprintf(key,sizeof(key),"%d",nr++);
+        BSON_APPEND_DOCUMENT(errors,key,&entry);
+        bson_destroy(&entry);
+    }
+    return nr;
+}
+
+/* Build the command reply of one caller out of the one of the whole message.
+ *
+ * With OP_MSG the caller gets its own n and the write errors of its own
+ * documents, the other fields are shared. When an ordered insert stopped
+ * before the documents of the caller, they were never tried and the caller
+ * gets an error saying so. A legacy getlasterror can't tell which document
+ * failed, so the caller gets it whole, with batchOffset and batchCount
+ * telling where its documents were in the message. */
+static void __mongoBatchCallerDoc(mongoInsertBatch *b, mongoBatchCaller *bc, bson_t *doc,
+                                  int opmsg, bson_t *out)
+{
+    bson_iter_t it;
+    bson_t errors, entry;
+    int32_t nr_errors, stop, n;
+
+    bson_init(out);
+    if (!opmsg) {
+        if (bson_iter_init(&it,doc)) {
+            while (bson_iter_next(&it))
+                bson_append_iter(out,NULL,-1,&it);
+        }
+        BSON_APPEND_INT32(out,"batchOffset",bc->first);
+        BSON_APPEND_INT32(out,"batchCount",bc->count);
+        return;
+    }
+
+    if (bson_iter_init(&it,doc)) {
+        while (bson_iter_next(&it)) {
+            if (strcmp(bson_iter_key(&it),"n") != 0 &&
+                strcmp(bson_iter_key(&it),"writeErrors") != 0)
+                bson_append_iter(out,NULL,-1,&it);
+        }
+    }
+    bson_init(&errors);
+    nr_errors = __mongoBatchCallerErrors(b,bc,doc,&errors,&stop);
+    if (stop < bc->first) {
+        n = 0;
+        bson_init(&entry);
+        BSON_APPEND_INT32(&entry,"index",0);
+        BSON_APPEND_UTF8(&entry,"errmsg","not attempted, an earlier insert of the batch failed");
+        BSON_APPEND_DOCUMENT(&errors,"0",&entry);
+        bson_destroy(&entry);
+        nr_errors = 1;
+    } else if (stop < bc->first + bc->count) {
+        n = stop - bc->first;
+    } else {
+        n = bc->count - nr_errors;
+    }
+    BSON_APPEND_INT32(out,"n",n);
+    if (nr_errors > 0)
+        BSON_APPEND_ARRAY(out,"writeErrors",&errors);
+    bson_destroy(&errors);
+}
+
+/* The reply a caller of a coalesced insert gets, built like one the server
+ * sent, see __mongoBatchCallerDoc. NULL when out of memory. */
+static void *__mongoBatchCallerReply(mongoContext *c, mongoInsertBatch *b,
+                                     mongoBatchCaller *bc, void *reply)
+{
+    mongoReply *m = reply;
+    size_t hdrlen = m->opCode == OP_MSG ? 21 : 36;
+    char *pkt;
+    void *own;
+    bson_t doc;
+
+    __mongoBatchCallerDoc(b,bc,mongoReplyCommandDoc(reply),m->opCode == OP_MSG,&doc);
+    pkt = mongo_malloc(hdrlen + doc.len);
+    if (pkt == NULL) {
+        bson_destroy(&doc);
+        return NULL;
+    }
+    dump32le((uint32_t)(hdrlen + doc.len),pkt);
+    dump32le((uint32_t)m->requestID,pkt+4);
+    dump32le((uint32_t)m->responseTo,pkt+8);
+    dump32le((uint32_t)m->opCode,pkt+12);
+    if (m->opCode == OP_MSG) {
+        dump32le(0,pkt+16);
+        pkt[20] = MSG_SECTION_BODY;
+    } else {
+        dump32le((uint32_t)m->responseFlags,pkt+16);
+        dump64le((uint64_t)m->cursorID,pkt+20);
+        dump32le((uint32_t)m->startingFrom,pkt+28);
+        dump32le(1,pkt+32);
+    }
+    memcpy(pkt + hdrlen,bson_get_data(&doc),doc.len);
+    own = c->reader->fn->createReply(pkt,hdrlen + doc.len);
+    mongo_free(pkt);
+    bson_destroy(&doc);
+    return own;
+}
+
+/* Hand the reply of a coalesced insert to the callback of every caller,
+ * it is registered as the callback of the message that carried them. Each
+ * caller gets a reply of its own, unless the reply isn't the result of the
+ * insert (a NULL reply or a failed command, which concern every caller) or
+ * the reader builds replies of another kind. */
+static void __mongoBatchReply(struct mongoAsyncContext *ac, void *reply, void *privdata) {
+    mongoContext *c = &ac->c;
+    mongoInsertBatch *b = privdata;
+    int split;
+    void *own;
+
+    split = reply != NULL && c->reader->fn->createReply == mongoReplyCreateFromBytes &&
+        mongoReplyCommandOk(reply);
+    for (int i = 0; i < b->nr_callers; i++) {
+        if (!split) {
+            b->callers[i].fn(ac,reply,b->callers[i].privdata);
+            continue;
+        }
+        own = __mongoBatchCallerReply(c,b,&b->callers[i],reply);
+        if (own == NULL)
+            __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+        b->callers[i].fn(ac,own,b->callers[i].privdata);
+        if (own != NULL)
+            c->reader->fn->freeObject(own);
+    }
+    __mongoBatchFree(b);
+}
 
+static int __mongoFlushInserts(mongoAsyncContext *ac);
 
 static mongoAsyncContext *mongoAsyncInitialize(mongoContext *c) {
     mongoAsyncContext *ac;
 
-    ac = realloc(c,sizeof(mongoAsyncContext));
+    ac = mongo_realloc(c,sizeof(mongoAsyncContext));
     if (ac == NULL)
         return NULL;
 
@@ -52,12 +272,33 @@ static mongoAsyncContext *mongoAsyncInitialize(mongoContext *c) {
     ac->ev.addWrite = NULL;
     ac->ev.delWrite = NULL;
     ac->ev.cleanup = NULL;
+    ac->ev.scheduleTimer = NULL;
 
     ac->onConnect = NULL;
     ac->onDisconnect = NULL;
 
     ac->replies.head = NULL;
     ac->replies.tail = NULL;
+    memset(&ac->slab,0,sizeof(ac->slab));
+    ac->stream = NULL;
+    ac->stream_to = 0;
+
+    ac->timeout = 0;
+    ac->timers = NULL;
+    ac->wakeup = 0;
+    ac->timedout = 0;
+
+    ac->onPause = NULL;
+    ac->onResume = NULL;
+    ac->high_bytes = ac->low_bytes = 0;
+    ac->high_reqs = ac->low_reqs = 0;
+
+    ac->batch = NULL;
+    ac->batch_docs = 0;
+    ac->batched = 0;
+    ac->batch_id = 0;
+    ac->batch_bytes = 0;
+    ac->inflight = 0;
 
     return ac;
 }
@@ -146,51 +387,312 @@ int mongoAsyncSetDisconnectCallback(mongoAsyncContext *ac, mongoDisconnectCallba
     return MONGO_ERR;
 }
 
-/* Helper functions to push/shift callbacks */
-static int __mongoPushCallback(mongoAsyncContext *ac, mongoCallback *source) {
-    mongoCallbackList *list = &ac->replies;
-    mongoCallback *cb;
+int mongoAsyncSetPauseCallback(mongoAsyncContext *ac, mongoWatermarkCallback *fn) {
+    if (ac->onPause == NULL) {
+        ac->onPause = fn;
+        return MONGO_OK;
+    }
+    return MONGO_ERR;
+}
 
-    /* Copy callback from stack to heap */
-    cb = malloc(sizeof(*cb));
-    if (cb == NULL)
+int mongoAsyncSetResumeCallback(mongoAsyncContext *ac, mongoWatermarkCallback *fn) {
+    if (ac->onResume == NULL) {
+        ac->onResume = fn;
+        return MONGO_OK;
+    }
+    return MONGO_ERR;
+}
+
+/* Limit the output waiting to be written, in bytes as counted by
+ * mongoBufferPending(), and the number of requests waiting for a reply. A
+ * zero high watermark disables that limit. Reaching a high watermark pauses
+ * the context: onPause is called and, when there is no such callback, new
+ * commands are refused with MONGO_ERR. Once the output and the requests are
+ * both back at or below their low watermark the context resumes and
+ * onResume is called. */
+int mongoAsyncSetWatermarks(mongoAsyncContext *ac, size_t high_bytes, size_t low_bytes,
+                            unsigned long high_reqs, unsigned long low_reqs) {
+    if ((high_bytes && low_bytes > high_bytes) || (high_reqs && low_reqs > high_reqs))
+        return MONGO_ERR;
+    ac->high_bytes = high_bytes;
+    ac->low_bytes = high_bytes ? low_bytes : 0;
+    ac->high_reqs = high_reqs;
+    ac->low_reqs = high_reqs ? low_reqs : 0;
+    return MONGO_OK;
+}
+
+/* Output not written yet, including the inserts being coalesced. */
+static size_t __mongoAsyncPending(mongoAsyncContext *ac) {
+    size_t pending = mongoBufferPending(&ac->c) + ac->inflight;
+
+    if (ac->batch && ac->batch->docs)
+        pending += sdslen(ac->batch->docs);
+    return pending;
+}
+
+/* Don't accept new commands when the connection is about to be closed, nor
+ * while it is paused and nobody was told about it. */
+static int __mongoAsyncRefuse(mongoAsyncContext *ac) {
+    int flags = ac->c.flags;
+
+    if (flags & (MONGO_DISCONNECTING | MONGO_FREEING))
+        return 1;
+    return (flags & MONGO_PAUSED) && ac->onPause == NULL;
+}
+
+/* Pause the context after a command made it reach a high watermark. The
+ * callback may free the context, so nothing must touch it afterwards. */
+static void __mongoCheckHighWater(mongoAsyncContext *ac) {
+    mongoContext *c = &(ac->c);
+
+    if (c->flags & MONGO_PAUSED)
+        return;
+    if ((ac->high_bytes && __mongoAsyncPending(ac) >= ac->high_bytes) ||
+        (ac->high_reqs && ac->slab.used >= ac->high_reqs)) {
+        c->flags |= MONGO_PAUSED;
+        if (ac->onPause) ac->onPause(ac);
+    }
+}
+
+/* Resume a paused context once it has drained below both low watermarks.
+ * As above, the callback may free the context. */
+static void __mongoCheckLowWater(mongoAsyncContext *ac) {
+    mongoContext *c = &(ac->c);
+
+    if (!(c->flags & MONGO_PAUSED))
+        return;
+    if ((ac->high_bytes == 0 || __mongoAsyncPending(ac) <= ac->low_bytes) &&
+        (ac->high_reqs == 0 || ac->slab.used <= ac->low_reqs)) {
+        c->flags &= ~MONGO_PAUSED;
+        if (ac->onResume) ac->onResume(ac);
+    }
+}
+
+/* Ask the event library to call mongoAsyncHandleTimeout() when the wheel
+ * needs to be advanced, unless a timer that fires soon enough is pending. */
+static void __mongoScheduleTimer(mongoAsyncContext *ac, uint64_t now) {
+    struct timeval tv;
+    int64_t wait;
+
+    if (ac->ev.scheduleTimer == NULL || ac->timers == NULL)
+        return;
+    wait = mongoTimerWheelNext(ac->timers,now);
+    if (wait < 0 || (ac->wakeup != 0 && ac->wakeup <= now + wait))
+        return;
+    ac->wakeup = now + wait;
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+    _EL_SCHEDULE_TIMER(ac,tv);
+}
+
+/* (Re)arm the deadline of a callback, timeout ms from now. */
+static int __mongoArmCallback(mongoAsyncContext *ac, mongoCallback *cb, uint64_t timeout) {
+    uint64_t now = mongoTimerNow();
+
+    if (ac->timers == NULL) {
+        ac->timers = mongoTimerWheelCreate(now);
+        if (ac->timers == NULL)
+            return MONGO_ERR_OOM;
+    }
+    mongoTimerDel(ac->timers,&cb->timer);
+    mongoTimerAdd(ac->timers,&cb->timer,now + timeout);
+    __mongoScheduleTimer(ac,now);
+    return MONGO_OK;
+}
+
+/* Add a chunk of slots to the slab and put them on the free list, the
+ * lowest first. */
+static int __mongoSlabGrow(mongoAsyncContext *ac) {
+    mongoCallbackSlab *s = &ac->slab;
+    mongoCallback **chunks, *chunk;
+    uint32_t base = s->nr_chunks * MONGO_CALLBACK_CHUNK;
+
+    chunks = mongo_realloc(s->chunks,(s->nr_chunks + 1) * sizeof(*chunks));
+    if (chunks == NULL)
+        return MONGO_ERR_OOM;
+    s->chunks = chunks;
+    chunk = mongo_malloc(MONGO_CALLBACK_CHUNK * sizeof(*chunk));
+    if (chunk == NULL)
         return MONGO_ERR_OOM;
+    s->chunks[s->nr_chunks++] = chunk;
+    for (int i = MONGO_CALLBACK_CHUNK - 1; i >= 0; i--) {
+        chunk[i].slot = base + i;
+        chunk[i].used = 0;
+        chunk[i].next = s->free;
+        s->free = chunk + i;
+    }
+    return MONGO_OK;
+}
+
+/* Double the buckets once there are as many waiting callbacks, and put the
+ * waiting callbacks in their new bucket. Request ids are consecutive, so
+ * their low bits spread them evenly. */
+static int __mongoSlabRehash(mongoAsyncContext *ac) {
+    mongoCallbackSlab *s = &ac->slab;
+    mongoCallback **buckets, *cb;
+    unsigned long size = s->size ? s->size * 2 : MONGO_CALLBACK_CHUNK;
+    unsigned long b;
+
+    buckets = mongo_calloc(size,sizeof(*buckets));
+    if (buckets == NULL)
+        return MONGO_ERR_OOM;
+    for (cb = ac->replies.head; cb != NULL; cb = cb->next) {
+        b = (uint32_t)cb->req_id & (size - 1);
+        cb->hnext = buckets[b];
+        buckets[b] = cb;
+    }
+    mongo_free(s->buckets);
+    s->buckets = buckets;
+    s->size = size;
+    return MONGO_OK;
+}
+
+static mongoCallback *__mongoFindCallback(mongoAsyncContext *ac, int32_t req_id) {
+    mongoCallbackSlab *s = &ac->slab;
+    mongoCallback *cb;
+
+    if (s->size == 0)
+        return NULL;
+    cb = s->buckets[(uint32_t)req_id & (s->size - 1)];
+    while (cb != NULL && cb->req_id != req_id)
+        cb = cb->hnext;
+    return cb;
+}
+
+/* Callback a handle refers to, or NULL when it is done. */
+static mongoCallback *__mongoHandleCallback(mongoAsyncContext *ac, uint64_t handle) {
+    mongoCallbackSlab *s = &ac->slab;
+    uint32_t slot = (uint32_t)handle;
+    mongoCallback *cb;
 
-    if (source != NULL) {
-        memcpy(cb,source,sizeof(*cb));
-        cb->next = NULL;
+    if (slot / MONGO_CALLBACK_CHUNK >= s->nr_chunks)
+        return NULL;
+    cb = s->chunks[slot / MONGO_CALLBACK_CHUNK] + slot % MONGO_CALLBACK_CHUNK;
+    if (!cb->used || cb->req_id != (int32_t)(uint32_t)(handle >> 32))
+        return NULL;
+    return cb;
+}
+
+static void __mongoSlabFree(mongoCallbackSlab *s) {
+    for (uint32_t i = 0; i < s->nr_chunks; i++)
+        mongo_free(s->chunks[i]);
+    mongo_free(s->chunks);
+    mongo_free(s->buckets);
+}
+
+/* Helper functions to push/shift callbacks. A callback is registered for
+ * the last request queued on the context. Everything that can fail is done
+ * before the callback is linked. On failure the request is queued already
+ * and its reply would have nowhere to go, so the context gets an error,
+ * which tears it down on the next write and fails the other callbacks. */
+static int __mongoPushCallback(mongoAsyncContext *ac, mongoCallback *source) {
+    mongoCallbackSlab *s = &ac->slab;
+    mongoCallbackList *list = &ac->replies;
+    mongoCallback *cb;
+    unsigned long b;
+
+    if ((s->free == NULL && __mongoSlabGrow(ac) != MONGO_OK) ||
+        (s->used >= s->size && __mongoSlabRehash(ac) != MONGO_OK) ||
+        (ac->timeout != 0 && ac->timers == NULL &&
+         (ac->timers = mongoTimerWheelCreate(mongoTimerNow())) == NULL))
+    {
+        __mongoSetError(&ac->c,MONGO_ERR_OOM,"Out of memory");
+        _EL_ADD_WRITE(ac);
+        return MONGO_ERR;
     }
 
+    /* Copy callback from stack to a free slot */
+    cb = s->free;
+    s->free = cb->next;
+
+    cb->fn = source->fn;
+    cb->privdata = source->privdata;
+    cb->flags = source->flags;
+    cb->req_id = ac->c.req_id;
+    cb->used = 1;
+    b = (uint32_t)cb->req_id & (s->size - 1);
+    cb->hnext = s->buckets[b];
+    s->buckets[b] = cb;
+    s->used++;
+    s->last = cb->slot;
+
     /* Store callback in list */
+    cb->next = NULL;
+    cb->prev = list->tail;
     if (list->head == NULL)
         list->head = cb;
     if (list->tail != NULL)
         list->tail->next = cb;
     list->tail = cb;
+
+    cb->timer.next = cb->timer.prev = NULL;
+    cb->timer.data = cb;
+    /* Can't fail, the wheel exists. */
+    if (ac->timeout != 0)
+        __mongoArmCallback(ac,cb,ac->timeout);
     return MONGO_OK;
 }
 
-static int __mongoShiftCallback(mongoAsyncContext *ac, mongoReply *rpl, mongoCallback *target) {
+/* Unlink a callback from the list and the index, and free its slot. */
+static void __mongoDropCallback(mongoAsyncContext *ac, mongoCallback *cb) {
+    mongoCallbackSlab *s = &ac->slab;
     mongoCallbackList *list = &ac->replies;
-    mongoCallback *cb = list->head;
+    mongoCallback **pp;
+
+    pp = &s->buckets[(uint32_t)cb->req_id & (s->size - 1)];
+    while (*pp != cb)
+        pp = &(*pp)->hnext;
+    *pp = cb->hnext;
+    s->used--;
+    if (ac->timers)
+        mongoTimerDel(ac->timers,&cb->timer);
+    if (cb == ac->stream)
+        ac->stream = NULL;
+    if (cb->prev) cb->prev->next = cb->next;
+    else list->head = cb->next;
+    if (cb->next) cb->next->prev = cb->prev;
+    else list->tail = cb->prev;
+    cb->used = 0;
+    cb->next = s->free;
+    s->free = cb;
+}
+
+/* Find the callback of a reply by its responseTo, or take the oldest one
+ * when rpl is NULL. A reply that continues the current exhaust stream wins
+ * over a request with the same id, the two count ids independently and the
+ * server can't answer anything else before the stream ends. */
+static int __mongoShiftCallback(mongoAsyncContext *ac, mongoReply *rpl, mongoCallback *target) {
+    mongoCallback *cb;
+    bool no_remove;
+
+    if (rpl == NULL)
+        cb = ac->replies.head;
+    else if (ac->stream && rpl->responseTo == ac->stream_to)
+        cb = ac->stream;
+    else
+        cb = __mongoFindCallback(ac,rpl->responseTo);
+    if (cb == NULL)
+        return MONGO_ERR;
 
-    if (cb != NULL) {
+    if (rpl && rpl->opCode == OP_MSG) {
+        // the server streams more OP_MSG replies to the same request (exhaustAllowed).
+        no_remove = ((mongoMsgReply *)rpl)->flagBits & MSG_FLAG_MORE_TO_COME;
+    } else {
         // if query with EXHAUST flag and the cursor is not zero, then we don't remove the cb from list.
-        bool no_remove = (cb->flags & QUERY_FLAG_EXHAUST && rpl && rpl->cursorID != 0);
+        no_remove = (cb->flags & QUERY_FLAG_EXHAUST && rpl && rpl->cursorID != 0);
+    }
 
-        /* Copy callback from heap to stack */
-        if (target != NULL)
-            memcpy(target,cb,sizeof(*cb));
+    /* Copy callback from heap to stack */
+    if (target != NULL)
+        memcpy(target,cb,sizeof(*cb));
 
-        if (!no_remove) {
-            list->head = cb->next;
-            if (cb == list->tail)
-                list->tail = NULL;
-            free(cb);
-        }
-        return MONGO_OK;
+    if (no_remove) {
+        ac->stream = cb;
+        ac->stream_to = rpl->requestID;
+    } else {
+        __mongoDropCallback(ac,cb);
     }
-    return MONGO_ERR;
+    return MONGO_OK;
 }
 
 static void __mongoRunCallback(mongoAsyncContext *ac, mongoCallback *cb, void *reply) {
@@ -211,6 +713,14 @@ static void __mongoAsyncFree(mongoAsyncContext *ac) {
     while (__mongoShiftCallback(ac,NULL,&cb) == MONGO_OK)
         __mongoRunCallback(ac,&cb,NULL);
 
+    /* The callers of inserts that were never sent come last. */
+    if (ac->batch) {
+        cb.fn = __mongoBatchReply;
+        cb.privdata = ac->batch;
+        ac->batch = NULL;
+        __mongoRunCallback(ac,&cb,NULL);
+    }
+
     /* Signal event lib to clean up */
     _EL_CLEANUP(ac);
 
@@ -225,6 +735,9 @@ static void __mongoAsyncFree(mongoAsyncContext *ac) {
     }
 
     /* Cleanup self */
+    __mongoSlabFree(&ac->slab);
+    if (ac->timers)
+        mongoTimerWheelFree(ac->timers);
     mongoFree(c);
 }
 
@@ -239,6 +752,71 @@ void mongoAsyncFree(mongoAsyncContext *ac) {
         __mongoAsyncFree(ac);
 }
 
+/* Forget the callback of a request, see mongoAsyncLastRequestId. The request
+ * stays on the wire, its reply (or the rest of an exhaust stream) is read and
+ * dropped when it arrives, so privdata is no longer referenced once this
+ * returns. Returns MONGO_ERR when no callback is waiting for req_id, or when
+ * it is the one of coalesced inserts, whose callers can't be dropped all at
+ * once behind their backs. */
+static int __mongoCancelCallback(mongoAsyncContext *ac, mongoCallback *cb) {
+    if (cb == NULL || cb->fn == __mongoBatchReply)
+        return MONGO_ERR;
+    cb->fn = NULL;
+    cb->privdata = NULL;
+    if (ac->timers)
+        mongoTimerDel(ac->timers,&cb->timer);
+    return MONGO_OK;
+}
+
+int mongoAsyncCancel(mongoAsyncContext *ac, int32_t req_id) {
+    return __mongoCancelCallback(ac,__mongoFindCallback(ac,req_id));
+}
+
+/* The same through the handle of the callback, see mongoAsyncLastHandle,
+ * which goes straight to its slot. */
+int mongoAsyncCancelHandle(mongoAsyncContext *ac, uint64_t handle) {
+    return __mongoCancelCallback(ac,__mongoHandleCallback(ac,handle));
+}
+
+static uint64_t __mongoTimevalToMs(const struct timeval tv) {
+    /* Round up, a deadline of 500us must not become no deadline at all. */
+    return (uint64_t)tv.tv_sec * 1000 + ((uint64_t)tv.tv_usec + 999) / 1000;
+}
+
+/* Give every request issued from now on a deadline of tv, a zero tv turns
+ * deadlines off again. A request that is still waiting for its reply when
+ * its deadline expires has its callback run with a NULL reply, while
+ * mongoAsyncTimedOut is true, and then behaves as cancelled: the connection
+ * stays up and the late reply is dropped. For an exhaust query the deadline
+ * covers the whole stream. Deadlines are checked by mongoAsyncHandleTimeout,
+ * which the adapters that provide scheduleTimer call when they are due. */
+int mongoAsyncSetTimeout(mongoAsyncContext *ac, const struct timeval tv) {
+    if (tv.tv_sec < 0 || tv.tv_usec < 0)
+        return MONGO_ERR;
+    ac->timeout = __mongoTimevalToMs(tv);
+    return MONGO_OK;
+}
+
+/* Set the deadline of a single request, tv from now, see
+ * mongoAsyncLastRequestId. A zero tv removes it. Returns MONGO_ERR when no
+ * callback is waiting for req_id, or when it is the one of coalesced
+ * inserts, which share the deadline they were given by mongoAsyncSetTimeout. */
+int mongoAsyncSetDeadline(mongoAsyncContext *ac, int32_t req_id, const struct timeval tv) {
+    mongoCallback *cb;
+
+    if (tv.tv_sec < 0 || tv.tv_usec < 0)
+        return MONGO_ERR;
+    cb = __mongoFindCallback(ac,req_id);
+    if (cb == NULL || cb->fn == NULL || cb->fn == __mongoBatchReply)
+        return MONGO_ERR;
+    if (tv.tv_sec == 0 && tv.tv_usec == 0) {
+        if (ac->timers)
+            mongoTimerDel(ac->timers,&cb->timer);
+        return MONGO_OK;
+    }
+    return __mongoArmCallback(ac,cb,__mongoTimevalToMs(tv)) == MONGO_OK ? MONGO_OK : MONGO_ERR;
+}
+
 /* Helper function to make the disconnect happen and clean up. */
 static void __mongoAsyncDisconnect(mongoAsyncContext *ac) {
     mongoContext *c = &(ac->c);
@@ -268,6 +846,7 @@ static void __mongoAsyncDisconnect(mongoAsyncContext *ac) {
  * when there are no pending callbacks. */
 void mongoAsyncDisconnect(mongoAsyncContext *ac) {
     mongoContext *c = &(ac->c);
+    __mongoFlushInserts(ac);
     c->flags |= MONGO_DISCONNECTING;
     if (!(c->flags & MONGO_IN_CALLBACK) && ac->replies.head == NULL)
         __mongoAsyncDisconnect(ac);
@@ -275,7 +854,7 @@ void mongoAsyncDisconnect(mongoAsyncContext *ac) {
 
 void mongoProcessCallbacks(mongoAsyncContext *ac) {
     mongoContext *c = &(ac->c);
-    mongoCallback cb = {NULL, 0, NULL, NULL};
+    mongoCallback cb;
     void *reply = NULL;
     int status;
 
@@ -283,7 +862,7 @@ void mongoProcessCallbacks(mongoAsyncContext *ac) {
         if (reply == NULL) {
             /* When the connection is being disconnected and there are
              * no more replies, this is the cue to really disconnect. */
-            if (c->flags & MONGO_DISCONNECTING && sdslen(c->obuf) == 0
+            if (c->flags & MONGO_DISCONNECTING && mongoBufferPending(c) == 0
                 && ac->replies.head == NULL) {
                 __mongoAsyncDisconnect(ac);
                 return;
@@ -294,8 +873,10 @@ void mongoProcessCallbacks(mongoAsyncContext *ac) {
             break;
         }
 
-        // ignore the return value
-        __mongoShiftCallback(ac, reply, &cb);
+        /* A reply nobody waits for, or whose request was cancelled, is
+         * dropped below. */
+        if (__mongoShiftCallback(ac, reply, &cb) != MONGO_OK)
+            cb.fn = NULL;
 
         if (cb.fn != NULL) {
             __mongoRunCallback(ac,&cb,reply);
@@ -318,6 +899,8 @@ void mongoProcessCallbacks(mongoAsyncContext *ac) {
     /* Disconnect when there was an error reading the reply */
     if (status != MONGO_OK)
         __mongoAsyncDisconnect(ac);
+    else
+        __mongoCheckLowWater(ac);
 }
 
 /* Internal helper function to detect socket status the first time a read or
@@ -379,6 +962,18 @@ void mongoAsyncHandleWrite(mongoAsyncContext *ac) {
             return;
     }
 
+    /* The event library takes the output itself in completion mode. */
+    if (c->flags & MONGO_COMPLETION) {
+        if (__mongoAsyncPending(ac) > ac->inflight)
+            _EL_ADD_WRITE(ac);
+        _EL_ADD_READ(ac);
+        return;
+    }
+
+    /* A failed flush leaves an error on the context, so the write fails
+     * too and the callers learn about it when it is torn down. */
+    __mongoFlushInserts(ac);
+
     if (mongoBufferWrite(c,&done) == MONGO_ERR) {
         __mongoAsyncDisconnect(ac);
     } else {
@@ -390,7 +985,112 @@ void mongoAsyncHandleWrite(mongoAsyncContext *ac) {
 
         /* Always schedule reads after writes */
         _EL_ADD_READ(ac);
+
+        __mongoCheckLowWater(ac);
+    }
+}
+
+/* Completion mode (MONGO_COMPLETION): instead of being told the socket is
+ * ready, the event library reads and writes itself and passes the results
+ * on. Its addWrite hook takes the output with mongoAsyncTakeOutput() and
+ * reports what got written with mongoAsyncHandleWritten(), its addRead hook
+ * starts receiving and hands the bytes to mongoAsyncHandleData(). Connecting
+ * still goes through mongoAsyncHandleWrite() once the socket is writable. */
+
+/* The output to write, owned by the caller who frees it with sdsfree(), or
+ * NULL when there is none. Its bytes count as pending output until they are
+ * reported written. */
+sds mongoAsyncTakeOutput(mongoAsyncContext *ac) {
+    mongoContext *c = &(ac->c);
+    sds out;
+
+    __mongoFlushInserts(ac);
+    out = mongoBufferTake(c);
+    if (out != NULL)
+        ac->inflight += sdslen(out);
+    return out;
+}
+
+/* Called with the result of writing output taken by mongoAsyncTakeOutput(),
+ * a byte count or a negated errno value. Short writes are continued by the
+ * event library, which reports every part. */
+void mongoAsyncHandleWritten(mongoAsyncContext *ac, ssize_t nwritten) {
+    mongoContext *c = &(ac->c);
+
+    if (nwritten < 0) {
+        errno = (int)-nwritten;
+        __mongoSetError(c,MONGO_ERR_IO,NULL);
+        __mongoAsyncDisconnect(ac);
+        return;
+    }
+    ac->inflight -= (size_t)nwritten < ac->inflight ? (size_t)nwritten : ac->inflight;
+    c->stats.bytes_out += (size_t)nwritten;
+    __mongoCheckLowWater(ac);
+}
+
+/* Called with bytes received from the server, nread is 0 on end of file or
+ * a negated errno value. The replies they complete are dispatched. */
+void mongoAsyncHandleData(mongoAsyncContext *ac, const char *buf, ssize_t nread) {
+    mongoContext *c = &(ac->c);
+
+    if (nread == 0) {
+        __mongoSetError(c,MONGO_ERR_EOF,"Server closed the connection");
+    } else if (nread < 0) {
+        errno = (int)-nread;
+        __mongoSetError(c,MONGO_ERR_IO,NULL);
+    } else if (mongoReaderFeed(c->reader,buf,(size_t)nread) != MONGO_OK) {
+        __mongoSetError(c,c->reader->err,c->reader->errstr);
+    } else {
+        mongoStatsRead(&c->stats,(size_t)nread,c->reader->len);
+    }
+    if (c->err) {
+        __mongoAsyncDisconnect(ac);
+        return;
+    }
+    mongoProcessCallbacks(ac);
+}
+
+/* This function should be called when the timer scheduled through
+ * ev.scheduleTimer fires, or periodically by applications whose event
+ * library has no timers. It runs the callbacks of the requests whose
+ * deadline expired, see mongoAsyncSetTimeout. */
+void mongoAsyncHandleTimeout(mongoAsyncContext *ac) {
+    mongoContext *c = &(ac->c);
+    mongoTimer expired;
+    mongoCallback *cb, tmp;
+    uint64_t now;
+
+    ac->wakeup = 0;
+    if (ac->timers == NULL)
+        return;
+
+    now = mongoTimerNow();
+    mongoTimerWheelAdvance(ac->timers,now,&expired);
+    while (expired.next != &expired) {
+        cb = expired.next->data;
+        mongoTimerDel(ac->timers,&cb->timer);
+        if (cb->fn == NULL)
+            continue;
+
+        /* The callback stays registered without fn, so its reply is read
+         * and dropped whenever it shows up. */
+        memcpy(&tmp,cb,sizeof(tmp));
+        cb->fn = NULL;
+        cb->privdata = NULL;
+
+        /* The context is healthy and its err is left alone, the flag only
+         * tells the callback why it gets no reply. */
+        ac->timedout = 1;
+        __mongoRunCallback(ac,&tmp,NULL);
+        ac->timedout = 0;
+
+        /* Proceed with free'ing when mongoAsyncFree() was called. */
+        if (c->flags & MONGO_FREEING) {
+            __mongoAsyncFree(ac);
+            return;
+        }
     }
+    __mongoScheduleTimer(ac,now);
 }
 
 int mongoAsyncQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
@@ -402,7 +1102,7 @@ int mongoAsyncQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
     mongoCallback cb;
 
     /* Don't accept new commands when the connection is about to be closed. */
-    if (c->flags & (MONGO_DISCONNECTING | MONGO_FREEING)) return MONGO_ERR;
+    if (__mongoAsyncRefuse(ac) || __mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
     status = mongoAppendQueryMsg(c, flags, db, col, nrSkip, nrReturn, q, rfields);
     if (status != MONGO_OK) {
         return MONGO_ERR;
@@ -413,11 +1113,48 @@ int mongoAsyncQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
     cb.privdata = privdata;
     cb.flags = flags;
 
-    __mongoPushCallback(ac,&cb);
+    if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+        return MONGO_ERR;
+
+    /* Always schedule a write when the write buffer is non-empty */
+    _EL_ADD_WRITE(ac);
+
+    __mongoCheckHighWater(ac);
+    return MONGO_OK;
+}
+
+/* Run a database command through OP_MSG. With MSG_FLAG_EXHAUST_ALLOWED in
+ * flags the callback keeps firing for every reply the server streams back
+ * with moreToCome set. */
+int mongoAsyncCommand(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
+                      uint32_t flags, char *db, bson_t *cmd)
+{
+    int status;
+    mongoContext *c = &(ac->c);
+    mongoCallback cb;
+
+    /* Don't accept new commands when the connection is about to be closed. */
+    if (__mongoAsyncRefuse(ac) || __mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
+    status = mongoAppendCommandMsg(c, flags, db, cmd);
+    if (status != MONGO_OK) {
+        return MONGO_ERR;
+    }
+
+    /* A request with moreToCome set has no reply. */
+    if (!(flags & MSG_FLAG_MORE_TO_COME)) {
+        /* Setup callback */
+        cb.fn = fn;
+        cb.privdata = privdata;
+        cb.flags = 0;
+
+        if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+            return MONGO_ERR;
+    }
 
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
+    __mongoCheckHighWater(ac);
     return MONGO_OK;
 }
 
@@ -427,7 +1164,7 @@ int mongoAsyncJsonQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privda
 {
     bson_error_t error;
     bson_t *q, *rf=NULL;
-    int status;
+    int status, borrow;
     q = bson_new_from_json((uint8_t *)q_js, -1, &error);
     if (!q) {
         return MONGO_ERR;
@@ -438,7 +1175,11 @@ int mongoAsyncJsonQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privda
             return MONGO_ERR;
         }
     }
+    /* q and rf are freed before they hit the wire, they can't be borrowed */
+    borrow = ac->c.flags & MONGO_BORROW;
+    ac->c.flags &= ~MONGO_BORROW;
     status = mongoAsyncQuery(ac, fn, privdata, flags, db, col, nrSkip, nrReturn, q, rf);
+    ac->c.flags |= borrow;
     bson_destroy(q);
     if (rf) bson_destroy(rf);
     return status;
@@ -473,6 +1214,165 @@ int mongoAsyncJsonFindOne(mongoAsyncContext *ac, mongoCallbackFn *fn, void *priv
     return mongoAsyncJsonQuery(ac,fn,privdata, 0, db, col, 0, -1, q_js, rf_js);
 }
 
+/* Send the inserts being coalesced as one message. The callers that asked
+ * for a reply share a single callback, registered for the message. When the
+ * message can't be queued the batch stays where it is, the error left on
+ * the context tears it down on the next write and fails the callers. */
+static int __mongoFlushInserts(mongoAsyncContext *ac) {
+    mongoContext *c = &(ac->c);
+    mongoInsertBatch *b = ac->batch;
+    mongoCallback cb;
+    bson_t *views, **pp;
+    size_t off = 0;
+    int status, borrow, reply;
+
+    if (b == NULL)
+        return MONGO_OK;
+    if (c->err)
+        return MONGO_ERR;
+
+    views = mongo_malloc(b->nr_docs * (sizeof(*views) + sizeof(*pp)));
+    if (views == NULL) {
+        __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+        return MONGO_ERR;
+    }
+    pp = (bson_t **)(views + b->nr_docs);
+    for (int i = 0; i < b->nr_docs; i++) {
+        uint32_t len = load32le(b->docs + off);
+        bson_init_static(views + i, (uint8_t *)b->docs + off, len);
+        pp[i] = views + i;
+        off += len;
+    }
+
+    /* The copies are freed right away, they can't be borrowed */
+    reply = b->nr_callers > 0;
+    borrow = c->flags & MONGO_BORROW;
+    c->flags &= ~MONGO_BORROW;
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendInsertCmd(c, reply? 0: MSG_FLAG_MORE_TO_COME, b->db, b->col,
+                                      b->flags, pp, b->nr_docs, NULL);
+    } else {
+        status = mongoAppendInsertMsg(c, b->flags, b->db, b->col, pp, b->nr_docs);
+        if (status == MONGO_OK && reply)
+            status = mongoAppendGetLastErrorRequest(c, 0, b->db);
+    }
+    c->flags |= borrow;
+    mongo_free(views);
+    if (status != MONGO_OK)
+        return MONGO_ERR;
+
+    ac->batch = NULL;
+    if (!reply) {
+        __mongoBatchFree(b);
+        return MONGO_OK;
+    }
+    sdsfree(b->docs);
+    b->docs = NULL;
+    cb.fn = __mongoBatchReply;
+    cb.privdata = b;
+    cb.flags = 0;
+    if (__mongoPushCallback(ac,&cb) != MONGO_OK) {
+        ac->batch = b;
+        return MONGO_ERR;
+    }
+    return MONGO_OK;
+}
+
+/* Add documents to the batch of their namespace, sending the batch first
+ * when they belong to another namespace or would take it over a limit. */
+static int __mongoCoalesceInsert(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
+                                 int32_t flags, char *db, char *col, bson_t *docs, int nr_docs)
+{
+    mongoContext *c = &ac->c;
+    mongoInsertBatch *b = ac->batch;
+    mongoBatchCaller *callers;
+    size_t len = 0;
+    sds buf;
+
+    if (c->err)
+        return MONGO_ERR;
+    for (int i = 0; i < nr_docs; ++i)
+        len += docs[i].len;
+    if (b && (b->flags != flags || strcmp(b->db, db) != 0 || strcmp(b->col, col) != 0 ||
+              b->nr_docs + nr_docs > ac->batch_docs ||
+              sdslen(b->docs) + len > ac->batch_bytes)) {
+        if (__mongoFlushInserts(ac) != MONGO_OK)
+            return MONGO_ERR;
+        b = NULL;
+    }
+    if (b == NULL) {
+        b = __mongoBatchCreate(db, col, flags);
+        if (b == NULL) {
+            __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+            return MONGO_ERR;
+        }
+        ac->batch = b;
+    }
+
+    if (fn != NULL && b->nr_callers == b->cap_callers) {
+        int cap = b->cap_callers ? b->cap_callers * 2 : 16;
+        callers = mongo_realloc(b->callers, cap * sizeof(*callers));
+        if (callers == NULL)
+            goto oom;
+        b->callers = callers;
+        b->cap_callers = cap;
+    }
+    buf = sdsMakeRoomFor(b->docs, len);
+    if (buf == NULL)
+        goto oom;
+    b->docs = buf;
+    for (int i = 0; i < nr_docs; ++i) {
+        memcpy(b->docs + sdslen(b->docs), bson_get_data(docs + i), docs[i].len);
+        sdsIncrLen(b->docs, (int)docs[i].len);
+    }
+    b->nr_docs += nr_docs;
+    if (fn != NULL) {
+        b->callers[b->nr_callers].fn = fn;
+        b->callers[b->nr_callers].privdata = privdata;
+        b->callers[b->nr_callers].first = b->nr_docs - nr_docs;
+        b->callers[b->nr_callers].count = nr_docs;
+        b->nr_callers++;
+    }
+
+    /* The batch goes out with the next write event at the latest. */
+    if (b->nr_docs >= ac->batch_docs || sdslen(b->docs) >= ac->batch_bytes)
+        __mongoFlushInserts(ac);
+    ac->batched = 1;
+    ac->batch_id = c->req_id;
+    _EL_ADD_WRITE(ac);
+
+    __mongoCheckHighWater(ac);
+    return MONGO_OK;
+
+oom:
+    /* Don't leave a batch that was created for these documents empty. */
+    if (b->nr_docs == 0) {
+        ac->batch = NULL;
+        __mongoBatchFree(b);
+    }
+    __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+    return MONGO_ERR;
+}
+
+/* Coalesce the inserts issued with mongoAsyncInsert into one message per
+ * run of inserts to the same namespace with the same flags. A run is sent
+ * when the context is about to write, before any other command is queued,
+ * or once it holds max_docs documents or max_bytes bytes (0 for
+ * MONGO_COALESCE_MAX_BYTES). Every caller's callback gets a reply of its
+ * own, see __mongoBatchCallerDoc. max_docs 0 turns coalescing off. Any
+ * pending run is sent first. */
+int mongoAsyncSetInsertCoalescing(mongoAsyncContext *ac, int max_docs, size_t max_bytes) {
+    if (max_docs < 0)
+        return MONGO_ERR;
+    if (max_bytes == 0 || max_bytes > MONGO_COALESCE_MAX_BYTES)
+        max_bytes = MONGO_COALESCE_MAX_BYTES;
+    if (__mongoFlushInserts(ac) != MONGO_OK)
+        return MONGO_ERR;
+    ac->batch_docs = max_docs;
+    ac->batch_bytes = max_bytes;
+    return MONGO_OK;
+}
+
 int mongoAsyncInsert(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
                      int32_t flags, char *db, char *col, bson_t *docs, int nr_docs)
 {
@@ -480,29 +1380,39 @@ int mongoAsyncInsert(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
     mongoCallback cb;
     int status;
     bson_t *pp[nr_docs];
-    if (c->flags & (MONGO_DISCONNECTING | MONGO_FREEING)) return MONGO_ERR;
+    if (__mongoAsyncRefuse(ac)) return MONGO_ERR;
+    if (ac->batch_docs > 0)
+        return __mongoCoalesceInsert(ac, fn, privdata, flags, db, col, docs, nr_docs);
+    if (__mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
     for (int i = 0; i < nr_docs; ++i) {
         pp[i] = docs + i;
     }
-    status = mongoAppendInsertMsg(c, flags, db, col, pp, nr_docs);
+    if (c->flags & MONGO_OP_MSG) {
+        /* Without a callback there is nobody to hand the reply to, so ask
+         * the server not to send one. */
+        status = mongoAppendInsertCmd(c, fn? 0: MSG_FLAG_MORE_TO_COME, db, col,
+                                      flags, pp, nr_docs, NULL);
+    } else {
+        status = mongoAppendInsertMsg(c, flags, db, col, pp, nr_docs);
+        if (status == MONGO_OK && fn != NULL)
+            status = mongoAppendGetLastErrorRequest(c, 0, db);
+    }
     if (status != MONGO_OK) {
         return status;
     }
     if (fn != NULL) {
-        status = mongoAppendGetLastErrorRequest(c, 0, db);
-        if (status != MONGO_OK) {
-            return status;
-        }
         /* Setup callback */
         cb.fn = fn;
         cb.privdata = privdata;
         cb.flags = 0;
 
-        __mongoPushCallback(ac,&cb);
+        if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+            return MONGO_ERR;
     }
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
+    __mongoCheckHighWater(ac);
     return MONGO_OK;
 }
 
@@ -512,26 +1422,31 @@ int mongoAsyncUpdate(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
     mongoContext *c = &ac->c;
     mongoCallback cb;
     int status;
-    if (c->flags & (MONGO_DISCONNECTING | MONGO_FREEING)) return MONGO_ERR;
-    status = mongoAppendUpdateMsg(c, db, col, flags, selector, update);
+    if (__mongoAsyncRefuse(ac) || __mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendUpdateCmd(c, fn? 0: MSG_FLAG_MORE_TO_COME, db, col,
+                                      flags, selector, update, NULL);
+    } else {
+        status = mongoAppendUpdateMsg(c, db, col, flags, selector, update);
+        if (status == MONGO_OK && fn != NULL)
+            status = mongoAppendGetLastErrorRequest(c, 0, db);
+    }
     if (status != MONGO_OK) {
         return status;
     }
     if (fn != NULL) {
-        status = mongoAppendGetLastErrorRequest(c, 0, db);
-        if (status != MONGO_OK) {
-            return status;
-        }
         /* Setup callback */
         cb.fn = fn;
         cb.privdata = privdata;
         cb.flags = 0;
 
-        __mongoPushCallback(ac,&cb);
+        if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+            return MONGO_ERR;
     }
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
+    __mongoCheckHighWater(ac);
     return MONGO_OK;
 }
 
@@ -541,26 +1456,31 @@ int mongoAsyncDelete(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
     mongoContext *c = &ac->c;
     mongoCallback cb;
     int status;
-    if (c->flags & (MONGO_DISCONNECTING | MONGO_FREEING)) return MONGO_ERR;
-    status = mongoAppendDeleteMsg(c, db, col, flags, selector);
+    if (__mongoAsyncRefuse(ac) || __mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendDeleteCmd(c, fn? 0: MSG_FLAG_MORE_TO_COME, db, col,
+                                      flags, selector, NULL);
+    } else {
+        status = mongoAppendDeleteMsg(c, db, col, flags, selector);
+        if (status == MONGO_OK && fn != NULL)
+            status = mongoAppendGetLastErrorRequest(c, 0, db);
+    }
     if (status != MONGO_OK) {
         return status;
     }
     if (fn != NULL) {
-        status = mongoAppendGetLastErrorRequest(c, 0, db);
-        if (status != MONGO_OK) {
-            return status;
-        }
         /* Setup callback */
         cb.fn = fn;
         cb.privdata = privdata;
         cb.flags = 0;
 
-        __mongoPushCallback(ac,&cb);
+        if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+            return MONGO_ERR;
     }
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
+    __mongoCheckHighWater(ac);
     return MONGO_OK;
 }
 
@@ -572,7 +1492,7 @@ int mongoAsyncKillCursors(mongoAsyncContext *ac, mongoCallbackFn *fn, void *priv
     mongoContext *c = &ac->c;
     mongoCallback cb;
     int status;
-    if (c->flags & (MONGO_DISCONNECTING | MONGO_FREEING)) return MONGO_ERR;
+    if (__mongoAsyncRefuse(ac) || __mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
     status = mongoAppendKillCursorsMsg(c, nr_id, ids);
     if (status != MONGO_OK) {
         return status;
@@ -587,11 +1507,13 @@ int mongoAsyncKillCursors(mongoAsyncContext *ac, mongoCallbackFn *fn, void *priv
         cb.privdata = privdata;
         cb.flags = 0;
 
-        __mongoPushCallback(ac,&cb);
+        if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+            return MONGO_ERR;
     }
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
+    __mongoCheckHighWater(ac);
     return MONGO_OK;
 }
 
@@ -603,7 +1525,7 @@ int mongoAsyncGetMore(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata
     mongoCallback cb;
 
     /* Don't accept new commands when the connection is about to be closed. */
-    if (c->flags & (MONGO_DISCONNECTING | MONGO_FREEING)) return MONGO_ERR;
+    if (__mongoAsyncRefuse(ac) || __mongoFlushInserts(ac) != MONGO_OK) return MONGO_ERR;
     status = mongoAppendGetMoreMsg(c, db, col, nrReturn, cursorId);
     if (status != MONGO_OK) {
         return MONGO_ERR;
@@ -614,10 +1536,12 @@ int mongoAsyncGetMore(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata
     cb.privdata = privdata;
     cb.flags = 0;
 
-    __mongoPushCallback(ac,&cb);
+    if (__mongoPushCallback(ac,&cb) != MONGO_OK)
+        return MONGO_ERR;
 
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
+    __mongoCheckHighWater(ac);
     return MONGO_OK;
 }
@@ -1,20 +1,31 @@
 #ifndef __HIMONGO_ASYNC_H
 #define __HIMONGO_ASYNC_H
 #include "himongo.h"
+#include "timer.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct mongoAsyncContext; /* need forward declaration of mongoAsyncContext */
+struct mongoInsertBatch; /* defined in async.c */
+
+/* Largest batch of coalesced inserts, see mongoAsyncSetInsertCoalescing */
+#define MONGO_COALESCE_MAX_BYTES (16*1024*1024)
 
 /* Reply callback prototype and container */
 typedef void (mongoCallbackFn)(struct mongoAsyncContext*, void*, void*);
 typedef struct mongoCallback {
-    struct mongoCallback *next; /* simple singly linked list */
+    struct mongoCallback *next; /* doubly linked list, in the order of the requests */
+    struct mongoCallback *prev;
+    struct mongoCallback *hnext; /* next in the bucket of its request id */
+    int32_t req_id; /* request the callback waits for */
+    uint32_t slot; /* index in the slab of the context */
+    int used; /* the slot holds a waiting callback */
     int flags;
     mongoCallbackFn *fn;
     void *privdata;
+    mongoTimer timer; /* deadline of the request, armed when it has one */
 } mongoCallback;
 
 /* List of callbacks for either regular replies or pub/sub */
@@ -22,10 +33,29 @@ typedef struct mongoCallbackList {
     mongoCallback *head, *tail;
 } mongoCallbackList;
 
+/* Callbacks live in slots that are allocated MONGO_CALLBACK_CHUNK at a time
+ * and never move, so a context that keeps about the same number of requests
+ * in flight stops allocating. The waiting ones are found by request id
+ * through a table of buckets. */
+#define MONGO_CALLBACK_CHUNK 64
+
+typedef struct mongoCallbackSlab {
+    mongoCallback **chunks;
+    uint32_t nr_chunks;
+    uint32_t last; /* slot of the callback registered last */
+    mongoCallback *free; /* free slots, linked by next */
+    mongoCallback **buckets; /* by request id, a power of two of them */
+    unsigned long size;
+    unsigned long used; /* waiting callbacks */
+} mongoCallbackSlab;
+
 /* Connection callback prototypes */
 typedef void (mongoDisconnectCallback)(const struct mongoAsyncContext*, int status);
 typedef void (mongoConnectCallback)(const struct mongoAsyncContext*, int status);
 
+/* Backpressure callback prototype, see mongoAsyncSetWatermarks */
+typedef void (mongoWatermarkCallback)(struct mongoAsyncContext*);
+
 /* Context for an async connection to Mongo */
 typedef struct mongoAsyncContext {
     /* Hold the regular context, so it can be realloc'ed. */
@@ -49,6 +79,11 @@ typedef struct mongoAsyncContext {
         void (*addWrite)(void *privdata);
         void (*delWrite)(void *privdata);
         void (*cleanup)(void *privdata);
+
+        /* Fire mongoAsyncHandleTimeout() once after tv, replacing the time
+         * set by an earlier call. Without it, the application has to call
+         * mongoAsyncHandleTimeout() itself for deadlines to expire. */
+        void (*scheduleTimer)(void *privdata, struct timeval tv);
     } ev;
 
     /* Called when either the connection is terminated due to an error or per
@@ -60,12 +95,86 @@ typedef struct mongoAsyncContext {
 
     /* Regular command callbacks */
     mongoCallbackList replies;
+
+    /* Slots of the same callbacks and their index by request id, replies
+     * are dispatched on their responseTo field. */
+    mongoCallbackSlab slab;
+
+    /* Callback of the exhaust stream being received. The server sends the
+     * replies of a stream back to back, each one answering the reply before
+     * it, so stream_to is the requestID of the last one. */
+    mongoCallback *stream;
+    int32_t stream_to;
+
+    /* Deadline given to new requests in ms, 0 for none, and the wheel the
+     * armed deadlines wait on. wakeup is when the timer asked from the event
+     * library fires, 0 when none is pending. */
+    uint64_t timeout;
+    mongoTimerWheel *timers;
+    uint64_t wakeup;
+
+    /* Set while the callback of a request whose deadline expired runs. */
+    int timedout;
+
+    /* Called when a command makes the context reach one of its high
+     * watermarks, and when it has drained to the low ones again. */
+    mongoWatermarkCallback *onPause;
+    mongoWatermarkCallback *onResume;
+
+    /* Watermarks on the pending output in bytes and on the number of
+     * requests waiting for a reply, a high watermark of 0 means no limit. */
+    size_t high_bytes, low_bytes;
+    unsigned long high_reqs, low_reqs;
+
+    /* Inserts being coalesced into one message and the limits of such a
+     * batch, coalescing is off while batch_docs is 0. */
+    struct mongoInsertBatch *batch;
+    int batch_docs;
+    size_t batch_bytes;
+
+    /* Set when the last command issued was a coalesced insert, as long as
+     * no request was queued after batch_id, see mongoAsyncLastRequestId. */
+    int batched;
+    int32_t batch_id;
+
+    /* Output taken by the event library and not reported written yet, see
+     * MONGO_COMPLETION. */
+    size_t inflight;
 } mongoAsyncContext;
 
 static inline bool mongoAsyncIsConnected(mongoAsyncContext *ac) {
     return (ac->c.flags & MONGO_CONNECTED)? true:false;
 }
 
+static inline bool mongoAsyncIsPaused(mongoAsyncContext *ac) {
+    return (ac->c.flags & MONGO_PAUSED)? true:false;
+}
+
+/* Tells a callback called with a NULL reply that the deadline of its request
+ * expired, see mongoAsyncSetTimeout. The context itself has no error then. */
+static inline bool mongoAsyncTimedOut(mongoAsyncContext *ac) {
+    return ac->timedout ? true : false;
+}
+
+/* Id of the last request queued on the context, it identifies the callback
+ * of the command that was just issued. It is 0 after a coalesced insert,
+ * which has no request of its own. */
+static inline int32_t mongoAsyncLastRequestId(mongoAsyncContext *ac) {
+    if (ac->batched && ac->batch_id == ac->c.req_id)
+        return 0;
+    return ac->c.req_id;
+}
+
+/* Handle of the callback of the command that was just issued, see
+ * mongoAsyncCancelHandle. It is made of the slot of the callback and the
+ * request id, so it goes stale once the callback is done even when the slot
+ * is reused. It is 0 after a coalesced insert, like the request id. */
+static inline uint64_t mongoAsyncLastHandle(mongoAsyncContext *ac) {
+    if (ac->batched && ac->batch_id == ac->c.req_id)
+        return 0;
+    return ((uint64_t)(uint32_t)ac->c.req_id << 32) | ac->slab.last;
+}
+
 /* Functions that proxy to himongo */
 mongoAsyncContext *mongoAsyncConnect(const char *ip, int port);
 mongoAsyncContext *mongoAsyncConnectBind(const char *ip, int port, const char *source_addr);
@@ -74,12 +183,27 @@ mongoAsyncContext *mongoAsyncConnectBindWithReuse(const char *ip, int port,
 mongoAsyncContext *mongoAsyncConnectUnix(const char *path);
 int mongoAsyncSetConnectCallback(mongoAsyncContext *ac, mongoConnectCallback *fn);
 int mongoAsyncSetDisconnectCallback(mongoAsyncContext *ac, mongoDisconnectCallback *fn);
+int mongoAsyncSetPauseCallback(mongoAsyncContext *ac, mongoWatermarkCallback *fn);
+int mongoAsyncSetResumeCallback(mongoAsyncContext *ac, mongoWatermarkCallback *fn);
+int mongoAsyncSetInsertCoalescing(mongoAsyncContext *ac, int max_docs, size_t max_bytes);
+int mongoAsyncSetWatermarks(mongoAsyncContext *ac, size_t high_bytes, size_t low_bytes,
+                            unsigned long high_reqs, unsigned long low_reqs);
 void mongoAsyncDisconnect(mongoAsyncContext *ac);
 void mongoAsyncFree(mongoAsyncContext *ac);
+int mongoAsyncCancel(mongoAsyncContext *ac, int32_t req_id);
+int mongoAsyncCancelHandle(mongoAsyncContext *ac, uint64_t handle);
+int mongoAsyncSetTimeout(mongoAsyncContext *ac, const struct timeval tv);
+int mongoAsyncSetDeadline(mongoAsyncContext *ac, int32_t req_id, const struct timeval tv);
 
-/* Handle read/write events */
+/* Handle read/write events and expired deadlines */
 void mongoAsyncHandleRead(mongoAsyncContext *ac);
 void mongoAsyncHandleWrite(mongoAsyncContext *ac);
+void mongoAsyncHandleTimeout(mongoAsyncContext *ac);
+
+/* Handle completed I/O, see MONGO_COMPLETION */
+sds mongoAsyncTakeOutput(mongoAsyncContext *ac);
+void mongoAsyncHandleWritten(mongoAsyncContext *ac, ssize_t nwritten);
+void mongoAsyncHandleData(mongoAsyncContext *ac, const char *buf, ssize_t nread);
 
 /* Command functions for an async context. Write the command to the
  * output buffer and register the provided callback. */
@@ -89,6 +213,8 @@ int mongoAsyncQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
 int mongoAsyncJsonQuery(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
                         int32_t flags, char *db, char *col, int nrSkip, int nrReturn,
                         char *q_js, char *rf_js);
+int mongoAsyncCommand(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
+                      uint32_t flags, char *db, bson_t *cmd);
 int mongoAsyncGetCollectionNames(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata, char *db);
 
 int mongoAsyncFindAll(mongoAsyncContext *ac, mongoCallbackFn *fn, void *privdata,
@@ -0,0 +1,291 @@
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HIMONGO_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+/* For ZSTD_customMem and the _advanced constructors. */
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#endif
+
+#include "alloc.h"
+#include "compress.h"
+#include "read.h"
+
+/*
+ * The streams are created the first time they are needed, so a context that
+ * only compresses never allocates a decompression stream and a reader never
+ * allocates a compression stream. After that they are reset and reused for
+ * every message.
+ */
+struct mongoCompressor {
+    int id;
+    int level;
+    char *dst; /* Output of the message being compressed */
+    size_t cap;
+    size_t len;
+#ifdef HIMONGO_WITH_ZLIB
+    z_stream deflate;
+    z_stream inflate;
+    unsigned deflate_init:1;
+    unsigned inflate_init:1;
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+#endif
+};
+
+#ifdef HIMONGO_WITH_ZLIB
+/* zlib allocates its stream state through these, so it ends up with the
+ * allocators of the library too. */
+static voidpf __mongoZalloc(voidpf opaque, uInt items, uInt size) {
+    (void)opaque;
+    return mongo_calloc(items, size);
+}
+
+static void __mongoZfree(voidpf opaque, voidpf address) {
+    (void)opaque;
+    mongo_free(address);
+}
+#endif
+
+#ifdef HIMONGO_WITH_ZSTD
+/* Same for the zstd contexts. */
+static void *__mongoZstdAlloc(void *opaque, size_t size) {
+    (void)opaque;
+    return mongo_malloc(size);
+}
+
+static void __mongoZstdFree(void *opaque, void *address) {
+    (void)opaque;
+    mongo_free(address);
+}
+
+static const ZSTD_customMem __mongoZstdMem = {__mongoZstdAlloc, __mongoZstdFree, NULL};
+#endif
+
+int mongoCompressorSupported(int id) {
+    switch (id) {
+    case MONGO_COMPRESSOR_NOOP:
+        return 1;
+#ifdef HIMONGO_WITH_ZLIB
+    case MONGO_COMPRESSOR_ZLIB:
+        return 1;
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    case MONGO_COMPRESSOR_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Name used for the compressor in the isMaster handshake. */
+const char *mongoCompressorName(int id) {
+    switch (id) {
+    case MONGO_COMPRESSOR_NOOP: return "noop";
+    case MONGO_COMPRESSOR_SNAPPY: return "snappy";
+    case MONGO_COMPRESSOR_ZLIB: return "zlib";
+    case MONGO_COMPRESSOR_ZSTD: return "zstd";
+    default: return NULL;
+    }
+}
+
+mongoCompressor *mongoCompressorCreate(int id, int level) {
+    mongoCompressor *z;
+
+    if (!mongoCompressorSupported(id))
+        return NULL;
+    z = mongo_calloc(1, sizeof(*z));
+    if (z == NULL)
+        return NULL;
+    z->id = id;
+    z->level = level;
+    return z;
+}
+
+void mongoCompressorFree(mongoCompressor *z) {
+    if (z == NULL)
+        return;
+#ifdef HIMONGO_WITH_ZLIB
+    if (z->deflate_init) deflateEnd(&z->deflate);
+    if (z->inflate_init) inflateEnd(&z->inflate);
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+#endif
+    mongo_free(z);
+}
+
+int mongoCompressorId(mongoCompressor *z) {
+    return z->id;
+}
+
+size_t mongoCompressBound(mongoCompressor *z, size_t len) {
+    switch (z->id) {
+#ifdef HIMONGO_WITH_ZLIB
+    case MONGO_COMPRESSOR_ZLIB:
+        return compressBound((uLong)len);
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    case MONGO_COMPRESSOR_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        return len;
+    }
+}
+
+int mongoCompressBegin(mongoCompressor *z, char *dst, size_t cap) {
+    z->dst = dst;
+    z->cap = cap;
+    z->len = 0;
+    switch (z->id) {
+#ifdef HIMONGO_WITH_ZLIB
+    case MONGO_COMPRESSOR_ZLIB:
+        if (!z->deflate_init) {
+            z->deflate.zalloc = __mongoZalloc;
+            z->deflate.zfree = __mongoZfree;
+            if (deflateInit(&z->deflate, z->level) != Z_OK)
+                return MONGO_ERR;
+            z->deflate_init = 1;
+        } else if (deflateReset(&z->deflate) != Z_OK) {
+            return MONGO_ERR;
+        }
+        z->deflate.next_out = (Bytef *)dst;
+        z->deflate.avail_out = (uInt)cap;
+        break;
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    case MONGO_COMPRESSOR_ZSTD:
+        if (z->cctx == NULL) {
+            z->cctx = ZSTD_createCCtx_advanced(__mongoZstdMem);
+            if (z->cctx == NULL)
+                return MONGO_ERR;
+            if (z->level != MONGO_COMPRESS_LEVEL_DEFAULT)
+                ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, z->level);
+        } else {
+            ZSTD_CCtx_reset(z->cctx, ZSTD_reset_session_only);
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    return MONGO_OK;
+}
+
+int mongoCompressUpdate(mongoCompressor *z, const char *src, size_t len) {
+    switch (z->id) {
+#ifdef HIMONGO_WITH_ZLIB
+    case MONGO_COMPRESSOR_ZLIB:
+        z->deflate.next_in = (Bytef *)src;
+        z->deflate.avail_in = (uInt)len;
+        while (z->deflate.avail_in > 0) {
+            if (z->deflate.avail_out == 0 ||
+                deflate(&z->deflate, Z_NO_FLUSH) != Z_OK)
+                return MONGO_ERR;
+        }
+        return MONGO_OK;
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    case MONGO_COMPRESSOR_ZSTD: {
+        ZSTD_inBuffer in = {src, len, 0};
+        ZSTD_outBuffer out = {z->dst, z->cap, z->len};
+
+        while (in.pos < in.size) {
+            if (out.pos == out.size ||
+                ZSTD_isError(ZSTD_compressStream2(z->cctx, &out, &in, ZSTD_e_continue)))
+                return MONGO_ERR;
+        }
+        z->len = out.pos;
+        return MONGO_OK;
+    }
+#endif
+    default:
+        if (len > z->cap - z->len)
+            return MONGO_ERR;
+        memcpy(z->dst + z->len, src, len);
+        z->len += len;
+        return MONGO_OK;
+    }
+}
+
+int mongoCompressEnd(mongoCompressor *z, size_t *written) {
+    switch (z->id) {
+#ifdef HIMONGO_WITH_ZLIB
+    case MONGO_COMPRESSOR_ZLIB:
+        if (deflate(&z->deflate, Z_FINISH) != Z_STREAM_END)
+            return MONGO_ERR;
+        z->len = z->cap - z->deflate.avail_out;
+        break;
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    case MONGO_COMPRESSOR_ZSTD: {
+        ZSTD_inBuffer in = {NULL, 0, 0};
+        ZSTD_outBuffer out = {z->dst, z->cap, z->len};
+        size_t left;
+
+        do {
+            left = ZSTD_compressStream2(z->cctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(left) || (left > 0 && out.pos == out.size))
+                return MONGO_ERR;
+        } while (left > 0);
+        z->len = out.pos;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    *written = z->len;
+    return MONGO_OK;
+}
+
+int mongoDecompress(mongoCompressor *z, const char *src, size_t srclen,
+                    char *dst, size_t dstlen)
+{
+    switch (z->id) {
+#ifdef HIMONGO_WITH_ZLIB
+    case MONGO_COMPRESSOR_ZLIB:
+        if (!z->inflate_init) {
+            z->inflate.zalloc = __mongoZalloc;
+            z->inflate.zfree = __mongoZfree;
+            if (inflateInit(&z->inflate) != Z_OK)
+                return MONGO_ERR;
+            z->inflate_init = 1;
+        } else if (inflateReset(&z->inflate) != Z_OK) {
+            return MONGO_ERR;
+        }
+        z->inflate.next_in = (Bytef *)src;
+        z->inflate.avail_in = (uInt)srclen;
+        z->inflate.next_out = (Bytef *)dst;
+        z->inflate.avail_out = (uInt)dstlen;
+        if (inflate(&z->inflate, Z_FINISH) != Z_STREAM_END ||
+            z->inflate.avail_out != 0)
+            return MONGO_ERR;
+        return MONGO_OK;
+#endif
+#ifdef HIMONGO_WITH_ZSTD
+    case MONGO_COMPRESSOR_ZSTD:
+        if (z->dctx == NULL) {
+            z->dctx = ZSTD_createDCtx_advanced(__mongoZstdMem);
+            if (z->dctx == NULL)
+                return MONGO_ERR;
+        }
+        if (ZSTD_decompressDCtx(z->dctx, dst, dstlen, src, srclen) != dstlen)
+            return MONGO_ERR;
+        return MONGO_OK;
+#endif
+    default:
+        if (srclen != dstlen)
+            return MONGO_ERR;
+        memcpy(dst, src, srclen);
+        return MONGO_OK;
+    }
+}
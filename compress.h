@@ -0,0 +1,46 @@
+#ifndef __HIMONGO_COMPRESS_H
+#define __HIMONGO_COMPRESS_H
+#include <stddef.h> /* for size_t */
+
+/* Compressor ids of OP_COMPRESSED. snappy is not implemented. zlib and zstd
+ * are available when built with HIMONGO_WITH_ZLIB and HIMONGO_WITH_ZSTD. */
+#define MONGO_COMPRESSOR_NOOP   0
+#define MONGO_COMPRESSOR_SNAPPY 1
+#define MONGO_COMPRESSOR_ZLIB   2
+#define MONGO_COMPRESSOR_ZSTD   3
+
+/* Messages shorter than this go out uncompressed by default. */
+#define MONGO_COMPRESS_THRESHOLD 1024
+
+/* Use the compression library's default level. */
+#define MONGO_COMPRESS_LEVEL_DEFAULT (-1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One compressor and its streams, which are kept from message to message. */
+typedef struct mongoCompressor mongoCompressor;
+
+int mongoCompressorSupported(int id);
+const char *mongoCompressorName(int id);
+mongoCompressor *mongoCompressorCreate(int id, int level);
+void mongoCompressorFree(mongoCompressor *z);
+int mongoCompressorId(mongoCompressor *z);
+
+/* Compress a message that comes in several pieces into dst, which must hold
+ * mongoCompressBound bytes. */
+size_t mongoCompressBound(mongoCompressor *z, size_t len);
+int mongoCompressBegin(mongoCompressor *z, char *dst, size_t cap);
+int mongoCompressUpdate(mongoCompressor *z, const char *src, size_t len);
+int mongoCompressEnd(mongoCompressor *z, size_t *written);
+
+/* Decompress src into exactly dstlen bytes. */
+int mongoDecompress(mongoCompressor *z, const char *src, size_t srclen,
+                    char *dst, size_t dstlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,17 +5,23 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sys/uio.h>
 
 #include "proto.h"
 #include "himongo.h"
 #include "net.h"
+#include "alloc.h"
 #include "sds.h"
 #include "utils.h"
+#include "endianconv.h"
+
+static void __mongoObserveFailed(mongoContext *c);
 
 void __mongoSetError(mongoContext *c, int type, const char *str) {
     size_t len;
 
     c->err = type;
+    c->stats.errors++;
     if (str != NULL) {
         len = strlen(str);
         len = len < (sizeof(c->errstr)-1) ? len : (sizeof(c->errstr)-1);
@@ -26,6 +32,10 @@ void __mongoSetError(mongoContext *c, int type, const char *str) {
         assert(type == MONGO_ERR_IO);
         __mongo_strerror_r(errno, c->errstr, sizeof(c->errstr));
     }
+
+    /* The requests in flight are lost. */
+    if (c->observer.fn != NULL)
+        __mongoObserveFailed(c);
 }
 
 char *bson_extract_string(bson_t *b, char *k) {
@@ -79,20 +89,20 @@ char **bson_extract_collection_names(bson_t *b) {
                 (name = (char*)bson_iter_utf8(&it4, NULL))) {
                 // check if the buffer is enough
                 if (n >= max_n) {
-                    if (pptr != buf) pptr = realloc(pptr, sizeof(void*)*max_n*2+1);
+                    if (pptr != buf) pptr = mongo_realloc(pptr, sizeof(void*)*max_n*2+1);
                     else {
-                        pptr = malloc(sizeof(void*)*max_n*2+1);
+                        pptr = mongo_malloc(sizeof(void*)*max_n*2+1);
                         memcpy(pptr, buf, sizeof(buf));
                     }
                     max_n *= 2;
                 }
-                pptr[n++] = strdup(name);
+                pptr[n++] = mongo_strdup(name);
             }
         }
     }
     if (pptr == buf){
         totalsz = (n+1) * sizeof(void*);
-        namev = malloc(totalsz);
+        namev = mongo_malloc(totalsz);
         memcpy(namev, pptr, n * sizeof(void *));
     } else {
         namev = pptr;
@@ -108,7 +118,7 @@ void freeReplyObject(void *reply) {
 static mongoContext *mongoContextInit(void) {
     mongoContext *c;
 
-    c = calloc(1,sizeof(mongoContext));
+    c = mongo_calloc(1,sizeof(mongoContext));
     if (c == NULL)
         return NULL;
 
@@ -120,6 +130,8 @@ static mongoContext *mongoContextInit(void) {
     c->tcp.source_addr = NULL;
     c->unix_sock.path = NULL;
     c->timeout = NULL;
+    c->wc.w = 1;
+    c->wc.flush_bytes = MONGO_WC_FLUSH_BYTES;
 
     if (c->obuf == NULL || c->reader == NULL) {
         mongoFree(c);
@@ -136,17 +148,21 @@ void mongoFree(mongoContext *c) {
         close(c->fd);
     if (c->obuf != NULL)
         sdsfree(c->obuf);
+    if (c->oref.refs != NULL)
+        mongo_free(c->oref.refs);
+    mongo_free(c->stamps.tab);
+    mongoCompressorFree(c->compressor);
     if (c->reader != NULL)
         mongoReaderFree(c->reader);
     if (c->tcp.host)
-        free(c->tcp.host);
+        mongo_free(c->tcp.host);
     if (c->tcp.source_addr)
-        free(c->tcp.source_addr);
+        mongo_free(c->tcp.source_addr);
     if (c->unix_sock.path)
-        free(c->unix_sock.path);
+        mongo_free(c->unix_sock.path);
     if (c->timeout)
-        free(c->timeout);
-    free(c);
+        mongo_free(c->timeout);
+    mongo_free(c);
 }
 
 int mongoFreeKeepFd(mongoContext *c) {
@@ -156,7 +172,12 @@ int mongoFreeKeepFd(mongoContext *c) {
     return fd;
 }
 
+static int __mongoNegotiateCompression(mongoContext *c, int id);
+
 int mongoReconnect(mongoContext *c) {
+    mongoCompressor *z = c->compressor;
+    int status;
+
     c->err = 0;
     memset(c->errstr, '\0', strlen(c->errstr));
 
@@ -168,20 +189,36 @@ int mongoReconnect(mongoContext *c) {
     mongoReaderFree(c->reader);
 
     c->obuf = sdsempty();
+    c->opos = 0;
+    c->oref.head = c->oref.len = c->oref.bytes = 0;
     c->reader = mongoReaderCreate();
 
+    /* The requests being timed are gone with the old connection. */
+    mongo_free(c->stamps.tab);
+    memset(&c->stamps,0,sizeof(c->stamps));
+
+    c->compressor = NULL;
     if (c->connection_type == MONGO_CONN_TCP) {
-        return mongoContextConnectBindTcp(c, c->tcp.host, c->tcp.port,
+        status = mongoContextConnectBindTcp(c, c->tcp.host, c->tcp.port,
                 c->timeout, c->tcp.source_addr);
     } else if (c->connection_type == MONGO_CONN_UNIX) {
-        return mongoContextConnectUnix(c, c->unix_sock.path, c->timeout);
+        status = mongoContextConnectUnix(c, c->unix_sock.path, c->timeout);
     } else {
         /* Something bad happened here and shouldn't have. There isn't
            enough information in the context to reconnect. */
         __mongoSetError(c,MONGO_ERR_OTHER,"Not enough information to reconnect");
+        status = MONGO_ERR;
     }
 
-    return MONGO_ERR;
+    /* Compression is negotiated per connection. */
+    if (z != NULL) {
+        if (status == MONGO_OK && (!(c->flags & MONGO_BLOCK) ||
+            __mongoNegotiateCompression(c, mongoCompressorId(z)) == MONGO_OK))
+            c->compressor = z;
+        else
+            mongoCompressorFree(z);
+    }
+    return status;
 }
 
 /* Connect to a Mongo instance. On error the field error in the returned
@@ -295,6 +332,88 @@ int mongoSetTimeout(mongoContext *c, const struct timeval tv) {
     return MONGO_ERR;
 }
 
+/* Make the write helpers use OP_MSG write commands, which needs
+ * MongoDB 3.6 or newer. */
+int mongoEnableOpMsg(mongoContext *c) {
+    c->flags |= MONGO_OP_MSG;
+    return MONGO_OK;
+}
+
+/* Offer the compressor to the server with isMaster and tell whether it
+ * accepted it. Sent uncompressed, as the handshake has to be. */
+static int __mongoNegotiateCompression(mongoContext *c, int id) {
+    const char *name = mongoCompressorName(id);
+    bson_t cmd, names, *doc;
+    bson_iter_t it, child;
+    mongoReply *reply;
+    int accepted = 0;
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "isMaster", 1);
+    BSON_APPEND_ARRAY_BEGIN(&cmd, "compression", &names);
+    BSON_APPEND_UTF8(&names, "0", name);
+    bson_append_array_end(&cmd, &names);
+    reply = mongoQuery(c, 0, (char *)"admin", (char *)"$cmd", 0, -1, &cmd, NULL);
+    bson_destroy(&cmd);
+    if (reply == NULL)
+        return MONGO_ERR;
+
+    doc = mongoReplyCommandDoc(reply);
+    if (doc != NULL && bson_iter_init(&it, doc) && bson_iter_find(&it, "compression") &&
+        BSON_ITER_HOLDS_ARRAY(&it) && bson_iter_recurse(&it, &child)) {
+        while (bson_iter_next(&child)) {
+            if (BSON_ITER_HOLDS_UTF8(&child) &&
+                strcmp(bson_iter_utf8(&child, NULL), name) == 0)
+                accepted = 1;
+        }
+    }
+    freeReplyObject(reply);
+    return accepted ? MONGO_OK : MONGO_ERR;
+}
+
+/* Set the write concern of mongoInsert, mongoUpdate and mongoDelete. With
+ * w = 1, the default, each write waits for its acknowledgement. With w = 0
+ * they queue the write without asking for one and return NULL, leaving err
+ * at 0, and the writes go out together once flush_bytes (0 for
+ * MONGO_WC_FLUSH_BYTES) are pending or when mongoFlushWrites is called,
+ * with a single check of the whole batch. Writes still queued when the
+ * context is freed are lost. Higher values of w are not supported. */
+int mongoSetWriteConcern(mongoContext *c, int w, size_t flush_bytes) {
+    if (w != 0 && w != 1)
+        return MONGO_ERR;
+    c->wc.w = w;
+    c->wc.flush_bytes = flush_bytes ? flush_bytes : MONGO_WC_FLUSH_BYTES;
+    return MONGO_OK;
+}
+
+/* Wrap the messages of at least threshold bytes (0 for the default) in
+ * OP_COMPRESSED, using one of the MONGO_COMPRESSOR_* ids. level is passed to
+ * the compression library, MONGO_COMPRESS_LEVEL_DEFAULT leaves it alone.
+ *
+ * A blocking context asks the server first. A non-blocking one can't wait
+ * for the answer, so the caller has to know that the server accepts the
+ * compressor. Returns MONGO_OK when compression is on. The err field is set
+ * only when the handshake failed on the connection; a compressor that isn't
+ * built in or that the server refused leaves the context usable. */
+int mongoEnableCompression(mongoContext *c, int compressor, int level, size_t threshold) {
+    mongoCompressor *z;
+
+    if (!mongoCompressorSupported(compressor))
+        return MONGO_ERR;
+    if ((c->flags & MONGO_BLOCK) &&
+        __mongoNegotiateCompression(c, compressor) != MONGO_OK)
+        return MONGO_ERR;
+    z = mongoCompressorCreate(compressor, level);
+    if (z == NULL) {
+        __mongoSetError(c, MONGO_ERR_OOM, "Out of memory");
+        return MONGO_ERR;
+    }
+    mongoCompressorFree(c->compressor);
+    c->compressor = z;
+    c->compress_threshold = threshold ? threshold : MONGO_COMPRESS_THRESHOLD;
+    return MONGO_OK;
+}
+
 /* Enable connection KeepAlive. */
 int mongoEnableKeepAlive(mongoContext *c) {
     if (mongoKeepAlive(c, MONGO_KEEPALIVE_INTERVAL) != MONGO_OK)
@@ -308,14 +427,22 @@ int mongoEnableKeepAlive(mongoContext *c) {
  * After this function is called, you may use mongoContextReadReply to
  * see if there is a reply available. */
 int mongoBufferRead(mongoContext *c) {
-    char buf[1024*16];
-    int nread;
+    char *buf;
+    size_t avail;
+    ssize_t nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return MONGO_ERR;
 
-    nread = read(c->fd,buf,sizeof(buf));
+    /* Read straight into the reader's buffer. */
+    buf = mongoReaderReserve(c->reader,&avail);
+    if (buf == NULL) {
+        __mongoSetError(c,c->reader->err,c->reader->errstr);
+        return MONGO_ERR;
+    }
+
+    nread = read(c->fd,buf,avail);
     if (nread == -1) {
         if ((errno == EAGAIN && !(c->flags & MONGO_BLOCK)) || (errno == EINTR)) {
             /* Try again later */
@@ -327,15 +454,93 @@ int mongoBufferRead(mongoContext *c) {
         __mongoSetError(c,MONGO_ERR_EOF,"Server closed the connection");
         return MONGO_ERR;
     } else {
-        if (mongoReaderFeed(c->reader,buf,nread) != MONGO_OK) {
-            __mongoSetError(c,c->reader->err,c->reader->errstr);
-            return MONGO_ERR;
-        }
+        mongoReaderCommit(c->reader,(size_t)nread);
+        mongoStatsRead(&c->stats,(size_t)nread,c->reader->len);
     }
     return MONGO_OK;
 }
 
+/* Number of output bytes not written yet, borrowed documents included. */
+size_t mongoBufferPending(mongoContext *c) {
+    return sdslen(c->obuf) - c->opos + c->oref.bytes;
+}
+
+/* Fill iov with the unwritten output, i.e. the output buffer interleaved
+ * with the borrowed documents. Returns the number of iovecs used. */
+static int __mongoBufferIov(mongoContext *c, struct iovec *iov, int max) {
+    mongoOutRef *ref;
+    size_t pos = c->opos;
+    size_t i;
+    int n = 0;
+
+    for (i = c->oref.head; i < c->oref.len; i++) {
+        ref = c->oref.refs + i;
+        if (ref->pos > pos) {
+            if (n == max) return n;
+            iov[n].iov_base = c->obuf + pos;
+            iov[n].iov_len = ref->pos - pos;
+            n++;
+            pos = ref->pos;
+        }
+        if (n == max) return n;
+        iov[n].iov_base = (void *)ref->ptr;
+        iov[n].iov_len = ref->len;
+        n++;
+    }
+    if (pos < sdslen(c->obuf) && n < max) {
+        iov[n].iov_base = c->obuf + pos;
+        iov[n].iov_len = sdslen(c->obuf) - pos;
+        n++;
+    }
+    return n;
+}
+
+/* Drop nwritten bytes from the head of the output. */
+static void __mongoBufferConsume(mongoContext *c, size_t nwritten) {
+    mongoOutRef *ref;
+    size_t n, i;
+
+    while (nwritten > 0 && c->oref.head < c->oref.len) {
+        ref = c->oref.refs + c->oref.head;
+        n = ref->pos - c->opos;
+        if (n > nwritten) n = nwritten;
+        c->opos += n;
+        nwritten -= n;
+        if (nwritten == 0) break;
+
+        n = ref->len < nwritten ? ref->len : nwritten;
+        ref->ptr += n;
+        ref->len -= n;
+        c->oref.bytes -= n;
+        nwritten -= n;
+        if (ref->len == 0) c->oref.head++;
+    }
+    c->opos += nwritten;
+
+    if (c->oref.head == c->oref.len)
+        c->oref.head = c->oref.len = 0;
+    if (c->opos == sdslen(c->obuf) && c->oref.len == 0) {
+        /* Keep a small buffer around, give big ones back. */
+        if (sdsavail(c->obuf) > 1024*16) {
+            sdsfree(c->obuf);
+            c->obuf = sdsempty();
+        } else {
+            sdsclear(c->obuf);
+        }
+        c->opos = 0;
+    } else if (c->opos >= 1024*16 && c->opos*2 >= sdslen(c->obuf)) {
+        /* The written prefix dominates the buffer, reclaim it. */
+        sdsrange(c->obuf,(int)c->opos,-1);
+        for (i = c->oref.head; i < c->oref.len; i++)
+            c->oref.refs[i].pos -= c->opos;
+        c->opos = 0;
+    }
+}
+
 /* Write the output buffer to the socket.
+ *
+ * Borrowed documents (see MONGO_BORROW) are written in place with writev(),
+ * so they are never copied on the way out.
  *
  * Returns MONGO_OK when the buffer is empty, or (a part of) the buffer was
  * successfully written to the socket. When the buffer is empty after the
@@ -345,14 +550,21 @@ int mongoBufferRead(mongoContext *c) {
  * c->errstr to hold the appropriate error string.
  */
 int mongoBufferWrite(mongoContext *c, int *done) {
-    int nwritten;
+    struct iovec iov[MONGO_IOV_MAX];
+    ssize_t nwritten;
+    int iovcnt;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return MONGO_ERR;
 
-    if (sdslen(c->obuf) > 0) {
-        nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
+    if (mongoBufferPending(c) > 0) {
+        if (c->oref.len == 0) {
+            nwritten = write(c->fd,c->obuf+c->opos,sdslen(c->obuf)-c->opos);
+        } else {
+            iovcnt = __mongoBufferIov(c,iov,MONGO_IOV_MAX);
+            nwritten = writev(c->fd,iov,iovcnt);
+        }
         if (nwritten == -1) {
             if ((errno == EAGAIN && !(c->flags & MONGO_BLOCK)) || (errno == EINTR)) {
                 /* Try again later */
@@ -361,18 +573,216 @@ int mongoBufferWrite(mongoContext *c, int *done) {
                 return MONGO_ERR;
             }
         } else if (nwritten > 0) {
-            if (nwritten == (signed)sdslen(c->obuf)) {
-                sdsfree(c->obuf);
-                c->obuf = sdsempty();
-            } else {
-                sdsrange(c->obuf,nwritten,-1);
-            }
+            __mongoBufferConsume(c,(size_t)nwritten);
+            c->stats.bytes_out += (size_t)nwritten;
+        }
+    }
+    if (done != NULL) *done = (mongoBufferPending(c) == 0);
+    return MONGO_OK;
+}
+
+/* Hand the unwritten output over to the caller, who writes it and frees it
+ * with sdsfree(). This is for event libraries that do the I/O themselves,
+ * see MONGO_COMPLETION. Borrowed documents are copied in, so the caller's
+ * documents are released as soon as this returns. Returns NULL when there
+ * is nothing to write or on error. */
+sds mongoBufferTake(mongoContext *c) {
+    struct iovec iov[MONGO_IOV_MAX];
+    sds out, empty;
+    size_t len;
+    int iovcnt;
+
+    if (c->err || mongoBufferPending(c) == 0)
+        return NULL;
+
+    if (c->oref.len == 0) {
+        /* Nothing borrowed, the buffer itself changes hands. */
+        if ((empty = sdsempty()) == NULL)
+            goto oom;
+        out = c->obuf;
+        if (c->opos > 0)
+            sdsrange(out,(int)c->opos,-1);
+        c->obuf = empty;
+        c->opos = 0;
+        return out;
+    }
+
+    if ((empty = sdsempty()) == NULL)
+        goto oom;
+    if ((out = sdsMakeRoomFor(empty,mongoBufferPending(c))) == NULL) {
+        sdsfree(empty);
+        goto oom;
+    }
+    while (mongoBufferPending(c) > 0) {
+        iovcnt = __mongoBufferIov(c,iov,MONGO_IOV_MAX);
+        len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            out = sdscatlen(out,iov[i].iov_base,iov[i].iov_len);
+            len += iov[i].iov_len;
         }
+        __mongoBufferConsume(c,len);
     }
-    if (done != NULL) *done = (sdslen(c->obuf) == 0);
+    return out;
+
+oom:
+    __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+    return NULL;
+}
+
+/* Write until the output is drained. Only for blocking contexts. */
+static int __mongoBufferFlush(mongoContext *c) {
+    int wdone = 0;
+
+    do {
+        if (mongoBufferWrite(c,&wdone) == MONGO_ERR)
+            return MONGO_ERR;
+    } while (!wdone);
     return MONGO_OK;
 }
 
+static void __mongoEventInit(mongoCommandEvent *ev, int type, int32_t opCode, int32_t req_id) {
+    memset(ev,0,sizeof(*ev));
+    ev->type = type;
+    ev->opCode = opCode;
+    ev->req_id = req_id;
+}
+
+/* Tell the observer about the reply to a stamped request. Replies that
+ * report a failure make it a failed event. */
+static void __mongoObserveReply(mongoContext *c, const mongoStamp *st, void *reply,
+                                uint64_t elapsed)
+{
+    mongoReply *rpl = reply;
+    mongoCommandEvent ev;
+    bson_t *doc;
+
+    __mongoEventInit(&ev,MONGO_EVENT_SUCCEEDED,st->opCode,st->req_id);
+    ev.bytes = (size_t)rpl->messageLength;
+    ev.elapsed_ns = elapsed;
+    ev.reply = reply;
+    if (rpl->opCode == OP_REPLY && (rpl->responseFlags & REPLY_FLAG_QUERY_FAILURE)) {
+        ev.type = MONGO_EVENT_FAILED;
+        doc = mongoReplyGetBson(rpl,0);
+        ev.errstr = doc ? bson_extract_string(doc,(char *)"$err") : NULL;
+        if (ev.errstr == NULL) ev.errstr = "Query failure";
+    } else if (st->cmd && !mongoReplyCommandOk(reply)) {
+        ev.type = MONGO_EVENT_FAILED;
+        doc = mongoReplyCommandDoc(reply);
+        ev.errstr = doc ? bson_extract_string(doc,(char *)"errmsg") : NULL;
+        if (ev.errstr == NULL) ev.errstr = "Command failed";
+    }
+    c->observer.fn(c,&ev,c->observer.privdata);
+}
+
+/* Fail every request still waiting for its reply, the context's error says
+ * why. */
+static void __mongoObserveFailed(mongoContext *c) {
+    mongoCommandEvent ev;
+    mongoStamp st;
+    uint64_t now;
+
+    if (c->stamps.tab == NULL)
+        return;
+    now = mongoStatsNow();
+    for (uint32_t i = 0; i < c->stamps.size && c->observer.fn != NULL; i++) {
+        if (c->stamps.tab[i].op < 0)
+            continue;
+        st = c->stamps.tab[i];
+        c->stamps.tab[i].op = -1;
+        c->stamps.used--;
+        __mongoEventInit(&ev,MONGO_EVENT_FAILED,st.opCode,st.req_id);
+        ev.elapsed_ns = now - st.t;
+        ev.errstr = c->errstr;
+        c->observer.fn(c,&ev,c->observer.privdata);
+    }
+}
+
+/* The stamp of req_id, NULL when it has none. Request ids are handed out
+ * in sequence, so their low bits spread them well enough. */
+static mongoStamp *__mongoStampFind(mongoContext *c, int32_t req_id) {
+    uint32_t mask = c->stamps.size - 1;
+    uint32_t i = (uint32_t)req_id & mask;
+
+    if (c->stamps.tab == NULL)
+        return NULL;
+    while (c->stamps.tab[i].op >= 0) {
+        if (c->stamps.tab[i].req_id == req_id)
+            return c->stamps.tab + i;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Free the slot of a stamp, moving back the entries after it that would
+ * no longer be found, so that lookups can stop at the first free slot. */
+static void __mongoStampDel(mongoContext *c, mongoStamp *st) {
+    mongoStamp *tab = c->stamps.tab;
+    uint32_t mask = c->stamps.size - 1;
+    uint32_t i = (uint32_t)(st - tab), j = i, home;
+
+    tab[i].op = -1;
+    c->stamps.used--;
+    while (1) {
+        j = (j + 1) & mask;
+        if (tab[j].op < 0)
+            return;
+        home = (uint32_t)tab[j].req_id & mask;
+        /* Leave it when its home is cyclically in (i, j]. */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        tab[i] = tab[j];
+        tab[j].op = -1;
+        i = j;
+    }
+}
+
+/* Take a free slot for req_id, growing the table when it is half full.
+ * NULL when out of memory, the request isn't timed then. */
+static mongoStamp *__mongoStampAdd(mongoContext *c, int32_t req_id) {
+    mongoStamp *old = c->stamps.tab, *tab;
+    uint32_t oldsize = c->stamps.size, size, i;
+
+    if (old == NULL || (c->stamps.used + 1) * 2 > oldsize) {
+        size = old ? oldsize * 2 : MONGO_STATS_STAMPS;
+        tab = mongo_malloc(size * sizeof(*tab));
+        if (tab == NULL)
+            return NULL;
+        for (i = 0; i < size; i++)
+            tab[i].op = -1;
+        c->stamps.tab = tab;
+        c->stamps.size = size;
+        c->stamps.used = 0;
+        for (i = 0; i < oldsize; i++) {
+            if (old[i].op >= 0)
+                *__mongoStampAdd(c,old[i].req_id) = old[i];
+        }
+        mongo_free(old);
+    }
+    i = (uint32_t)req_id & (c->stamps.size - 1);
+    while (c->stamps.tab[i].op >= 0)
+        i = (i + 1) & (c->stamps.size - 1);
+    c->stamps.used++;
+    return c->stamps.tab + i;
+}
+
+/* Count a reply and time the request it answers, when it was stamped by
+ * __mongoStatsQueued. */
+static void __mongoStatsReply(mongoContext *c, void *reply) {
+    mongoStamp st, *slot;
+    uint64_t elapsed;
+
+    c->stats.replies_in++;
+    slot = __mongoStampFind(c,((mongoReply *)reply)->responseTo);
+    if (slot == NULL)
+        return;
+    st = *slot;
+    __mongoStampDel(c,slot);
+    elapsed = mongoStatsNow() - st.t;
+    mongoHistogramRecord(&c->stats.latency[st.op], elapsed / 1000);
+    if (c->observer.fn != NULL)
+        __mongoObserveReply(c,&st,reply,elapsed);
+}
+
 /* Internal helper function to try and get a reply from the reader,
  * or set an error in the context otherwise. */
 int mongoGetReplyFromReader(mongoContext *c, void **reply) {
@@ -380,11 +790,31 @@ int mongoGetReplyFromReader(mongoContext *c, void **reply) {
         __mongoSetError(c,c->reader->err,c->reader->errstr);
         return MONGO_ERR;
     }
+    if (*reply != NULL)
+        __mongoStatsReply(c,*reply);
+    return MONGO_OK;
+}
+
+/* Copy the statistics of the context, for an async context pass &ac->c. */
+void mongoGetStats(mongoContext *c, mongoStats *stats) {
+    memcpy(stats,&c->stats,sizeof(*stats));
+}
+
+/* Start counting from zero. Requests in flight are still timed. */
+void mongoResetStats(mongoContext *c) {
+    memset(&c->stats,0,sizeof(c->stats));
+}
+
+/* Have fn called when a request is queued and when its reply comes in, or
+ * NULL to stop. Requests without a reply only have a started event. The
+ * strings of an event are only valid during the call. */
+int mongoSetCommandObserver(mongoContext *c, mongoCommandObserver *fn, void *privdata) {
+    c->observer.fn = fn;
+    c->observer.privdata = privdata;
     return MONGO_OK;
 }
 
 int mongoGetReply(mongoContext *c, void **reply) {
-    int wdone = 0;
     void *aux = NULL;
 
     /* Try to read pending replies */
@@ -394,10 +824,8 @@ int mongoGetReply(mongoContext *c, void **reply) {
     /* For the blocking context, flush output buffer and read reply */
     if (aux == NULL && c->flags & MONGO_BLOCK) {
         /* Write until done */
-        do {
-            if (mongoBufferWrite(c,&wdone) == MONGO_ERR)
-                return MONGO_ERR;
-        } while (!wdone);
+        if (__mongoBufferFlush(c) == MONGO_ERR)
+            return MONGO_ERR;
 
         /* Read until there is a reply */
         do {
@@ -413,27 +841,369 @@ int mongoGetReply(mongoContext *c, void **reply) {
     return MONGO_OK;
 }
 
+/* Size of a message about to be queued. */
+typedef struct mongoMsgSize {
+    size_t len; /* Whole message, header included */
+    size_t copied; /* Bytes that go into obuf */
+    size_t nr_refs; /* Number of borrowed documents */
+} mongoMsgSize;
+
+/* Large documents go out by reference when the caller allows it. */
+#define __mongoBorrows(doc, borrow) ((borrow) && (doc)->len >= MONGO_BORROW_MIN_LEN)
+
+static inline void __mongoMsgSizeInit(mongoMsgSize *sz, size_t fixed) {
+    sz->len = sz->copied = 16 + fixed;
+    sz->nr_refs = 0;
+}
+
+static inline void __mongoMsgSizeAddDoc(mongoMsgSize *sz, bson_t *doc, int borrow) {
+    sz->len += doc->len;
+    if (__mongoBorrows(doc, borrow)) sz->nr_refs++;
+    else sz->copied += doc->len;
+}
 
 /*
- * Write a formatted command to the output buffer.
+ * Fixed layout writers. Once __mongoBeginMsg reserved the room for a message
+ * its fields are stored straight at the tail of obuf: an encoder takes the
+ * tail, puts its fields one after the other and commits the new end, without
+ * going through a format string.
  */
-int mongoAppendReqeustRaw(mongoContext *c, int32_t req_id, int32_t opCode, char *m, size_t len) {
+static inline char *__mongoTail(mongoContext *c) {
+    return c->obuf + sdslen(c->obuf);
+}
+
+static inline void __mongoCommit(mongoContext *c, char *p) {
+    sdsIncrLen(c->obuf, (int)(p - __mongoTail(c)));
+}
+
+static inline char *__mongoPut8(char *p, uint8_t v) {
+    *p = (char)v;
+    return p + 1;
+}
+
+static inline char *__mongoPut32(char *p, int32_t v) {
+    uint32_t u = intrev32ifbe((uint32_t)v);
+    memcpy(p, &u, 4);
+    return p + 4;
+}
+
+static inline char *__mongoPut64(char *p, int64_t v) {
+    uint64_t u = intrev64ifbe((uint64_t)v);
+    memcpy(p, &u, 8);
+    return p + 8;
+}
+
+static inline char *__mongoPutHeader(char *p, int32_t len, int32_t req_id,
+                                     int32_t resp_to, int32_t opCode)
+{
+    p = __mongoPut32(p, len);
+    p = __mongoPut32(p, req_id);
+    p = __mongoPut32(p, resp_to);
+    return __mongoPut32(p, opCode);
+}
+
+/* "db.col", or "db" alone when col is NULL, measured once per message. */
+typedef struct mongoNs {
+    char *db;
+    char *col;
+    size_t dblen;
+    size_t collen;
+    size_t len; /* Including the trailing NUL */
+} mongoNs;
+
+static inline void __mongoNsInit(mongoNs *ns, char *db, char *col) {
+    ns->db = db;
+    ns->col = col;
+    ns->dblen = strlen(db);
+    ns->collen = col ? strlen(col) : 0;
+    ns->len = ns->dblen + 1 + (col ? ns->collen + 1 : 0);
+}
+
+static inline char *__mongoPutNs(char *p, mongoNs *ns) {
+    memcpy(p, ns->db, ns->dblen);
+    p += ns->dblen;
+    if (ns->col) {
+        *p++ = '.';
+        memcpy(p, ns->col, ns->collen);
+        p += ns->collen;
+    }
+    *p++ = '\0';
+    return p;
+}
+
+/* Make room for a whole message up front, so that nothing can fail once
+ * we started writing it. */
+static int __mongoBufferReserve(mongoContext *c, size_t copied, size_t nr_refs) {
     sds newbuf;
-    int32_t totallen = (int32_t)(16 + len);
-    if (req_id <= 0) req_id = ++(c->req_id);
+    mongoOutRef *refs;
+    size_t cap;
 
-    //TODO size should be size_t
-    newbuf = mongoSdscatpack(c->obuf, "<iiiim", totallen, req_id, 0, opCode, m, len);
-    if (newbuf == NULL) {
-        __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+    newbuf = sdsMakeRoomFor(c->obuf, copied);
+    if (newbuf == NULL)
+        goto oom;
+    c->obuf = newbuf;
+    if (c->oref.len + nr_refs > c->oref.cap) {
+        cap = (c->oref.len + nr_refs) * 2;
+        refs = mongo_realloc(c->oref.refs, cap * sizeof(*refs));
+        if (refs == NULL)
+            goto oom;
+        c->oref.refs = refs;
+        c->oref.cap = cap;
+    }
+    return MONGO_OK;
+
+oom:
+    __mongoSetError(c,MONGO_ERR_OOM,"Out of memory");
+    return MONGO_ERR;
+}
+
+/* Reserve room for a message and write its standard header. */
+static int __mongoBeginMsg(mongoContext *c, int32_t opCode, mongoMsgSize *sz) {
+    if (__mongoBufferReserve(c, sz->copied, sz->nr_refs) != MONGO_OK)
         return MONGO_ERR;
+    c->omsg = sdslen(c->obuf);
+    __mongoCommit(c, __mongoPutHeader(__mongoTail(c), (int32_t)sz->len, ++(c->req_id), 0, opCode));
+    return MONGO_OK;
+}
+
+/* The fullCollectionName of a legacy message, which all of them have right
+ * after their first field. NULL when the message is too short. */
+static const char *__mongoMsgNs(mongoContext *c, char *hdr) {
+    size_t avail = sdslen(c->obuf) - c->omsg;
+
+    if (avail <= 20 || memchr(hdr+20,'\0',avail-20) == NULL)
+        return NULL;
+    return hdr+20;
+}
+
+static int __mongoIsCmdNs(const char *ns) {
+    size_t len = ns ? strlen(ns) : 0;
+    return len >= 5 && !strcmp(ns+len-5,".$cmd");
+}
+
+/* Tell the observer about the message at c->omsg. */
+static void __mongoObserveStarted(mongoContext *c, char *hdr, int32_t opCode) {
+    mongoCommandEvent ev;
+    size_t avail = sdslen(c->obuf) - c->omsg;
+    bson_iter_t it;
+    bson_t body;
+
+    __mongoEventInit(&ev,MONGO_EVENT_STARTED,opCode,(int32_t)load32le(hdr+4));
+    ev.bytes = load32le(hdr);
+    if (opCode == OP_MSG) {
+        /* Name and database of the command in the body section. */
+        if (avail >= 26 && hdr[20] == MSG_SECTION_BODY && load32le(hdr+21) <= avail-21 &&
+            bson_init_static(&body,(const uint8_t *)hdr+21,load32le(hdr+21)) &&
+            bson_iter_init(&it,&body) && bson_iter_next(&it)) {
+            ev.command = bson_iter_key(&it);
+            if (bson_iter_find(&it,"$db") && BSON_ITER_HOLDS_UTF8(&it))
+                ev.ns = bson_iter_utf8(&it,NULL);
+        }
+    } else if (opCode != OP_KILL_CURSORS) {
+        ev.ns = __mongoMsgNs(c,hdr);
+    }
+    c->observer.fn(c,&ev,c->observer.privdata);
+}
+
+/* Count the message at c->omsg and stamp it with the time it was queued,
+ * unless the server doesn't answer it. */
+static void __mongoStatsQueued(mongoContext *c) {
+    char *hdr = c->obuf + c->omsg;
+    int32_t req_id = (int32_t)load32le(hdr+4);
+    int32_t opCode = (int32_t)load32le(hdr+12);
+    mongoStamp *st;
+    int op, cmd = 0;
+
+    c->stats.msgs_out++;
+    if (c->observer.fn != NULL)
+        __mongoObserveStarted(c,hdr,opCode);
+
+    switch (opCode) {
+    case OP_QUERY:
+        op = MONGO_STATS_OP_QUERY;
+        cmd = __mongoIsCmdNs(__mongoMsgNs(c,hdr));
+        break;
+    case OP_GET_MORE:
+        op = MONGO_STATS_OP_GET_MORE;
+        break;
+    case OP_MSG:
+        if (load32le(hdr) < 20 || (load32le(hdr+16) & MSG_FLAG_MORE_TO_COME))
+            return;
+        op = MONGO_STATS_OP_MSG;
+        cmd = 1;
+        break;
+    case OP_UPDATE:
+    case OP_INSERT:
+    case OP_DELETE:
+    case OP_KILL_CURSORS:
+        return;
+    default:
+        op = MONGO_STATS_OP_OTHER;
+        break;
     }
+
+    st = __mongoStampAdd(c,req_id);
+    if (st == NULL)
+        return;
+    st->req_id = req_id;
+    st->opCode = opCode;
+    st->op = (int16_t)op;
+    st->cmd = (int16_t)cmd;
+    st->t = mongoStatsNow();
+}
+
+/* Commands the wire protocol doesn't allow to be compressed: the handshake
+ * and everything that carries credentials. */
+static const char *__mongoUncompressedCmds[] = {
+    "hello", "isMaster", "ismaster", "saslStart", "saslContinue", "getnonce",
+    "authenticate", "createUser", "updateUser", "copydbSaslStart",
+    "copydbgetnonce", "copydb", NULL
+};
+
+/* The name of the command sent by the message at c->omsg, which is the first
+ * key of its command document. That document is looked up in the refs from
+ * first on when it was borrowed. NULL when the message is not a command. */
+static const char *__mongoMsgCmdName(mongoContext *c, size_t first) {
+    char *hdr = c->obuf + c->omsg;
+    size_t end = sdslen(c->obuf), off;
+    const char *ns, *doc = NULL;
+
+    if (load32le(hdr+12) == OP_MSG) {
+        if (end - c->omsg < 21 || hdr[20] != MSG_SECTION_BODY)
+            return NULL;
+        off = c->omsg + 21;
+    } else if (load32le(hdr+12) == OP_QUERY) {
+        if (!__mongoIsCmdNs(ns = __mongoMsgNs(c,hdr)))
+            return NULL;
+        off = (size_t)(ns - c->obuf) + strlen(ns) + 9;
+    } else {
+        return NULL;
+    }
+
+    for (size_t i = first; i < c->oref.len; ++i) {
+        if (c->oref.refs[i].pos == off)
+            doc = c->oref.refs[i].ptr;
+    }
+    if (doc == NULL && off + 5 < end)
+        doc = c->obuf + off;
+    return doc != NULL && doc[4] != '\0' ? doc + 5 : NULL;
+}
+
+static int __mongoIsUncompressedCmd(const char *name) {
+    for (int i = 0; name != NULL && __mongoUncompressedCmds[i] != NULL; ++i) {
+        if (!strcmp(name, __mongoUncompressedCmds[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Finish the message started by the last __mongoBeginMsg. With compression
+ * on, a message of at least compress_threshold bytes is replaced by its
+ * OP_COMPRESSED form. The documents it borrowed are compressed along with the
+ * rest, so their refs are dropped. The handshake and authentication commands
+ * are never compressed, as the wire protocol requires. The compressed bytes
+ * are written past the
+ * end of obuf and then moved over the original, and the message stays as it
+ * is whenever compressing fails or doesn't pay off.
+ *
+ * struct OP_COMPRESSED {
+ *     MsgHeader header;          // standard message header
+ *     int32     originalOpcode;  // opcode of the wrapped message
+ *     int32     uncompressedSize; // size of the wrapped message without its header
+ *     uint8     compressorId;    // compressor that compressed the message
+ *     char*     compressedMessage;
+ * }
+ */
+static int __mongoEndMsg(mongoContext *c) {
+    mongoCompressor *z = c->compressor;
+    mongoOutRef *ref;
+    size_t start = c->omsg, len, end, pos, first, bound, clen, refbytes = 0;
+    char *hdr, *p;
+    sds newbuf;
+
+    __mongoStatsQueued(c);
+    if (z == NULL)
+        return MONGO_OK;
+    len = load32le(c->obuf + start);
+    if (len < c->compress_threshold)
+        return MONGO_OK;
+
+    /* The refs of this message are the last ones, past its header. */
+    for (first = c->oref.len; first > 0 && c->oref.refs[first-1].pos > start; first--)
+        ;
+    if (__mongoIsUncompressedCmd(__mongoMsgCmdName(c, first)))
+        return MONGO_OK;
+
+    bound = mongoCompressBound(z, len - 16);
+    newbuf = sdsMakeRoomForNonGreedy(c->obuf, 25 + bound);
+    if (newbuf == NULL)
+        return MONGO_OK;
     c->obuf = newbuf;
+    end = sdslen(c->obuf);
+    if (mongoCompressBegin(z, c->obuf + end + 25, bound) != MONGO_OK)
+        return MONGO_OK;
+    pos = start + 16;
+    for (size_t i = first; i < c->oref.len; ++i) {
+        ref = c->oref.refs + i;
+        if (mongoCompressUpdate(z, c->obuf + pos, ref->pos - pos) != MONGO_OK ||
+            mongoCompressUpdate(z, ref->ptr, ref->len) != MONGO_OK)
+            return MONGO_OK;
+        pos = ref->pos;
+        refbytes += ref->len;
+    }
+    if (mongoCompressUpdate(z, c->obuf + pos, end - pos) != MONGO_OK ||
+        mongoCompressEnd(z, &clen) != MONGO_OK)
+        return MONGO_OK;
+    if (clen >= len - 16 && mongoCompressorId(z) != MONGO_COMPRESSOR_NOOP)
+        return MONGO_OK;
+
+    hdr = c->obuf + start;
+    p = __mongoPutHeader(c->obuf + end, (int32_t)(25 + clen), (int32_t)load32le(hdr+4),
+                         (int32_t)load32le(hdr+8), OP_COMPRESSED);
+    p = __mongoPut32(p, (int32_t)load32le(hdr+12));
+    p = __mongoPut32(p, (int32_t)(len - 16));
+    __mongoPut8(p, (uint8_t)mongoCompressorId(z));
+    memmove(c->obuf + start, c->obuf + end, 25 + clen);
+    sdsIncrLen(c->obuf, (int)(start + 25 + clen) - (int)end);
+    c->oref.len = first;
+    c->oref.bytes -= refbytes;
     return MONGO_OK;
 }
 
-static inline int __mongoAppendReqeust(mongoContext *c, int32_t opCode, char *m, size_t len) {
-    return mongoAppendReqeustRaw(c, ++(c->req_id), opCode, m, len);
+/* Queue a document, by reference when __mongoBorrows says so. The room was
+ * reserved by __mongoBeginMsg. */
+static void __mongoPutDoc(mongoContext *c, bson_t *doc, int borrow) {
+    mongoOutRef *ref;
+
+    if (__mongoBorrows(doc, borrow)) {
+        ref = c->oref.refs + c->oref.len++;
+        ref->pos = sdslen(c->obuf);
+        ref->ptr = (const char *)bson_get_data(doc);
+        ref->len = doc->len;
+        c->oref.bytes += doc->len;
+    } else {
+        memcpy(__mongoTail(c), bson_get_data(doc), doc->len);
+        sdsIncrLen(c->obuf, (int)doc->len);
+    }
+}
+
+/*
+ * Write a formatted command to the output buffer.
+ */
+int mongoAppendReqeustRaw(mongoContext *c, int32_t req_id, int32_t opCode, char *m, size_t len) {
+    int32_t totallen = (int32_t)(16 + len);
+    char *p;
+    if (req_id <= 0) req_id = ++(c->req_id);
+
+    //TODO size should be size_t
+    if (__mongoBufferReserve(c, 16 + len, 0) != MONGO_OK)
+        return MONGO_ERR;
+    c->omsg = sdslen(c->obuf);
+    p = __mongoPutHeader(__mongoTail(c), totallen, req_id, 0, opCode);
+    if (len > 0) memcpy(p, m, len);
+    __mongoCommit(c, p + len);
+    return __mongoEndMsg(c);
 }
 
 /*
@@ -445,37 +1215,36 @@ static inline int __mongoAppendReqeust(mongoContext *c, int32_t opCode, char *m,
  *     document  selector;           // the query to select the document
  *     document  update;             // specification of the update to perform
  * }
+ *
+ * borrow tells whether the caller's documents may be queued by reference,
+ * the same goes for the other encoders below.
  */
+static int __mongoAppendUpdateMsg(mongoContext *c, char *db, char *col, int32_t flags,
+                                  bson_t *selector, bson_t *update, int borrow)
+{
+    mongoMsgSize sz;
+    mongoNs ns;
+    char *p;
+
+    __mongoNsInit(&ns, db, col);
+    __mongoMsgSizeInit(&sz, 4 + ns.len + 4);
+    __mongoMsgSizeAddDoc(&sz, selector, borrow);
+    __mongoMsgSizeAddDoc(&sz, update, borrow);
+    if (__mongoBeginMsg(c, OP_UPDATE, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    p = __mongoPut32(__mongoTail(c), 0);
+    p = __mongoPutNs(p, &ns);
+    __mongoCommit(c, __mongoPut32(p, flags));
+    __mongoPutDoc(c, selector, borrow);
+    __mongoPutDoc(c, update, borrow);
+    return __mongoEndMsg(c);
+}
+
 int mongoAppendUpdateMsg(mongoContext *c, char *db, char *col, int32_t flags,
                          bson_t *selector, bson_t *update)
 {
-    char buf[BUFSIZ];
-    int status;
-    sds s;
-    size_t len = 0;
-    uint8_t *s_data = (uint8_t *)bson_get_data(selector);
-    uint8_t *u_data = (uint8_t *)bson_get_data(update);
-    size_t s_len = selector->len;
-    size_t u_len = update->len;
-    status = mongoSnpack(buf, len, BUFSIZ, "<issSimm",
-                         0, db, ".", col, flags,
-                         s_data, s_len, u_data, u_len);
-    if (status < 0) {
-        s = sdsempty();
-        s = mongoSdscatpack(s, "<issSimm",
-                            0, db, ".", col, flags,
-                            s_data, s_len, u_data, u_len);
-        if (s == NULL) {
-            __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-            return MONGO_OK;
-        }
-        status = __mongoAppendReqeust(c, OP_UPDATE, s, sdslen(s));
-        sdsfree(s);
-    } else {
-        len = (size_t)status;
-        status = __mongoAppendReqeust(c, OP_UPDATE, buf, len);
-    }
-    return status;
+    return __mongoAppendUpdateMsg(c, db, col, flags, selector, update,
+                                  c->flags & MONGO_BORROW);
 }
 
 /*
@@ -488,50 +1257,31 @@ int mongoAppendUpdateMsg(mongoContext *c, char *db, char *col, int32_t flags,
  *     document* documents;          // one or more documents to insert into the collection
  * }
  */
-int mongoAppendInsertMsg(mongoContext *c, int32_t flags, char *db, char *col,
-                         bson_t **docs, size_t nr_docs)
+static int __mongoAppendInsertMsg(mongoContext *c, int32_t flags, char *db, char *col,
+                                  bson_t **docs, size_t nr_docs, int borrow)
 {
-    char buf[BUFSIZ];
-    int status;
-    sds s;
-    size_t len = 0;
-    uint8_t *d_data;
-    size_t d_len;
-    status = mongoSnpack(buf, len, BUFSIZ, "<issS",
-                         flags, db, ".", col);
-    assert(status > 0);
-    len = (size_t)status;
+    mongoMsgSize sz;
+    mongoNs ns;
 
+    __mongoNsInit(&ns, db, col);
+    __mongoMsgSizeInit(&sz, 4 + ns.len);
     for (size_t i = 0; i < nr_docs; ++i) {
-        d_data = (uint8_t *)bson_get_data(docs[i]);
-        d_len = docs[i]->len;
-        status = mongoSnpack(buf, len, BUFSIZ - len, "<m", d_data, d_len);
-        if (status < 0) break;
-        len = (size_t)status;
-    }
-    if (status < 0) {
-        s = sdsempty();
-        s = mongoSdscatpack(s, "<issS",
-                            flags, db, ".", col);
-        if (s == NULL) {
-            __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-            return MONGO_OK;
-        }
-        for (size_t i = 0; i < nr_docs; ++i) {
-            d_data = (uint8_t *)bson_get_data(docs[i]);
-            d_len = docs[i]->len;
-            s= mongoSdscatpack(s, "<m", d_data, d_len);
-            if (s == NULL) {
-                __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-                return MONGO_OK;
-            }
-        }
-        status = __mongoAppendReqeust(c, OP_INSERT, s, sdslen(s));
-        sdsfree(s);
-    } else {
-        status = __mongoAppendReqeust(c, OP_INSERT, buf, len);
+        __mongoMsgSizeAddDoc(&sz, docs[i], borrow);
     }
-    return status;
+    if (__mongoBeginMsg(c, OP_INSERT, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    __mongoCommit(c, __mongoPutNs(__mongoPut32(__mongoTail(c), flags), &ns));
+    for (size_t i = 0; i < nr_docs; ++i) {
+        __mongoPutDoc(c, docs[i], borrow);
+    }
+    return __mongoEndMsg(c);
+}
+
+int mongoAppendInsertMsg(mongoContext *c, int32_t flags, char *db, char *col,
+                         bson_t **docs, size_t nr_docs)
+{
+    return __mongoAppendInsertMsg(c, flags, db, col, docs, nr_docs,
+                                  c->flags & MONGO_BORROW);
 }
 
 /*
@@ -547,53 +1297,37 @@ int mongoAppendInsertMsg(mongoContext *c, int32_t flags, char *db, char *col,
  *                                       //  to return.  See below for details.
  * }
  */
-int mongoAppendQueryMsg(mongoContext *c, int32_t flags, char *db, char *col,
-                        int nrSkip, int nrReturn, bson_t *q, bson_t *rfields)
+static int __mongoAppendQueryMsg(mongoContext *c, int32_t flags, char *db, char *col,
+                                 int nrSkip, int nrReturn, bson_t *q, bson_t *rfields,
+                                 int borrow)
 {
+    mongoMsgSize sz;
+    mongoNs ns;
+    char *p;
     bson_t empty;
     bson_init(&empty);
     if (!q) q = &empty;
 
-    char buf[BUFSIZ];
-    int status;
-    sds s;
-    size_t len = 0;
-    size_t remain = BUFSIZ;
-    uint8_t *q_data = (uint8_t *)bson_get_data(q);
-    uint8_t *rf_data = rfields? (uint8_t *)bson_get_data(rfields): NULL;
-    size_t q_len = q->len;
-    size_t rf_len = rfields? rfields->len: 0;
-    if (col == NULL) {
-        status = mongoSnpack(buf, len, remain, "<iSiimm",
-                             flags, db, nrSkip, nrReturn,
-                             q_data, q_len, rf_data, rf_len);
-    } else {
-        status = mongoSnpack(buf, len, remain, "<issSiimm",
-                             flags, db, ".", col, nrSkip, nrReturn,
-                             q_data, q_len, rf_data, rf_len);
-    }
-    if (status < 0) {
-        s = sdsempty();
-        if (col == NULL) {
-            s = mongoSdscatpack(s, "<iSiimm",
-                                flags, db, nrSkip, nrReturn,
-                                q_data, q_len, rf_data, rf_len);
-        } else {
-            s = mongoSdscatpack(s, "<issSiimm",
-                                flags, db, ".", col, nrSkip, nrReturn,
-                                q_data, q_len, rf_data, rf_len);
-        }
-        if (s == NULL) {
-            __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-            return MONGO_OK;
-        }
-        status = __mongoAppendReqeust(c, OP_QUERY, s, sdslen(s));
-        sdsfree(s);
-    } else {
-        len = (size_t)status;
-        status = __mongoAppendReqeust(c, OP_QUERY, buf, len);
-    }
-    return status;
+    __mongoNsInit(&ns, db, col);
+    __mongoMsgSizeInit(&sz, 4 + ns.len + 4 + 4);
+    __mongoMsgSizeAddDoc(&sz, q, borrow);
+    if (rfields) __mongoMsgSizeAddDoc(&sz, rfields, borrow);
+    if (__mongoBeginMsg(c, OP_QUERY, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    p = __mongoPut32(__mongoTail(c), flags);
+    p = __mongoPutNs(p, &ns);
+    p = __mongoPut32(p, nrSkip);
+    __mongoCommit(c, __mongoPut32(p, nrReturn));
+    __mongoPutDoc(c, q, borrow);
+    if (rfields) __mongoPutDoc(c, rfields, borrow);
+    return __mongoEndMsg(c);
+}
+
+int mongoAppendQueryMsg(mongoContext *c, int32_t flags, char *db, char *col,
+                        int nrSkip, int nrReturn, bson_t *q, bson_t *rfields)
+{
+    return __mongoAppendQueryMsg(c, flags, db, col, nrSkip, nrReturn, q, rfields,
+                                 c->flags & MONGO_BORROW);
 }
 
 /*
@@ -608,28 +1342,19 @@ int mongoAppendQueryMsg(mongoContext *c, int32_t flags, char *db, char *col,
  * }
  */
 int mongoAppendGetMoreMsg(mongoContext *c, char *db, char *col, int32_t nrReturn, int64_t cursorID) {
-    char buf[BUFSIZ];
-    int status;
-    sds s;
-    size_t len = 0;
-    size_t remain = BUFSIZ;
-    status = mongoSnpack(buf, len, remain, "<issSiq",
-                         0, db, ".", col, nrReturn, cursorID);
-    if (status < 0) {
-        s = sdsempty();
-        s = mongoSdscatpack(s, "<issSiq",
-                            0, db, ".", col, nrReturn, cursorID);
-        if (s == NULL) {
-            __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-            return MONGO_OK;
-        }
-        status = __mongoAppendReqeust(c, OP_GET_MORE, s, sdslen(s));
-        sdsfree(s);
-    } else {
-        len = (size_t)status;
-        status = __mongoAppendReqeust(c, OP_GET_MORE, buf, len);
-    }
-    return status;
+    mongoMsgSize sz;
+    mongoNs ns;
+    char *p;
+
+    __mongoNsInit(&ns, db, col);
+    __mongoMsgSizeInit(&sz, 4 + ns.len + 4 + 8);
+    if (__mongoBeginMsg(c, OP_GET_MORE, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    p = __mongoPut32(__mongoTail(c), 0);
+    p = __mongoPutNs(p, &ns);
+    p = __mongoPut32(p, nrReturn);
+    __mongoCommit(c, __mongoPut64(p, cursorID));
+    return __mongoEndMsg(c);
 }
 
 /*
@@ -643,35 +1368,29 @@ int mongoAppendGetMoreMsg(mongoContext *c, char *db, char *col, int32_t nrReturn
  *     document  selector;           // query object.  See below for details.
  * }
  */
+static int __mongoAppendDeleteMsg(mongoContext *c, char *db, char *col, int32_t flags,
+                                  bson_t *selector, int borrow)
+{
+    mongoMsgSize sz;
+    mongoNs ns;
+    char *p;
+
+    __mongoNsInit(&ns, db, col);
+    __mongoMsgSizeInit(&sz, 4 + ns.len + 4);
+    __mongoMsgSizeAddDoc(&sz, selector, borrow);
+    if (__mongoBeginMsg(c, OP_DELETE, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    p = __mongoPut32(__mongoTail(c), 0);
+    p = __mongoPutNs(p, &ns);
+    __mongoCommit(c, __mongoPut32(p, flags));
+    __mongoPutDoc(c, selector, borrow);
+    return __mongoEndMsg(c);
+}
+
 int mongoAppendDeleteMsg(mongoContext *c, char *db, char *col, int32_t flags,
                          bson_t *selector)
 {
-    char buf[BUFSIZ];
-    int status;
-    sds s;
-    size_t len = 0;
-    size_t remain = BUFSIZ;
-    uint8_t *s_data = (uint8_t *)bson_get_data(selector);
-    size_t s_len = selector->len;
-    status = mongoSnpack(buf, len, remain, "<issSim",
-                         0, db, ".", col, flags,
-                         s_data, s_len);
-    if (status < 0) {
-        s = sdsempty();
-        s = mongoSdscatpack(s, "<issSim",
-                            0, db, ".", col, flags,
-                            s_data, s_len);
-        if (s == NULL) {
-            __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-            return MONGO_OK;
-        }
-        status = __mongoAppendReqeust(c, OP_DELETE, s, sdslen(s));
-        sdsfree(s);
-    } else {
-        len = (size_t)status;
-        status = __mongoAppendReqeust(c, OP_DELETE, buf, len);
-    }
-    return status;
+    return __mongoAppendDeleteMsg(c, db, col, flags, selector, c->flags & MONGO_BORROW);
 }
 
 /*
@@ -686,46 +1405,215 @@ int mongoAppendDeleteMsg(mongoContext *c, char *db, char *col, int32_t flags,
  */
 int mongoAppendKillCursorsMsg(mongoContext *c, int32_t nrID, int64_t *IDs)
 {
-    char buf[BUFSIZ];
-    int status = 0;
-    sds s;
-    size_t len = 0;
-    size_t remain = BUFSIZ;
-    status = mongoSnpack(buf, len, remain, "<ii", 0, nrID);
-    assert(status > 0);
-    len = (size_t)status;
+    mongoMsgSize sz;
+    char *p;
+
+    __mongoMsgSizeInit(&sz, 4 + 4 + 8 * (size_t)nrID);
+    if (__mongoBeginMsg(c, OP_KILL_CURSORS, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    p = __mongoPut32(__mongoTail(c), 0);
+    p = __mongoPut32(p, nrID);
     for (int32_t i = 0; i < nrID; ++i) {
-        status = mongoSnpack(buf, len, BUFSIZ - len, "<q", IDs[i]);
-        if (status < 0) break;
-        len = (size_t )status;
-    }
-    if (status < 0) {
-        s = sdsempty();
-        for (int32_t i = 0; i < nrID; ++i) {
-            if (i == 0) s = mongoSdscatpack(s, "<iiq", 0, nrID, IDs[i]);
-            else s = mongoSdscatpack(s, "<q", IDs[i]);
-            if (s == NULL) {
-                __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
-                return MONGO_OK;
-            }
+        p = __mongoPut64(p, IDs[i]);
+    }
+    __mongoCommit(c, p);
+    return __mongoEndMsg(c);
+}
+
+/*
+ * OP_MSG message format
+ *
+ * struct {
+ *     MsgHeader header;          // standard message header
+ *     uint32    flagBits;        // message flags
+ *     Sections[] sections;       // one kind 0 section (the body document)
+ *                                //  and any number of kind 1 sections:
+ *                                //  int32 size; cstring identifier; document* docs
+ * }
+ *
+ * the body must carry the "$db" field, see mongoAppendCommandMsg. it is
+ * always copied, borrow only applies to the documents of the sequences.
+ */
+static int __mongoAppendMsg(mongoContext *c, uint32_t flags, bson_t *body,
+                            mongoDocSeq *seqs, int nr_seqs, int borrow)
+{
+    mongoMsgSize sz;
+    size_t seq_len, id_len;
+    char *p;
+
+    __mongoMsgSizeInit(&sz, 4 + 1);
+    __mongoMsgSizeAddDoc(&sz, body, 0);
+    for (int i = 0; i < nr_seqs; ++i) {
+        seq_len = 1 + 4 + strlen(seqs[i].identifier) + 1;
+        sz.len += seq_len;
+        sz.copied += seq_len;
+        for (int32_t j = 0; j < seqs[i].nr_docs; ++j) {
+            __mongoMsgSizeAddDoc(&sz, seqs[i].docs[j], borrow);
         }
-        status = __mongoAppendReqeust(c, OP_KILL_CURSORS, s, sdslen(s));
-        sdsfree(s);
-    } else {
-        status = __mongoAppendReqeust(c, OP_KILL_CURSORS, buf, len);
     }
+    if (__mongoBeginMsg(c, OP_MSG, &sz) != MONGO_OK)
+        return MONGO_ERR;
+    p = __mongoPut32(__mongoTail(c), (int32_t)flags);
+    __mongoCommit(c, __mongoPut8(p, MSG_SECTION_BODY));
+    __mongoPutDoc(c, body, 0);
+    for (int i = 0; i < nr_seqs; ++i) {
+        id_len = strlen(seqs[i].identifier) + 1;
+        seq_len = 4 + id_len;
+        for (int32_t j = 0; j < seqs[i].nr_docs; ++j) {
+            seq_len += seqs[i].docs[j]->len;
+        }
+        p = __mongoPut8(__mongoTail(c), MSG_SECTION_DOC_SEQUENCE);
+        p = __mongoPut32(p, (int32_t)seq_len);
+        memcpy(p, seqs[i].identifier, id_len);
+        __mongoCommit(c, p + id_len);
+        for (int32_t j = 0; j < seqs[i].nr_docs; ++j) {
+            __mongoPutDoc(c, seqs[i].docs[j], borrow);
+        }
+    }
+    return __mongoEndMsg(c);
+}
+
+int mongoAppendMsg(mongoContext *c, uint32_t flags, bson_t *body,
+                   mongoDocSeq *seqs, int nr_seqs)
+{
+    return __mongoAppendMsg(c, flags, body, seqs, nr_seqs, c->flags & MONGO_BORROW);
+}
+
+/*
+ * run an arbitrary database command through OP_MSG, cmd is copied and
+ * the "$db" field is added to the copy.
+ */
+int mongoAppendCommandMsg(mongoContext *c, uint32_t flags, char *db, bson_t *cmd) {
+    bson_t *body;
+    int status;
+
+    body = bson_copy(cmd);
+    if (body == NULL) {
+        __mongoSetError(c, MONGO_ERR_OOM, "Out of memory.");
+        return MONGO_ERR;
+    }
+    BSON_APPEND_UTF8(body, "$db", db);
+    status = __mongoAppendMsg(c, flags, body, NULL, 0, 0);
+    bson_destroy(body);
+    return status;
+}
+
+/*
+ * build the body of an insert/update/delete command. the write concern is
+ * carried inline, a request with moreToCome set gets {w: 0} unless the
+ * caller gave one.
+ */
+static void __mongoWriteCmdInit(bson_t *body, const char *name, char *db, char *col,
+                                uint32_t flags, bson_t *wc)
+{
+    bson_t w0;
+
+    bson_init(body);
+    BSON_APPEND_UTF8(body, name, col);
+    BSON_APPEND_UTF8(body, "$db", db);
+    if (wc) {
+        BSON_APPEND_DOCUMENT(body, "writeConcern", wc);
+    } else if (flags & MSG_FLAG_MORE_TO_COME) {
+        bson_init(&w0);
+        BSON_APPEND_INT32(&w0, "w", 0);
+        BSON_APPEND_DOCUMENT(body, "writeConcern", &w0);
+        bson_destroy(&w0);
+    }
+}
+
+/*
+ * insert command, the documents are sent as a kind 1 section.
+ * iflags takes INSERT_FLAG_CONT_ON_ERR, which maps to {ordered: false}.
+ */
+static int __mongoAppendInsertCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                                  int32_t iflags, bson_t **docs, size_t nr_docs,
+                                  bson_t *wc, int borrow)
+{
+    bson_t body;
+    mongoDocSeq seq;
+    int status;
+
+    __mongoWriteCmdInit(&body, "insert", db, col, flags, wc);
+    if (iflags & INSERT_FLAG_CONT_ON_ERR) BSON_APPEND_BOOL(&body, "ordered", false);
+    seq.identifier = (char *)"documents";
+    seq.nr_docs = (int32_t)nr_docs;
+    seq.docs = docs;
+    status = __mongoAppendMsg(c, flags, &body, &seq, 1, borrow);
+    bson_destroy(&body);
+    return status;
+}
+
+int mongoAppendInsertCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                         int32_t iflags, bson_t **docs, size_t nr_docs, bson_t *wc)
+{
+    return __mongoAppendInsertCmd(c, flags, db, col, iflags, docs, nr_docs, wc,
+                                  c->flags & MONGO_BORROW);
+}
+
+/*
+ * update command with a single update statement, uflags takes the
+ * UPDATE_FLAG_* bits of OP_UPDATE.
+ */
+int mongoAppendUpdateCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                         int32_t uflags, bson_t *selector, bson_t *update, bson_t *wc)
+{
+    bson_t body, stmt;
+    bson_t *pstmt = &stmt;
+    mongoDocSeq seq;
+    int status;
+
+    __mongoWriteCmdInit(&body, "update", db, col, flags, wc);
+    bson_init(&stmt);
+    BSON_APPEND_DOCUMENT(&stmt, "q", selector);
+    BSON_APPEND_DOCUMENT(&stmt, "u", update);
+    if (uflags & UPDATE_FLAG_UPSERT) BSON_APPEND_BOOL(&stmt, "upsert", true);
+    if (uflags & UPDATE_FLAG_MULTIPLE) BSON_APPEND_BOOL(&stmt, "multi", true);
+    seq.identifier = (char *)"updates";
+    seq.nr_docs = 1;
+    seq.docs = &pstmt;
+    status = __mongoAppendMsg(c, flags, &body, &seq, 1, 0);
+    bson_destroy(&stmt);
+    bson_destroy(&body);
+    return status;
+}
+
+/*
+ * delete command with a single delete statement, dflags takes
+ * DELETE_FLAG_SINGLE.
+ */
+int mongoAppendDeleteCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                         int32_t dflags, bson_t *selector, bson_t *wc)
+{
+    bson_t body, stmt;
+    bson_t *pstmt = &stmt;
+    mongoDocSeq seq;
+    int status;
+
+    __mongoWriteCmdInit(&body, "delete", db, col, flags, wc);
+    bson_init(&stmt);
+    BSON_APPEND_DOCUMENT(&stmt, "q", selector);
+    BSON_APPEND_INT32(&stmt, "limit", (dflags & DELETE_FLAG_SINGLE)? 1: 0);
+    seq.identifier = (char *)"deletes";
+    seq.nr_docs = 1;
+    seq.docs = &pstmt;
+    status = __mongoAppendMsg(c, flags, &body, &seq, 1, 0);
+    bson_destroy(&stmt);
+    bson_destroy(&body);
     return status;
 }
 
 int mongoAppendCmdRequst(mongoContext *c, int32_t flags, char *db, char *q_js){
     bson_error_t error;
     bson_t *q;
+    int status;
     q = bson_new_from_json((uint8_t *)q_js, -1, &error);
     if (!q) {
         __mongoSetError(c, MONGO_ERR_PROTOCOL, error.message);
         return MONGO_ERR;
     }
-    return mongoAppendQueryMsg(c, flags, db, (char *)"$cmd", 0, -1, q, NULL);
+    status = __mongoAppendQueryMsg(c, flags, db, (char *)"$cmd", 0, -1, q, NULL, 0);
+    bson_destroy(q);
+    return status;
 }
 
 int mongoAppendGetLastErrorRequest(mongoContext *c, int32_t flags, char *db) {
@@ -747,6 +1635,10 @@ static void *__mongoBlockForReply(mongoContext *c) {
     void *reply;
 
     if (c->flags & MONGO_BLOCK) {
+        /* Borrowed documents must be on the wire before we return, even
+         * when the reply is already sitting in the reader. */
+        if (c->oref.len > 0 && __mongoBufferFlush(c) != MONGO_OK)
+            return NULL;
         if (mongoGetReply(c,&reply) != MONGO_OK)
             return NULL;
         return reply;
@@ -754,10 +1646,19 @@ static void *__mongoBlockForReply(mongoContext *c) {
     return NULL;
 }
 
+/* The helpers below flush before they return in a blocking context, so
+ * they can always borrow there. Elsewhere they follow MONGO_BORROW. */
+#define __mongoHelperBorrow(c) ((c)->flags & (MONGO_BLOCK|MONGO_BORROW))
+
+/* Unacknowledged writes return before they are flushed, so they only
+ * borrow when MONGO_BORROW says so. */
+#define __mongoWriteBorrow(c) ((c)->wc.w == 0 ? (c)->flags & MONGO_BORROW : __mongoHelperBorrow(c))
+
 void *mongoQuery(mongoContext *c, int32_t flags, char *db, char *col,
                  int nrSkip, int nrReturn, bson_t *q, bson_t *rfields)
 {
-    int status = mongoAppendQueryMsg(c, flags, db, col, nrSkip, nrReturn, q, rfields);
+    int status = __mongoAppendQueryMsg(c, flags, db, col, nrSkip, nrReturn, q, rfields,
+                                       __mongoHelperBorrow(c));
     if (status != MONGO_OK) {
         return NULL;
     }
@@ -782,7 +1683,11 @@ void *mongoQueryWithJson(mongoContext *c, int32_t flags, char *db, char *col,
             return NULL;
         }
     }
-    rpl = mongoQuery(c, flags, db, col, nrSkip, nrReturn, q, rf);
+    /* q and rf die right here, so only borrow when we flush before that. */
+    rpl = NULL;
+    if (__mongoAppendQueryMsg(c, flags, db, col, nrSkip, nrReturn, q, rf,
+                              c->flags & MONGO_BLOCK) == MONGO_OK)
+        rpl = __mongoBlockForReply(c);
     bson_destroy(q);
     if (rf) bson_destroy(rf);
     return rpl;
@@ -807,9 +1712,9 @@ void **mongoFindAll(mongoContext *c, char *db, char *col, bson_t *q, bson_t *rfi
     mongoReply *rpl = mongoQuery(c, QUERY_FLAG_EXHAUST, db, col, 0, nrPerQuery, q, rfield);
     while(1) {
         if (n >= max_n) {
-            if (pptr != buf) pptr = realloc(pptr, sizeof(void*)*max_n*2);
+            if (pptr != buf) pptr = mongo_realloc(pptr, sizeof(void*)*max_n*2);
             else {
-                pptr = malloc(sizeof(void*)*max_n*2);
+                pptr = mongo_malloc(sizeof(void*)*max_n*2);
                 memcpy(pptr, buf, sizeof(buf));
             }
             max_n *= 2;
@@ -822,7 +1727,7 @@ void **mongoFindAll(mongoContext *c, char *db, char *col, bson_t *q, bson_t *rfi
     pptr[n] = NULL;
     if (pptr == buf) {
         totalsize = (n+1) * sizeof(void*);
-        retv = malloc(totalsize);
+        retv = mongo_malloc(totalsize);
         memcpy(retv, pptr, totalsize);
     } else {
         retv = pptr;
@@ -871,6 +1776,15 @@ void *mongoGetCollectionNames(mongoContext *c, char *db) {
     return namev;
 }
 
+void *mongoCommand(mongoContext *c, char *db, bson_t *cmd) {
+    int status;
+    status = mongoAppendCommandMsg(c, 0, db, cmd);
+    if (status != MONGO_OK) {
+        return NULL;
+    }
+    return __mongoBlockForReply(c);
+}
+
 void *mongoGetLastError(mongoContext *c, char *db) {
     void *rpl = mongoDbJsonCmd(c, 0, db, -1, (char*)"{\"getlasterror\": 1}");
     return rpl;
@@ -881,16 +1795,77 @@ void *mongoDropDatabase(mongoContext *c, char *db) {
     return rpl;
 }
 
+static int __mongoWritesFailed(void *rpl) {
+    if (!mongoReplyCommandOk(rpl))
+        return 1;
+    return bson_extract_string(mongoReplyCommandDoc(rpl), (char *)"err") != NULL;
+}
+
+/* Flush the unacknowledged writes and check them with one round trip:
+ * getlasterror, which reports the last error on the connection, or with
+ * OP_MSG a ping, since there is no way to learn about errors of
+ * unacknowledged OP_MSG writes, it only confirms the server went through
+ * them. A check that reports an error is counted in c->wc.failed. Returns
+ * the reply of the check, or NULL with err set when it could not be made. */
+void *mongoFlushWrites(mongoContext *c) {
+    void *rpl;
+    bson_t ping;
+    int status;
+
+    if (c->flags & MONGO_OP_MSG) {
+        bson_init(&ping);
+        BSON_APPEND_INT32(&ping, "ping", 1);
+        status = mongoAppendCommandMsg(c, 0, (char *)"admin", &ping);
+        bson_destroy(&ping);
+    } else {
+        status = mongoAppendGetLastErrorRequest(c, 0, (char *)"admin");
+    }
+    if (status != MONGO_OK)
+        return NULL;
+    rpl = __mongoBlockForReply(c);
+    if (rpl == NULL)
+        return NULL;
+    c->wc.pending = 0;
+    if (__mongoWritesFailed(rpl))
+        c->wc.failed++;
+    return rpl;
+}
+
+/* An unacknowledged write was queued, flush the batch when it is big
+ * enough. */
+static void *__mongoUnackedWrite(mongoContext *c) {
+    void *rpl;
+
+    c->wc.pending++;
+    if (mongoBufferPending(c) >= c->wc.flush_bytes) {
+        rpl = mongoFlushWrites(c);
+        if (rpl)
+            freeReplyObject(rpl);
+    }
+    return NULL;
+}
+
 void *mongoInsert(mongoContext *c, int32_t flags, char *db, char *col, bson_t *docs, int nr_docs) {
     int status;
     bson_t *pp[nr_docs];
     for (int i = 0; i < nr_docs; ++i) {
         pp[i] = docs + i;
     }
-    status = mongoAppendInsertMsg(c, flags, db, col, pp, nr_docs);
+    if (c->flags & MONGO_OP_MSG) {
+        status = __mongoAppendInsertCmd(c, c->wc.w ? 0 : MSG_FLAG_MORE_TO_COME, db, col,
+                                        flags, pp, nr_docs, NULL, __mongoWriteBorrow(c));
+        if (status != MONGO_OK) {
+            return NULL;
+        }
+        return c->wc.w ? __mongoBlockForReply(c) : __mongoUnackedWrite(c);
+    }
+    status = __mongoAppendInsertMsg(c, flags, db, col, pp, nr_docs, __mongoWriteBorrow(c));
     if (status != MONGO_OK) {
         return NULL;
     }
+    if (c->wc.w == 0) {
+        return __mongoUnackedWrite(c);
+    }
     status = mongoAppendGetLastErrorRequest(c, 0, db);
     if (status != MONGO_OK) {
         return NULL;
@@ -900,10 +1875,22 @@ void *mongoInsert(mongoContext *c, int32_t flags, char *db, char *col, bson_t *d
 
 void *mongoUpdate(mongoContext *c, char *db, char *col, int32_t flags, bson_t *selector, bson_t *update) {
     int status;
-    status = mongoAppendUpdateMsg(c, db, col, flags, selector, update);
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendUpdateCmd(c, c->wc.w ? 0 : MSG_FLAG_MORE_TO_COME, db, col,
+                                      flags, selector, update, NULL);
+        if (status != MONGO_OK) {
+            return NULL;
+        }
+        return c->wc.w ? __mongoBlockForReply(c) : __mongoUnackedWrite(c);
+    }
+    status = __mongoAppendUpdateMsg(c, db, col, flags, selector, update,
+                                    __mongoWriteBorrow(c));
     if (status != MONGO_OK) {
         return NULL;
     }
+    if (c->wc.w == 0) {
+        return __mongoUnackedWrite(c);
+    }
     status = mongoAppendGetLastErrorRequest(c, 0, db);
     if (status != MONGO_OK) {
         return NULL;
@@ -913,10 +1900,21 @@ void *mongoUpdate(mongoContext *c, char *db, char *col, int32_t flags, bson_t *s
 
 void *mongoDelete(mongoContext *c, char *db, char *col, int32_t flags, bson_t *selector) {
     int status;
-    status = mongoAppendDeleteMsg(c, db, col, flags, selector);
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendDeleteCmd(c, c->wc.w ? 0 : MSG_FLAG_MORE_TO_COME, db, col,
+                                      flags, selector, NULL);
+        if (status != MONGO_OK) {
+            return NULL;
+        }
+        return c->wc.w ? __mongoBlockForReply(c) : __mongoUnackedWrite(c);
+    }
+    status = __mongoAppendDeleteMsg(c, db, col, flags, selector, __mongoWriteBorrow(c));
     if (status != MONGO_OK) {
         return NULL;
     }
+    if (c->wc.w == 0) {
+        return __mongoUnackedWrite(c);
+    }
     status = mongoAppendGetLastErrorRequest(c, 0, db);
     if (status != MONGO_OK) {
         return NULL;
@@ -945,3 +1943,215 @@ void *mongoGetMore(mongoContext *c, char *db, char *col, int32_t nrReturn, int64
     }
     return __mongoBlockForReply(c);
 }
+
+/*
+ * Cursors
+ *
+ * A cursor holds at most one batch of documents at a time: the batch is freed
+ * before the next one is read, so a scan runs in constant memory however
+ * large the result set is. In getMore mode every batch is asked for with
+ * OP_GET_MORE. In exhaust mode the server streams all the batches after the
+ * initial query without being asked.
+ *
+ * A legacy cursor keeps its id for its whole life, so with prefetching on the
+ * next OP_GET_MORE requests go out as soon as a batch arrives and the
+ * following batches travel while the caller works on the current one. The
+ * replies come back in order; the ones that follow the last batch only say
+ * "cursor not found" and are drained.
+ *
+ * Cursors need a blocking context.
+ */
+static void __mongoCursorSetError(mongoCursor *cur, int type, const char *str) {
+    size_t len;
+
+    cur->err = type;
+    len = strlen(str);
+    len = len < (sizeof(cur->errstr)-1) ? len : (sizeof(cur->errstr)-1);
+    memcpy(cur->errstr,str,len);
+    cur->errstr[len] = '\0';
+    cur->cursorID = 0;
+}
+
+/* Take over a reply to OP_QUERY or OP_GET_MORE as the current batch. */
+static void __mongoCursorSetReply(mongoCursor *cur, mongoReply *reply) {
+    char *errmsg;
+
+    if (reply == NULL) {
+        if (cur->c->err == 0)
+            __mongoSetError(cur->c, MONGO_ERR_OTHER, "No reply to a cursor request");
+        __mongoCursorSetError(cur, cur->c->err, cur->c->errstr);
+        return;
+    }
+    if (reply->opCode != OP_REPLY) {
+        freeReplyObject(reply);
+        __mongoSetError(cur->c, MONGO_ERR_PROTOCOL, "Unexpected reply to a cursor request");
+        __mongoCursorSetError(cur, cur->c->err, cur->c->errstr);
+        return;
+    }
+    if (reply->responseFlags & REPLY_FLAG_CURSOR_NOT_FOUND) {
+        freeReplyObject(reply);
+        __mongoCursorSetError(cur, MONGO_ERR_OTHER, "Cursor not found");
+        return;
+    }
+    if (reply->responseFlags & REPLY_FLAG_QUERY_FAILURE) {
+        errmsg = reply->numberReturned > 0 ?
+            bson_extract_string(reply->docs[0], (char *)"$err") : NULL;
+        __mongoCursorSetError(cur, MONGO_ERR_OTHER, errmsg ? errmsg : "Query failure");
+        freeReplyObject(reply);
+        return;
+    }
+    cur->reply = reply;
+    cur->next = 0;
+    cur->cursorID = reply->cursorID;
+    cur->batchBytes = (size_t)reply->messageLength;
+}
+
+/* Send OP_GET_MORE requests ahead until there are `prefetch` in flight or
+ * the batches they ask for would go over prefetchBytes. */
+static void __mongoCursorPrefetch(mongoCursor *cur) {
+    int sent = 0;
+
+    while (cur->cursorID != 0 && cur->inflight < cur->prefetch &&
+           (cur->prefetchBytes == 0 ||
+            (size_t)(cur->inflight+1) * cur->batchBytes <= cur->prefetchBytes))
+    {
+        if (mongoAppendGetMoreMsg(cur->c, cur->db, cur->col, cur->batchSize,
+                                  cur->cursorID) != MONGO_OK)
+            break;
+        cur->inflight++;
+        sent = 1;
+    }
+    /* An error shows up on the next read. */
+    if (sent) __mongoBufferFlush(cur->c);
+}
+
+/* Read and drop the replies to the requests still in flight, so that the
+ * context is left with nothing pending. */
+static void __mongoCursorDrain(mongoCursor *cur) {
+    void *reply;
+
+    while (cur->inflight > 0 && cur->c->err == 0) {
+        if (mongoGetReply(cur->c, &reply) != MONGO_OK)
+            break;
+        freeReplyObject(reply);
+        cur->inflight--;
+    }
+    cur->inflight = 0;
+}
+
+/*
+ * Send a query and return a cursor over its results. batchSize is the number
+ * of documents per batch, 0 leaves it to the server. flags takes
+ * MONGO_CURSOR_EXHAUST.
+ *
+ * Returns NULL only when the cursor can't be allocated. Any other error is
+ * reported by mongoCursorNext.
+ */
+mongoCursor *mongoCursorCreate(mongoContext *c, char *db, char *col, bson_t *q,
+                               bson_t *rfields, int32_t batchSize, int flags)
+{
+    mongoCursor *cur;
+
+    cur = mongo_calloc(1, sizeof(*cur));
+    if (cur == NULL) {
+        __mongoSetError(c, MONGO_ERR_OOM, "Out of memory");
+        return NULL;
+    }
+    cur->c = c;
+    cur->flags = flags;
+    cur->batchSize = batchSize;
+
+    if (!(c->flags & MONGO_BLOCK)) {
+        __mongoCursorSetError(cur, MONGO_ERR_OTHER, "Cursors need a blocking context");
+        return cur;
+    }
+    if (strlen(db) >= sizeof(cur->db) || strlen(col) >= sizeof(cur->col)) {
+        __mongoCursorSetError(cur, MONGO_ERR_OTHER, "Namespace too long");
+        return cur;
+    }
+    strcpy(cur->db, db);
+    strcpy(cur->col, col);
+
+    __mongoCursorSetReply(cur, mongoQuery(c, (flags & MONGO_CURSOR_EXHAUST) ? QUERY_FLAG_EXHAUST : 0,
+                                          db, col, 0, batchSize, q, rfields));
+    return cur;
+}
+
+/*
+ * Keep up to `depth` OP_GET_MORE requests in flight ahead of the batch being
+ * handed out, but no more than maxBytes (0 for no cap) worth of batches,
+ * going by the size of the last one. A depth of 0 turns prefetching off.
+ * Exhaust cursors don't need this, the server already streams ahead.
+ */
+void mongoCursorSetPrefetch(mongoCursor *cur, int depth, size_t maxBytes) {
+    if (cur->flags & MONGO_CURSOR_EXHAUST)
+        return;
+    cur->prefetch = depth > 0 ? depth : 0;
+    cur->prefetchBytes = maxBytes;
+    if (cur->err == 0) __mongoCursorPrefetch(cur);
+}
+
+/*
+ * Return the next document, or NULL when the results are exhausted or an
+ * error occurred, in which case the err field of the cursor is set. The
+ * document is owned by the cursor and stays valid until the next call to
+ * mongoCursorNext or mongoCursorFree.
+ */
+bson_t *mongoCursorNext(mongoCursor *cur) {
+    void *reply;
+
+    while (cur->err == 0) {
+        if (cur->reply != NULL) {
+            if (cur->next < cur->reply->numberReturned)
+                return cur->reply->docs[cur->next++];
+            freeReplyObject(cur->reply);
+            cur->reply = NULL;
+        }
+        if (cur->cursorID == 0) {
+            __mongoCursorDrain(cur);
+            break;
+        }
+
+        if (!(cur->flags & MONGO_CURSOR_EXHAUST) && cur->inflight == 0) {
+            if (mongoAppendGetMoreMsg(cur->c, cur->db, cur->col, cur->batchSize,
+                                      cur->cursorID) == MONGO_OK)
+                cur->inflight++;
+        }
+        reply = NULL;
+        if ((cur->flags & MONGO_CURSOR_EXHAUST) || cur->inflight > 0) {
+            if (mongoGetReply(cur->c, &reply) != MONGO_OK)
+                reply = NULL;
+            else if (cur->inflight > 0)
+                cur->inflight--;
+        }
+        __mongoCursorSetReply(cur, reply);
+        __mongoCursorPrefetch(cur);
+    }
+    return NULL;
+}
+
+/*
+ * Free the cursor. A getMore cursor that is still open on the server is
+ * killed with OP_KILL_CURSORS, and the replies to prefetched requests are
+ * drained. An exhaust stream can't be stopped, so closing it early puts the
+ * context in an error state, reconnect before reusing it.
+ */
+void mongoCursorFree(mongoCursor *cur) {
+    mongoContext *c;
+
+    if (cur == NULL)
+        return;
+    c = cur->c;
+    if (cur->reply != NULL)
+        freeReplyObject(cur->reply);
+    if (cur->cursorID != 0 && c->err == 0) {
+        if (cur->flags & MONGO_CURSOR_EXHAUST) {
+            __mongoSetError(c, MONGO_ERR_OTHER, "Exhaust cursor closed before its end");
+        } else if (mongoAppendKillCursorsMsg(c, 1, &cur->cursorID) == MONGO_OK) {
+            /* No reply comes back, don't leave the message in the buffer. */
+            __mongoBufferFlush(c);
+        }
+    }
+    __mongoCursorDrain(cur);
+    mongo_free(cur);
+}
@@ -5,7 +5,9 @@
 #include <sys/time.h> /* for struct timeval */
 #include <stdint.h> /* uintXX_t, etc */
 #include "sds.h" /* for sds */
+#include "alloc.h"
 #include "proto.h"
+#include "stats.h"
 #include "libbson/src/bson/bson.h"
 
 #define HIMONGO_MAJOR 0
@@ -34,15 +36,44 @@
 /* Flag that is set when an async callback is executed. */
 #define MONGO_IN_CALLBACK 0x10
 
+/* Flag that is set when the write helpers should send OP_MSG write commands
+ * carrying their write concern instead of legacy opcodes + getlasterror. */
+#define MONGO_OP_MSG 0x20
+
+/* Flag that is set when the mongoAppend* functions may queue large documents
+ * by reference instead of copying them into the output buffer. The caller
+ * then has to keep those documents alive and unmodified until
+ * mongoBufferPending() drops to zero. */
+#define MONGO_BORROW 0x40
+
 /* Flag that is set when we should set SO_REUSEADDR before calling bind() */
 #define MONGO_REUSEADDR 0x80
 
+/* Flag specific to the async API which means that the context reached one
+ * of its high watermarks and did not drain to the low ones yet. */
+#define MONGO_PAUSED 0x100
+
+/* Flag specific to the async API which means that the event library does the
+ * I/O itself and passes the results on, instead of signalling readiness. */
+#define MONGO_COMPLETION 0x200
+
 #define MONGO_KEEPALIVE_INTERVAL 15 /* seconds */
 
 /* number of times we retry to connect in the case of EADDRNOTAVAIL and
  * SO_REUSEADDR is being used. */
 #define MONGO_CONNECT_RETRIES  10
 
+/* Documents smaller than this are always copied into the output buffer,
+ * borrowing them would cost more in iovecs than the copy. */
+#define MONGO_BORROW_MIN_LEN 1024
+
+/* Max number of iovecs handed to a single writev() call. */
+#define MONGO_IOV_MAX 64
+
+/* Unacknowledged writes queued before mongoInsert, mongoUpdate and
+ * mongoDelete flush them, when mongoSetWriteConcern is given 0 bytes. */
+#define MONGO_WC_FLUSH_BYTES (1024*1024)
+
 /* strerror_r has two completely different prototypes and behaviors
  * depending on system issues, so we need to operate on the error buffer
  * differently depending on which strerror_r we're using. */
@@ -81,6 +112,35 @@ enum mongoConnectionType {
     MONGO_CONN_UNIX
 };
 
+/* Caller owned bytes that are written right before byte `pos` of the
+ * output buffer, see MONGO_BORROW. */
+typedef struct mongoOutRef {
+    size_t pos;
+    const char *ptr;
+    size_t len;
+} mongoOutRef;
+
+/* Events of the command observer, see mongoSetCommandObserver. */
+#define MONGO_EVENT_STARTED 1 /* a request was queued */
+#define MONGO_EVENT_SUCCEEDED 2 /* its reply was parsed */
+#define MONGO_EVENT_FAILED 3 /* its reply reports a failure, or the context failed */
+
+typedef struct mongoCommandEvent {
+    int type;
+    int32_t opCode; /* of the request */
+    int32_t req_id;
+    const char *ns; /* started: "db.col" of legacy requests, $db of OP_MSG */
+    const char *command; /* started: command name of OP_MSG */
+    size_t bytes; /* size of the request, or of the reply when there is one */
+    uint64_t elapsed_ns; /* succeeded/failed: since the request was queued */
+    void *reply; /* succeeded/failed: NULL when the context failed */
+    const char *errstr; /* failed */
+} mongoCommandEvent;
+
+struct mongoContext;
+typedef void (mongoCommandObserver)(struct mongoContext *c, const mongoCommandEvent *ev,
+                                    void *privdata);
+
 /* Context for a connection to Mongo */
 typedef struct mongoContext {
     int err; /* Error flags, 0 when there is no error */
@@ -88,6 +148,8 @@ typedef struct mongoContext {
     int fd;
     int flags;
     char *obuf; /* Write buffer */
+    size_t opos; /* Bytes of obuf already written */
+    size_t omsg; /* Start of the last message queued in obuf */
     mongoReader *reader; /* Protocol reader */
 
     enum mongoConnectionType connection_type;
@@ -103,11 +165,65 @@ typedef struct mongoContext {
         char *path;
     } unix_sock;
 
+    struct {
+        mongoOutRef *refs;
+        size_t head; /* First ref that is not fully written */
+        size_t len;
+        size_t cap;
+        size_t bytes; /* Unwritten bytes over all refs */
+    } oref;
+
+    mongoCompressor *compressor; /* OP_COMPRESSED is used when set */
+    size_t compress_threshold; /* Shorter messages are not compressed */
+
     char dbname[MONGO_MAX_DBNAME_LEN];
     char namespace[MONGO_MAX_NS_LEN];
     int32_t req_id;
+
+    /* Write concern of the blocking write helpers, see mongoSetWriteConcern */
+    struct {
+        int w; /* 0 for unacknowledged writes */
+        size_t flush_bytes;
+        unsigned long pending; /* unacknowledged writes since the last check */
+        unsigned long failed; /* checks that reported an error */
+    } wc;
+
+    mongoStats stats; /* see mongoGetStats */
+
+    /* Requests being timed, allocated on first use, see stats.h. */
+    struct {
+        mongoStamp *tab; /* open addressing on req_id, op < 0 marks a free slot */
+        uint32_t size; /* power of two */
+        uint32_t used;
+    } stamps;
+
+    struct {
+        mongoCommandObserver *fn;
+        void *privdata;
+    } observer;
 } mongoContext;
 
+/* Flags for mongoCursorCreate. */
+#define MONGO_CURSOR_EXHAUST 0x1 /* Let the server stream every batch */
+
+/* Query results handed out one document at a time, see mongoCursorNext. */
+typedef struct mongoCursor {
+    mongoContext *c;
+    int flags;
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+    char db[MONGO_MAX_DBNAME_LEN];
+    char col[MONGO_MAX_NS_LEN];
+    int32_t batchSize;
+    int64_t cursorID; /* 0 once the server has no more batches */
+    mongoReply *reply; /* The batch being handed out */
+    int32_t next; /* Index of the next document in reply */
+    int prefetch; /* Max OP_GET_MORE requests sent ahead, 0 = none */
+    size_t prefetchBytes; /* Max bytes of batches in flight, 0 = no cap */
+    int inflight; /* OP_GET_MORE requests sent but not read yet */
+    size_t batchBytes; /* Size of the last batch */
+} mongoCursor;
+
 mongoContext *mongoConnect(const char *ip, int port);
 mongoContext *mongoConnectWithTimeout(const char *ip, int port, const struct timeval tv);
 mongoContext *mongoConnectNonBlock(const char *ip, int port);
@@ -133,10 +249,20 @@ int mongoReconnect(mongoContext *c);
 
 int mongoSetTimeout(mongoContext *c, const struct timeval tv);
 int mongoEnableKeepAlive(mongoContext *c);
+int mongoEnableOpMsg(mongoContext *c);
+int mongoEnableCompression(mongoContext *c, int compressor, int level, size_t threshold);
+int mongoSetWriteConcern(mongoContext *c, int w, size_t flush_bytes);
 void mongoFree(mongoContext *c);
 int mongoFreeKeepFd(mongoContext *c);
 int mongoBufferRead(mongoContext *c);
 int mongoBufferWrite(mongoContext *c, int *done);
+size_t mongoBufferPending(mongoContext *c);
+sds mongoBufferTake(mongoContext *c);
+
+/* Statistics of the context, see stats.h */
+void mongoGetStats(mongoContext *c, mongoStats *stats);
+void mongoResetStats(mongoContext *c);
+int mongoSetCommandObserver(mongoContext *c, mongoCommandObserver *fn, void *privdata);
 
 int mongoAppendReqeustRaw(mongoContext *c, int32_t req_id, int32_t opCode, char *m, size_t len);
 int mongoAppendUpdateMsg(mongoContext *c, char *db, char *col, int32_t flags,
@@ -149,6 +275,16 @@ int mongoAppendGetMoreMsg(mongoContext *c, char *db, char *col, int32_t nrReturn
 int mongoAppendDeleteMsg(mongoContext *c, char *db, char *col, int32_t flags, bson_t *selector);
 int mongoAppendKillCursorsMsg(mongoContext *c, int32_t nrID, int64_t *IDs);
 
+int mongoAppendMsg(mongoContext *c, uint32_t flags, bson_t *body,
+                   mongoDocSeq *seqs, int nr_seqs);
+int mongoAppendCommandMsg(mongoContext *c, uint32_t flags, char *db, bson_t *cmd);
+int mongoAppendInsertCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                         int32_t iflags, bson_t **docs, size_t nr_docs, bson_t *wc);
+int mongoAppendUpdateCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                         int32_t uflags, bson_t *selector, bson_t *update, bson_t *wc);
+int mongoAppendDeleteCmd(mongoContext *c, uint32_t flags, char *db, char *col,
+                         int32_t dflags, bson_t *selector, bson_t *wc);
+
 int mongoAppendCmdRequst(mongoContext *c, int32_t flags, char *db, char *q_js);
 int mongoAppendGetLastErrorRequest(mongoContext *c, int32_t flags, char *db);
 /* In a blocking context, this function first checks if there are unconsumed
@@ -169,12 +305,20 @@ void *mongoGetCollectionNames(mongoContext *c, char *db);
 void *mongoListCollections(mongoContext *c, char *db);
 void *mongoDropDatabase(mongoContext *c, char *db);
 void *mongoGetLastError(mongoContext *c, char *db);
+void *mongoCommand(mongoContext *c, char *db, bson_t *cmd);
 
 void *mongoInsert(mongoContext *c, int32_t flags, char *db, char *col, bson_t *docs, int nr_docs);
 void *mongoUpdate(mongoContext *c, char *db, char *col, int32_t flags, bson_t *selector, bson_t *update);
 void *mongoDelete(mongoContext *c, char *db, char *col, int32_t flags, bson_t *selector);
 void *mongoGetMore(mongoContext *c, char *db, char *col, int32_t nrReturn, int64_t cursorId);
 void mongoKillCursors(mongoContext *c, int64_t *ids, int nr_id);
+void *mongoFlushWrites(mongoContext *c);
+
+mongoCursor *mongoCursorCreate(mongoContext *c, char *db, char *col, bson_t *q,
+                               bson_t *rfields, int32_t batchSize, int flags);
+void mongoCursorSetPrefetch(mongoCursor *cur, int depth, size_t maxBytes);
+bson_t *mongoCursorNext(mongoCursor *cur);
+void mongoCursorFree(mongoCursor *cur);
 
 char *bson_extract_string(bson_t *b, char *k);
 int64_t bson_extract_int64(bson_t *b, char *k);
@@ -52,6 +52,7 @@
 #include <stdlib.h>
 
 #include "net.h"
+#include "alloc.h"
 #include "sds.h"
 
 /* Defined in himongo.c */
@@ -287,21 +288,21 @@ static int _mongoContextConnectTcp(mongoContext *c, const char *addr, int port,
      **/
     if (c->tcp.host != addr) {
         if (c->tcp.host)
-            free(c->tcp.host);
+            mongo_free(c->tcp.host);
 
-        c->tcp.host = strdup(addr);
+        c->tcp.host = mongo_strdup(addr);
     }
 
     if (timeout) {
         if (c->timeout != timeout) {
             if (c->timeout == NULL)
-                c->timeout = malloc(sizeof(struct timeval));
+                c->timeout = mongo_malloc(sizeof(struct timeval));
 
             memcpy(c->timeout, timeout, sizeof(struct timeval));
         }
     } else {
         if (c->timeout)
-            free(c->timeout);
+            mongo_free(c->timeout);
         c->timeout = NULL;
     }
 
@@ -311,11 +312,11 @@ static int _mongoContextConnectTcp(mongoContext *c, const char *addr, int port,
     }
 
     if (source_addr == NULL) {
-        free(c->tcp.source_addr);
+        mongo_free(c->tcp.source_addr);
         c->tcp.source_addr = NULL;
     } else if (c->tcp.source_addr != source_addr) {
-        free(c->tcp.source_addr);
-        c->tcp.source_addr = strdup(source_addr);
+        mongo_free(c->tcp.source_addr);
+        c->tcp.source_addr = mongo_strdup(source_addr);
     }
 
     snprintf(_port, 6, "%d", port);
@@ -439,18 +440,18 @@ int mongoContextConnectUnix(mongoContext *c, const char *path, const struct time
 
     c->connection_type = MONGO_CONN_UNIX;
     if (c->unix_sock.path != path)
-        c->unix_sock.path = strdup(path);
+        c->unix_sock.path = mongo_strdup(path);
 
     if (timeout) {
         if (c->timeout != timeout) {
             if (c->timeout == NULL)
-                c->timeout = malloc(sizeof(struct timeval));
+                c->timeout = mongo_malloc(sizeof(struct timeval));
 
             memcpy(c->timeout, timeout, sizeof(struct timeval));
         }
     } else {
         if (c->timeout)
-            free(c->timeout);
+            mongo_free(c->timeout);
         c->timeout = NULL;
     }
 
@@ -0,0 +1,273 @@
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "himongo.h"
+#include "pipeline.h"
+
+/* A pipeline records the request id of every operation queued through it.
+ * mongoPipelineExec writes them all out at once and reads replies until
+ * each operation got its own, found by the responseTo of the reply, so the
+ * order in which the server answers doesn't matter. An operation whose
+ * reply reports a failure gets its own error, a broken connection fails
+ * the operations still waiting. */
+
+mongoPipeline *mongoPipelineCreate(mongoContext *c) {
+    mongoPipeline *p;
+
+    p = mongo_calloc(1,sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->c = c;
+    return p;
+}
+
+/* Free the replies that were not taken and forget the operations, the
+ * pipeline can be used again. */
+void mongoPipelineReset(mongoPipeline *p) {
+    for (int i = 0; i < p->nr_ops; i++) {
+        if (p->ops[i].reply)
+            freeReplyObject(p->ops[i].reply);
+    }
+    p->nr_ops = 0;
+    p->nr_pending = 0;
+}
+
+void mongoPipelineFree(mongoPipeline *p) {
+    if (p == NULL)
+        return;
+    mongoPipelineReset(p);
+    mongo_free(p->ops);
+    mongo_free(p);
+}
+
+/* Make room for a slot before the request is queued, so a queued request
+ * always has one. */
+static int __mongoPipelineReserve(mongoPipeline *p) {
+    mongoPipelineOp *ops;
+    int cap;
+
+    if (p->nr_ops < p->cap)
+        return MONGO_OK;
+    cap = p->cap ? p->cap * 2 : 16;
+    ops = mongo_realloc(p->ops, cap * sizeof(*ops));
+    if (ops == NULL)
+        return MONGO_ERR;
+    p->ops = ops;
+    p->cap = cap;
+    return MONGO_OK;
+}
+
+/* Give the last request queued on the context a slot. Returns its index. */
+static int __mongoPipelinePush(mongoPipeline *p, int cmd) {
+    mongoPipelineOp *op = p->ops + p->nr_ops;
+
+    op->req_id = p->c->req_id;
+    op->cmd = cmd;
+    op->reply = NULL;
+    op->err = 0;
+    op->errstr[0] = '\0';
+    p->nr_pending++;
+    return p->nr_ops++;
+}
+
+/* The functions below queue an operation and return the index of its slot,
+ * or MONGO_ERR when it could not be queued. Exhaust queries are refused,
+ * they are answered with more than one reply. */
+int mongoPipelineQuery(mongoPipeline *p, int32_t flags, char *db, char *col,
+                       int nrSkip, int nrReturn, bson_t *q, bson_t *rfields)
+{
+    if ((flags & QUERY_FLAG_EXHAUST) || __mongoPipelineReserve(p) != MONGO_OK)
+        return MONGO_ERR;
+    if (mongoAppendQueryMsg(p->c, flags, db, col, nrSkip, nrReturn, q, rfields) != MONGO_OK)
+        return MONGO_ERR;
+    return __mongoPipelinePush(p, 0);
+}
+
+int mongoPipelineFindOne(mongoPipeline *p, char *db, char *col, bson_t *q, bson_t *rfields) {
+    return mongoPipelineQuery(p, 0, db, col, 0, -1, q, rfields);
+}
+
+int mongoPipelineCommand(mongoPipeline *p, char *db, bson_t *cmd) {
+    if (__mongoPipelineReserve(p) != MONGO_OK)
+        return MONGO_ERR;
+    if (mongoAppendCommandMsg(p->c, 0, db, cmd) != MONGO_OK)
+        return MONGO_ERR;
+    return __mongoPipelinePush(p, 1);
+}
+
+/* Writes are acknowledged like with mongoInsert and friends, the slot gets
+ * the reply of the write command or of its getlasterror. */
+int mongoPipelineInsert(mongoPipeline *p, int32_t flags, char *db, char *col,
+                        bson_t *docs, int nr_docs)
+{
+    mongoContext *c = p->c;
+    int status;
+    bson_t *pp[nr_docs];
+
+    if (__mongoPipelineReserve(p) != MONGO_OK)
+        return MONGO_ERR;
+    for (int i = 0; i < nr_docs; ++i) {
+        pp[i] = docs + i;
+    }
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendInsertCmd(c, 0, db, col, flags, pp, nr_docs, NULL);
+    } else {
+        status = mongoAppendInsertMsg(c, flags, db, col, pp, nr_docs);
+        if (status == MONGO_OK)
+            status = mongoAppendGetLastErrorRequest(c, 0, db);
+    }
+    if (status != MONGO_OK)
+        return MONGO_ERR;
+    return __mongoPipelinePush(p, 1);
+}
+
+int mongoPipelineUpdate(mongoPipeline *p, char *db, char *col, int32_t flags,
+                        bson_t *selector, bson_t *update)
+{
+    mongoContext *c = p->c;
+    int status;
+
+    if (__mongoPipelineReserve(p) != MONGO_OK)
+        return MONGO_ERR;
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendUpdateCmd(c, 0, db, col, flags, selector, update, NULL);
+    } else {
+        status = mongoAppendUpdateMsg(c, db, col, flags, selector, update);
+        if (status == MONGO_OK)
+            status = mongoAppendGetLastErrorRequest(c, 0, db);
+    }
+    if (status != MONGO_OK)
+        return MONGO_ERR;
+    return __mongoPipelinePush(p, 1);
+}
+
+int mongoPipelineDelete(mongoPipeline *p, char *db, char *col, int32_t flags, bson_t *selector) {
+    mongoContext *c = p->c;
+    int status;
+
+    if (__mongoPipelineReserve(p) != MONGO_OK)
+        return MONGO_ERR;
+    if (c->flags & MONGO_OP_MSG) {
+        status = mongoAppendDeleteCmd(c, 0, db, col, flags, selector, NULL);
+    } else {
+        status = mongoAppendDeleteMsg(c, db, col, flags, selector);
+        if (status == MONGO_OK)
+            status = mongoAppendGetLastErrorRequest(c, 0, db);
+    }
+    if (status != MONGO_OK)
+        return MONGO_ERR;
+    return __mongoPipelinePush(p, 1);
+}
+
+int mongoPipelineGetMore(mongoPipeline *p, char *db, char *col, int32_t nrReturn,
+                         int64_t cursorId)
+{
+    if (__mongoPipelineReserve(p) != MONGO_OK)
+        return MONGO_ERR;
+    if (mongoAppendGetMoreMsg(p->c, db, col, nrReturn, cursorId) != MONGO_OK)
+        return MONGO_ERR;
+    return __mongoPipelinePush(p, 0);
+}
+
+/* Slot of the request a reply answers, or NULL. Request ids only grow while
+ * the operations are queued, so the slots are sorted by their distance to
+ * the first one, wrap around included. */
+static mongoPipelineOp *__mongoPipelineLookup(mongoPipeline *p, int32_t responseTo) {
+    uint32_t off = (uint32_t)responseTo - (uint32_t)p->ops[0].req_id;
+    int lo = 0, hi = p->nr_ops - 1, mid;
+    uint32_t cur;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        cur = (uint32_t)p->ops[mid].req_id - (uint32_t)p->ops[0].req_id;
+        if (cur == off)
+            return p->ops + mid;
+        if (cur < off)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+static void __mongoPipelineSetError(mongoPipelineOp *op, int type, const char *str) {
+    op->err = type;
+    snprintf(op->errstr, sizeof(op->errstr), "%s", str);
+}
+
+/* Fail the operation when its reply reports a failure: a query failure, a
+ * command that is not ok, the err of a getlasterror or the first write
+ * error of a write command. */
+static void __mongoPipelineCheck(mongoPipelineOp *op) {
+    mongoReply *rpl = op->reply;
+    bson_t *doc;
+    char *msg;
+
+    if (rpl->opCode == OP_REPLY && (rpl->responseFlags & REPLY_FLAG_QUERY_FAILURE)) {
+        doc = mongoReplyGetBson(rpl, 0);
+        msg = doc ? bson_extract_string(doc, (char *)"$err") : NULL;
+        __mongoPipelineSetError(op, MONGO_ERR_OTHER, msg ? msg : "Query failure");
+        return;
+    }
+    if (!op->cmd)
+        return;
+    doc = mongoReplyCommandDoc(rpl);
+    if (!mongoReplyCommandOk(rpl)) {
+        msg = doc ? bson_extract_string(doc, (char *)"errmsg") : NULL;
+        __mongoPipelineSetError(op, MONGO_ERR_OTHER, msg ? msg : "Command failed");
+    } else if ((msg = bson_extract_string(doc, (char *)"err")) != NULL ||
+               (msg = bson_extract_string(doc, (char *)"writeErrors.0.errmsg")) != NULL) {
+        __mongoPipelineSetError(op, MONGO_ERR_OTHER, msg);
+    }
+}
+
+/* Send the queued operations and wait for all their replies, which needs a
+ * blocking context. Every slot ends up with its reply, its error, or both
+ * when the reply reports a failure. Returns MONGO_ERR when the context
+ * failed, the operations that did not get a reply then have the error of
+ * the context. */
+int mongoPipelineExec(mongoPipeline *p) {
+    mongoContext *c = p->c;
+    mongoPipelineOp *op;
+    void *reply;
+
+    if (!(c->flags & MONGO_BLOCK))
+        return MONGO_ERR;
+    while (p->nr_pending > 0) {
+        if (mongoGetReply(c, &reply) != MONGO_OK)
+            break;
+
+        /* Replies to requests queued outside the pipeline are dropped. */
+        op = __mongoPipelineLookup(p, ((mongoReply *)reply)->responseTo);
+        if (op == NULL || op->reply != NULL || op->err != 0) {
+            freeReplyObject(reply);
+            continue;
+        }
+        op->reply = reply;
+        p->nr_pending--;
+        __mongoPipelineCheck(op);
+    }
+    if (p->nr_pending == 0)
+        return MONGO_OK;
+
+    for (int i = 0; i < p->nr_ops; i++) {
+        op = p->ops + i;
+        if (op->reply == NULL && op->err == 0)
+            __mongoPipelineSetError(op, c->err ? c->err : MONGO_ERR_OTHER, c->errstr);
+    }
+    p->nr_pending = 0;
+    return MONGO_ERR;
+}
+
+/* Hand the reply of an operation over to the caller, who frees it. */
+void *mongoPipelineTakeReply(mongoPipeline *p, int i) {
+    void *reply;
+
+    if (i < 0 || i >= p->nr_ops)
+        return NULL;
+    reply = p->ops[i].reply;
+    p->ops[i].reply = NULL;
+    return reply;
+}
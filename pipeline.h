@@ -0,0 +1,51 @@
+#ifndef __HIMONGO_PIPELINE_H
+#define __HIMONGO_PIPELINE_H
+#include "himongo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Result slot of one operation of a pipeline. */
+typedef struct mongoPipelineOp {
+    int32_t req_id; /* Request whose reply fills the slot */
+    int cmd; /* The reply is a command reply with an ok field */
+    void *reply; /* mongoReply or mongoMsgReply (see opCode), owned by the pipeline */
+    int err; /* Error flags, 0 when the operation succeeded */
+    char errstr[128]; /* String representation of error when applicable */
+} mongoPipelineOp;
+
+/* Operations queued on a blocking context, sent together by
+ * mongoPipelineExec, see pipeline.c. */
+typedef struct mongoPipeline {
+    mongoContext *c;
+    int nr_ops;
+    int cap;
+    mongoPipelineOp *ops;
+    int nr_pending; /* Ops still waiting for their reply */
+} mongoPipeline;
+
+mongoPipeline *mongoPipelineCreate(mongoContext *c);
+void mongoPipelineReset(mongoPipeline *p);
+void mongoPipelineFree(mongoPipeline *p);
+
+int mongoPipelineQuery(mongoPipeline *p, int32_t flags, char *db, char *col,
+                       int nrSkip, int nrReturn, bson_t *q, bson_t *rfields);
+int mongoPipelineFindOne(mongoPipeline *p, char *db, char *col, bson_t *q, bson_t *rfields);
+int mongoPipelineCommand(mongoPipeline *p, char *db, bson_t *cmd);
+int mongoPipelineInsert(mongoPipeline *p, int32_t flags, char *db, char *col,
+                        bson_t *docs, int nr_docs);
+int mongoPipelineUpdate(mongoPipeline *p, char *db, char *col, int32_t flags,
+                        bson_t *selector, bson_t *update);
+int mongoPipelineDelete(mongoPipeline *p, char *db, char *col, int32_t flags, bson_t *selector);
+int mongoPipelineGetMore(mongoPipeline *p, char *db, char *col, int32_t nrReturn,
+                         int64_t cursorId);
+
+int mongoPipelineExec(mongoPipeline *p);
+void *mongoPipelineTakeReply(mongoPipeline *p, int i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,393 @@
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "himongo.h"
+#include "pool.h"
+#include "compress.h"
+
+/* Idle contexts are spread over MONGO_POOL_SHARDS independently locked
+ * stacks, a checkout starts at a round robin shard and moves on to the next
+ * one when it is empty. The number of open contexts is a single atomic
+ * counter, so the common path never takes a pool wide lock. Only callers
+ * waiting for a context at max_size sleep on the pool condition. */
+
+#define __atomicLoad(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define __atomicStore(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define __atomicIncr(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define __atomicDecr(p, v) __atomic_fetch_sub((p), (v), __ATOMIC_SEQ_CST)
+#define __atomicCas(p, e, v) \
+    __atomic_compare_exchange_n((p), (e), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+typedef struct mongoPoolEntry {
+    mongoContext *c;
+    long long last_used; /* ms */
+} mongoPoolEntry;
+
+typedef struct mongoPoolShard {
+    pthread_mutex_t lock;
+    int nr_idle;
+    mongoPoolEntry *idle; /* Stack, the longest idle entry is at index 0 */
+    char pad[64]; /* Keep shards off each other's cache lines */
+} mongoPoolShard;
+
+struct mongoPool {
+    mongoPoolOptions opts;
+    char *ip;
+    char *path;
+    int size; /* Open contexts, checked out ones included */
+    unsigned int next; /* Round robin shard hint */
+    unsigned int gen; /* Bumped whenever a context or a slot is released */
+    int waiters;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    mongoPoolShard shards[MONGO_POOL_SHARDS];
+};
+
+static long long __mongoPoolMsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Take a slot for a new context, fails at max_size. */
+static int __mongoPoolReserveSlot(mongoPool *p) {
+    int size = __atomicLoad(&p->size);
+
+    while (size < p->opts.max_size) {
+        if (__atomicCas(&p->size, &size, size+1))
+            return 1;
+    }
+    return 0;
+}
+
+/* Give up a slot unless that would drop below min_size, for eviction. */
+static int __mongoPoolReleaseSlotAboveMin(mongoPool *p) {
+    int size = __atomicLoad(&p->size);
+
+    while (size > p->opts.min_size) {
+        if (__atomicCas(&p->size, &size, size-1))
+            return 1;
+    }
+    return 0;
+}
+
+/* Wake up one caller waiting in mongoPoolGet, if any. */
+static void __mongoPoolNotify(mongoPool *p) {
+    __atomicIncr(&p->gen, 1);
+    if (__atomicLoad(&p->waiters) > 0) {
+        pthread_mutex_lock(&p->wait_lock);
+        pthread_cond_signal(&p->wait_cond);
+        pthread_mutex_unlock(&p->wait_lock);
+    }
+}
+
+/* Close a context and release its slot. */
+static void __mongoPoolDiscard(mongoPool *p, mongoContext *c) {
+    mongoFree(c);
+    __atomicDecr(&p->size, 1);
+    __mongoPoolNotify(p);
+}
+
+static void __mongoPoolSetup(mongoPool *p, mongoContext *c) {
+    c->flags |= p->opts.flags;
+    if (p->opts.timeout.tv_sec || p->opts.timeout.tv_usec)
+        mongoSetTimeout(c, p->opts.timeout);
+}
+
+/* Undo what a borrower may have changed on a context before the next one
+ * gets it: flags, write concern, compression, observer and socket timeout
+ * go back to what the pool set up. Fails when the timeout can't be set. */
+static int __mongoPoolReset(mongoPool *p, mongoContext *c) {
+    c->flags &= ~(MONGO_OP_MSG|MONGO_BORROW);
+    c->flags |= p->opts.flags;
+    c->wc.w = 1;
+    c->wc.flush_bytes = MONGO_WC_FLUSH_BYTES;
+    c->wc.pending = 0;
+    c->wc.failed = 0;
+    mongoCompressorFree(c->compressor);
+    c->compressor = NULL;
+    mongoSetCommandObserver(c, NULL, NULL);
+    return mongoSetTimeout(c, p->opts.timeout);
+}
+
+/* Open a context for a slot taken by the caller. A context that failed to
+ * connect is returned as well so the caller can see its err field, handing
+ * it back with mongoPoolPut releases the slot. */
+static mongoContext *__mongoPoolConnect(mongoPool *p) {
+    mongoContext *c;
+    int has_timeout = p->opts.timeout.tv_sec || p->opts.timeout.tv_usec;
+
+    if (p->ip != NULL) {
+        c = has_timeout ? mongoConnectWithTimeout(p->ip, p->opts.port, p->opts.timeout) :
+            mongoConnect(p->ip, p->opts.port);
+    } else {
+        c = has_timeout ? mongoConnectUnixWithTimeout(p->path, p->opts.timeout) :
+            mongoConnectUnix(p->path);
+    }
+    if (c == NULL) {
+        __atomicDecr(&p->size, 1);
+        __mongoPoolNotify(p);
+        return NULL;
+    }
+    if (!c->err)
+        __mongoPoolSetup(p, c);
+    return c;
+}
+
+static int __mongoPoolPing(mongoContext *c) {
+    bson_t cmd;
+    void *reply;
+    int ok;
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "ping", 1);
+    if (c->flags & MONGO_OP_MSG)
+        reply = mongoCommand(c, (char *)"admin", &cmd);
+    else
+        reply = mongoQuery(c, 0, (char *)"admin", (char *)"$cmd", 0, -1, &cmd, NULL);
+    bson_destroy(&cmd);
+    if (reply == NULL)
+        return MONGO_ERR;
+    ok = mongoReplyCommandOk(reply);
+    freeReplyObject(reply);
+    return ok ? MONGO_OK : MONGO_ERR;
+}
+
+/* Make sure a context that sat idle for a while still works, reconnecting
+ * it once when it doesn't. */
+static int __mongoPoolCheck(mongoPool *p, mongoPoolEntry *e) {
+    if (p->opts.check_interval <= 0 ||
+        __mongoPoolMsec() - e->last_used < p->opts.check_interval)
+        return MONGO_OK;
+    if (__mongoPoolPing(e->c) == MONGO_OK)
+        return MONGO_OK;
+    if (mongoReconnect(e->c) != MONGO_OK)
+        return MONGO_ERR;
+    __mongoPoolSetup(p, e->c);
+    return MONGO_OK;
+}
+
+static mongoContext *__mongoPoolTakeIdle(mongoPool *p) {
+    unsigned int start = __atomicIncr(&p->next, 1);
+    mongoPoolShard *s;
+    mongoPoolEntry e;
+    int i, found;
+
+    for (i = 0; i < MONGO_POOL_SHARDS; i++) {
+        s = &p->shards[(start + i) % MONGO_POOL_SHARDS];
+        if (__atomicLoad(&s->nr_idle) == 0)
+            continue;
+
+        found = 0;
+        pthread_mutex_lock(&s->lock);
+        if (s->nr_idle > 0) {
+            e = s->idle[s->nr_idle-1];
+            __atomicStore(&s->nr_idle, s->nr_idle-1);
+            found = 1;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (found) {
+            if (__mongoPoolCheck(p, &e) == MONGO_OK)
+                return e.c;
+            __mongoPoolDiscard(p, e.c);
+        }
+    }
+    return NULL;
+}
+
+/* Remove the longest idle entry of a shard if it expired and the pool is
+ * above min_size. Called with the shard locked, the context is returned so
+ * that it can be closed after unlocking. */
+static mongoContext *__mongoPoolExpire(mongoPool *p, mongoPoolShard *s, long long now) {
+    mongoContext *c;
+
+    if (p->opts.idle_timeout <= 0 || s->nr_idle == 0 ||
+        now - s->idle[0].last_used < p->opts.idle_timeout)
+        return NULL;
+    if (!__mongoPoolReleaseSlotAboveMin(p))
+        return NULL;
+    c = s->idle[0].c;
+    memmove(s->idle, s->idle+1, (s->nr_idle-1) * sizeof(mongoPoolEntry));
+    __atomicStore(&s->nr_idle, s->nr_idle-1);
+    return c;
+}
+
+mongoPool *mongoPoolCreate(const mongoPoolOptions *opts) {
+    mongoPool *p;
+    mongoContext *c;
+    int i;
+
+    if (opts->max_size <= 0 || opts->min_size < 0 || opts->min_size > opts->max_size ||
+        (opts->ip == NULL && opts->path == NULL))
+        return NULL;
+
+    p = mongo_calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    /* Everything mongoPoolFree destroys is set up before the first
+     * allocation that can fail. */
+    pthread_mutex_init(&p->wait_lock, NULL);
+    pthread_cond_init(&p->wait_cond, NULL);
+    for (i = 0; i < MONGO_POOL_SHARDS; i++)
+        pthread_mutex_init(&p->shards[i].lock, NULL);
+    p->opts = *opts;
+    p->ip = opts->ip ? mongo_strdup(opts->ip) : NULL;
+    p->path = opts->path ? mongo_strdup(opts->path) : NULL;
+    p->opts.ip = p->ip;
+    p->opts.path = p->path;
+    if ((opts->ip && p->ip == NULL) || (opts->path && p->path == NULL))
+        goto oom;
+    for (i = 0; i < MONGO_POOL_SHARDS; i++) {
+        /* Every context may end up in the same shard. */
+        p->shards[i].idle = mongo_malloc(opts->max_size * sizeof(mongoPoolEntry));
+        if (p->shards[i].idle == NULL)
+            goto oom;
+    }
+
+    /* Open min_size contexts up front, the ones that fail to connect are
+     * opened on demand later on. */
+    for (i = 0; i < opts->min_size; i++) {
+        if (!__mongoPoolReserveSlot(p))
+            break;
+        c = __mongoPoolConnect(p);
+        mongoPoolPut(p, c);
+    }
+    return p;
+
+oom:
+    mongoPoolFree(p);
+    return NULL;
+}
+
+/* Close the pool and its idle contexts. Contexts still checked out must have
+ * been handed back before. */
+void mongoPoolFree(mongoPool *p) {
+    mongoPoolShard *s;
+    int i, j;
+
+    if (p == NULL)
+        return;
+    for (i = 0; i < MONGO_POOL_SHARDS; i++) {
+        s = &p->shards[i];
+        for (j = 0; j < s->nr_idle; j++)
+            mongoFree(s->idle[j].c);
+        mongo_free(s->idle);
+        pthread_mutex_destroy(&s->lock);
+    }
+    pthread_mutex_destroy(&p->wait_lock);
+    pthread_cond_destroy(&p->wait_cond);
+    mongo_free(p->ip);
+    mongo_free(p->path);
+    mongo_free(p);
+}
+
+/* Check out a blocking context: an idle one when there is one, a new one
+ * while below max_size, otherwise wait up to wait_timeout for one to be
+ * handed back.
+ *
+ * Returns NULL when no context is available (or out of memory). A returned
+ * context may have its err field set when connecting failed; it must be
+ * handed back with mongoPoolPut like any other. */
+mongoContext *mongoPoolGet(mongoPool *p) {
+    mongoContext *c;
+    struct timespec ts;
+    long long deadline = 0, now;
+    unsigned int gen;
+
+    while (1) {
+        gen = __atomicLoad(&p->gen);
+        c = __mongoPoolTakeIdle(p);
+        if (c != NULL)
+            return c;
+        if (__mongoPoolReserveSlot(p))
+            return __mongoPoolConnect(p);
+
+        if (p->opts.wait_timeout <= 0)
+            return NULL;
+        now = __mongoPoolMsec();
+        if (deadline == 0)
+            deadline = now + p->opts.wait_timeout;
+        else if (now >= deadline)
+            return NULL;
+
+        /* Sleep until something is released. The generation check under the
+         * lock closes the window between TakeIdle and the wait. */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (deadline - now) / 1000;
+        ts.tv_nsec += ((deadline - now) % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&p->wait_lock);
+        __atomicIncr(&p->waiters, 1);
+        if (__atomicLoad(&p->gen) == gen)
+            pthread_cond_timedwait(&p->wait_cond, &p->wait_lock, &ts);
+        __atomicDecr(&p->waiters, 1);
+        pthread_mutex_unlock(&p->wait_lock);
+    }
+}
+
+/* Hand a context back. Contexts that saw an error, lost their connection or
+ * still have requests or replies in flight are closed instead of being
+ * reused, since their protocol state is unknown. The others get the pool's
+ * settings back, see __mongoPoolReset. */
+void mongoPoolPut(mongoPool *p, mongoContext *c) {
+    mongoPoolShard *s;
+    mongoContext *expired;
+    long long now;
+
+    if (c == NULL)
+        return;
+    if (c->err || !(c->flags & MONGO_CONNECTED) ||
+        mongoBufferPending(c) > 0 || c->reader->len > 0 ||
+        __mongoPoolReset(p, c) != MONGO_OK) {
+        __mongoPoolDiscard(p, c);
+        return;
+    }
+
+    now = __mongoPoolMsec();
+    s = &p->shards[__atomicIncr(&p->next, 1) % MONGO_POOL_SHARDS];
+    pthread_mutex_lock(&s->lock);
+    s->idle[s->nr_idle].c = c;
+    s->idle[s->nr_idle].last_used = now;
+    __atomicStore(&s->nr_idle, s->nr_idle+1);
+    expired = __mongoPoolExpire(p, s, now);
+    pthread_mutex_unlock(&s->lock);
+
+    if (expired != NULL)
+        mongoFree(expired);
+    __mongoPoolNotify(p);
+}
+
+/* Close every idle context that passed idle_timeout, as far as min_size
+ * allows. Put already does this lazily one context at a time, call this
+ * from a timer to shrink a pool that went quiet. */
+void mongoPoolEvictIdle(mongoPool *p) {
+    mongoPoolShard *s;
+    mongoContext *c;
+    long long now = __mongoPoolMsec();
+    int i;
+
+    for (i = 0; i < MONGO_POOL_SHARDS; i++) {
+        s = &p->shards[i];
+        do {
+            pthread_mutex_lock(&s->lock);
+            c = __mongoPoolExpire(p, s, now);
+            pthread_mutex_unlock(&s->lock);
+            if (c != NULL)
+                mongoFree(c);
+        } while (c != NULL);
+    }
+}
+
+/* Number of open contexts, checked out ones included. */
+int mongoPoolSize(mongoPool *p) {
+    return __atomicLoad(&p->size);
+}
@@ -0,0 +1,38 @@
+#ifndef __HIMONGO_POOL_H
+#define __HIMONGO_POOL_H
+#include "himongo.h"
+
+/* Number of independently locked idle lists, see pool.c. */
+#define MONGO_POOL_SHARDS 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mongoPoolOptions {
+    const char *ip; /* TCP address, or NULL to connect to path */
+    int port;
+    const char *path; /* Unix socket path, used when ip is NULL */
+    struct timeval timeout; /* Connect and read/write timeout, 0 for none */
+    int flags; /* Extra context flags, e.g. MONGO_OP_MSG */
+    int min_size; /* Contexts kept open even when idle */
+    int max_size; /* Cap on open contexts, checked out ones included */
+    int idle_timeout; /* ms an idle context above min_size is kept, 0 = forever */
+    int check_interval; /* ms idle after which checkout pings first, 0 = never */
+    int wait_timeout; /* ms mongoPoolGet waits at max_size, 0 = fail at once */
+} mongoPoolOptions;
+
+typedef struct mongoPool mongoPool;
+
+mongoPool *mongoPoolCreate(const mongoPoolOptions *opts);
+void mongoPoolFree(mongoPool *p);
+mongoContext *mongoPoolGet(mongoPool *p);
+void mongoPoolPut(mongoPool *p, mongoContext *c);
+void mongoPoolEvictIdle(mongoPool *p);
+int mongoPoolSize(mongoPool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,60 +4,258 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "proto.h"
+#include "endianconv.h"
+#include "alloc.h"
+#include "sds.h"
 #include "utils.h"
 #include "read.h"
 
-void * mongoReplyCreateFromBytes(char *buf, size_t size) {
+#define ALIGN16(n) (((n) + 15) & ~(size_t)15)
+
+/*
+ * a reply lives in a single allocation: the struct, the document pointers,
+ * a static bson_t view per document and, unless the reply owns the packet,
+ * a copy of the document bytes the views point into. the pointer count is
+ * rounded up to keep the views 16 bytes aligned. mongoReplyFree releases
+ * it with one free.
+ *
+ *   | mongoReply | docs[] | bson_t views[] | documents (copy mode) |
+ *
+ * with nocopy set buf is an sds holding exactly one packet, the views point
+ * into it and the reply takes ownership of it, so it is released at once by
+ * mongoReplyFree. buf is not freed on error.
+ */
+static mongoReply *__mongoReplyCreate(char *buf, size_t size, int nocopy) {
+    mongoReply hdr, *m;
     int offset;
-    int num = 0;
-    bson_t *bs;
-    bson_reader_t *reader;
-    bool eof;
-    mongoReply *m = calloc(1, sizeof(*m));
+    int32_t num = 0;
+    uint32_t doclen;
+    size_t pos, nptr, datalen, blocklen;
+    char *mem, *data;
+    bson_t *views;
+
+    memset(&hdr, 0, sizeof(hdr));
     offset = mongoSnunpack(buf, 0, size, "<iiiiiqii",
-                           &(m->messageLength), &(m->requestID), &(m->responseTo),
-                           &(m->opCode), &(m->responseFlags), &(m->cursorID),
-                           &(m->startingFrom), &(m->numberReturned));
-    if (offset < 0) {
-        free(m);
+                           &(hdr.messageLength), &(hdr.requestID), &(hdr.responseTo),
+                           &(hdr.opCode), &(hdr.responseFlags), &(hdr.cursorID),
+                           &(hdr.startingFrom), &(hdr.numberReturned));
+    if (offset < 0 || hdr.numberReturned < 0) {
         return NULL;
     }
-    if (m->numberReturned > 0) {
-        m->docs = calloc(1, m->numberReturned * sizeof(bson_t *));
-        reader = bson_reader_new_from_data((uint8_t *)(buf+offset), size-offset);
-        while((bs = (bson_t *)bson_reader_read(reader, &eof))) {
-            if (num >= m->numberReturned) {
-                goto invalid;
-            }
-            /*
-             * since the bson object returned by bson_reader_read is a
-             * static field in bson_reader_t struct,
-             * so we must copy this bson object.
-             */
-            m->docs[num++] = bson_copy(bs);
+
+    /* the documents must fill the rest of the packet exactly. */
+    for (pos = offset; pos < size; pos += doclen) {
+        if (size - pos < 4) return NULL;
+        doclen = load32le(buf+pos);
+        if (num >= hdr.numberReturned || doclen < 5 || doclen > size-pos) {
+            return NULL;
         }
-        if (!eof || num != m->numberReturned) {
-            goto invalid;
+        num++;
+    }
+    if (num != hdr.numberReturned) {
+        return NULL;
+    }
+
+    nptr = ((size_t)num + 1) & ~(size_t)1;
+    datalen = nocopy? 0: size - offset;
+    blocklen = ALIGN16(sizeof(mongoReply)) + nptr * sizeof(bson_t *) +
+               (size_t)num * sizeof(bson_t) + datalen;
+    mem = mongo_malloc(blocklen);
+    if (mem == NULL) {
+        return NULL;
+    }
+    m = (mongoReply *)mem;
+    *m = hdr;
+    m->docs = num? (bson_t **)(mem + ALIGN16(sizeof(mongoReply))): NULL;
+    views = (bson_t *)(mem + ALIGN16(sizeof(mongoReply)) + nptr * sizeof(bson_t *));
+    data = buf + offset;
+    if (!nocopy) {
+        data = memcpy(views + num, data, datalen);
+    }
+    for (int32_t i = 0; i < num; i++) {
+        doclen = load32le(data);
+        if (!bson_init_static(views+i, (uint8_t *)data, doclen)) {
+            mongo_free(m);
+            return NULL;
         }
-        bson_reader_destroy(reader);
+        m->docs[i] = views+i;
+        data += doclen;
+    }
+    if (nocopy) m->raw = buf;
+    return m;
+}
+
+void * mongoReplyCreateFromBytes(char *buf, size_t size) {
+    if (size >= 16 && (int32_t)load32le(buf+12) == OP_MSG) {
+        return mongoMsgReplyCreate(buf, size, 0);
+    }
+    return __mongoReplyCreate(buf, size, 0);
+}
+
+/*
+ * like mongoReplyCreateFromBytes, but the reply takes ownership of buf (an sds
+ * holding exactly one packet) instead of copying the documents out of it.
+ * docs[] are static bson views into buf, so the whole packet is released at
+ * once by mongoReplyFree. buf is freed on error as well.
+ */
+void * mongoReplyCreateNoCopy(char *buf, size_t size) {
+    mongoReply *m;
+
+    if (size >= 16 && (int32_t)load32le(buf+12) == OP_MSG) {
+        return mongoMsgReplyCreate(buf, size, 1);
+    }
+    m = __mongoReplyCreate(buf, size, 1);
+    if (m == NULL) {
+        sdsfree(buf);
     }
     return m;
-invalid:
-    mongoReplyFree(m);
-    return NULL;
 }
 
 void mongoReplyFree(void *p) {
     mongoReply *m = p;
     if (!m) return;
 
-    for (int i = 0; i < m->numberReturned; ++i) {
-        if (m->docs[i]) bson_destroy(m->docs[i]);
+    if (m->opCode == OP_MSG) {
+        mongoMsgReplyFree(p);
+        return;
     }
-    free(m->docs);
-    free(m);
+
+    /* docs[] are static views into the reply or raw, see __mongoReplyCreate. */
+    sdsfree(m->raw);
+    mongo_free(m);
+}
+
+/*
+ * struct OP_MSG {
+ *     MsgHeader header;          // standard message header
+ *     uint32 flagBits;           // message flags
+ *     Sections[] sections;       // data sections
+ *     optional<uint32> checksum; // optional CRC-32C checksum
+ * }
+ *
+ * the checksum is verified when MSG_FLAG_CHECKSUM_PRESENT is set.
+ *
+ * like an OP_REPLY, the reply, the section array, the document pointers and
+ * a static bson view per document live in one allocation. without nocopy a
+ * copy of the packet goes at its end and the views and the sequence
+ * identifiers point into it. when nocopy is set, buf is an sds which the
+ * reply takes ownership of, exactly like mongoReplyCreateNoCopy.
+ */
+void * mongoMsgReplyCreate(char *buf, size_t size, int nocopy) {
+    mongoMsgReply hdr, *m;
+    size_t offset, end, sec_end, idlen, blocklen, seqlen;
+    size_t nr_docs = 0, nr_sections = 0, nptr;
+    int nr_body = 0;
+    uint32_t len;
+    char kind, *mem, *id;
+    bson_t **ptrs;
+    bson_t *views;
+    mongoDocSeq *seq;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (mongoSnunpack(buf, 0, size, "<iiiii",
+                      &(hdr.messageLength), &(hdr.requestID), &(hdr.responseTo),
+                      &(hdr.opCode), &(hdr.flagBits)) < 0) {
+        goto invalid;
+    }
+    end = size;
+    if (hdr.flagBits & MSG_FLAG_CHECKSUM_PRESENT) {
+        /* the CRC-32C of everything before it, a mismatch is invalid. */
+        if (end < 24) goto invalid;
+        end -= 4;
+        if (mongoCrc32c(0, buf, end) != load32le(buf+end)) goto invalid;
+    }
+
+    /* first pass: validate the sections and size the block. */
+    for (offset = 20; offset < end; ) {
+        kind = buf[offset++];
+        if (end - offset < 4) goto invalid;
+        len = load32le(buf+offset);
+        if (kind == MSG_SECTION_BODY) {
+            if (len < 5 || len > end-offset) goto invalid;
+            nr_body++;
+            offset += len;
+        } else if (kind == MSG_SECTION_DOC_SEQUENCE) {
+            if (len < 4 || len > end-offset) goto invalid;
+            sec_end = offset + len;
+            offset += 4;
+            id = memchr(buf+offset, '\0', sec_end-offset);
+            if (id == NULL) goto invalid;
+            idlen = (size_t)(id - (buf+offset));
+            offset += idlen + 1;
+            while (offset < sec_end) {
+                if (sec_end - offset < 4) goto invalid;
+                len = load32le(buf+offset);
+                if (len < 5 || len > sec_end-offset) goto invalid;
+                nr_docs++;
+                offset += len;
+            }
+            nr_sections++;
+        } else {
+            goto invalid;
+        }
+    }
+    if (nr_body != 1) goto invalid;
+
+    nptr = (nr_docs + 1) & ~(size_t)1;
+    seqlen = ALIGN16(nr_sections * sizeof(mongoDocSeq));
+    blocklen = ALIGN16(sizeof(mongoMsgReply)) + seqlen + nptr * sizeof(bson_t *) +
+               (nr_docs + 1) * sizeof(bson_t);
+    if (!nocopy) blocklen += size;
+    mem = mongo_malloc(blocklen);
+    if (mem == NULL) goto invalid;
+    m = (mongoMsgReply *)mem;
+    *m = hdr;
+    mem += ALIGN16(sizeof(mongoMsgReply));
+    m->seqs = nr_sections? (mongoDocSeq *)mem: NULL;
+    ptrs = (bson_t **)(mem + seqlen);
+    views = (bson_t *)(ptrs + nptr);
+    if (nocopy) m->raw = buf;
+    else buf = memcpy(views + nr_docs + 1, buf, size);
+
+    /* second pass: build the documents. */
+    for (offset = 20; offset < end; ) {
+        kind = buf[offset++];
+        len = load32le(buf+offset);
+        if (kind == MSG_SECTION_BODY) {
+            if (!bson_init_static(views, (uint8_t *)buf+offset, len)) goto fail;
+            m->body = views++;
+            offset += len;
+            continue;
+        }
+        sec_end = offset + len;
+        offset += 4;
+        seq = m->seqs + m->nr_seqs++;
+        seq->identifier = buf+offset;
+        seq->nr_docs = 0;
+        seq->docs = ptrs;
+        offset += strlen(seq->identifier) + 1;
+        while (offset < sec_end) {
+            len = load32le(buf+offset);
+            if (!bson_init_static(views, (uint8_t *)buf+offset, len)) goto fail;
+            *ptrs++ = views++;
+            seq->nr_docs++;
+            offset += len;
+        }
+    }
+    return m;
+fail:
+    mongoMsgReplyFree(m);
+    return NULL;
+invalid:
+    if (nocopy) sdsfree(buf);
+    return NULL;
+}
+
+void mongoMsgReplyFree(mongoMsgReply *m) {
+    if (!m) return;
+
+    /* the documents are static views into the reply or raw. */
+    sdsfree(m->raw);
+    mongo_free(m);
 }
 
 bson_t *mongoReplyGetBson(mongoReply *m, int idx) {
@@ -65,9 +263,56 @@ bson_t *mongoReplyGetBson(mongoReply *m, int idx) {
     return m->docs[idx];
 }
 
+/* The command reply document of an OP_REPLY or OP_MSG reply, i.e. the
+ * first document or the body. NULL when there is none. */
+bson_t *mongoReplyCommandDoc(void *p) {
+    mongoReply *m = p;
+
+    if (m->opCode == OP_MSG) return ((mongoMsgReply *)p)->body;
+    if (m->responseFlags & REPLY_FLAG_QUERY_FAILURE) return NULL;
+    return mongoReplyGetBson(m, 0);
+}
+
+/* Check the "ok" field of a command reply. */
+int mongoReplyCommandOk(void *p) {
+    bson_t *doc = mongoReplyCommandDoc(p);
+    bson_iter_t it;
+
+    return doc != NULL && bson_iter_init(&it, doc) &&
+        bson_iter_find(&it, "ok") && bson_iter_as_bool(&it);
+}
+
+static int mongoMsgReplyToStr(mongoMsgReply *m, char *buf, size_t len) {
+    int n;
+    size_t offset = 0;
+    char *ss;
+    n = snprintf(buf+offset, len,
+                 "rid: %i \nrespTO: %d \nOpCode: %d \nflagBits: %u \nsections: %d\n",
+                 m->requestID, m->responseTo, m->opCode, m->flagBits, m->nr_seqs+1);
+    offset += n;
+    if (offset >= len-1) return MONGO_ERR;
+    ss = bson_as_json(m->body, NULL);
+    n = snprintf(buf+offset, len-offset, "BODY\n%s\n\n", ss);
+    offset += n;
+    bson_free(ss);
+    if (offset >= len-1) return MONGO_ERR;
+    for (int32_t i = 0; i < m->nr_seqs; ++i) {
+        for (int32_t j = 0; j < m->seqs[i].nr_docs; ++j) {
+            ss = bson_as_json(m->seqs[i].docs[j], NULL);
+            n = snprintf(buf+offset, len-offset, "%s %d\n%s\n\n",
+                         m->seqs[i].identifier, j, ss);
+            offset += n;
+            bson_free(ss);
+            if (offset >= len-1) return MONGO_ERR;
+        }
+    }
+    return MONGO_OK;
+}
+
 int mongoReplyToStr(mongoReply *m, char *buf, size_t len) {
     int n;
     int offset = 0;
+    if (m->opCode == OP_MSG) return mongoMsgReplyToStr((mongoMsgReply *)m, buf, len);
     n = snprintf(buf+offset, len,
                  "rid: %i \nrespTO: %d \nOpCode: %d \n"
                  "respFlags: %d \ncursorID: %ld \nstartFrom: %d \nnrReturn: %d\n",
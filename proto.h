@@ -12,7 +12,6 @@
 #define MONGO_MAX_NS_LEN      120
 
 #define OP_REPLY	1
-#define OP_MSG	1000
 #define OP_UPDATE	2001
 #define OP_INSERT	2002
 #define RESERVED	2003
@@ -20,6 +19,8 @@
 #define OP_GET_MORE	2005
 #define OP_DELETE	2006
 #define OP_KILL_CURSORS	2007
+#define OP_COMPRESSED	2012
+#define OP_MSG	2013
 
 #define INSERT_FLAG_CONT_ON_ERR      1
 
@@ -43,6 +44,13 @@
 #define REPLY_FLAG_AWAIT_CAPABLE      (1 << 3)
 #define REPLY_FLAG_MASK               0xF0FFFFFF
 
+#define MSG_FLAG_CHECKSUM_PRESENT     1
+#define MSG_FLAG_MORE_TO_COME         (1 << 1)
+#define MSG_FLAG_EXHAUST_ALLOWED      (1 << 16)
+
+#define MSG_SECTION_BODY              0
+#define MSG_SECTION_DOC_SEQUENCE      1
+
 #define MSG_HEADER                              \
     int32_t messageLength;                      \
     int32_t requestID;                          \
@@ -59,17 +67,39 @@ typedef struct replyMsg {
     int32_t startingFrom;
     int32_t numberReturned;
     bson_t **docs;
+    char *raw;       /* packet bytes owned by a zero-copy reply, NULL otherwise */
 } mongoReply;
 
-struct mongoCursor {
-    char *namespace[MONGO_MAX_NS_LEN];
-    int32_t numberToReturn;
-    int64_t cursorID;
-};
+/*!
+ * kind 1 section of an OP_MSG message
+ */
+typedef struct mongoDocSeq {
+    char *identifier;
+    int32_t nr_docs;
+    bson_t **docs;
+} mongoDocSeq;
+
+/*!
+ * OP_MSG message, replies of this type can be told apart from mongoReply
+ * by the opCode field of the common header.
+ */
+typedef struct msgMsg {
+    MSG_HEADER;
+    uint32_t flagBits;
+    bson_t *body;    /* the kind 0 section */
+    int32_t nr_seqs;
+    mongoDocSeq *seqs; /* in the allocation of the reply, see proto.c */
+    char *raw;       /* packet bytes owned by a zero-copy reply, NULL otherwise */
+} mongoMsgReply;
 
 void * mongoReplyCreateFromBytes(char *buf, size_t size);
+void * mongoReplyCreateNoCopy(char *buf, size_t size);
 void mongoReplyFree(void *m);
 bson_t *mongoReplyGetBson(mongoReply *m, int idx);
+bson_t *mongoReplyCommandDoc(void *m);
+int mongoReplyCommandOk(void *m);
+void * mongoMsgReplyCreate(char *buf, size_t size, int nocopy);
+void mongoMsgReplyFree(mongoMsgReply *m);
 int mongoReplyToStr(mongoReply *m, char *buf, size_t len);
 
 #endif /* _HIMONGO_PROTO_H_ */
@@ -10,16 +10,51 @@
 
 #include "endianconv.h"
 #include "read.h"
+#include "alloc.h"
 #include "sds.h"
 #include "proto.h"
+#include "utils.h"
 
 /* Default set of functions to build the reply. Keep in mind that such a
  * function returning NULL is interpreted as error. */
 static mongoReplyObjectFunctions defaultFunctions = {
         mongoReplyCreateFromBytes,
-        mongoReplyFree
+        mongoReplyFree,
+        mongoReplyCreateNoCopy
 };
 
+static mongoReaderSeg *__mongoReaderSegCreate(size_t cap) {
+    mongoReaderSeg *seg;
+
+    seg = mongo_malloc(sizeof(*seg));
+    if (seg == NULL)
+        return NULL;
+    seg->next = NULL;
+    seg->buf = sdsnewcap(cap);
+    if (seg->buf == NULL) {
+        mongo_free(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+static void __mongoReaderSegFree(mongoReaderSeg *seg) {
+    sdsfree(seg->buf);
+    mongo_free(seg);
+}
+
+/* Drop every segment, buffered data included. */
+static void __mongoReaderClear(mongoReader *r) {
+    mongoReaderSeg *seg;
+
+    while ((seg = r->head) != NULL) {
+        r->head = seg->next;
+        __mongoReaderSegFree(seg);
+    }
+    r->tail = NULL;
+    r->pos = r->len = 0;
+}
+
 static void __mongoReaderSetError(mongoReader *r, int type, const char *str) {
     size_t len;
 
@@ -29,11 +64,7 @@ static void __mongoReaderSetError(mongoReader *r, int type, const char *str) {
     }
 
     /* Clear input buffer on errors. */
-    if (r->buf != NULL) {
-        sdsfree(r->buf);
-        r->buf = NULL;
-        r->pos = r->len = 0;
-    }
+    __mongoReaderClear(r);
 
     /* Set error. */
     r->err = type;
@@ -54,64 +85,299 @@ mongoReader *mongoReaderCreate(void) {
 mongoReader *mongoReaderCreateWithFunctions(mongoReplyObjectFunctions *fn) {
     mongoReader *r;
 
-    r = calloc(sizeof(mongoReader),1);
+    r = mongo_calloc(sizeof(mongoReader),1);
     if (r == NULL)
         return NULL;
 
     r->err = 0;
     r->errstr[0] = '\0';
     r->fn = fn;
-    r->buf = sdsempty();
     r->maxbuf = MONGO_READER_MAX_BUF;
-    if (r->buf == NULL) {
-        free(r);
-        return NULL;
-    }
-
     return r;
 }
 
 void mongoReaderFree(mongoReader *r) {
     if (r->reply != NULL && r->fn && r->fn->freeObject)
         r->fn->freeObject(r->reply);
-    if (r->buf != NULL)
-        sdsfree(r->buf);
-    free(r);
+    __mongoReaderClear(r);
+    mongoCompressorFree(r->decompressor);
+    mongo_free(r);
 }
 
-int mongoReaderFeed(mongoReader *r, const char *buf, size_t len) {
-    sds newbuf;
+/* Copy n unread bytes starting at the cursor into dst, across segments. */
+static void __mongoReaderPeek(mongoReader *r, char *dst, size_t n) {
+    mongoReaderSeg *seg = r->head;
+    size_t pos = r->pos, chunk;
+
+    while (n > 0) {
+        chunk = sdslen(seg->buf) - pos;
+        if (chunk > n) chunk = n;
+        memcpy(dst,seg->buf+pos,chunk);
+        dst += chunk;
+        n -= chunk;
+        seg = seg->next;
+        pos = 0;
+    }
+}
+
+/* Move the cursor n bytes forward and free the segments left behind. The
+ * tail segment is kept for reuse. */
+static void __mongoReaderConsume(mongoReader *r, size_t n) {
+    mongoReaderSeg *seg;
+
+    r->len -= n;
+    while (r->head != r->tail && r->pos + n >= sdslen(r->head->buf)) {
+        n -= sdslen(r->head->buf) - r->pos;
+        seg = r->head;
+        r->head = seg->next;
+        r->pos = 0;
+        __mongoReaderSegFree(seg);
+    }
+    r->pos += n;
+}
+
+/* Length of the packet at the cursor, which must have its header buffered.
+ * Returns 0 and sets an error when the length is bogus. */
+static size_t __mongoReaderPacketLen(mongoReader *r) {
+    char hdr[4];
+    int32_t pktlen;
+
+    if (r->pktlen == 0) {
+        __mongoReaderPeek(r,hdr,sizeof(hdr));
+        pktlen = (int32_t)load32le(hdr);
+        if (pktlen < 16 || pktlen > MONGO_MAX_MSG_SIZE) {
+            __mongoReaderSetError(r,MONGO_ERR_PROTOCOL,"Invalid packet length");
+            return 0;
+        }
+        r->pktlen = (size_t)pktlen;
+    }
+    return r->pktlen;
+}
+
+/* Return the writable tail of the read buffer so that the caller can read(2)
+ * straight into it, and store its size in *avail. Call mongoReaderCommit
+ * with the number of bytes actually written.
+ *
+ * When the packet at the cursor is known not to fit in the room left, its
+ * buffered head is moved once into a segment that holds the whole packet,
+ * so a large reply is allocated once at its exact size and stays contiguous.
+ * Otherwise a full tail just gets a fresh segment chained after it.
+ *
+ * Returns NULL when the reader is in an erroneous state. */
+char *mongoReaderReserve(mongoReader *r, size_t *avail) {
+    mongoReaderSeg *seg;
+    size_t room, unread, need = 0;
 
     /* Return early when this reader is in an erroneous state. */
     if (r->err)
-        return MONGO_ERR;
+        return NULL;
 
-    /* Copy the provided buffer. */
-    if (buf != NULL && len >= 1) {
+    if (r->len == 0 && r->tail != NULL) {
         /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf) {
-            sdsfree(r->buf);
-            r->buf = sdsempty();
+        if (r->maxbuf != 0 &&
+            sdslen(r->tail->buf) + sdsavail(r->tail->buf) > r->maxbuf) {
+            __mongoReaderClear(r);
+        } else {
+            sdsclear(r->tail->buf);
             r->pos = 0;
-
-            /* r->buf should not be NULL since we just free'd a larger one. */
-            assert(r->buf != NULL);
         }
+    }
 
-        newbuf = sdscatlen(r->buf,buf,len);
-        if (newbuf == NULL) {
+    if (r->len >= 4) {
+        if (__mongoReaderPacketLen(r) == 0)
+            return NULL;
+        if (r->pktlen > r->len)
+            need = r->pktlen - r->len;
+    }
+
+    room = r->tail ? sdsavail(r->tail->buf) : 0;
+    if (need > 0 && room < need) {
+        unread = r->len;
+        seg = __mongoReaderSegCreate(r->pktlen > MONGO_READER_CHUNK ?
+                                     r->pktlen : MONGO_READER_CHUNK);
+        if (seg == NULL) {
             __mongoReaderSetErrorOOM(r);
-            return MONGO_ERR;
+            return NULL;
         }
+        __mongoReaderPeek(r,seg->buf,unread);
+        sdsIncrLen(seg->buf,(int)unread);
+        __mongoReaderClear(r);
+        r->head = r->tail = seg;
+        r->len = unread;
+    } else if (need == 0 && room < MONGO_READER_MIN_ROOM) {
+        seg = __mongoReaderSegCreate(MONGO_READER_CHUNK);
+        if (seg == NULL) {
+            __mongoReaderSetErrorOOM(r);
+            return NULL;
+        }
+        if (r->tail != NULL) {
+            r->tail->next = seg;
+        } else {
+            r->head = seg;
+            r->pos = 0;
+        }
+        r->tail = seg;
+    }
+
+    *avail = sdsavail(r->tail->buf);
+    return r->tail->buf + sdslen(r->tail->buf);
+}
+
+/* Account len bytes written into the room returned by mongoReaderReserve. */
+void mongoReaderCommit(mongoReader *r, size_t len) {
+    sdsIncrLen(r->tail->buf,(int)len);
+    r->len += len;
+}
+
+int mongoReaderFeed(mongoReader *r, const char *buf, size_t len) {
+    char *room;
+    size_t avail;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return MONGO_ERR;
 
-        r->buf = newbuf;
-        r->len = sdslen(r->buf);
+    /* Copy the provided buffer. */
+    while (buf != NULL && len > 0) {
+        room = mongoReaderReserve(r,&avail);
+        if (room == NULL)
+            return MONGO_ERR;
+        if (avail > len) avail = len;
+        memcpy(room,buf,avail);
+        mongoReaderCommit(r,avail);
+        buf += avail;
+        len -= avail;
     }
 
     return MONGO_OK;
 }
 
+/* Detach the current packet from the read buffer as an sds string of its own.
+ * When the packet starts its segment, fills at least half of its allocation
+ * and what follows it is shorter than the packet itself, the segment is
+ * handed over as is and only the rest gets copied. Otherwise the packet is
+ * copied out into an exact size string, so that a small reply doesn't keep
+ * a whole read chunk alive. */
+static sds __mongoReaderTakePacket(mongoReader *r) {
+    mongoReaderSeg *seg = r->head;
+    sds pkt;
+    size_t rest;
+
+    if (r->pos == 0 && sdslen(seg->buf) >= r->pktlen &&
+        r->pktlen >= sdsAllocSize(seg->buf) / 2 &&
+        (rest = sdslen(seg->buf) - r->pktlen) < r->pktlen)
+    {
+        pkt = seg->buf;
+        if (rest == 0) {
+            r->head = seg->next;
+            if (r->head == NULL) r->tail = NULL;
+            mongo_free(seg);
+        } else {
+            seg->buf = sdsnewlen(pkt+r->pktlen,rest);
+            if (seg->buf == NULL) {
+                seg->buf = pkt;
+                return NULL;
+            }
+            sdsIncrLen(pkt,-(int)rest);
+        }
+        r->len -= r->pktlen;
+    } else {
+        pkt = sdsnewcap(r->pktlen);
+        if (pkt == NULL)
+            return NULL;
+        __mongoReaderPeek(r,pkt,r->pktlen);
+        sdsIncrLen(pkt,(int)r->pktlen);
+        __mongoReaderConsume(r,r->pktlen);
+    }
+    return pkt;
+}
+
+/*
+ * struct OP_COMPRESSED {
+ *     MsgHeader header;          // standard message header
+ *     int32     originalOpcode;  // opcode of the wrapped message
+ *     int32     uncompressedSize; // size of the wrapped message without its header
+ *     uint8     compressorId;    // compressor that compressed the message
+ *     char*     compressedMessage;
+ * }
+ *
+ * Rebuild the packet wrapped in the compressed packet pkt as an sds string.
+ * The decompressor is kept in the reader, since the replies on a connection
+ * all use the same one. Sets an error and returns NULL on failure.
+ */
+static sds __mongoReaderUncompress(mongoReader *r, char *pkt) {
+    int32_t opCode, size;
+    uint8_t id;
+    sds out;
+
+    if (r->pktlen < 25) goto invalid;
+    opCode = (int32_t)load32le(pkt+16);
+    size = (int32_t)load32le(pkt+20);
+    id = (uint8_t)pkt[24];
+    if (size < 0 || size > MONGO_MAX_MSG_SIZE - 16) goto invalid;
+
+    if (r->decompressor == NULL || mongoCompressorId(r->decompressor) != id) {
+        mongoCompressorFree(r->decompressor);
+        r->decompressor = mongoCompressorCreate(id, MONGO_COMPRESS_LEVEL_DEFAULT);
+        if (r->decompressor == NULL) {
+            __mongoReaderSetError(r,MONGO_ERR_PROTOCOL,"Unsupported compressor");
+            return NULL;
+        }
+    }
+    out = sdsnewcap(16 + (size_t)size);
+    if (out == NULL) {
+        __mongoReaderSetErrorOOM(r);
+        return NULL;
+    }
+    mongoSnpack(out, 0, 16, "<iiii", 16 + size, (int32_t)load32le(pkt+4),
+                (int32_t)load32le(pkt+8), opCode);
+    if (mongoDecompress(r->decompressor, pkt+25, r->pktlen-25, out+16,
+                        (size_t)size) != MONGO_OK) {
+        sdsfree(out);
+        goto invalid;
+    }
+    sdsIncrLen(out, 16 + size);
+    return out;
+
+invalid:
+    __mongoReaderSetError(r,MONGO_ERR_PROTOCOL,"Invalid compressed packet");
+    return NULL;
+}
+
+/* Build the reply of an OP_COMPRESSED packet. */
+static void __mongoReaderCreateCompressed(mongoReader *r) {
+    sds tmp = NULL, pkt;
+    char *src;
+
+    if (sdslen(r->head->buf) - r->pos >= r->pktlen) {
+        src = r->head->buf + r->pos;
+    } else {
+        tmp = sdsnewcap(r->pktlen);
+        if (tmp == NULL) {
+            __mongoReaderSetErrorOOM(r);
+            return;
+        }
+        __mongoReaderPeek(r,tmp,r->pktlen);
+        src = tmp;
+    }
+    pkt = __mongoReaderUncompress(r, src);
+    sdsfree(tmp);
+    if (pkt == NULL)
+        return;
+    __mongoReaderConsume(r,r->pktlen);
+
+    if (r->zerocopy && r->fn->createReplyNoCopy) {
+        r->reply = r->fn->createReplyNoCopy(pkt, sdslen(pkt));
+    } else {
+        r->reply = r->fn->createReply(pkt, sdslen(pkt));
+        sdsfree(pkt);
+    }
+}
+
 int mongoReaderGetReply(mongoReader *r, void **reply) {
+    char hdr[16];
+    sds pkt;
+
     /* Default target pointer to NULL. */
     if (reply != NULL)
         *reply = NULL;
@@ -120,30 +386,47 @@ int mongoReaderGetReply(mongoReader *r, void **reply) {
     if (r->err)
         return MONGO_ERR;
 
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
+    /* Wait for a whole packet. */
+    if (r->len < 4)
         return MONGO_OK;
-    if (r->len - r->pos < 4)
-        return MONGO_OK;
-    if (r->pktlen == 0) r->pktlen = load32le(r->buf+r->pos);
-    if (r->len - r->pos < r->pktlen) return MONGO_OK;
+    if (__mongoReaderPacketLen(r) == 0)
+        return MONGO_ERR;
+    if (r->len < r->pktlen) return MONGO_OK;
+    __mongoReaderPeek(r,hdr,sizeof(hdr));
     /* create a reply object */
-    r->reply = r->fn->createReply(r->buf+r->pos, r->pktlen);
-
-    r->pos += r->pktlen;
+    if ((int32_t)load32le(hdr+12) == OP_COMPRESSED) {
+        __mongoReaderCreateCompressed(r);
+    } else if (r->zerocopy && r->fn->createReplyNoCopy) {
+        pkt = __mongoReaderTakePacket(r);
+        if (pkt == NULL) {
+            __mongoReaderSetErrorOOM(r);
+            return MONGO_ERR;
+        }
+        r->reply = r->fn->createReplyNoCopy(pkt, r->pktlen);
+    } else if (sdslen(r->head->buf) - r->pos >= r->pktlen) {
+        r->reply = r->fn->createReply(r->head->buf+r->pos, r->pktlen);
+        __mongoReaderConsume(r,r->pktlen);
+    } else {
+        /* The packet straddles segments, this is the only place where
+         * it has to be made contiguous. */
+        pkt = sdsnewcap(r->pktlen);
+        if (pkt == NULL) {
+            __mongoReaderSetErrorOOM(r);
+            return MONGO_ERR;
+        }
+        __mongoReaderPeek(r,pkt,r->pktlen);
+        r->reply = r->fn->createReply(pkt, r->pktlen);
+        sdsfree(pkt);
+        __mongoReaderConsume(r,r->pktlen);
+    }
     r->pktlen = 0;
+
+    if (r->reply == NULL && !r->err)
+        __mongoReaderSetError(r,MONGO_ERR_PROTOCOL,"Invalid reply packet");
     /* Return ASAP when an error occurred. */
     if (r->err)
         return MONGO_ERR;
 
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
-        r->len = sdslen(r->buf);
-    }
-
     /* Emit a reply when there is one. */
     if (reply != NULL)
         *reply = r->reply;
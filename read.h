@@ -1,6 +1,7 @@
 #ifndef __HIMONGO_READ_H
 #define __HIMONGO_READ_H
 #include <stdio.h> /* for size_t */
+#include "compress.h"
 
 #define MONGO_ERR -1
 #define MONGO_OK 0
@@ -16,6 +17,9 @@
 #define MONGO_ERR_OTHER 2 /* Everything else... */
 
 #define MONGO_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
+#define MONGO_READER_CHUNK (1024*16)  /* Size of a new read buffer segment. */
+#define MONGO_READER_MIN_ROOM 1024  /* Less room than this starts a new segment. */
+#define MONGO_MAX_MSG_SIZE (48*1000*1000)  /* maxMessageSizeBytes of mongod. */
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,17 +28,31 @@ extern "C" {
 typedef struct mongoReplyObjectFunctions {
     void *(*createReply)(char*, size_t);
     void (*freeObject)(void*);
+    /* Optional: like createReply, but takes ownership of the packet, which
+     * is passed as an sds string of exactly one packet. Used when the reader
+     * is in zero-copy mode. */
+    void *(*createReplyNoCopy)(char*, size_t);
 } mongoReplyObjectFunctions;
 
+/* The read buffer is a chain of segments in arrival order. Consumed segments
+ * are freed from the front, so unread bytes never have to be moved. */
+typedef struct mongoReaderSeg {
+    struct mongoReaderSeg *next;
+    char *buf; /* sds, sdslen() is the filled part */
+} mongoReaderSeg;
+
 typedef struct mongoReader {
     int err; /* Error flags, 0 when there is no error */
     char errstr[128]; /* String representation of error when applicable */
 
-    char *buf; /* Read buffer */
-    size_t pos; /* Buffer cursor */
-    size_t len; /* Buffer length */
+    mongoReaderSeg *head; /* Segment holding the cursor */
+    mongoReaderSeg *tail; /* Segment new data is appended to */
+    size_t pos; /* Buffer cursor, inside head */
+    size_t len; /* Unread bytes over all segments */
     size_t maxbuf; /* Max length of unused buffer */
     size_t pktlen; /* length of current packet. */
+    int zerocopy; /* Hand packet bytes over to the reply instead of copying */
+    mongoCompressor *decompressor; /* Kept for the next OP_COMPRESSED reply */
     void *reply; /* Temporary reply pointer */
 
     mongoReplyObjectFunctions *fn;
@@ -48,6 +66,8 @@ mongoReader *mongoReaderCreateWithFunctions(mongoReplyObjectFunctions *fn);
 
 void mongoReaderFree(mongoReader *r);
 int mongoReaderFeed(mongoReader *r, const char *buf, size_t len);
+char *mongoReaderReserve(mongoReader *r, size_t *avail);
+void mongoReaderCommit(mongoReader *r, size_t len);
 int mongoReaderGetReply(mongoReader *r, void **reply);
 
 #define mongoReaderSetPrivdata(_r, _p) (int)(((mongoReader*)(_r))->privdata = (_p))
@@ -34,9 +34,12 @@
  *
  * This file is used in order to change the SDS allocator at compile time.
  * Just define the following defines to what you want to use. Also add
- * the include of your alternate allocator if needed (not needed in order
- * to use the default libc allocator). */
+ * the include of your alternate allocator if needed. Himongo routes them
+ * through the allocators set with mongoSetAllocators(). */
 
-#define s_malloc malloc
-#define s_realloc realloc
-#define s_free free
+#include "alloc.h"
+
+#define s_malloc mongo_malloc
+#define s_calloc mongo_calloc
+#define s_realloc mongo_realloc
+#define s_free mongo_free
@@ -0,0 +1,83 @@
+#include "fmacros.h"
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+/* Nanoseconds on the monotonic clock, the time base of the stamps. */
+uint64_t mongoStatsNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Small values have a bucket each, larger ones go by their highest bit and
+ * the MONGO_HIST_SUB_BITS bits below it. */
+static int __mongoHistIndex(uint64_t v) {
+    int e;
+
+    if (v < MONGO_HIST_SUB)
+        return (int)v;
+    if (v > UINT32_MAX)
+        return MONGO_HIST_BUCKETS - 1;
+    e = 31 - __builtin_clz((uint32_t)v);
+    return (e - MONGO_HIST_SUB_BITS + 1) * MONGO_HIST_SUB +
+        (int)((v >> (e - MONGO_HIST_SUB_BITS)) & (MONGO_HIST_SUB - 1));
+}
+
+/* Largest value that falls into a bucket. */
+static uint64_t __mongoHistUpper(int idx) {
+    int e, sub;
+
+    if (idx < MONGO_HIST_SUB)
+        return (uint64_t)idx;
+    e = idx / MONGO_HIST_SUB + MONGO_HIST_SUB_BITS - 1;
+    sub = idx % MONGO_HIST_SUB;
+    return ((uint64_t)(MONGO_HIST_SUB + sub + 1) << (e - MONGO_HIST_SUB_BITS)) - 1;
+}
+
+void mongoHistogramRecord(mongoHistogram *h, uint64_t value) {
+    if (h->count == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[__mongoHistIndex(value)]++;
+}
+
+/* Add the values of src to dst, e.g. to sum up the connections of a pool. */
+void mongoHistogramMerge(mongoHistogram *dst, const mongoHistogram *src) {
+    if (src->count == 0)
+        return;
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (int i = 0; i < MONGO_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+/* The value below which the given percentage (0 to 100) of the recorded
+ * values fall, rounded up to the end of its bucket. 0 when empty. */
+uint64_t mongoHistogramPercentile(const mongoHistogram *h, double percentile) {
+    uint64_t rank, seen = 0, upper;
+
+    if (h->count == 0)
+        return 0;
+    if (percentile <= 0)
+        return h->min;
+    rank = percentile >= 100 ? h->count : (uint64_t)(percentile / 100 * (double)h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < MONGO_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            upper = __mongoHistUpper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,77 @@
+#ifndef __HIMONGO_STATS_H
+#define __HIMONGO_STATS_H
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Log-linear latency histogram in microseconds, in the spirit of HDR
+ * histograms: every power of two is split into 8 buckets, so a value is
+ * known within 12.5%. Values of 2^32 us (about 71 minutes) and more land
+ * in the last bucket. */
+#define MONGO_HIST_SUB_BITS 3
+#define MONGO_HIST_SUB (1 << MONGO_HIST_SUB_BITS)
+#define MONGO_HIST_BUCKETS ((32 - MONGO_HIST_SUB_BITS + 1) * MONGO_HIST_SUB)
+
+typedef struct mongoHistogram {
+    uint64_t count;
+    uint64_t sum; /* of all recorded values, for the mean */
+    uint64_t min, max;
+    uint32_t buckets[MONGO_HIST_BUCKETS];
+} mongoHistogram;
+
+/* Opcodes that get a latency histogram of their own. OP_MSG requests
+ * answered by the server and the legacy opcodes with a reply have one,
+ * the rest share the last. */
+#define MONGO_STATS_OP_QUERY 0
+#define MONGO_STATS_OP_GET_MORE 1
+#define MONGO_STATS_OP_MSG 2
+#define MONGO_STATS_OP_OTHER 3
+#define MONGO_STATS_OPS 4
+
+/* Counters of a context since it was created or last reset. The latency of
+ * a request runs from the moment it is queued until its reply is parsed,
+ * matching the reply's responseTo with the request id. */
+typedef struct mongoStats {
+    uint64_t bytes_out; /* written to the socket */
+    uint64_t bytes_in; /* read from the socket */
+    uint64_t msgs_out; /* messages queued */
+    uint64_t replies_in; /* replies parsed */
+    uint64_t errors; /* errors set on the context */
+    size_t reader_hwm; /* most unparsed bytes the reader held */
+    mongoHistogram latency[MONGO_STATS_OPS];
+} mongoStats;
+
+/* Requests waiting for their reply are remembered in a hash table keyed by
+ * request id, with room for MONGO_STATS_STAMPS of them at first. It doubles
+ * whenever it gets half full, so every request in flight is timed however
+ * many there are. */
+#define MONGO_STATS_STAMPS 256
+
+typedef struct mongoStamp {
+    int32_t req_id;
+    int32_t opCode;
+    int16_t op; /* MONGO_STATS_OP_*, -1 when the slot is free */
+    int16_t cmd; /* the reply carries an ok field */
+    uint64_t t; /* mongoStatsNow() when it was queued */
+} mongoStamp;
+
+uint64_t mongoStatsNow(void);
+
+void mongoHistogramRecord(mongoHistogram *h, uint64_t value);
+void mongoHistogramMerge(mongoHistogram *dst, const mongoHistogram *src);
+uint64_t mongoHistogramPercentile(const mongoHistogram *h, double percentile);
+
+static inline void mongoStatsRead(mongoStats *s, size_t nread, size_t buffered) {
+    s->bytes_in += nread;
+    if (buffered > s->reader_hwm)
+        s->reader_hwm = buffered;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
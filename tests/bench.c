@@ -0,0 +1,407 @@
+/*
+ * End-to-end throughput and latency benchmark for himongo.
+ *
+ * Scenarios:
+ *     get       sync point reads, one findOne per round trip
+ *     pipeline  async point reads with a fixed number of queries in flight
+ *     insert    sync bulk inserts of fixed size documents
+ *     scan      exhaust cursor scans, one op per document
+ *
+ * Every scenario reports ops/s, MB/s of document payload moved and the
+ * p50/p99/p999 latency of a single op. The reads expect the collection to
+ * be populated, mock_server does that on its own.
+ *
+ * usage: himongo-bench [-h host] [-p port] [-s unix socket] [-t tests]
+ *                      [-n ops] [-P depth] [-d doc size] [-k docs per insert]
+ *                      [-M] [-z compressor]
+ *
+ * The scenarios run over TCP, and again over the unix socket when -s is
+ * given. -M sends OP_MSG where the library can, -z compresses requests
+ * with noop, zlib or zstd.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ae.h"
+#include "../adapters/ae.h"
+#include "../himongo.h"
+
+#define BENCH_DB (char *)"bench"
+#define BENCH_COL (char *)"docs"
+#define BENCH_INSERT_COL (char *)"inserts"
+
+static struct config {
+    const char *host;
+    int port;
+    const char *path;
+    const char *tests;
+    int requests;
+    int depth;
+    int docsize;
+    int bulk;
+    int opmsg;
+    int compressor;
+} config;
+
+typedef struct benchResult {
+    uint64_t *lat; /* Latency of every op in ns */
+    int nr;
+    uint64_t bytes;
+    uint64_t start;
+    uint64_t end;
+} benchResult;
+
+static uint64_t nstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void die(const char *what, const char *errstr) {
+    fprintf(stderr, "%s: %s\n", what, errstr ? errstr : "unknown error");
+    exit(1);
+}
+
+static void resultInit(benchResult *r, int nr) {
+    r->lat = malloc(sizeof(uint64_t) * (size_t)nr);
+    if (r->lat == NULL)
+        die("bench", "out of memory");
+    r->nr = 0;
+    r->bytes = 0;
+    r->start = nstime();
+    r->end = r->start;
+}
+
+static int cmpLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(benchResult *r, double p) {
+    int i = (int)(p * r->nr);
+
+    if (i >= r->nr) i = r->nr - 1;
+    return r->lat[i] / 1000.0;
+}
+
+static void resultReport(benchResult *r, const char *name, const char *transport) {
+    double secs;
+
+    if (r->nr == 0) {
+        printf("%-8s %-4s no ops\n", name, transport);
+        free(r->lat);
+        return;
+    }
+    secs = (r->end - r->start) / 1e9;
+    qsort(r->lat, (size_t)r->nr, sizeof(uint64_t), cmpLatency);
+    printf("%-8s %-4s %8d ops %10.0f ops/s %8.2f MB/s   "
+           "p50 %8.1fus  p99 %8.1fus  p999 %8.1fus\n",
+           name, transport, r->nr, r->nr / secs, r->bytes / secs / (1024 * 1024),
+           percentile(r, 0.50), percentile(r, 0.99), percentile(r, 0.999));
+    free(r->lat);
+}
+
+static void setupContext(mongoContext *c) {
+    if (config.opmsg)
+        mongoEnableOpMsg(c);
+    if (config.compressor >= 0 &&
+        mongoEnableCompression(c, config.compressor, MONGO_COMPRESS_LEVEL_DEFAULT, 0) != MONGO_OK)
+        die("compression", c->err ? c->errstr : "refused by the server");
+}
+
+static mongoContext *connectSync(void) {
+    mongoContext *c;
+
+    c = config.path ? mongoConnectUnix(config.path)
+                    : mongoConnect(config.host, config.port);
+    if (c == NULL)
+        die("connect", "can't allocate mongo context");
+    if (c->err)
+        die("connect", c->errstr);
+    setupContext(c);
+    return c;
+}
+
+static void benchGet(benchResult *r) {
+    mongoContext *c = connectSync();
+    mongoReply *reply;
+    bson_t q;
+    uint64_t t;
+
+    for (int i = 0; i < config.requests; i++) {
+        bson_init(&q);
+        BSON_APPEND_INT32(&q, "_id", i);
+        t = nstime();
+        reply = mongoQuery(c, 0, BENCH_DB, BENCH_COL, 0, -1, &q, NULL);
+        r->lat[r->nr++] = nstime() - t;
+        bson_destroy(&q);
+        if (reply == NULL)
+            die("get", c->errstr);
+        for (int j = 0; j < reply->numberReturned; j++)
+            r->bytes += reply->docs[j]->len;
+        freeReplyObject(reply);
+    }
+    r->end = nstime();
+    mongoFree(c);
+}
+
+static void benchInsert(benchResult *r) {
+    mongoContext *c = connectSync();
+    bson_t *docs = malloc(sizeof(bson_t) * (size_t)config.bulk);
+    bson_t cmd;
+    char *payload;
+    void *reply;
+    int64_t id = 0;
+    size_t plen;
+    uint64_t t;
+
+    /* _id and the framing take about 40 bytes, pad the rest. */
+    plen = config.docsize > 40 ? (size_t)config.docsize - 40 : 1;
+    payload = malloc(plen + 1);
+    if (docs == NULL || payload == NULL)
+        die("insert", "out of memory");
+    memset(payload, 'x', plen);
+    payload[plen] = '\0';
+
+    for (int i = 0; i < config.requests; i++) {
+        for (int j = 0; j < config.bulk; j++) {
+            bson_init(&docs[j]);
+            BSON_APPEND_INT64(&docs[j], "_id", id++);
+            BSON_APPEND_UTF8(&docs[j], "payload", payload);
+        }
+        t = nstime();
+        reply = mongoInsert(c, 0, BENCH_DB, BENCH_INSERT_COL, docs, config.bulk);
+        r->lat[r->nr++] = nstime() - t;
+        if (reply == NULL)
+            die("insert", c->errstr);
+        freeReplyObject(reply);
+        for (int j = 0; j < config.bulk; j++) {
+            r->bytes += docs[j].len;
+            bson_destroy(&docs[j]);
+        }
+    }
+    r->end = nstime();
+
+    /* Don't let the inserted documents pile up on the server. */
+    bson_init(&cmd);
+    BSON_APPEND_UTF8(&cmd, "drop", BENCH_INSERT_COL);
+    reply = mongoCommand(c, BENCH_DB, &cmd);
+    if (reply) freeReplyObject(reply);
+    bson_destroy(&cmd);
+    free(payload);
+    free(docs);
+    mongoFree(c);
+}
+
+static void benchScan(benchResult *r) {
+    mongoContext *c = connectSync();
+    mongoCursor *cur;
+    bson_t *doc;
+    uint64_t t;
+    int before;
+
+    while (r->nr < config.requests) {
+        before = r->nr;
+        cur = mongoCursorCreate(c, BENCH_DB, BENCH_COL, NULL, NULL, 0, MONGO_CURSOR_EXHAUST);
+        if (cur == NULL)
+            die("scan", c->errstr);
+        t = nstime();
+        while (r->nr < config.requests && (doc = mongoCursorNext(cur)) != NULL) {
+            uint64_t now = nstime();
+
+            r->lat[r->nr++] = now - t;
+            r->bytes += doc->len;
+            t = now;
+        }
+        if (cur->err)
+            die("scan", cur->errstr);
+        mongoCursorFree(cur);
+        /* An empty collection, or a scan cut short that left the exhaust
+         * stream on the wire. */
+        if (r->nr == before || c->err)
+            break;
+    }
+    r->end = nstime();
+    mongoFree(c);
+}
+
+/* The pipeline keeps config.depth queries in flight, slot i remembers when
+ * the query it carries was sent. */
+static struct pipelineState {
+    aeEventLoop *el;
+    benchResult *r;
+    uint64_t *sent;
+    int issued;
+    int done;
+} pl;
+
+static void pipelineSend(mongoAsyncContext *ac, int slot);
+
+static void pipelineCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    mongoReply *reply = r;
+    int slot = (int)(intptr_t)privdata;
+
+    /* The context is going away, pipelineDisconnect reports why. */
+    if (reply == NULL)
+        return;
+    pl.r->lat[pl.r->nr++] = nstime() - pl.sent[slot];
+    for (int j = 0; j < reply->numberReturned; j++)
+        pl.r->bytes += reply->docs[j]->len;
+    if (++pl.done == config.requests) {
+        pl.r->end = nstime();
+        mongoAsyncDisconnect(ac);
+        return;
+    }
+    if (pl.issued < config.requests)
+        pipelineSend(ac, slot);
+}
+
+static void pipelineSend(mongoAsyncContext *ac, int slot) {
+    bson_t q;
+
+    bson_init(&q);
+    BSON_APPEND_INT32(&q, "_id", pl.issued++);
+    pl.sent[slot] = nstime();
+    if (mongoAsyncQuery(ac, pipelineCallback, (void *)(intptr_t)slot, 0,
+                        BENCH_DB, BENCH_COL, 0, -1, &q, NULL) != MONGO_OK)
+        die("pipeline", ac->errstr);
+    bson_destroy(&q);
+}
+
+static void pipelineConnect(const mongoAsyncContext *ac, int status) {
+    if (status != MONGO_OK) {
+        fprintf(stderr, "pipeline: %s\n", ac->errstr);
+        aeStop(pl.el);
+    }
+}
+
+static void pipelineDisconnect(const mongoAsyncContext *ac, int status) {
+    if (status != MONGO_OK)
+        fprintf(stderr, "pipeline: %s\n", ac->errstr);
+    aeStop(pl.el);
+}
+
+static void benchPipeline(benchResult *r) {
+    mongoAsyncContext *ac;
+
+    memset(&pl, 0, sizeof(pl));
+    pl.r = r;
+    pl.sent = calloc((size_t)config.depth, sizeof(uint64_t));
+    pl.el = aeCreateEventLoop(1024, true);
+    if (pl.sent == NULL || pl.el == NULL)
+        die("pipeline", "out of memory");
+
+    ac = config.path ? mongoAsyncConnectUnix(config.path)
+                     : mongoAsyncConnect(config.host, config.port);
+    if (ac == NULL)
+        die("pipeline", "can't allocate mongo context");
+    if (ac->err)
+        die("pipeline", ac->errstr);
+    setupContext(&ac->c);
+    mongoAeAttach(pl.el, ac);
+    mongoAsyncSetConnectCallback(ac, pipelineConnect);
+    mongoAsyncSetDisconnectCallback(ac, pipelineDisconnect);
+
+    for (int i = 0; i < config.depth && pl.issued < config.requests; i++)
+        pipelineSend(ac, i);
+    aeMain(pl.el);
+    if (pl.done != config.requests)
+        die("pipeline", "connection lost before all replies arrived");
+
+    aeDeleteEventLoop(pl.el);
+    free(pl.sent);
+}
+
+static int wanted(const char *name) {
+    const char *p = config.tests;
+    size_t len = strlen(name);
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == config.tests || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
+
+static void runAll(const char *transport) {
+    static const struct {
+        const char *name;
+        void (*fn)(benchResult *r);
+    } scenarios[] = {
+        {"get", benchGet},
+        {"pipeline", benchPipeline},
+        {"insert", benchInsert},
+        {"scan", benchScan},
+    };
+    benchResult r;
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (!wanted(scenarios[i].name))
+            continue;
+        resultInit(&r, config.requests);
+        scenarios[i].fn(&r);
+        resultReport(&r, scenarios[i].name, transport);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-h host] [-p port] [-s unix socket] [-t tests] [-n ops]\n"
+        "          [-P depth] [-d doc size] [-k docs per insert] [-M] [-z compressor]\n"
+        "tests: get,pipeline,insert,scan (default all)\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *path;
+    int opt;
+
+    config.host = "127.0.0.1";
+    config.port = 27017;
+    config.path = NULL;
+    config.tests = "get,pipeline,insert,scan";
+    config.requests = 100000;
+    config.depth = 16;
+    config.docsize = 256;
+    config.bulk = 10;
+    config.opmsg = 0;
+    config.compressor = -1;
+
+    while ((opt = getopt(argc, argv, "h:p:s:t:n:P:d:k:Mz:")) != -1) {
+        switch (opt) {
+        case 'h': config.host = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 's': config.path = optarg; break;
+        case 't': config.tests = optarg; break;
+        case 'n': config.requests = atoi(optarg); break;
+        case 'P': config.depth = atoi(optarg); break;
+        case 'd': config.docsize = atoi(optarg); break;
+        case 'k': config.bulk = atoi(optarg); break;
+        case 'M': config.opmsg = 1; break;
+        case 'z':
+            if (!strcmp(optarg, "noop")) config.compressor = MONGO_COMPRESSOR_NOOP;
+            else if (!strcmp(optarg, "zlib")) config.compressor = MONGO_COMPRESSOR_ZLIB;
+            else if (!strcmp(optarg, "zstd")) config.compressor = MONGO_COMPRESSOR_ZSTD;
+            else usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.requests <= 0 || config.depth <= 0 || config.bulk <= 0)
+        usage(argv[0]);
+
+    path = config.path;
+    config.path = NULL;
+    runAll("tcp");
+    if (path) {
+        config.path = path;
+        runAll("unix");
+    }
+    return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * Microbenchmarks for the encode and decode hot paths: the pack/unpack
+ * format interpreters in utils.c, a whole OP_QUERY message, and turning
+ * OP_REPLY packets of 1 doc, 101 docs and a 16MB batch into replies through
+ * mongoReaderGetReply (copying and zero-copy) and mongoReplyCreateFromBytes.
+ *
+ * Every case is run until it has taken at least the time given with -t
+ * (milliseconds, 200 by default) and reports ns/op. When built with
+ * MICROBENCH_COUNT_ALLOCS and linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, as `make himongo-microbench`
+ * does with GNU ld, it also reports heap allocations and bytes per op.
+ *
+ * usage: himongo-microbench [-t ms] [filter]
+ *
+ * Only the cases whose name contains filter are run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../himongo.h"
+#include "../utils.h"
+
+static uint64_t nr_allocs;
+static uint64_t alloc_bytes;
+
+#ifdef MICROBENCH_COUNT_ALLOCS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    nr_allocs++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    nr_allocs++;
+    alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    nr_allocs++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+static uint64_t nstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* A case runs fn(arg) n times and may keep state in arg across calls. */
+typedef struct benchCase {
+    const char *name;
+    void (*fn)(void *arg, long n);
+    void *arg;
+} benchCase;
+
+static void runCase(benchCase *bc, uint64_t mintime) {
+    uint64_t start, elapsed, allocs, bytes;
+    long n = 1;
+
+    /* Warm up, then grow n until a run takes long enough to be measured. */
+    bc->fn(bc->arg, 1);
+    for (;;) {
+        allocs = nr_allocs;
+        bytes = alloc_bytes;
+        start = nstime();
+        bc->fn(bc->arg, n);
+        elapsed = nstime() - start;
+        allocs = nr_allocs - allocs;
+        bytes = alloc_bytes - bytes;
+        if (elapsed >= mintime || n >= (1L << 30))
+            break;
+        n = elapsed ? (long)(n * 1.2 * mintime / elapsed) + 1 : n * 100;
+    }
+#ifdef MICROBENCH_COUNT_ALLOCS
+    printf("%-28s %10ld ops %12.1f ns/op %8.1f allocs/op %12.0f B/op\n", bc->name, n,
+           (double)elapsed / n, (double)allocs / n, (double)bytes / n);
+#else
+    printf("%-28s %10ld ops %12.1f ns/op\n", bc->name, n, (double)elapsed / n);
+    (void)allocs; (void)bytes;
+#endif
+}
+
+/* ---------------------------- pack / unpack ------------------------------ */
+
+static void benchSdscatpack(void *arg, long n) {
+    sds s = sdsempty();
+
+    (void)arg;
+    for (long i = 0; i < n; i++) {
+        sdsclear(s);
+        s = mongoSdscatpack(s, "<iiii", 64, (int32_t)i, 0, OP_QUERY);
+        s = mongoSdscatpack(s, "<issSii", 0, "bench", ".", "docs", 0, -1);
+    }
+    sdsfree(s);
+}
+
+static void benchSnpack(void *arg, long n) {
+    char *buf = arg;
+
+    for (long i = 0; i < n; i++)
+        mongoSnpack(buf, 0, 64, "<iiiiiib", 64, (int32_t)i, 0, OP_COMPRESSED,
+                    OP_QUERY, 48, MONGO_COMPRESSOR_NOOP);
+}
+
+static void benchSnunpack(void *arg, long n) {
+    char *buf = arg;
+    int32_t len, id, to, op, flags, from, nr;
+    int64_t cursor;
+
+    for (long i = 0; i < n; i++)
+        mongoSnunpack(buf, 0, 36, "<iiiiiqii", &len, &id, &to, &op, &flags,
+                      &cursor, &from, &nr);
+}
+
+static void benchAppendQuery(void *arg, long n) {
+    mongoContext *c = arg;
+    bson_t q;
+
+    bson_init(&q);
+    BSON_APPEND_INT32(&q, "_id", 42);
+    for (long i = 0; i < n; i++) {
+        sdsclear(c->obuf);
+        c->opos = 0;
+        mongoAppendQueryMsg(c, 0, (char *)"bench", (char *)"docs", 0, -1, &q, NULL);
+    }
+    bson_destroy(&q);
+}
+
+/* ------------------------------- replies --------------------------------- */
+
+typedef struct replyShape {
+    const char *name;
+    int nr_docs;
+    size_t docsize;
+    char *pkt; /* OP_REPLY packet */
+    size_t len;
+    mongoReader *reader;
+} replyShape;
+
+static replyShape shapes[] = {
+    {"1doc", 1, 100, NULL, 0, NULL},
+    {"101docs", 101, 100, NULL, 0, NULL},
+    {"16MB", 1024, 16 * 1024, NULL, 0, NULL},
+};
+
+/* Build an OP_REPLY with nr_docs documents of about docsize bytes each,
+ * {_id: i, name: "doc-i", payload: "xxx..."}. */
+static void buildReply(replyShape *rs) {
+    char name[32], *payload;
+    sds pkt;
+    bson_t doc;
+
+    payload = malloc(rs->docsize);
+    memset(payload, 'x', rs->docsize - 1);
+    payload[rs->docsize - 1] = '\0';
+    if (rs->docsize > 64)
+        payload[rs->docsize - 64] = '\0';
+
+    pkt = mongoSdscatpack(sdsempty(), "<iiiiiqii", 0, 1, 1, OP_REPLY, 0,
+                          (int64_t)0, 0, rs->nr_docs);
+    for (int i = 0; i < rs->nr_docs; i++) {
+        snprintf(name, sizeof(name), "doc-%d", i);
+        bson_init(&doc);
+        BSON_APPEND_INT32(&doc, "_id", i);
+        BSON_APPEND_UTF8(&doc, "name", name);
+        BSON_APPEND_UTF8(&doc, "payload", payload);
+        pkt = sdscatlen(pkt, bson_get_data(&doc), doc.len);
+        bson_destroy(&doc);
+    }
+    mongoSnpack(pkt, 0, 4, "<i", (int32_t)sdslen(pkt));
+    rs->pkt = pkt;
+    rs->len = sdslen(pkt);
+    free(payload);
+}
+
+static void feedAndGet(mongoReader *r, replyShape *rs, long n) {
+    void *reply;
+
+    for (long i = 0; i < n; i++) {
+        if (mongoReaderFeed(r, rs->pkt, rs->len) != MONGO_OK ||
+            mongoReaderGetReply(r, &reply) != MONGO_OK || reply == NULL) {
+            fprintf(stderr, "%s: %s\n", rs->name, r->errstr);
+            exit(1);
+        }
+        r->fn->freeObject(reply);
+    }
+}
+
+static void benchReaderCopy(void *arg, long n) {
+    replyShape *rs = arg;
+
+    if (rs->reader == NULL)
+        rs->reader = mongoReaderCreate();
+    rs->reader->zerocopy = 0;
+    feedAndGet(rs->reader, rs, n);
+}
+
+static void benchReaderZeroCopy(void *arg, long n) {
+    replyShape *rs = arg;
+
+    if (rs->reader == NULL)
+        rs->reader = mongoReaderCreate();
+    rs->reader->zerocopy = 1;
+    feedAndGet(rs->reader, rs, n);
+}
+
+static void benchCreateFromBytes(void *arg, long n) {
+    replyShape *rs = arg;
+    void *reply;
+
+    for (long i = 0; i < n; i++) {
+        reply = mongoReplyCreateFromBytes(rs->pkt, rs->len);
+        if (reply == NULL) {
+            fprintf(stderr, "%s: can't create reply\n", rs->name);
+            exit(1);
+        }
+        mongoReplyFree(reply);
+    }
+}
+
+int main(int argc, char **argv) {
+    const size_t nr_shapes = sizeof(shapes) / sizeof(shapes[0]);
+    benchCase cases[4 + 3 * sizeof(shapes) / sizeof(shapes[0])];
+    char names[3 * sizeof(shapes) / sizeof(shapes[0])][64];
+    char packbuf[64], unpackbuf[36];
+    const char *filter = NULL;
+    uint64_t mintime = 200;
+    mongoContext *c;
+    size_t nr = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't': mintime = (uint64_t)atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t ms] [filter]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+    mintime *= 1000000;
+
+    mongoSnpack(unpackbuf, 0, sizeof(unpackbuf), "<iiiiiqii", 136, 7, 1, OP_REPLY,
+                0, (int64_t)1234567, 0, 1);
+    c = mongoConnectFd(-1);
+    if (c == NULL) {
+        fprintf(stderr, "Can't allocate mongo context\n");
+        return 1;
+    }
+
+    cases[nr++] = (benchCase){"sdscatpack/query", benchSdscatpack, NULL};
+    cases[nr++] = (benchCase){"snpack/compressed-header", benchSnpack, packbuf};
+    cases[nr++] = (benchCase){"snunpack/reply-header", benchSnunpack, unpackbuf};
+    cases[nr++] = (benchCase){"append/query", benchAppendQuery, c};
+    for (size_t i = 0; i < nr_shapes; i++) {
+        buildReply(&shapes[i]);
+        snprintf(names[3 * i], 64, "reader/%s", shapes[i].name);
+        snprintf(names[3 * i + 1], 64, "reader-zerocopy/%s", shapes[i].name);
+        snprintf(names[3 * i + 2], 64, "createFromBytes/%s", shapes[i].name);
+        cases[nr++] = (benchCase){names[3 * i], benchReaderCopy, &shapes[i]};
+        cases[nr++] = (benchCase){names[3 * i + 1], benchReaderZeroCopy, &shapes[i]};
+        cases[nr++] = (benchCase){names[3 * i + 2], benchCreateFromBytes, &shapes[i]};
+    }
+
+    for (size_t i = 0; i < nr; i++) {
+        if (filter && strstr(cases[i].name, filter) == NULL)
+            continue;
+        runCase(&cases[i], mintime);
+    }
+
+    for (size_t i = 0; i < nr_shapes; i++) {
+        if (shapes[i].reader)
+            mongoReaderFree(shapes[i].reader);
+        sdsfree(shapes[i].pkt);
+    }
+    mongoFree(c);
+    return 0;
+}
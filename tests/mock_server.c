@@ -0,0 +1,978 @@
+/*
+ * A mock mongod for tests and benchmarks, built on the ae event loop.
+ *
+ * It speaks enough of the wire protocol for the client: OP_QUERY (with the
+ * exhaust flag), OP_GET_MORE, OP_KILL_CURSORS, OP_INSERT, OP_MSG and
+ * OP_COMPRESSED requests; OP_UPDATE and OP_DELETE are read and ignored.
+ * Commands, sent either to "<db>.$cmd" or through OP_MSG, are isMaster/hello,
+ * ping, getlasterror, listCollections, insert, find, getMore, killCursors,
+ * drop and dropDatabase.
+ *
+ * Collections live in memory. A collection is created on first use with
+ * the number of generated documents given by -n, {_id: i, name: "doc-i"}.
+ * Queries ignore their filter and return the whole collection. Like mongod,
+ * inserts refuse documents with a top level field name starting with '$',
+ * which tests use to make single documents of a batch fail: the insert
+ * command reports them in writeErrors, OP_INSERT through getlasterror. An
+ * ordered insert stops at the first one.
+ *
+ * usage: mock_server [-p port] [-s unix socket] [-n docs] [-b batch size]
+ *                    [-l latency ms] [-F fault=N]...
+ *
+ * The server listens on 127.0.0.1:port, and on the unix socket as well when
+ * -s is given.
+ *
+ * Latency delays every reply by the given number of milliseconds, replies
+ * still go out in order. Faults are injected on every Nth request received
+ * by the server:
+ *     close=N    close the connection instead of answering
+ *     drop=N     don't answer at all
+ *     error=N    answer with a query failure / {ok: 0}
+ *     garbage=N  answer with a packet of invalid length
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "ae.h"
+#include "../himongo.h"
+#include "../utils.h"
+#include "../endianconv.h"
+
+#define MOCK_IOBUF_LEN (1024*16)
+#define MOCK_DEFAULT_BATCH 101
+
+typedef struct mockCollection {
+    char *ns; /* "db.col" */
+    bson_t **docs;
+    size_t nr_docs;
+    size_t cap;
+    struct mockCollection *next;
+} mockCollection;
+
+typedef struct mockCursor {
+    int64_t id;
+    mockCollection *col;
+    size_t pos; /* Next document to return */
+    struct mockCursor *next;
+} mockCursor;
+
+/* A reply held back by the latency setting. */
+typedef struct mockDelayed {
+    long long due; /* ms */
+    sds pkt;
+    struct mockDelayed *next;
+} mockDelayed;
+
+typedef struct mockClient {
+    int fd;
+    sds rbuf;
+    sds wbuf;
+    mockDelayed *dhead, *dtail;
+    long long timer; /* Time event flushing dhead, -1 when none */
+    char last_err[128]; /* Of the last legacy write, for getlasterror */
+} mockClient;
+
+static struct {
+    aeEventLoop *el;
+    int nr_docs;
+    int batch;
+    long long latency;
+    long fault_close, fault_drop, fault_error, fault_garbage;
+    long nr_requests;
+    int32_t req_id;
+    int64_t next_cursor;
+    mockCollection *cols;
+    mockCursor *cursors;
+    mongoCompressor *decompressor;
+} server;
+
+static long long mstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* -------------------------- In-memory collections ------------------------- */
+
+static void collectionAdd(mockCollection *col, const bson_t *doc) {
+    if (col->nr_docs == col->cap) {
+        col->cap = col->cap ? col->cap * 2 : 64;
+        col->docs = realloc(col->docs, col->cap * sizeof(bson_t *));
+    }
+    col->docs[col->nr_docs++] = bson_copy(doc);
+}
+
+static mockCollection *collectionLookup(const char *db, const char *name, int create) {
+    mockCollection *col;
+    char ns[MONGO_MAX_NS_LEN], dname[32];
+    bson_t doc;
+
+    snprintf(ns, sizeof(ns), "%s.%s", db, name);
+    for (col = server.cols; col != NULL; col = col->next) {
+        if (strcmp(col->ns, ns) == 0) return col;
+    }
+    if (!create) return NULL;
+
+    col = calloc(1, sizeof(*col));
+    col->ns = strdup(ns);
+    for (int i = 0; i < server.nr_docs; i++) {
+        snprintf(dname, sizeof(dname), "doc-%d", i);
+        bson_init(&doc);
+        BSON_APPEND_INT32(&doc, "_id", i);
+        BSON_APPEND_UTF8(&doc, "name", dname);
+        collectionAdd(col, &doc);
+        bson_destroy(&doc);
+    }
+    col->next = server.cols;
+    server.cols = col;
+    return col;
+}
+
+static void cursorFree(mockCursor *cur) {
+    mockCursor **pp;
+
+    for (pp = &server.cursors; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == cur) {
+            *pp = cur->next;
+            free(cur);
+            return;
+        }
+    }
+}
+
+/* Drop a collection, or every collection of db when name is NULL. */
+static void collectionDrop(const char *db, const char *name) {
+    mockCollection **pp = &server.cols, *col;
+    mockCursor *cur, *next;
+    size_t dblen = strlen(db);
+
+    while ((col = *pp) != NULL) {
+        if (strncmp(col->ns, db, dblen) != 0 || col->ns[dblen] != '.' ||
+            (name != NULL && strcmp(col->ns + dblen + 1, name) != 0)) {
+            pp = &col->next;
+            continue;
+        }
+        *pp = col->next;
+        for (cur = server.cursors; cur != NULL; cur = next) {
+            next = cur->next;
+            if (cur->col == col) cursorFree(cur);
+        }
+        for (size_t i = 0; i < col->nr_docs; i++) bson_destroy(col->docs[i]);
+        free(col->docs);
+        free(col->ns);
+        free(col);
+    }
+}
+
+static mockCursor *cursorLookup(int64_t id) {
+    mockCursor *cur;
+
+    for (cur = server.cursors; cur != NULL; cur = cur->next) {
+        if (cur->id == id) return cur;
+    }
+    return NULL;
+}
+
+/* Take the next batch of a cursor. Returns the cursor id to report, which
+ * is 0 once the cursor is exhausted and freed. */
+static int64_t cursorNextBatch(mockCursor *cur, int32_t batch, bson_t ***docs, int32_t *nr) {
+    size_t left = cur->col->nr_docs - cur->pos;
+    int64_t id = cur->id;
+
+    if (batch <= 0) batch = server.batch;
+    *nr = (int32_t)((size_t)batch < left ? (size_t)batch : left);
+    *docs = cur->col->docs + cur->pos;
+    cur->pos += (size_t)*nr;
+    if (cur->pos == cur->col->nr_docs) {
+        cursorFree(cur);
+        id = 0;
+    }
+    return id;
+}
+
+static mockCursor *cursorCreate(mockCollection *col) {
+    mockCursor *cur = calloc(1, sizeof(*cur));
+
+    cur->id = ++server.next_cursor;
+    cur->col = col;
+    cur->next = server.cursors;
+    server.cursors = cur;
+    return cur;
+}
+
+/* ------------------------------- Replies ---------------------------------- */
+
+static sds replyCreate(int32_t responseTo, int32_t flags, int64_t cursorID,
+                       int32_t from, bson_t **docs, int32_t nr)
+{
+    size_t len = 36;
+    sds pkt;
+
+    for (int32_t i = 0; i < nr; i++) len += docs[i]->len;
+    pkt = sdsMakeRoomFor(sdsempty(), len);
+    pkt = mongoSdscatpack(pkt, "<iiiiiqii", (int32_t)len, ++server.req_id, responseTo,
+                          OP_REPLY, flags, cursorID, from, nr);
+    for (int32_t i = 0; i < nr; i++) {
+        pkt = sdscatlen(pkt, bson_get_data(docs[i]), docs[i]->len);
+    }
+    return pkt;
+}
+
+static sds msgReplyCreate(int32_t responseTo, bson_t *body) {
+    sds pkt;
+
+    pkt = sdsMakeRoomFor(sdsempty(), 21 + body->len);
+    pkt = mongoSdscatpack(pkt, "<iiiiib", (int32_t)(21 + body->len), ++server.req_id,
+                          responseTo, OP_MSG, 0, MSG_SECTION_BODY);
+    return sdscatlen(pkt, bson_get_data(body), body->len);
+}
+
+static void clientWritable(aeEventLoop *el, int fd, void *privdata, int mask);
+static int clientFlushDelayed(aeEventLoop *el, long long id, void *privdata);
+
+static void clientQueue(mockClient *c, sds pkt) {
+    if (sdslen(c->wbuf) == 0) {
+        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, clientWritable, c);
+    }
+    c->wbuf = sdscatlen(c->wbuf, pkt, sdslen(pkt));
+    sdsfree(pkt);
+}
+
+/* Hand a reply to the client, right away or after the configured latency. */
+static void clientReply(mockClient *c, sds pkt) {
+    mockDelayed *d;
+
+    if (server.latency <= 0) {
+        clientQueue(c, pkt);
+        return;
+    }
+    d = malloc(sizeof(*d));
+    d->due = mstime() + server.latency;
+    d->pkt = pkt;
+    d->next = NULL;
+    if (c->dtail) c->dtail->next = d;
+    else c->dhead = d;
+    c->dtail = d;
+    if (c->timer == -1) {
+        c->timer = aeCreateTimeEvent(server.el, server.latency, clientFlushDelayed, c, NULL);
+    }
+}
+
+static int clientFlushDelayed(aeEventLoop *el, long long id, void *privdata) {
+    mockClient *c = privdata;
+    mockDelayed *d;
+    long long now = mstime();
+    AE_NOTUSED(el);
+    AE_NOTUSED(id);
+
+    while ((d = c->dhead) != NULL && d->due <= now) {
+        c->dhead = d->next;
+        if (c->dhead == NULL) c->dtail = NULL;
+        clientQueue(c, d->pkt);
+        free(d);
+    }
+    if (c->dhead == NULL) {
+        c->timer = -1;
+        return AE_NOMORE;
+    }
+    return (int)(c->dhead->due - now);
+}
+
+static void clientFree(mockClient *c) {
+    mockDelayed *d;
+
+    aeDeleteFileEvent(server.el, c->fd, AE_READABLE|AE_WRITABLE);
+    if (c->timer != -1) aeDeleteTimeEvent(server.el, c->timer);
+    while ((d = c->dhead) != NULL) {
+        c->dhead = d->next;
+        sdsfree(d->pkt);
+        free(d);
+    }
+    close(c->fd);
+    sdsfree(c->rbuf);
+    sdsfree(c->wbuf);
+    free(c);
+}
+
+/* ------------------------------- Commands --------------------------------- */
+
+static void appendBatch(bson_t *out, const char *key, bson_t **docs, int32_t nr) {
+    bson_t arr;
+    char idx[16];
+
+    bson_init(&arr);
+    for (int32_t i = 0; i < nr; i++) {
+        snprintf(idx, sizeof(idx), "%d", i);
+        BSON_APPEND_DOCUMENT(&arr, idx, docs[i]);
+    }
+    BSON_APPEND_ARRAY(out, key, &arr);
+    bson_destroy(&arr);
+}
+
+static void appendCursor(bson_t *out, int64_t id, const char *ns, const char *key,
+                         bson_t **docs, int32_t nr)
+{
+    bson_t cursor;
+
+    bson_init(&cursor);
+    BSON_APPEND_INT64(&cursor, "id", id);
+    BSON_APPEND_UTF8(&cursor, "ns", ns);
+    appendBatch(&cursor, key, docs, nr);
+    BSON_APPEND_DOCUMENT(out, "cursor", &cursor);
+    bson_destroy(&cursor);
+}
+
+static int32_t iterInt32(bson_iter_t *it) {
+    return BSON_ITER_HOLDS_NUMBER(it) ? (int32_t)bson_iter_as_int64(it) : 0;
+}
+
+/* Look a field of cmd up. */
+static int cmdFind(bson_t *cmd, const char *key, bson_iter_t *it) {
+    return bson_iter_init(it, cmd) && bson_iter_find(it, key);
+}
+
+/* The error inserting doc would give, NULL when it can be inserted. */
+static const char *docInvalid(const bson_t *doc, char *buf, size_t len) {
+    bson_iter_t it;
+
+    if (!bson_iter_init(&it, doc)) return "invalid document";
+    while (bson_iter_next(&it)) {
+        if (bson_iter_key(&it)[0] == '$') {
+            snprintf(buf, len, "Document can't have $ prefixed field names: %s",
+                     bson_iter_key(&it));
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+/* Progress of an insert command over its documents. */
+typedef struct mockInsert {
+    mockCollection *col;
+    int ordered;
+    int32_t index; /* of the next document */
+    int32_t n; /* documents inserted */
+    int32_t nr_errors;
+    int stopped;
+    bson_t errors; /* writeErrors array */
+} mockInsert;
+
+static void insertDoc(mockInsert *ins, const bson_t *doc) {
+    const char *err;
+    char buf[128], key[16];
+    bson_t entry;
+
+    if (ins->stopped) return;
+    if ((err = docInvalid(doc, buf, sizeof(buf))) == NULL) {
+        collectionAdd(ins->col, doc);
+        ins->n++;
+    } else {
+        bson_init(&entry);
+        BSON_APPEND_INT32(&entry, "index", ins->index);
+        BSON_APPEND_INT32(&entry, "code", 52);
+        BSON_APPEND_UTF8(&entry, "errmsg", err);
+        snprintf(key, sizeof(key), "%d", ins->nr_errors++);
+        BSON_APPEND_DOCUMENT(&ins->errors, key, &entry);
+        bson_destroy(&entry);
+        ins->stopped = ins->ordered;
+    }
+    ins->index++;
+}
+
+/* Insert the documents of an array field or a document sequence. */
+static void cmdInsertDocs(mockInsert *ins, bson_iter_t *arr, mongoDocSeq *seq) {
+    bson_iter_t child;
+    const uint8_t *data;
+    uint32_t len;
+    bson_t doc;
+
+    if (seq != NULL) {
+        for (int32_t i = 0; i < seq->nr_docs; i++) insertDoc(ins, seq->docs[i]);
+        return;
+    }
+    if (arr == NULL || !BSON_ITER_HOLDS_ARRAY(arr) || !bson_iter_recurse(arr, &child))
+        return;
+    while (bson_iter_next(&child)) {
+        if (!BSON_ITER_HOLDS_DOCUMENT(&child)) continue;
+        bson_iter_document(&child, &len, &data);
+        bson_init_static(&doc, data, len);
+        insertDoc(ins, &doc);
+    }
+}
+
+/*
+ * Run a command and build its reply document into out. seqs are the kind 1
+ * sections of an OP_MSG request.
+ */
+static void runCommand(mockClient *cl, const char *db, bson_t *cmd, mongoDocSeq *seqs,
+                       int32_t nr_seqs, bson_t *out)
+{
+    bson_iter_t it, arg, child;
+    const char *name, *col = NULL;
+    char ns[MONGO_MAX_NS_LEN], buf[128];
+    mockCollection *c;
+    mockCursor *cur;
+    mockInsert ins;
+    bson_t **docs, names, entry;
+    int32_t nr, batch = 0;
+    int64_t id;
+    size_t dblen = strlen(db);
+    int i;
+
+    bson_init(out);
+    if (!bson_iter_init(&it, cmd) || !bson_iter_next(&it)) {
+        BSON_APPEND_INT32(out, "ok", 0);
+        BSON_APPEND_UTF8(out, "errmsg", "empty command");
+        return;
+    }
+    name = bson_iter_key(&it);
+    if (BSON_ITER_HOLDS_UTF8(&it)) col = bson_iter_utf8(&it, NULL);
+    if (cmdFind(cmd, "batchSize", &arg)) batch = iterInt32(&arg);
+
+    if (!strcasecmp(name, "isMaster") || !strcmp(name, "hello")) {
+        BSON_APPEND_BOOL(out, "ismaster", true);
+        BSON_APPEND_INT32(out, "maxBsonObjectSize", 16*1024*1024);
+        BSON_APPEND_INT32(out, "maxMessageSizeBytes", MONGO_MAX_MSG_SIZE);
+        BSON_APPEND_INT32(out, "maxWriteBatchSize", 100000);
+        BSON_APPEND_INT32(out, "minWireVersion", 0);
+        BSON_APPEND_INT32(out, "maxWireVersion", 6);
+        /* Accept the offered compressors that the library can decompress. */
+        if (cmdFind(cmd, "compression", &arg) && BSON_ITER_HOLDS_ARRAY(&arg) &&
+            bson_iter_recurse(&arg, &child)) {
+            bson_init(&names);
+            for (i = 0; bson_iter_next(&child); ) {
+                if (!BSON_ITER_HOLDS_UTF8(&child)) continue;
+                for (int cid = 0; mongoCompressorName(cid) != NULL; cid++) {
+                    if (strcmp(mongoCompressorName(cid), bson_iter_utf8(&child, NULL)) ||
+                        !mongoCompressorSupported(cid))
+                        continue;
+                    snprintf(buf, sizeof(buf), "%d", i++);
+                    BSON_APPEND_UTF8(&names, buf, mongoCompressorName(cid));
+                }
+            }
+            BSON_APPEND_ARRAY(out, "compression", &names);
+            bson_destroy(&names);
+        }
+    } else if (!strcmp(name, "ping")) {
+        /* nothing to add */
+    } else if (!strcasecmp(name, "getlasterror")) {
+        BSON_APPEND_INT32(out, "n", 0);
+        if (cl->last_err[0]) {
+            BSON_APPEND_UTF8(out, "err", cl->last_err);
+            BSON_APPEND_INT32(out, "code", 52);
+        } else {
+            BSON_APPEND_NULL(out, "err");
+        }
+    } else if (!strcmp(name, "listCollections")) {
+        bson_init(&names);
+        i = 0;
+        for (c = server.cols; c != NULL; c = c->next) {
+            if (strncmp(c->ns, db, dblen) != 0 || c->ns[dblen] != '.') continue;
+            bson_init(&entry);
+            BSON_APPEND_UTF8(&entry, "name", c->ns + dblen + 1);
+            BSON_APPEND_UTF8(&entry, "type", "collection");
+            snprintf(buf, sizeof(buf), "%d", i++);
+            BSON_APPEND_DOCUMENT(&names, buf, &entry);
+            bson_destroy(&entry);
+        }
+        snprintf(ns, sizeof(ns), "%s.$cmd.listCollections", db);
+        bson_init(&entry);
+        BSON_APPEND_INT64(&entry, "id", 0);
+        BSON_APPEND_UTF8(&entry, "ns", ns);
+        BSON_APPEND_ARRAY(&entry, "firstBatch", &names);
+        BSON_APPEND_DOCUMENT(out, "cursor", &entry);
+        bson_destroy(&entry);
+        bson_destroy(&names);
+    } else if (!strcmp(name, "insert") && col != NULL) {
+        memset(&ins, 0, sizeof(ins));
+        ins.col = collectionLookup(db, col, 1);
+        ins.ordered = !cmdFind(cmd, "ordered", &arg) || bson_iter_as_bool(&arg);
+        bson_init(&ins.errors);
+        for (i = 0; i < nr_seqs; i++) {
+            if (!strcmp(seqs[i].identifier, "documents")) cmdInsertDocs(&ins, NULL, seqs+i);
+        }
+        if (cmdFind(cmd, "documents", &arg)) cmdInsertDocs(&ins, &arg, NULL);
+        BSON_APPEND_INT32(out, "n", ins.n);
+        if (ins.nr_errors) BSON_APPEND_ARRAY(out, "writeErrors", &ins.errors);
+        bson_destroy(&ins.errors);
+    } else if ((!strcmp(name, "update") || !strcmp(name, "delete")) && col != NULL) {
+        BSON_APPEND_INT32(out, "n", 0);
+    } else if (!strcmp(name, "find") && col != NULL) {
+        cur = cursorCreate(collectionLookup(db, col, 1));
+        snprintf(ns, sizeof(ns), "%s", cur->col->ns);
+        id = cursorNextBatch(cur, batch, &docs, &nr);
+        appendCursor(out, id, ns, "firstBatch", docs, nr);
+    } else if (!strcmp(name, "getMore")) {
+        cur = cursorLookup(bson_iter_as_int64(&it));
+        if (cur == NULL) {
+            BSON_APPEND_INT32(out, "ok", 0);
+            BSON_APPEND_UTF8(out, "errmsg", "cursor not found");
+            BSON_APPEND_INT32(out, "code", 43);
+            return;
+        }
+        snprintf(ns, sizeof(ns), "%s", cur->col->ns);
+        id = cursorNextBatch(cur, batch, &docs, &nr);
+        appendCursor(out, id, ns, "nextBatch", docs, nr);
+    } else if (!strcmp(name, "killCursors")) {
+        if (cmdFind(cmd, "cursors", &arg) && BSON_ITER_HOLDS_ARRAY(&arg) &&
+            bson_iter_recurse(&arg, &child)) {
+            while (bson_iter_next(&child)) {
+                if ((cur = cursorLookup(bson_iter_as_int64(&child))) != NULL) cursorFree(cur);
+            }
+        }
+    } else if (!strcmp(name, "drop") && col != NULL) {
+        collectionDrop(db, col);
+    } else if (!strcmp(name, "dropDatabase")) {
+        collectionDrop(db, NULL);
+    } else {
+        snprintf(buf, sizeof(buf), "no such command: '%s'", name);
+        BSON_APPEND_INT32(out, "ok", 0);
+        BSON_APPEND_UTF8(out, "errmsg", buf);
+        BSON_APPEND_INT32(out, "code", 59);
+        return;
+    }
+    BSON_APPEND_INT32(out, "ok", 1);
+}
+
+static bson_t *errorDoc(void) {
+    bson_t *doc = bson_new();
+
+    BSON_APPEND_UTF8(doc, "$err", "injected failure");
+    BSON_APPEND_INT32(doc, "code", 1);
+    BSON_APPEND_INT32(doc, "ok", 0);
+    return doc;
+}
+
+/* ------------------------------- Requests --------------------------------- */
+
+/* Split "db.col" at the first dot, in place. */
+static char *splitNs(char *ns) {
+    char *dot = strchr(ns, '.');
+
+    if (dot == NULL) return NULL;
+    *dot = '\0';
+    return dot + 1;
+}
+
+static void handleQuery(mockClient *c, int32_t reqId, char *p, char *end, int fail) {
+    int32_t flags, nrSkip, nrReturn, nr, from;
+    char *ns, *col;
+    bson_t q, out, *err, **docs;
+    mockCursor *cur;
+    int64_t id;
+
+    flags = (int32_t)load32le(p);
+    ns = p + 4;
+    p = ns + strlen(ns) + 1;
+    nrSkip = (int32_t)load32le(p);
+    nrReturn = (int32_t)load32le(p + 4);
+    p += 8;
+    (void)nrSkip;
+    if (p + 4 > end || !bson_init_static(&q, (uint8_t *)p, load32le(p))) {
+        clientReply(c, replyCreate(reqId, REPLY_FLAG_QUERY_FAILURE, 0, 0, NULL, 0));
+        return;
+    }
+    if (fail) {
+        err = errorDoc();
+        clientReply(c, replyCreate(reqId, REPLY_FLAG_QUERY_FAILURE, 0, 0, &err, 1));
+        bson_destroy(err);
+        return;
+    }
+    if ((col = splitNs(ns)) == NULL) col = ns + strlen(ns);
+
+    if (!strcmp(col, "$cmd")) {
+        runCommand(c, ns, &q, NULL, 0, &out);
+        err = &out;
+        clientReply(c, replyCreate(reqId, 0, 0, 0, &err, 1));
+        bson_destroy(&out);
+        return;
+    }
+
+    /* A negative numberToReturn asks for a single batch. */
+    cur = cursorCreate(collectionLookup(ns, col, 1));
+    id = cursorNextBatch(cur, nrReturn < 0 ? -nrReturn : nrReturn, &docs, &nr);
+    if (id != 0 && nrReturn < 0) {
+        cursorFree(cur);
+        id = 0;
+    }
+    clientReply(c, replyCreate(reqId, 0, id, 0, docs, nr));
+
+    /* Exhaust: stream the remaining batches without being asked. */
+    if (flags & QUERY_FLAG_EXHAUST) {
+        while (id != 0) {
+            from = (int32_t)cur->pos;
+            id = cursorNextBatch(cur, nrReturn, &docs, &nr);
+            clientReply(c, replyCreate(server.req_id, 0, id, from, docs, nr));
+        }
+    }
+}
+
+static void handleGetMore(mockClient *c, int32_t reqId, char *p, int fail) {
+    int32_t nrReturn, nr, from;
+    int64_t id;
+    mockCursor *cur;
+    bson_t **docs;
+
+    p += 4;
+    p += strlen(p) + 1;
+    nrReturn = (int32_t)load32le(p);
+    id = (int64_t)load64le(p + 4);
+    cur = cursorLookup(id);
+    if (cur == NULL || fail) {
+        clientReply(c, replyCreate(reqId, REPLY_FLAG_CURSOR_NOT_FOUND, 0, 0, NULL, 0));
+        return;
+    }
+    from = (int32_t)cur->pos;
+    id = cursorNextBatch(cur, nrReturn, &docs, &nr);
+    clientReply(c, replyCreate(reqId, 0, id, from, docs, nr));
+}
+
+static void handleKillCursors(char *p) {
+    int32_t n = (int32_t)load32le(p + 4);
+    mockCursor *cur;
+
+    for (int32_t i = 0; i < n; i++) {
+        if ((cur = cursorLookup((int64_t)load64le(p + 8 + 8*i))) != NULL) cursorFree(cur);
+    }
+}
+
+static void handleInsert(mockClient *c, char *p, char *end) {
+    int32_t flags = (int32_t)load32le(p);
+    char *ns = p + 4, *col, buf[128];
+    const char *err;
+    mockCollection *coll;
+    bson_t doc;
+    uint32_t len;
+
+    c->last_err[0] = '\0';
+    p = ns + strlen(ns) + 1;
+    if ((col = splitNs(ns)) == NULL) return;
+    coll = collectionLookup(ns, col, 1);
+    while (p + 4 <= end) {
+        len = load32le(p);
+        if (len > (size_t)(end - p) || !bson_init_static(&doc, (uint8_t *)p, len)) break;
+        if ((err = docInvalid(&doc, buf, sizeof(buf))) == NULL) {
+            collectionAdd(coll, &doc);
+        } else {
+            snprintf(c->last_err, sizeof(c->last_err), "%s", err);
+            if (!(flags & INSERT_FLAG_CONT_ON_ERR)) break;
+        }
+        p += len;
+    }
+}
+
+static void handleMsg(mockClient *c, int32_t reqId, char *p, char *end, int fail) {
+    uint32_t flagBits = load32le(p), len;
+    mongoDocSeq *seqs;
+    bson_t body, out, *views, **ptrs;
+    bson_iter_t it;
+    char *q, *d, *sec_end, db[MONGO_MAX_DBNAME_LEN] = "admin";
+    int32_t nr_seqs = 0, nr_docs = 0, have_body = 0;
+
+    if (flagBits & MSG_FLAG_CHECKSUM_PRESENT) end -= 4;
+    p += 4;
+
+    /* First pass: count the sections and the documents in them. */
+    for (q = p; q + 5 <= end; q += 1 + len) {
+        len = load32le(q + 1);
+        if (len < 5 || len > (size_t)(end - q - 1)) return;
+        if (*q != MSG_SECTION_DOC_SEQUENCE) continue;
+        nr_seqs++;
+        sec_end = q + 1 + len;
+        for (d = q + 5, d += strlen(d) + 1; d + 4 <= sec_end; d += load32le(d)) {
+            if (load32le(d) < 5) return;
+            nr_docs++;
+        }
+    }
+    seqs = calloc(nr_seqs + 1, sizeof(*seqs));
+    views = calloc(nr_docs + 1, sizeof(bson_t));
+    ptrs = calloc(nr_docs + 1, sizeof(bson_t *));
+
+    nr_seqs = nr_docs = 0;
+    while (p + 5 <= end) {
+        len = load32le(p + 1);
+        if (*p++ == MSG_SECTION_BODY) {
+            have_body = bson_init_static(&body, (uint8_t *)p, len);
+            p += len;
+            continue;
+        }
+        sec_end = p + len;
+        p += 4;
+        seqs[nr_seqs].identifier = p;
+        seqs[nr_seqs].docs = ptrs + nr_docs;
+        for (p += strlen(p) + 1; p + 4 <= sec_end; p += len) {
+            len = load32le(p);
+            if (bson_init_static(views + nr_docs, (uint8_t *)p, len)) {
+                ptrs[nr_docs] = views + nr_docs;
+                nr_docs++;
+                seqs[nr_seqs].nr_docs++;
+            }
+        }
+        nr_seqs++;
+        p = sec_end;
+    }
+
+    if (have_body) {
+        if (bson_iter_init(&it, &body) && bson_iter_find(&it, "$db") && BSON_ITER_HOLDS_UTF8(&it))
+            snprintf(db, sizeof(db), "%s", bson_iter_utf8(&it, NULL));
+        if (fail) {
+            bson_init(&out);
+            BSON_APPEND_INT32(&out, "ok", 0);
+            BSON_APPEND_UTF8(&out, "errmsg", "injected failure");
+        } else {
+            runCommand(c, db, &body, seqs, nr_seqs, &out);
+        }
+        if (!(flagBits & MSG_FLAG_MORE_TO_COME))
+            clientReply(c, msgReplyCreate(reqId, &out));
+        bson_destroy(&out);
+    }
+    free(seqs);
+    free(views);
+    free(ptrs);
+}
+
+/* Handle one whole packet. Returns 0 when the connection has to go. */
+static int handlePacket(mockClient *c, char *pkt, size_t len) {
+    int32_t reqId = (int32_t)load32le(pkt + 4), opCode = (int32_t)load32le(pkt + 12);
+    int32_t size;
+    char *end = pkt + len;
+    sds inner;
+    long n = ++server.nr_requests;
+    int fail = 0, ret = 1;
+
+    if (server.fault_close && n % server.fault_close == 0) return 0;
+    if (server.fault_drop && n % server.fault_drop == 0) return 1;
+    if (server.fault_error && n % server.fault_error == 0) fail = 1;
+    if (server.fault_garbage && n % server.fault_garbage == 0) {
+        clientReply(c, mongoSdscatpack(sdsempty(), "<iiii", 5, ++server.req_id, reqId, OP_REPLY));
+        return 1;
+    }
+
+    switch (opCode) {
+    case OP_QUERY:
+        handleQuery(c, reqId, pkt + 16, end, fail);
+        break;
+    case OP_GET_MORE:
+        handleGetMore(c, reqId, pkt + 16, fail);
+        break;
+    case OP_KILL_CURSORS:
+        handleKillCursors(pkt + 16);
+        break;
+    case OP_INSERT:
+        handleInsert(c, pkt + 16, end);
+        break;
+    case OP_UPDATE:
+    case OP_DELETE:
+        c->last_err[0] = '\0';
+        break;
+    case OP_MSG:
+        handleMsg(c, reqId, pkt + 16, end, fail);
+        break;
+    case OP_COMPRESSED:
+        /* Unwrap it and handle the original message, uncounted. */
+        size = (int32_t)load32le(pkt + 20);
+        if (len < 25 || size < 0) return 0;
+        if (server.decompressor == NULL ||
+            mongoCompressorId(server.decompressor) != (uint8_t)pkt[24]) {
+            mongoCompressorFree(server.decompressor);
+            server.decompressor = mongoCompressorCreate((uint8_t)pkt[24], -1);
+            if (server.decompressor == NULL) return 0;
+        }
+        inner = sdsMakeRoomFor(sdsempty(), 16 + (size_t)size);
+        inner = mongoSdscatpack(inner, "<iiii", 16 + size, reqId, 0, (int32_t)load32le(pkt + 16));
+        if (mongoDecompress(server.decompressor, pkt + 25, len - 25, inner + 16,
+                            (size_t)size) != MONGO_OK) {
+            sdsfree(inner);
+            return 0;
+        }
+        sdsIncrLen(inner, size);
+        server.nr_requests--;
+        ret = handlePacket(c, inner, sdslen(inner));
+        sdsfree(inner);
+        break;
+    default:
+        return 0;
+    }
+    return ret;
+}
+
+/* ---------------------------- Event handlers ------------------------------ */
+
+static void clientWritable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    mockClient *c = privdata;
+    ssize_t n;
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    n = write(fd, c->wbuf, sdslen(c->wbuf));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        clientFree(c);
+        return;
+    }
+    sdsrange(c->wbuf, (int)n, -1);
+    if (sdslen(c->wbuf) == 0) {
+        aeDeleteFileEvent(server.el, fd, AE_WRITABLE);
+    }
+}
+
+static void clientReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    mockClient *c = privdata;
+    size_t pos = 0, len;
+    ssize_t n;
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    c->rbuf = sdsMakeRoomFor(c->rbuf, MOCK_IOBUF_LEN);
+    n = read(fd, c->rbuf + sdslen(c->rbuf), sdsavail(c->rbuf));
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        clientFree(c);
+        return;
+    }
+    sdsIncrLen(c->rbuf, (int)n);
+
+    while (sdslen(c->rbuf) - pos >= 16) {
+        len = load32le(c->rbuf + pos);
+        if (len < 16 || len > MONGO_MAX_MSG_SIZE) {
+            clientFree(c);
+            return;
+        }
+        if (sdslen(c->rbuf) - pos < len) break;
+        if (!handlePacket(c, c->rbuf + pos, len)) {
+            clientFree(c);
+            return;
+        }
+        pos += len;
+    }
+    sdsrange(c->rbuf, (int)pos, -1);
+}
+
+static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    mockClient *c;
+    int cfd, one = 1;
+    AE_NOTUSED(el);
+    AE_NOTUSED(privdata);
+    AE_NOTUSED(mask);
+
+    cfd = accept(fd, NULL, NULL);
+    if (cfd == -1) return;
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c = calloc(1, sizeof(*c));
+    c->fd = cfd;
+    c->rbuf = sdsempty();
+    c->wbuf = sdsempty();
+    c->timer = -1;
+    if (aeCreateFileEvent(server.el, cfd, AE_READABLE, clientReadable, c) == AE_ERR) {
+        clientFree(c);
+    }
+}
+
+static int listenTcp(int port) {
+    struct sockaddr_in sa;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(fd, 511) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listenUnix(const char *path) {
+    struct sockaddr_un sa;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(fd, 511) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int parseFault(const char *arg) {
+    const char *eq = strchr(arg, '=');
+    long n;
+
+    if (eq == NULL || (n = atol(eq + 1)) <= 0) return -1;
+    if (!strncmp(arg, "close=", 6)) server.fault_close = n;
+    else if (!strncmp(arg, "drop=", 5)) server.fault_drop = n;
+    else if (!strncmp(arg, "error=", 6)) server.fault_error = n;
+    else if (!strncmp(arg, "garbage=", 8)) server.fault_garbage = n;
+    else return -1;
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: mock_server [-p port] [-s unix socket] [-n docs] [-b batch size]\n"
+            "                   [-l latency ms] [-F close|drop|error|garbage=N]...\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int port = 27017, fd;
+    const char *path = NULL;
+    int opt;
+
+    server.nr_docs = 1000;
+    server.batch = MOCK_DEFAULT_BATCH;
+    while ((opt = getopt(argc, argv, "p:s:n:b:l:F:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 's': path = optarg; break;
+        case 'n': server.nr_docs = atoi(optarg); break;
+        case 'b': server.batch = atoi(optarg); break;
+        case 'l': server.latency = atoll(optarg); break;
+        case 'F': if (parseFault(optarg) != 0) usage(); break;
+        default: usage();
+        }
+    }
+    if (server.batch <= 0) usage();
+
+    signal(SIGPIPE, SIG_IGN);
+    server.el = aeCreateEventLoop(1024, true);
+    /* Always on TCP, and also on the unix socket when one is given. */
+    if ((fd = listenTcp(port)) == -1) {
+        fprintf(stderr, "Can't listen on 127.0.0.1:%d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    aeCreateFileEvent(server.el, fd, AE_READABLE, acceptHandler, NULL);
+    if (path) {
+        if ((fd = listenUnix(path)) == -1) {
+            fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        aeCreateFileEvent(server.el, fd, AE_READABLE, acceptHandler, NULL);
+    }
+    aeMain(server.el);
+    aeDeleteEventLoop(server.el);
+    return 0;
+}
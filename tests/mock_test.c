@@ -0,0 +1,1563 @@
+/*
+ * Assertions against tests/mock_server.c, run by "make mock-check".
+ *
+ * Every group of tests that needs a mock server starts one of its own, with
+ * the options it needs, on a free port and stops it when done. The mock server binary is
+ * ./mock_server unless another path is given as the first argument. The
+ * exit status is the number of failed tests, capped at 255.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ae.h"
+#include "../adapters/ae.h"
+#include "../himongo.h"
+#include "../pool.h"
+#include "../pipeline.h"
+#include "../utils.h"
+#include "../timer.h"
+#include "../compress.h"
+#include "../endianconv.h"
+
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+static const char *mock_path = "./mock_server";
+static pid_t mock_pid = -1;
+
+/* A port nothing listens on right now. */
+static int freePort(void) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int fd, port = 0;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&sa, &len) == 0)
+        port = ntohs(sa.sin_port);
+    close(fd);
+    return port;
+}
+
+static int canConnect(int port) {
+    struct sockaddr_in sa;
+    int fd, ok;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ok = connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+    close(fd);
+    return ok;
+}
+
+/* Start the mock server with the given options, a space separated list,
+ * and return its port once it accepts connections. Exits on failure, as
+ * none of the tests can run without it. */
+static int mockStart(const char *opts) {
+    char *argv[32], *copy, *tok, portbuf[16];
+    int argc = 0, port = freePort();
+
+    snprintf(portbuf, sizeof(portbuf), "%d", port);
+    argv[argc++] = (char *)mock_path;
+    argv[argc++] = (char *)"-p";
+    argv[argc++] = portbuf;
+    copy = strdup(opts);
+    for (tok = strtok(copy, " "); tok != NULL && argc < 31; tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+
+    mock_pid = fork();
+    if (mock_pid == 0) {
+        execv(mock_path, argv);
+        fprintf(stderr, "Can't start %s: %s\n", mock_path, strerror(errno));
+        _exit(1);
+    }
+    free(copy);
+    for (int i = 0; i < 200 && mock_pid > 0; i++) {
+        if (canConnect(port))
+            return port;
+        usleep(10000);
+    }
+    fprintf(stderr, "The mock server didn't come up on port %d\n", port);
+    exit(1);
+}
+
+static void mockStop(void) {
+    if (mock_pid <= 0)
+        return;
+    kill(mock_pid, SIGTERM);
+    waitpid(mock_pid, NULL, 0);
+    mock_pid = -1;
+}
+
+static bson_t *docOf(void *reply, int idx) {
+    mongoReply *r = reply;
+    return r != NULL && idx < r->numberReturned ? r->docs[idx] : NULL;
+}
+
+static void test_mock_server(void) {
+    int port = mockStart("-n 10");
+    mongoContext *c;
+    mongoReply *r;
+    bson_t doc, cmd;
+
+    c = mongoConnect("127.0.0.1", port);
+    test("Connect to the mock server: ");
+    test_cond(c != NULL && c->err == 0);
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "ping", 1);
+    r = mongoQuery(c, 0, (char *)"admin", (char *)"$cmd", 0, -1, &cmd, NULL);
+    test("Run a command through OP_QUERY: ");
+    test_cond(r != NULL && mongoReplyCommandOk(r));
+    freeReplyObject(r);
+    bson_destroy(&cmd);
+
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    test("A new collection holds the generated documents: ");
+    test_cond(r != NULL && r->numberReturned == 10 && r->cursorID == 0 &&
+              bson_extract_int32(docOf(r, 9), (char *)"_id") == 9);
+    freeReplyObject(r);
+
+    bson_init(&doc);
+    BSON_APPEND_INT32(&doc, "_id", 10);
+    r = mongoInsert(c, 0, (char *)"db", (char *)"col", &doc, 1);
+    test("Insert a document: ");
+    test_cond(r != NULL && mongoReplyCommandOk(r));
+    freeReplyObject(r);
+    bson_destroy(&doc);
+
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    test("Queries see the inserted document: ");
+    test_cond(r != NULL && r->numberReturned == 11);
+    freeReplyObject(r);
+    mongoFree(c);
+    mockStop();
+
+    port = mockStart("-n 10 -F error=2");
+    c = mongoConnect("127.0.0.1", port);
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    freeReplyObject(r);
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    test("Injected errors answer with a query failure: ");
+    test_cond(r != NULL && (r->responseFlags & REPLY_FLAG_QUERY_FAILURE));
+    freeReplyObject(r);
+    mongoFree(c);
+    mockStop();
+
+    port = mockStart("-F close=1");
+    c = mongoConnect("127.0.0.1", port);
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    test("Injected closes end the connection: ");
+    test_cond(r == NULL && c->err == MONGO_ERR_EOF);
+    mongoFree(c);
+    mockStop();
+}
+
+/* Number of elements of the array at the dotted path of doc. */
+static int arrayLen(bson_t *doc, const char *path) {
+    bson_iter_t it, child;
+    int n = 0;
+
+    if (doc == NULL || !bson_iter_init(&it, doc) ||
+        !bson_iter_find_descendant(&it, path, &child) ||
+        !BSON_ITER_HOLDS_ARRAY(&child) || !bson_iter_recurse(&child, &it))
+        return -1;
+    while (bson_iter_next(&it))
+        n++;
+    return n;
+}
+
+static void test_op_msg(void) {
+    mongoContext *c = mongoConnectFd(-1);
+    mongoReader *r;
+    mongoMsgReply *m;
+    bson_t docs[5], *pp[5], sel, cmd;
+    void *reply;
+    int port, zc;
+    /* header, flagBits and two kind 0 sections holding empty documents */
+    char twobodies[32] = {32,0,0,0, 1,0,0,0, 0,0,0,0, (char)0xdd,0x07,0,0, 0,0,0,0,
+                          0, 5,0,0,0,0, 0, 5,0,0,0,0};
+    /* header, the checksumPresent flag, a body and room for the checksum */
+    char summed[30] = {30,0,0,0, 1,0,0,0, 0,0,0,0, (char)0xdd,0x07,0,0, 1,0,0,0,
+                       0, 5,0,0,0,0};
+    uint32_t crc;
+
+    for (int i = 0; i < 5; i++) {
+        bson_init(&docs[i]);
+        BSON_APPEND_INT32(&docs[i], "i", i);
+        pp[i] = &docs[i];
+    }
+    bson_init(&sel);
+    BSON_APPEND_INT32(&sel, "x", 1);
+    mongoAppendInsertCmd(c, 0, (char *)"db", (char *)"col", INSERT_FLAG_CONT_ON_ERR, pp, 5, NULL);
+    mongoAppendDeleteCmd(c, MSG_FLAG_MORE_TO_COME, (char *)"db", (char *)"col",
+                         DELETE_FLAG_SINGLE, &sel, NULL);
+    for (zc = 0; zc < 2; zc++) {
+        r = mongoReaderCreate();
+        r->zerocopy = zc;
+        mongoReaderFeed(r, c->obuf, sdslen(c->obuf));
+        mongoReaderGetReply(r, &reply);
+        m = reply;
+        test(zc ? "OP_MSG documents sequence is parsed (zero copy): " :
+                  "OP_MSG documents sequence is parsed: ");
+        test_cond(m != NULL && m->opCode == OP_MSG && m->nr_seqs == 1 &&
+                  m->seqs[0].nr_docs == 5 && !strcmp(m->seqs[0].identifier, "documents") &&
+                  bson_extract_int32(m->seqs[0].docs[3], (char *)"i") == 3 &&
+                  bson_extract_string(m->body, (char *)"insert") != NULL &&
+                  !strcmp(bson_extract_string(m->body, (char *)"insert"), "col"));
+        freeReplyObject(reply);
+
+        mongoReaderGetReply(r, &reply);
+        m = reply;
+        test("OP_MSG flagBits are kept: ");
+        test_cond(m != NULL && m->flagBits == MSG_FLAG_MORE_TO_COME && m->nr_seqs == 1);
+        freeReplyObject(reply);
+
+        test("The reader is drained after both messages: ");
+        test_cond(mongoReaderGetReply(r, &reply) == MONGO_OK && reply == NULL);
+        mongoReaderFree(r);
+    }
+    for (int i = 0; i < 5; i++)
+        bson_destroy(&docs[i]);
+    bson_destroy(&sel);
+    c->fd = -1;
+    mongoFree(c);
+
+    r = mongoReaderCreate();
+    mongoReaderFeed(r, twobodies, sizeof(twobodies));
+    test("OP_MSG with two body sections is a protocol error: ");
+    test_cond(mongoReaderGetReply(r, &reply) == MONGO_ERR && r->err == MONGO_ERR_PROTOCOL);
+    mongoReaderFree(r);
+
+    test("CRC-32C gives the check value of the Castagnoli polynomial: ");
+    test_cond(mongoCrc32c(0, "123456789", 9) == 0xe3069283);
+
+    crc = mongoCrc32c(0, summed, 26);
+    for (int i = 0; i < 4; i++)
+        summed[26+i] = (char)(crc >> (8*i));
+    r = mongoReaderCreate();
+    mongoReaderFeed(r, summed, sizeof(summed));
+    mongoReaderGetReply(r, &reply);
+    test("OP_MSG with a matching checksum is parsed: ");
+    test_cond(reply != NULL && ((mongoMsgReply *)reply)->flagBits == MSG_FLAG_CHECKSUM_PRESENT);
+    freeReplyObject(reply);
+    summed[29] ^= 1;
+    mongoReaderFeed(r, summed, sizeof(summed));
+    test("OP_MSG with a checksum mismatch is a protocol error: ");
+    test_cond(mongoReaderGetReply(r, &reply) == MONGO_ERR && r->err == MONGO_ERR_PROTOCOL);
+    mongoReaderFree(r);
+
+    port = mockStart("-n 3");
+    c = mongoConnect("127.0.0.1", port);
+    mongoEnableOpMsg(c);
+    bson_init(&cmd);
+    BSON_APPEND_UTF8(&cmd, "find", "col");
+    reply = mongoCommand(c, (char *)"db", &cmd);
+    m = reply;
+    test("A command round trips through OP_MSG: ");
+    test_cond(m != NULL && m->opCode == OP_MSG && mongoReplyCommandOk(reply) &&
+              arrayLen(m->body, "cursor.firstBatch") == 3);
+    freeReplyObject(reply);
+    bson_destroy(&cmd);
+
+    bson_init(&docs[0]);
+    BSON_APPEND_INT32(&docs[0], "_id", 3);
+    bson_init(&docs[1]);
+    BSON_APPEND_INT32(&docs[1], "_id", 4);
+    reply = mongoInsert(c, 0, (char *)"db", (char *)"col", docs, 2);
+    test("Inserts are sent as an OP_MSG insert command: ");
+    test_cond(reply != NULL && ((mongoMsgReply *)reply)->opCode == OP_MSG &&
+              mongoReplyCommandOk(reply) &&
+              bson_extract_int32(mongoReplyCommandDoc(reply), (char *)"n") == 2);
+    freeReplyObject(reply);
+    bson_destroy(&docs[0]);
+    bson_destroy(&docs[1]);
+    mongoFree(c);
+    mockStop();
+}
+
+/* Opcode of the last message queued on c. */
+static int32_t lastOpCode(mongoContext *c) {
+    return (int32_t)load32le(c->obuf + c->omsg + 12);
+}
+
+/* Messages of at least the threshold go out as OP_COMPRESSED, borrowed
+ * documents included, but the handshake and authentication commands never
+ * do. zlib when it was built in, the noop compressor otherwise. */
+static void test_compression(void) {
+    int cid = mongoCompressorSupported(MONGO_COMPRESSOR_ZLIB) ?
+        MONGO_COMPRESSOR_ZLIB : MONGO_COMPRESSOR_NOOP;
+    bson_t big, small, cmd, *pp;
+    char pad[2048];
+    const char *s;
+    mongoContext *c;
+    mongoReply *r;
+    void *reply;
+    int port, ok;
+
+    memset(pad, 'z', sizeof(pad) - 1);
+    pad[sizeof(pad) - 1] = '\0';
+    port = mockStart("-n 0");
+    c = mongoConnect("127.0.0.1", port);
+    test("The compressor is negotiated with the server: ");
+    test_cond(mongoEnableCompression(c, cid, MONGO_COMPRESS_LEVEL_DEFAULT, 256) == MONGO_OK &&
+              mongoCompressorId(c->compressor) == cid);
+
+    c->flags |= MONGO_BORROW;
+    bson_init(&big);
+    BSON_APPEND_INT32(&big, "_id", 1);
+    BSON_APPEND_UTF8(&big, "s", pad);
+    pp = &big;
+    mongoAppendInsertMsg(c, 0, (char *)"db", (char *)"col", &pp, 1);
+    test("A borrowed document above the threshold is sent compressed: ");
+    test_cond(lastOpCode(c) == OP_COMPRESSED && c->oref.len == 0);
+
+    bson_init(&small);
+    BSON_APPEND_INT32(&small, "_id", 2);
+    pp = &small;
+    mongoAppendInsertMsg(c, 0, (char *)"db", (char *)"col", &pp, 1);
+    test("A message below the threshold is sent as it is: ");
+    test_cond(lastOpCode(c) == OP_INSERT);
+
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    s = bson_extract_string(docOf(r, 0), (char *)"s");
+    test("Both documents round trip through the server: ");
+    test_cond(r != NULL && r->numberReturned == 2 && s != NULL && !strcmp(s, pad) &&
+              bson_extract_int32(docOf(r, 1), (char *)"_id") == 2);
+    freeReplyObject(r);
+    bson_destroy(&big);
+    bson_destroy(&small);
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "isMaster", 1);
+    BSON_APPEND_UTF8(&cmd, "pad", pad);
+    mongoAppendQueryMsg(c, 0, (char *)"admin", (char *)"$cmd", 0, -1, &cmd, NULL);
+    ok = lastOpCode(c) == OP_QUERY && c->oref.len == 1;
+    ok = mongoGetReply(c, &reply) == MONGO_OK && ok && mongoReplyCommandOk(reply);
+    test("A borrowed isMaster above the threshold is not compressed: ");
+    test_cond(ok);
+    freeReplyObject(reply);
+    bson_destroy(&cmd);
+    c->flags &= ~MONGO_BORROW;
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "saslStart", 1);
+    BSON_APPEND_UTF8(&cmd, "pad", pad);
+    mongoAppendCommandMsg(c, 0, (char *)"admin", &cmd);
+    ok = lastOpCode(c) == OP_MSG;
+    ok = mongoGetReply(c, &reply) == MONGO_OK && ok && reply != NULL;
+    test("saslStart is not compressed through OP_MSG either: ");
+    test_cond(ok);
+    freeReplyObject(reply);
+    bson_destroy(&cmd);
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "ping", 1);
+    BSON_APPEND_UTF8(&cmd, "pad", pad);
+    mongoAppendCommandMsg(c, 0, (char *)"admin", &cmd);
+    ok = lastOpCode(c) == OP_COMPRESSED;
+    ok = mongoGetReply(c, &reply) == MONGO_OK && ok && mongoReplyCommandOk(reply);
+    test("Other commands are compressed through OP_MSG: ");
+    test_cond(ok);
+    freeReplyObject(reply);
+    bson_destroy(&cmd);
+    mongoFree(c);
+    mockStop();
+}
+
+/* An OP_REPLY with the given request id and ndocs documents of about pad
+ * bytes each. */
+static sds replyPacket(int rid, int ndocs, int pad) {
+    sds body = sdsempty(), pkt = sdsempty();
+    char s[8192];
+    bson_t b;
+
+    memset(s, 'x', pad);
+    s[pad] = '\0';
+    for (int i = 0; i < ndocs; i++) {
+        bson_init(&b);
+        BSON_APPEND_INT32(&b, "i", i);
+        BSON_APPEND_UTF8(&b, "s", s);
+        body = sdscatlen(body, bson_get_data(&b), b.len);
+        bson_destroy(&b);
+    }
+    pkt = mongoSdscatpack(pkt, "<iiiiiqii", (int)(36 + sdslen(body)), rid, 7,
+                          OP_REPLY, 0, (long long)0, 0, ndocs);
+    pkt = sdscatlen(pkt, body, sdslen(body));
+    sdsfree(body);
+    return pkt;
+}
+
+/* Number of documents in packet k of the stream fed to the reader, packet
+ * 20 is larger than a read segment. */
+#define READER_DOCS(k) ((k) == 20 ? 300 : (k) % 7)
+
+static void test_reader(void) {
+    static const char *names[] = {
+        "Packets straddling read segments are parsed: ",
+        "Packets straddling read segments are parsed (zero copy): ",
+        "Packets read in place straddling segments are parsed: ",
+        "Packets read in place straddling segments are parsed (zero copy): ",
+    };
+    mongoReader *r;
+    mongoReply *m, *kept;
+    sds all, pkt;
+    void *reply;
+    size_t off, n, avail;
+    int mode, got, bad, port;
+    mongoContext *c;
+    char *b;
+
+    all = sdsempty();
+    for (int k = 0; k < 50; k++) {
+        pkt = replyPacket(k, READER_DOCS(k), k == 20 ? 7000 : k * 13 % 300);
+        all = sdscatlen(all, pkt, sdslen(pkt));
+        sdsfree(pkt);
+    }
+    for (mode = 0; mode < 4; mode++) {
+        r = mongoReaderCreate();
+        r->zerocopy = mode & 1;
+        got = bad = 0;
+        /* Feed the stream in odd chunks, through mongoReaderFeed() or
+         * through mongoReaderReserve()/mongoReaderCommit(). */
+        for (off = 0; ; off += n) {
+            n = 97 + off % 5000;
+            if (off + n > sdslen(all))
+                n = sdslen(all) - off;
+            if (n && !(mode & 2)) {
+                mongoReaderFeed(r, all + off, n);
+            } else if (n) {
+                if ((b = mongoReaderReserve(r, &avail)) == NULL)
+                    break;
+                if (n > avail)
+                    n = avail;
+                memcpy(b, all + off, n);
+                mongoReaderCommit(r, n);
+            }
+            while (mongoReaderGetReply(r, &reply) == MONGO_OK && reply != NULL) {
+                m = reply;
+                if (m->requestID != got || m->numberReturned != READER_DOCS(got))
+                    bad++;
+                for (int i = 0; i < m->numberReturned; i++)
+                    if (bson_extract_int32(m->docs[i], (char *)"i") != i)
+                        bad++;
+                freeReplyObject(reply);
+                got++;
+            }
+            if (n == 0)
+                break;
+        }
+        test(names[mode]);
+        test_cond(got == 50 && bad == 0 && r->err == 0);
+        mongoReaderFree(r);
+    }
+
+    /* A zero copy reply owns the bytes of its packet, it outlives both the
+     * segment it was read from and the reader. */
+    r = mongoReaderCreate();
+    r->zerocopy = 1;
+    mongoReaderFeed(r, all, sdslen(all));
+    mongoReaderGetReply(r, &reply);
+    kept = reply;
+    for (got = 1; mongoReaderGetReply(r, &reply) == MONGO_OK && reply != NULL; got++)
+        freeReplyObject(reply);
+    mongoReaderFree(r);
+    memset(all, 0, sdslen(all));
+    test("Zero copy replies outlive the reader: ");
+    test_cond(got == 50 && kept != NULL && kept->requestID == 0 &&
+              kept->numberReturned == 0);
+    freeReplyObject(kept);
+
+    r = mongoReaderCreate();
+    r->zerocopy = 1;
+    pkt = replyPacket(1, 3, 100);
+    mongoReaderFeed(r, pkt, sdslen(pkt));
+    mongoReaderGetReply(r, &reply);
+    kept = reply;
+    pkt[sdslen(pkt) - 2] = '\0';
+    mongoReaderFeed(r, pkt, sdslen(pkt));
+    mongoReaderGetReply(r, &reply);
+    freeReplyObject(reply);
+    mongoReaderFree(r);
+    sdsfree(pkt);
+    test("Zero copy replies outlive later reads: ");
+    test_cond(kept != NULL && kept->numberReturned == 3 &&
+              bson_extract_int32(kept->docs[2], (char *)"i") == 2 &&
+              bson_extract_string(kept->docs[2], (char *)"s") != NULL &&
+              strlen(bson_extract_string(kept->docs[2], (char *)"s")) == 100);
+    freeReplyObject(kept);
+    sdsfree(all);
+
+    port = mockStart("-n 2000 -b 2000");
+    c = mongoConnect("127.0.0.1", port);
+    reply = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    m = reply;
+    test("A reply larger than a read segment comes over the wire: ");
+    test_cond(m != NULL && m->numberReturned == 2000 &&
+              bson_extract_int32(docOf(m, 1999), (char *)"_id") == 1999);
+    freeReplyObject(reply);
+    mongoFree(c);
+    mockStop();
+}
+
+static int pingOk(mongoContext *c) {
+    bson_t cmd;
+    void *reply;
+    int ok;
+
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "ping", 1);
+    reply = mongoQuery(c, 0, (char *)"admin", (char *)"$cmd", 0, -1, &cmd, NULL);
+    ok = reply != NULL && mongoReplyCommandOk(reply);
+    freeReplyObject(reply);
+    bson_destroy(&cmd);
+    return ok;
+}
+
+static void noObserver(mongoContext *c, const mongoCommandEvent *ev, void *privdata) {
+    (void)c; (void)ev; (void)privdata;
+}
+
+typedef struct poolWorker {
+    mongoPool *pool;
+    int fails;
+    int oversize;
+} poolWorker;
+
+static void *poolWork(void *arg) {
+    poolWorker *w = arg;
+    mongoContext *c;
+
+    for (int i = 0; i < 300; i++) {
+        if ((c = mongoPoolGet(w->pool)) == NULL) {
+            w->fails++;
+            continue;
+        }
+        if (mongoPoolSize(w->pool) > 4)
+            w->oversize++;
+        if (!pingOk(c))
+            w->fails++;
+        mongoPoolPut(w->pool, c);
+    }
+    return NULL;
+}
+
+typedef struct poolLater {
+    mongoPool *pool;
+    mongoContext *c;
+} poolLater;
+
+static void *poolPutLater(void *arg) {
+    poolLater *l = arg;
+
+    usleep(30000);
+    mongoPoolPut(l->pool, l->c);
+    return NULL;
+}
+
+static void test_pool(void) {
+    mongoPoolOptions o;
+    mongoPool *p;
+    mongoContext *c, *held[4];
+    poolWorker w[8];
+    poolLater late;
+    pthread_t th[8];
+    int fails = 0, oversize = 0, i;
+
+    memset(&o, 0, sizeof(o));
+    o.ip = "127.0.0.1";
+    o.port = mockStart("");
+    o.min_size = 2;
+    o.max_size = 4;
+    o.wait_timeout = 5000;
+    o.idle_timeout = 20;
+    p = mongoPoolCreate(&o);
+    test("A new pool opens min_size contexts: ");
+    test_cond(p != NULL && mongoPoolSize(p) == 2);
+
+    for (i = 0; i < 8; i++) {
+        w[i].pool = p;
+        w[i].fails = w[i].oversize = 0;
+        pthread_create(&th[i], NULL, poolWork, &w[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        pthread_join(th[i], NULL);
+        fails += w[i].fails;
+        oversize += w[i].oversize;
+    }
+    test("Concurrent checkouts stay within max_size: ");
+    test_cond(fails == 0 && oversize == 0 && mongoPoolSize(p) <= 4);
+
+    for (i = 0; i < 4; i++)
+        held[i] = mongoPoolGet(p);
+    late.pool = p;
+    late.c = held[3];
+    pthread_create(&th[0], NULL, poolPutLater, &late);
+    c = mongoPoolGet(p);
+    pthread_join(th[0], NULL);
+    test("Checkout at max_size waits for a context to be handed back: ");
+    test_cond(c != NULL && c == held[3] && mongoPoolSize(p) == 4);
+    for (i = 0; i < 4; i++)
+        mongoPoolPut(p, held[i]);
+
+    usleep(50000);
+    mongoPoolEvictIdle(p);
+    test("Idle contexts above min_size are evicted: ");
+    test_cond(mongoPoolSize(p) == 2);
+
+    c = mongoPoolGet(p);
+    c->err = MONGO_ERR_IO;
+    mongoPoolPut(p, c);
+    test("A context handed back in error is closed: ");
+    test_cond(mongoPoolSize(p) == 1);
+    mongoPoolFree(p);
+
+    /* No waiting: the checkout past max_size fails at once. */
+    o.min_size = 1;
+    o.max_size = 1;
+    o.idle_timeout = 0;
+    p = mongoPoolCreate(&o);
+    held[0] = mongoPoolGet(p);
+    held[1] = mongoPoolGet(p);
+    test("Checkout fails at max_size without wait_timeout: ");
+    test_cond(held[0] != NULL && held[1] == NULL);
+
+    c = held[0];
+    mongoEnableOpMsg(c);
+    mongoSetWriteConcern(c, 0, 1);
+    mongoSetCommandObserver(c, noObserver, NULL);
+    mongoPoolPut(p, c);
+    c = mongoPoolGet(p);
+    test("Put resets what the borrower changed: ");
+    test_cond(c == held[0] && !(c->flags & MONGO_OP_MSG) && c->wc.w == 1 &&
+              c->wc.flush_bytes == MONGO_WC_FLUSH_BYTES && c->observer.fn == NULL);
+    mongoPoolPut(p, c);
+    mongoPoolFree(p);
+    mockStop();
+
+    /* The mock closes the connection on its second request, which is the
+     * ping of the second checkout. */
+    o.port = mockStart("-F close=2");
+    o.check_interval = 1;
+    p = mongoPoolCreate(&o);
+    c = mongoPoolGet(p);
+    pingOk(c);
+    mongoPoolPut(p, c);
+    usleep(20000);
+    c = mongoPoolGet(p);
+    test("A dead idle context is reconnected on checkout: ");
+    test_cond(c != NULL && c->err == 0 && pingOk(c));
+    mongoPoolPut(p, c);
+    mongoPoolFree(p);
+    mockStop();
+}
+
+/* Walk a cursor to its end, counting the documents that come in _id order
+ * and the batches that held more than maxBatch documents. */
+static int cursorScan(mongoCursor *cur, int maxBatch, int *oversize) {
+    bson_t *doc;
+    int n = 0;
+
+    while ((doc = mongoCursorNext(cur)) != NULL) {
+        if (bson_extract_int32(doc, (char *)"_id") != n)
+            break;
+        if (cur->reply->numberReturned > maxBatch)
+            (*oversize)++;
+        n++;
+    }
+    return n;
+}
+
+static void test_cursor(void) {
+    int port = mockStart("-n 1000 -b 100"), oversize = 0, n;
+    mongoContext *c = mongoConnect("127.0.0.1", port);
+    mongoCursor *cur;
+    mongoReply *r;
+    int64_t id;
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100, 0);
+    n = cursorScan(cur, 100, &oversize);
+    test("A getMore cursor yields every document once, in order: ");
+    test_cond(n == 1000 && cur->err == 0 && oversize == 0);
+    mongoCursorFree(cur);
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100,
+                            MONGO_CURSOR_EXHAUST);
+    n = cursorScan(cur, 100, &oversize);
+    test("An exhaust cursor yields every document once, in order: ");
+    test_cond(n == 1000 && cur->err == 0 && oversize == 0);
+    mongoCursorFree(cur);
+    test("The context is clean after both scans: ");
+    test_cond(c->err == 0 && mongoBufferPending(c) == 0 && c->reader->len == 0);
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100, 0);
+    mongoCursorNext(cur);
+    id = cur->cursorID;
+    mongoCursorFree(cur);
+    r = mongoGetMore(c, (char *)"db", (char *)"col", 100, id);
+    test("Closing a getMore cursor early kills it on the server: ");
+    test_cond(id != 0 && r != NULL && (r->responseFlags & REPLY_FLAG_CURSOR_NOT_FOUND));
+    freeReplyObject(r);
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100,
+                            MONGO_CURSOR_EXHAUST);
+    mongoCursorNext(cur);
+    mongoCursorFree(cur);
+    test("Closing an exhaust cursor early leaves the context in error: ");
+    test_cond(c->err == MONGO_ERR_OTHER);
+    mongoFree(c);
+    mockStop();
+
+    port = mockStart("-n 10 -F error=1");
+    c = mongoConnect("127.0.0.1", port);
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100, 0);
+    test("A query failure is reported by the cursor: ");
+    test_cond(mongoCursorNext(cur) == NULL && cur->err == MONGO_ERR_OTHER);
+    mongoCursorFree(cur);
+    mongoFree(c);
+    mockStop();
+}
+
+static long long msNow(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Time a getMore scan with the given prefetch depth, -1 when it doesn't
+ * return every document. */
+static long long timedScan(mongoContext *c, int depth) {
+    long long start = msNow();
+    mongoCursor *cur;
+    int n, oversize = 0;
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100, 0);
+    mongoCursorSetPrefetch(cur, depth, 0);
+    n = cursorScan(cur, 100, &oversize);
+    mongoCursorFree(cur);
+    return n == 1000 && oversize == 0 ? msNow() - start : -1;
+}
+
+static void test_prefetch(void) {
+    int port = mockStart("-n 1000 -b 100"), oversize = 0, n;
+    mongoContext *c = mongoConnect("127.0.0.1", port);
+    mongoCursor *cur;
+    size_t batch;
+    long long plain, ahead;
+    int64_t id;
+    mongoReply *r;
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100, 0);
+    mongoCursorSetPrefetch(cur, 3, 0);
+    test("Prefetching sends depth getMores ahead: ");
+    test_cond(cur->err == 0 && cur->inflight == 3);
+    n = cursorScan(cur, 100, &oversize);
+    test("A prefetching cursor yields every document once, in order: ");
+    test_cond(n == 1000 && cur->err == 0 && oversize == 0 && cur->inflight == 0);
+    mongoCursorFree(cur);
+    test("The context is clean after a prefetching scan: ");
+    test_cond(c->err == 0 && mongoBufferPending(c) == 0 && c->reader->len == 0);
+
+    cur = mongoCursorCreate(c, (char *)"db", (char *)"col", NULL, NULL, 100, 0);
+    batch = cur->batchBytes;
+    mongoCursorSetPrefetch(cur, 8, batch * 2 + batch / 2);
+    test("The byte cap limits the getMores in flight: ");
+    test_cond(cur->err == 0 && cur->inflight == 2);
+    mongoCursorNext(cur);
+    id = cur->cursorID;
+    mongoCursorFree(cur);
+    test("Closing a prefetching cursor drains the replies in flight: ");
+    test_cond(c->err == 0 && mongoBufferPending(c) == 0 && c->reader->len == 0 &&
+              pingOk(c));
+    r = mongoGetMore(c, (char *)"db", (char *)"col", 100, id);
+    test("Closing a prefetching cursor kills it on the server: ");
+    test_cond(r != NULL && (r->responseFlags & REPLY_FLAG_CURSOR_NOT_FOUND));
+    freeReplyObject(r);
+    mongoFree(c);
+    mockStop();
+
+    /* Every reply takes 20ms: ten batches one after the other take over
+     * 200ms, prefetched they travel together. */
+    port = mockStart("-n 1000 -b 100 -l 20");
+    c = mongoConnect("127.0.0.1", port);
+    plain = timedScan(c, 0);
+    ahead = timedScan(c, 4);
+    test("Prefetching hides the round trips between batches: ");
+    test_cond(plain >= 200 && ahead >= 0 && ahead * 2 < plain);
+    mongoFree(c);
+    mockStop();
+}
+
+static void test_timer_wheel(void) {
+    enum { N = 20000 };
+    static mongoTimer t[N];
+    static char fired[N];
+    uint64_t now = 123456789, d;
+    mongoTimerWheel *w = mongoTimerWheelCreate(now);
+    mongoTimer ex, *x;
+    int early = 0, late = 0, wrong = 0, stuck = 0, i;
+    int64_t wait;
+
+    srand(1);
+    for (i = 0; i < N; i++) {
+        /* Mostly short deadlines, a tenth of them up to hours away. */
+        d = i % 10 == 0 ? (uint64_t)rand() % 20000000 : (uint64_t)rand() % 300000;
+        t[i].next = NULL;
+        t[i].data = (void *)(intptr_t)i;
+        mongoTimerAdd(w, &t[i], now + d);
+    }
+    for (i = 0; i < N; i += 7)
+        mongoTimerDel(w, &t[i]);
+    test("Deleted timers are no longer counted: ");
+    test_cond(w->count == (unsigned long)(N - (N + 6) / 7));
+
+    while (w->count > 0 && !stuck) {
+        if ((wait = mongoTimerWheelNext(w, now)) < 0)
+            stuck = 1;
+        now += wait ? (uint64_t)wait : 1;
+        mongoTimerWheelAdvance(w, now, &ex);
+        while (ex.next != &ex) {
+            x = ex.next;
+            i = (int)(intptr_t)x->data;
+            mongoTimerDel(w, x);
+            if (x->expires > now) early++;
+            if (x->expires + 1 < now) late++;
+            if (fired[i] || i % 7 == 0) wrong++;
+            fired[i] = 1;
+        }
+    }
+    for (i = 0; i < N; i++)
+        if (fired[i] != (i % 7 != 0))
+            wrong++;
+    test("Timers fire once, neither early nor late: ");
+    test_cond(!stuck && early == 0 && late == 0 && wrong == 0);
+    mongoTimerWheelFree(w);
+}
+
+/* Callbacks of the deadline tests, in the order they ran. */
+static struct {
+    aeEventLoop *el;
+    uint64_t start;
+    int tags[8];
+    uint64_t at[8];
+    int nr, bad;
+} dl;
+
+static void deadlineCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    int tag = (int)(intptr_t)privdata;
+
+    /* A timed out request gets a NULL reply and leaves the context alone. */
+    if ((r == NULL) != mongoAsyncTimedOut(ac) || ac->err != 0)
+        dl.bad++;
+    if (dl.nr < 8) {
+        dl.at[dl.nr] = mongoTimerNow() - dl.start;
+        dl.tags[dl.nr++] = r == NULL ? -tag : tag;
+    }
+    /* Retrying from the callback of a timed out request goes through. */
+    if (tag == 1 && mongoAsyncFindOne(ac, deadlineCallback, (void *)4,
+                                      (char *)"db", (char *)"col", NULL, NULL) != MONGO_OK)
+        dl.bad++;
+    if (tag == 4)
+        mongoAsyncDisconnect(ac);
+}
+
+static void deadlineDisconnect(const mongoAsyncContext *ac, int status) {
+    (void)ac; (void)status;
+    aeStop(dl.el);
+}
+
+static void test_deadlines(void) {
+    int port = mockStart("-n 1 -l 200");
+    mongoAsyncContext *ac;
+    struct timeval none = {0, 0}, t50 = {0, 50000}, t1s = {1, 0};
+    int unknown;
+
+    memset(&dl, 0, sizeof(dl));
+    dl.el = aeCreateEventLoop(64, true);
+    ac = mongoAsyncConnect("127.0.0.1", port);
+    mongoAeAttach(dl.el, ac);
+    mongoAsyncSetDisconnectCallback(ac, deadlineDisconnect);
+    dl.start = mongoTimerNow();
+
+    /* Replies take 200ms: request 1 times out at 50ms, 3 has its deadline
+     * lifted and 2 gets a longer one. 4 is the retry of 1. */
+    mongoAsyncSetTimeout(ac, t50);
+    mongoAsyncFindOne(ac, deadlineCallback, (void *)1, (char *)"db", (char *)"col", NULL, NULL);
+    mongoAsyncFindOne(ac, deadlineCallback, (void *)3, (char *)"db", (char *)"col", NULL, NULL);
+    mongoAsyncSetDeadline(ac, mongoAsyncLastRequestId(ac), none);
+    mongoAsyncSetTimeout(ac, none);
+    mongoAsyncFindOne(ac, deadlineCallback, (void *)2, (char *)"db", (char *)"col", NULL, NULL);
+    mongoAsyncSetDeadline(ac, mongoAsyncLastRequestId(ac), t1s);
+    unknown = mongoAsyncSetDeadline(ac, mongoAsyncLastRequestId(ac) + 100, t1s);
+    aeMain(dl.el);
+
+    test("Deadlines can't be set on unknown requests: ");
+    test_cond(unknown == MONGO_ERR);
+    test("Only the request past its deadline times out: ");
+    test_cond(dl.nr == 4 && dl.tags[0] == -1 && dl.tags[1] == 3 &&
+              dl.tags[2] == 2 && dl.tags[3] == 4);
+    test("Timeouts leave the context usable and without error: ");
+    test_cond(dl.bad == 0);
+    test("The deadline fires on time: ");
+    test_cond(dl.at[0] >= 50 && dl.at[0] < 150 && dl.at[1] >= 200);
+    aeDeleteEventLoop(dl.el);
+    mockStop();
+}
+
+/* State of the watermark tests. */
+static struct {
+    aeEventLoop *el;
+    int replies, paused, resumed, more, last;
+    int replies_at_resume;
+} wm;
+
+static void wmDisconnect(const mongoAsyncContext *ac, int status) {
+    (void)ac; (void)status;
+    aeStop(wm.el);
+}
+
+static void wmCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    (void)privdata;
+    if (r != NULL)
+        wm.replies++;
+    if (wm.replies == wm.last)
+        mongoAsyncDisconnect(ac);
+}
+
+static void wmPause(mongoAsyncContext *ac) {
+    (void)ac;
+    wm.paused++;
+}
+
+/* Queue the requests the test held back once the context drained. */
+static void wmResume(mongoAsyncContext *ac) {
+    wm.resumed++;
+    wm.replies_at_resume = wm.replies;
+    for (; wm.more > 0; wm.more--)
+        mongoAsyncFindOne(ac, wmCallback, NULL, (char *)"db", (char *)"col", NULL, NULL);
+}
+
+static mongoAsyncContext *wmConnect(int port) {
+    mongoAsyncContext *ac = mongoAsyncConnect("127.0.0.1", port);
+
+    wm.el = aeCreateEventLoop(64, true);
+    mongoAeAttach(wm.el, ac);
+    mongoAsyncSetDisconnectCallback(ac, wmDisconnect);
+    mongoAsyncSetResumeCallback(ac, wmResume);
+    return ac;
+}
+
+static void test_watermarks(void) {
+    int port = mockStart("-n 1 -l 50"), accepted = 0, bad, refused;
+    mongoAsyncContext *ac;
+    char pad[1000];
+    bson_t big;
+
+    memset(&wm, 0, sizeof(wm));
+    ac = wmConnect(port);
+    bad = mongoAsyncSetWatermarks(ac, 0, 0, 2, 10);
+    mongoAsyncSetWatermarks(ac, 0, 0, 10, 2);
+    test("A low watermark above the high one is refused: ");
+    test_cond(bad == MONGO_ERR);
+
+    /* Without a pause callback, commands are refused at the high watermark
+     * until the context drains to the low one. */
+    while (accepted < 100 &&
+           mongoAsyncFindOne(ac, wmCallback, NULL, (char *)"db", (char *)"col",
+                             NULL, NULL) == MONGO_OK)
+        accepted++;
+    refused = mongoAsyncIsPaused(ac);
+    wm.more = 3;
+    wm.last = 13;
+    aeMain(wm.el);
+    test("Commands are refused at the high request watermark: ");
+    test_cond(accepted == 10 && refused);
+    test("Resume is called once below the low request watermark: ");
+    test_cond(wm.resumed == 1 && wm.replies_at_resume >= 8 && wm.replies == 13);
+    aeDeleteEventLoop(wm.el);
+
+    /* With a pause callback, the caller is told and commands still go in. */
+    memset(&wm, 0, sizeof(wm));
+    ac = wmConnect(port);
+    mongoAsyncSetPauseCallback(ac, wmPause);
+    mongoAsyncSetWatermarks(ac, 64 * 1024, 0, 0, 0);
+    memset(pad, 'x', sizeof(pad) - 1);
+    pad[sizeof(pad) - 1] = '\0';
+    bson_init(&big);
+    BSON_APPEND_UTF8(&big, "pad", pad);
+    for (bad = 0, accepted = 0; accepted < 200; accepted++)
+        if (mongoAsyncInsert(ac, NULL, NULL, 0, (char *)"db", (char *)"col", &big, 1) != MONGO_OK)
+            bad++;
+    bson_destroy(&big);
+    test("The pause callback is called once at the high byte watermark: ");
+    test_cond(bad == 0 && wm.paused == 1 && mongoAsyncIsPaused(ac));
+    mongoAsyncFindOne(ac, wmCallback, NULL, (char *)"db", (char *)"col", NULL, NULL);
+    wm.last = 1;
+    aeMain(wm.el);
+    test("Resume is called once the output drained: ");
+    test_cond(wm.resumed == 1 && wm.replies == 1);
+    aeDeleteEventLoop(wm.el);
+    mockStop();
+}
+
+/* The integer at the dotted path of doc, -1 when there is none. */
+static int64_t intAt(bson_t *doc, const char *path) {
+    bson_iter_t it, child;
+
+    if (doc == NULL || !bson_iter_init(&it, doc) ||
+        !bson_iter_find_descendant(&it, path, &child))
+        return -1;
+    return bson_iter_as_int64(&child);
+}
+
+/* State of the coalescing tests. */
+static struct {
+    aeEventLoop *el;
+    int ok, nulls, found, acked_before_query;
+    int results, wrong;
+} co;
+
+/* What one caller of a coalesced insert should be told, -1 for fields that
+ * must be absent. */
+typedef struct coExpect {
+    int n;
+    int err_index; /* index of the first write error */
+    int not_attempted; /* the first write error says so */
+    int offset, count; /* batchOffset and batchCount of legacy inserts */
+    int code;
+} coExpect;
+
+static void coDisconnect(const mongoAsyncContext *ac, int status) {
+    (void)ac; (void)status;
+    aeStop(co.el);
+}
+
+static void coInsertCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    (void)ac; (void)privdata;
+    if (r != NULL) co.ok++;
+    else co.nulls++;
+}
+
+static void coCountCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    mongoReply *rep = r;
+
+    (void)privdata;
+    if (rep == NULL || rep->opCode != OP_REPLY)
+        return;
+    co.found += rep->numberReturned;
+    if (rep->cursorID == 0)
+        mongoAsyncDisconnect(ac);
+}
+
+static void coQueryCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    (void)ac; (void)privdata;
+    if (r != NULL)
+        co.acked_before_query = co.ok;
+}
+
+static void coResultCallback(mongoAsyncContext *ac, void *r, void *privdata) {
+    coExpect *e = privdata;
+    bson_t *doc = r ? mongoReplyCommandDoc(r) : NULL;
+    char *errmsg;
+
+    if (doc == NULL || intAt(doc, "n") != e->n ||
+        intAt(doc, "writeErrors.0.index") != e->err_index ||
+        intAt(doc, "batchOffset") != e->offset || intAt(doc, "batchCount") != e->count ||
+        intAt(doc, e->err_index >= 0 ? "writeErrors.0.code" : "code") != e->code)
+        co.wrong++;
+    errmsg = doc ? bson_extract_string(doc, (char *)"writeErrors.0.errmsg") : NULL;
+    if (e->not_attempted && (errmsg == NULL || strncmp(errmsg, "not attempted", 13)))
+        co.wrong++;
+    if (++co.results == 3)
+        mongoAsyncDisconnect(ac);
+}
+
+static mongoAsyncContext *coConnect(int port, int opmsg) {
+    mongoAsyncContext *ac = mongoAsyncConnect("127.0.0.1", port);
+
+    co.el = aeCreateEventLoop(64, true);
+    if (opmsg)
+        mongoEnableOpMsg(&ac->c);
+    mongoAeAttach(co.el, ac);
+    mongoAsyncSetDisconnectCallback(ac, coDisconnect);
+    return ac;
+}
+
+/* 1000 single document inserts coalesced 500 at a time, then 10 without a
+ * callback and a query, which must see all of them. */
+static void coalesceRun(int port, int opmsg, char *col) {
+    mongoAsyncContext *ac;
+    int32_t first;
+    int bad = 0, after_inserts = -1;
+    bson_t d;
+
+    memset(&co, 0, sizeof(co));
+    ac = coConnect(port, opmsg);
+    mongoAsyncSetInsertCoalescing(ac, 500, 0);
+    first = ac->c.req_id;
+    for (int i = 0; i < 1010; i++) {
+        bson_init(&d);
+        BSON_APPEND_INT32(&d, "_id", i);
+        if (mongoAsyncInsert(ac, i < 1000 ? coInsertCallback : NULL, NULL, 0,
+                             (char *)"db", col, &d, 1) != MONGO_OK)
+            bad++;
+        bson_destroy(&d);
+        if (i == 999)
+            after_inserts = ac->c.req_id - first;
+    }
+    mongoAsyncFindOne(ac, coQueryCallback, NULL, (char *)"db", col, NULL, NULL);
+    test(opmsg ? "Inserts are coalesced into insert commands: " :
+                 "Inserts are coalesced into OP_INSERT messages: ");
+    /* A full batch goes out at once, the rest before the query. Legacy
+     * batches are followed by their getlasterror. */
+    test_cond(bad == 0 && after_inserts == (opmsg ? 2 : 4) &&
+              ac->c.req_id - first == (opmsg ? 4 : 6));
+    mongoAsyncFindAll(ac, coCountCallback, NULL, (char *)"db", col, NULL, NULL, 200);
+    aeMain(co.el);
+    test("Every caller is answered and the query sees every insert: ");
+    test_cond(co.ok == 1000 && co.nulls == 0 && co.found == 1010 &&
+              co.acked_before_query == 1000);
+    aeDeleteEventLoop(co.el);
+}
+
+/* Three callers share a batch of 6 documents, the 4th one is refused. */
+static void coalesceErrors(int port, int opmsg, int32_t flags, coExpect *want) {
+    mongoAsyncContext *ac;
+    bson_t d[6];
+
+    memset(&co, 0, sizeof(co));
+    for (int i = 0; i < 6; i++) {
+        bson_init(&d[i]);
+        BSON_APPEND_INT32(&d[i], i == 3 ? "$bad" : "_id", i);
+    }
+    ac = coConnect(port, opmsg);
+    mongoAsyncSetInsertCoalescing(ac, 100, 0);
+    mongoAsyncInsert(ac, coResultCallback, &want[0], flags, (char *)"db", (char *)"err", d, 2);
+    mongoAsyncInsert(ac, coResultCallback, &want[1], flags, (char *)"db", (char *)"err", d + 2, 3);
+    mongoAsyncInsert(ac, coResultCallback, &want[2], flags, (char *)"db", (char *)"err", d + 5, 1);
+    aeMain(co.el);
+    aeDeleteEventLoop(co.el);
+    for (int i = 0; i < 6; i++)
+        bson_destroy(&d[i]);
+}
+
+static void test_coalesce(void) {
+    int port = mockStart("-n 0");
+    coExpect ordered[3] = {
+        {2, -1, 0, -1, -1, -1}, {1, 1, 0, -1, -1, 52}, {0, 0, 1, -1, -1, -1},
+    };
+    coExpect unordered[3] = {
+        {2, -1, 0, -1, -1, -1}, {2, 1, 0, -1, -1, 52}, {1, -1, 0, -1, -1, -1},
+    };
+    coExpect legacy[3] = {
+        {0, -1, 0, 0, 2, 52}, {0, -1, 0, 2, 3, 52}, {0, -1, 0, 5, 1, 52},
+    };
+    mongoAsyncContext *ac;
+    int32_t id;
+    int no_id, refused;
+    struct timeval t1s = {1, 0};
+    bson_t d;
+
+    coalesceRun(port, 0, (char *)"legacy");
+    coalesceRun(port, 1, (char *)"opmsg");
+
+    coalesceErrors(port, 1, 0, ordered);
+    test("Each caller of an ordered insert command gets its own result: ");
+    test_cond(co.results == 3 && co.wrong == 0);
+    coalesceErrors(port, 1, INSERT_FLAG_CONT_ON_ERR, unordered);
+    test("Each caller of an unordered insert command gets its own result: ");
+    test_cond(co.results == 3 && co.wrong == 0);
+    coalesceErrors(port, 0, 0, legacy);
+    test("Each caller of a legacy insert gets its part of the batch: ");
+    test_cond(co.results == 3 && co.wrong == 0);
+
+    /* Coalesced inserts have no request of their own, and the callback of
+     * the batch can't be cancelled or given a deadline. */
+    memset(&co, 0, sizeof(co));
+    ac = mongoAsyncConnect("127.0.0.1", port);
+    mongoAsyncSetInsertCoalescing(ac, 100, 0);
+    bson_init(&d);
+    BSON_APPEND_INT32(&d, "_id", 1);
+    mongoAsyncInsert(ac, coInsertCallback, NULL, 0, (char *)"db", (char *)"x", &d, 1);
+    no_id = mongoAsyncLastRequestId(ac) == 0 && mongoAsyncLastHandle(ac) == 0;
+    mongoAsyncInsert(ac, coInsertCallback, NULL, 0, (char *)"db", (char *)"x", &d, 1);
+    mongoAsyncSetInsertCoalescing(ac, 0, 0);
+    id = mongoAsyncLastRequestId(ac);
+    refused = id != 0 && mongoAsyncCancel(ac, id) == MONGO_ERR &&
+        mongoAsyncCancelHandle(ac, mongoAsyncLastHandle(ac)) == MONGO_ERR &&
+        mongoAsyncSetDeadline(ac, id, t1s) == MONGO_ERR;
+    test("Coalesced inserts have no request id or handle: ");
+    test_cond(no_id);
+    test("The batch can't be cancelled or given a deadline: ");
+    test_cond(refused);
+    mongoAsyncFindOne(ac, coInsertCallback, NULL, (char *)"db", (char *)"x", NULL, NULL);
+    test("Requests after the batch get their own id again: ");
+    test_cond(mongoAsyncLastRequestId(ac) == id + 1 && mongoAsyncCancel(ac, id + 1) == MONGO_OK);
+    mongoAsyncInsert(ac, coInsertCallback, NULL, 0, (char *)"db", (char *)"x", &d, 1);
+    mongoAsyncInsert(ac, coInsertCallback, NULL, 0, (char *)"db", (char *)"x", &d, 1);
+    mongoAsyncFree(ac);
+    bson_destroy(&d);
+    /* Both callers of the batch that was never read and the two of the
+     * unsent one get a NULL reply, the cancelled query isn't called. */
+    test("Freeing the context fails every caller left: ");
+    test_cond(co.nulls == 4 && co.ok == 0);
+    mockStop();
+}
+
+/* Queue n findOnes on a pipeline. */
+static void pipelineFindOnes(mongoPipeline *p, int n) {
+    bson_t q;
+
+    for (int i = 0; i < n; i++) {
+        bson_init(&q);
+        BSON_APPEND_INT32(&q, "_id", i);
+        mongoPipelineFindOne(p, (char *)"db", (char *)"col", &q, NULL);
+        bson_destroy(&q);
+    }
+}
+
+static void pipelineRun(int port, int opmsg) {
+    mongoContext *c = mongoConnect("127.0.0.1", port);
+    mongoPipeline *p;
+    bson_t d, bad, cmd;
+    int idx[4], errs = 0, unmatched = 0, exhaust;
+    void *reply;
+
+    if (opmsg)
+        mongoEnableOpMsg(c);
+    p = mongoPipelineCreate(c);
+    pipelineFindOnes(p, 500);
+    bson_init(&d);
+    BSON_APPEND_INT32(&d, "_id", 9000);
+    bson_init(&bad);
+    BSON_APPEND_INT32(&bad, "$bad", 1);
+    bson_init(&cmd);
+    BSON_APPEND_INT32(&cmd, "ping", 1);
+    idx[0] = mongoPipelineInsert(p, 0, (char *)"db", (char *)"w", &d, 1);
+    idx[1] = mongoPipelineInsert(p, 0, (char *)"db", (char *)"w", &bad, 1);
+    idx[2] = mongoPipelineCommand(p, (char *)"admin", &cmd);
+    idx[3] = mongoPipelineUpdate(p, (char *)"db", (char *)"w", 0, &d, &d);
+    exhaust = mongoPipelineQuery(p, QUERY_FLAG_EXHAUST, (char *)"db", (char *)"col",
+                                 0, 0, NULL, NULL);
+    bson_destroy(&d);
+    bson_destroy(&bad);
+    bson_destroy(&cmd);
+
+    test(opmsg ? "Pipelined operations are slotted in order (OP_MSG): " :
+                 "Pipelined operations are slotted in order: ");
+    test_cond(idx[0] == 500 && idx[1] == 501 && idx[2] == 502 && idx[3] == 503 &&
+              exhaust == MONGO_ERR && p->nr_ops == 504);
+    test("A pipeline of 504 operations executes: ");
+    test_cond(mongoPipelineExec(p) == MONGO_OK && p->nr_pending == 0);
+    for (int i = 0; i < p->nr_ops; i++) {
+        if (p->ops[i].reply == NULL ||
+            ((mongoReply *)p->ops[i].reply)->responseTo != p->ops[i].req_id)
+            unmatched++;
+        if (p->ops[i].err && i != idx[1])
+            errs++;
+    }
+    test("Every slot holds the reply to its own request: ");
+    test_cond(unmatched == 0 && errs == 0);
+    test("A failed write only fails its own slot: ");
+    test_cond(p->ops[idx[1]].err == MONGO_ERR_OTHER &&
+              strstr(p->ops[idx[1]].errstr, "$ prefixed") != NULL);
+
+    reply = mongoPipelineTakeReply(p, 0);
+    test("Taking a reply leaves the slot empty: ");
+    test_cond(reply != NULL && p->ops[0].reply == NULL && docOf(reply, 0) != NULL);
+    freeReplyObject(reply);
+    mongoPipelineReset(p);
+    pipelineFindOnes(p, 3);
+    test("A reset pipeline can be used again: ");
+    test_cond(p->nr_ops == 3 && mongoPipelineExec(p) == MONGO_OK &&
+              p->ops[2].reply != NULL && p->ops[2].err == 0);
+    mongoPipelineFree(p);
+    mongoFree(c);
+}
+
+static void test_pipeline(void) {
+    int port = mockStart("-n 10");
+    mongoContext *c;
+    mongoPipeline *p;
+    int status, errs;
+
+    pipelineRun(port, 0);
+    pipelineRun(port, 1);
+    mockStop();
+
+    port = mockStart("-n 10 -F error=3");
+    c = mongoConnect("127.0.0.1", port);
+    p = mongoPipelineCreate(c);
+    pipelineFindOnes(p, 5);
+    status = mongoPipelineExec(p);
+    test("A query failure only fails its own slot: ");
+    test_cond(status == MONGO_OK && p->ops[2].err == MONGO_ERR_OTHER &&
+              p->ops[2].reply != NULL && p->ops[1].err == 0 && p->ops[3].err == 0);
+    mongoPipelineFree(p);
+    mongoFree(c);
+    mockStop();
+
+    /* The mock may drop the replies it queued before closing, the slots
+     * from the third on can't have one. */
+    port = mockStart("-n 10 -F close=3");
+    c = mongoConnect("127.0.0.1", port);
+    p = mongoPipelineCreate(c);
+    pipelineFindOnes(p, 5);
+    status = mongoPipelineExec(p);
+    errs = 0;
+    for (int i = 0; i < 5; i++)
+        if (p->ops[i].reply != NULL ? i >= 2 || p->ops[i].err != 0 :
+                                      p->ops[i].err != MONGO_ERR_EOF)
+            errs++;
+    test("Slots left without a reply get the error of the context: ");
+    test_cond(status == MONGO_ERR && errs == 0);
+    mongoPipelineFree(p);
+    mongoFree(c);
+    mockStop();
+}
+
+/* Allocator counting the blocks it hands out and those still live. */
+static long nr_allocs, nr_live;
+
+static void *countMalloc(size_t size) {
+    void *p = malloc(size);
+    if (p) nr_allocs++, nr_live++;
+    return p;
+}
+
+static void *countCalloc(size_t nmemb, size_t size) {
+    void *p = calloc(nmemb, size);
+    if (p) nr_allocs++, nr_live++;
+    return p;
+}
+
+static void *countRealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p) nr_allocs++;
+    if (p && ptr == NULL) nr_live++;
+    return p;
+}
+
+static void countFree(void *ptr) {
+    if (ptr) nr_live--;
+    free(ptr);
+}
+
+static void test_reply_alloc(void) {
+    mongoAllocFuncs fns = {countMalloc, countCalloc, countRealloc, countFree};
+    sds pkt = replyPacket(3, 150, 10), raw;
+    mongoContext *c = mongoConnectFd(-1);
+    bson_t docs[5], *pp[5];
+    mongoReply *r;
+    mongoMsgReply *m;
+    char *lo, *hi, *data;
+    int inside = 1, port;
+
+    for (int i = 0; i < 5; i++) {
+        bson_init(&docs[i]);
+        BSON_APPEND_INT32(&docs[i], "i", i);
+        pp[i] = &docs[i];
+    }
+    mongoAppendInsertCmd(c, 0, (char *)"db", (char *)"col", 0, pp, 5, NULL);
+    for (int i = 0; i < 5; i++)
+        bson_destroy(&docs[i]);
+
+    mongoSetAllocators(&fns);
+    nr_allocs = nr_live = 0;
+    r = mongoReplyCreateFromBytes(pkt, sdslen(pkt));
+    test("A reply of 150 documents is one allocation: ");
+    test_cond(r != NULL && nr_allocs == 1 && r->numberReturned == 150 &&
+              bson_extract_int32(r->docs[149], (char *)"i") == 149);
+
+    /* The documents are copied into the block of the reply. */
+    lo = (char *)r;
+    hi = lo + sizeof(*r) + 150 * (sizeof(bson_t *) + sizeof(bson_t)) + sdslen(pkt);
+    for (int i = 0; r != NULL && i < r->numberReturned; i++) {
+        data = (char *)bson_get_data(r->docs[i]);
+        if (data < lo || data >= hi)
+            inside = 0;
+    }
+    test("Its documents live in the same block: ");
+    test_cond(r != NULL && inside);
+    freeReplyObject(r);
+    test("Freeing it is a single free: ");
+    test_cond(nr_live == 0);
+
+    nr_allocs = 0;
+    m = mongoReplyCreateFromBytes(c->obuf, sdslen(c->obuf));
+    test("An OP_MSG reply with a document sequence is one allocation: ");
+    test_cond(m != NULL && nr_allocs == 1 && m->nr_seqs == 1 && m->seqs[0].nr_docs == 5 &&
+              bson_extract_int32(m->seqs[0].docs[4], (char *)"i") == 4);
+    freeReplyObject(m);
+
+    raw = sdsnewlen(pkt, sdslen(pkt));
+    nr_allocs = 0;
+    r = mongoReplyCreateNoCopy(raw, sdslen(raw));
+    test("A zero copy reply adds one allocation to its packet: ");
+    test_cond(r != NULL && nr_allocs == 1 && r->numberReturned == 150);
+    freeReplyObject(r);
+    test("Freeing it releases the packet as well: ");
+    test_cond(nr_live == 0);
+
+    nr_allocs = 0;
+    pkt[32]++; /* numberReturned, one more than there are documents */
+    r = mongoReplyCreateFromBytes(pkt, sdslen(pkt));
+    test("An invalid reply allocates nothing: ");
+    test_cond(r == NULL && nr_allocs == 0 && nr_live == 0);
+    mongoResetAllocators();
+    sdsfree(pkt);
+    c->fd = -1;
+    mongoFree(c);
+
+    port = mockStart("-n 150 -b 150");
+    c = mongoConnect("127.0.0.1", port);
+    r = mongoQuery(c, 0, (char *)"db", (char *)"col", 0, 0, NULL, NULL);
+    test("A reply of 150 documents comes over the wire intact: ");
+    test_cond(r != NULL && r->numberReturned == 150 &&
+              bson_extract_int32(docOf(r, 149), (char *)"_id") == 149 &&
+              !strcmp(bson_extract_string(docOf(r, 149), (char *)"name"), "doc-149"));
+    freeReplyObject(r);
+    mongoFree(c);
+    mockStop();
+}
+
+/* Everything the library allocates goes through the allocators set with
+ * mongoSetAllocators(), which the counting allocator can tell. */
+static void test_allocators(void) {
+    mongoAllocFuncs fns = {countMalloc, countCalloc, countRealloc, countFree};
+    static const int ids[] = {MONGO_COMPRESSOR_ZLIB, MONGO_COMPRESSOR_ZSTD};
+    static const char *names[] = {
+        "zlib streams go through the allocators: ",
+        "zstd contexts go through the allocators: ",
+    };
+    char src[4096], dst[8192], back[4096];
+    mongoCompressor *z;
+    long begin, decomp;
+    size_t written = 0;
+    int ok;
+    sds str;
+
+    mongoSetAllocators(&fns);
+    nr_allocs = nr_live = 0;
+    str = sdsnewlen(NULL, 100);
+    str = sdsMakeRoomFor(str, 10000);
+    sdsfree(str);
+    test("Zero filled sds strings go through the allocators: ");
+    test_cond(nr_allocs == 2 && nr_live == 0);
+
+    memset(src, 'x', sizeof(src));
+    for (int i = 0; i < 2; i++) {
+        if (!mongoCompressorSupported(ids[i]))
+            continue;
+        nr_allocs = nr_live = 0;
+        z = mongoCompressorCreate(ids[i], -1);
+        begin = nr_allocs;
+        ok = z != NULL && mongoCompressBegin(z, dst, sizeof(dst)) == MONGO_OK &&
+            mongoCompressUpdate(z, src, sizeof(src)) == MONGO_OK &&
+            mongoCompressEnd(z, &written) == MONGO_OK;
+        begin = nr_allocs - begin;
+        decomp = nr_allocs;
+        ok = ok && mongoDecompress(z, dst, written, back, sizeof(back)) == MONGO_OK &&
+            memcmp(src, back, sizeof(src)) == 0;
+        decomp = nr_allocs - decomp;
+        mongoCompressorFree(z);
+        test(names[i]);
+        test_cond(ok && begin > 0 && decomp > 0 && nr_live == 0);
+    }
+    mongoResetAllocators();
+}
+
+/* Allocator failing the allocation of a timer wheel, the first thing a
+ * context with a timeout allocates for its first callback. */
+static void *failWheelMalloc(size_t size) {
+    return size == sizeof(mongoTimerWheel) ? NULL : malloc(size);
+}
+
+static void test_callback_oom(void) {
+    mongoAllocFuncs fns = {failWheelMalloc, calloc, realloc, free};
+    int port = mockStart("-n 1");
+    struct timeval t1s = {1, 0};
+    mongoAsyncContext *ac;
+    int status;
+    bson_t d;
+
+    memset(&co, 0, sizeof(co));
+    ac = mongoAsyncConnect("127.0.0.1", port);
+    mongoAsyncSetTimeout(ac, t1s);
+    mongoSetAllocators(&fns);
+    status = mongoAsyncFindOne(ac, coInsertCallback, NULL, (char *)"db", (char *)"col", NULL, NULL);
+    mongoResetAllocators();
+    test("A command whose callback can't be registered fails: ");
+    test_cond(status == MONGO_ERR && ac->c.err == MONGO_ERR_OOM);
+    mongoAsyncFree(ac);
+    test("Its callback is never called: ");
+    test_cond(co.ok == 0 && co.nulls == 0);
+
+    ac = mongoAsyncConnect("127.0.0.1", port);
+    mongoAsyncSetTimeout(ac, t1s);
+    mongoAsyncSetInsertCoalescing(ac, 100, 0);
+    bson_init(&d);
+    BSON_APPEND_INT32(&d, "_id", 1);
+    mongoAsyncInsert(ac, coInsertCallback, NULL, 0, (char *)"db", (char *)"col", &d, 1);
+    bson_destroy(&d);
+    mongoSetAllocators(&fns);
+    status = mongoAsyncFindOne(ac, coInsertCallback, NULL, (char *)"db", (char *)"col", NULL, NULL);
+    mongoResetAllocators();
+    test("A batch whose callback can't be registered fails the command: ");
+    test_cond(status == MONGO_ERR && ac->c.err == MONGO_ERR_OOM);
+    mongoAsyncFree(ac);
+    test("The callers of the batch are failed once: ");
+    test_cond(co.ok == 0 && co.nulls == 1);
+    mockStop();
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        mock_path = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    test_mock_server();
+    test_op_msg();
+    test_compression();
+    test_reader();
+    test_pool();
+    test_cursor();
+    test_prefetch();
+    test_timer_wheel();
+    test_deadlines();
+    test_watermarks();
+    test_coalesce();
+    test_pipeline();
+    test_reply_alloc();
+    test_allocators();
+    test_callback_oom();
+
+    if (fails == 0) {
+        printf("ALL TESTS PASSED\n");
+    } else {
+        printf("*** %d TESTS FAILED ***\n", fails);
+    }
+    return fails > 255 ? 255 : fails;
+}
@@ -0,0 +1,159 @@
+#include "fmacros.h"
+#include <stdlib.h>
+#include <time.h>
+#include "alloc.h"
+#include "timer.h"
+
+#define __slotEmpty(head) ((head)->next == (head))
+
+static void __mongoTimerLink(mongoTimer *head, mongoTimer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void __mongoTimerUnlink(mongoTimer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/* Move all the timers of a list to the tail of another one. */
+static void __mongoTimerSplice(mongoTimer *from, mongoTimer *to) {
+    if (__slotEmpty(from))
+        return;
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    from->next = from->prev = from;
+}
+
+/* Milliseconds on the monotonic clock, the time base of the wheels. */
+uint64_t mongoTimerNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+mongoTimerWheel *mongoTimerWheelCreate(uint64_t now) {
+    mongoTimerWheel *w;
+    mongoTimer *head;
+
+    w = mongo_malloc(sizeof(*w));
+    if (w == NULL)
+        return NULL;
+    w->next = now;
+    w->count = 0;
+    for (int l = 0; l < MONGO_WHEEL_LEVELS; l++) {
+        for (int i = 0; i < MONGO_WHEEL_SLOTS; i++) {
+            head = &w->slots[l][i];
+            head->next = head->prev = head;
+        }
+    }
+    return w;
+}
+
+/* The timers still armed on the wheel are left alone, they belong to the
+ * caller. */
+void mongoTimerWheelFree(mongoTimerWheel *w) {
+    mongo_free(w);
+}
+
+static void __mongoTimerPlace(mongoTimerWheel *w, mongoTimer *t) {
+    const uint64_t span = (uint64_t)1 << (MONGO_WHEEL_BITS * MONGO_WHEEL_LEVELS);
+    uint64_t at, delta;
+    int l;
+
+    /* A deadline in the past fires on the next tick, one beyond the reach of
+     * the wheel parks in the last slot the top level can address. */
+    at = t->expires < w->next ? w->next : t->expires;
+    delta = at - w->next;
+    if (delta >= span) {
+        at = w->next + span - 1;
+        delta = span - 1;
+    }
+    for (l = 0; l < MONGO_WHEEL_LEVELS - 1; l++) {
+        if (delta < (uint64_t)1 << (MONGO_WHEEL_BITS * (l + 1)))
+            break;
+    }
+    __mongoTimerLink(&w->slots[l][(at >> (MONGO_WHEEL_BITS * l)) & MONGO_WHEEL_MASK], t);
+}
+
+/* Arm a timer to expire at the given time, which is in the same milliseconds
+ * as mongoTimerNow. The timer must not be armed already. */
+void mongoTimerAdd(mongoTimerWheel *w, mongoTimer *t, uint64_t expires) {
+    t->expires = expires;
+    __mongoTimerPlace(w, t);
+    w->count++;
+}
+
+/* Disarm a timer, either waiting on the wheel or handed out as expired by
+ * mongoTimerWheelAdvance and not yet taken off that list. */
+void mongoTimerDel(mongoTimerWheel *w, mongoTimer *t) {
+    if (!mongoTimerArmed(t))
+        return;
+    __mongoTimerUnlink(t);
+    w->count--;
+}
+
+/* Redistribute a slot of an upper level over the levels below it. */
+static void __mongoTimerCascade(mongoTimerWheel *w, int level, int idx) {
+    mongoTimer list, *t;
+
+    list.next = list.prev = &list;
+    __mongoTimerSplice(&w->slots[level][idx], &list);
+    while (!__slotEmpty(&list)) {
+        t = list.next;
+        __mongoTimerUnlink(t);
+        __mongoTimerPlace(w, t);
+    }
+}
+
+/* Run the wheel's clock up to now and move the timers that expired on the
+ * way to the expired list, which is initialized here. The caller takes them
+ * off with mongoTimerDel, which leaves them unarmed. */
+void mongoTimerWheelAdvance(mongoTimerWheel *w, uint64_t now, mongoTimer *expired) {
+    uint64_t tick;
+    int idx;
+
+    expired->next = expired->prev = expired;
+    if (w->count == 0) {
+        /* Nothing to walk over. */
+        if (w->next <= now)
+            w->next = now + 1;
+        return;
+    }
+
+    while (w->next <= now) {
+        tick = w->next;
+        idx = tick & MONGO_WHEEL_MASK;
+        if (idx == 0) {
+            for (int l = 1; l < MONGO_WHEEL_LEVELS; l++) {
+                int i = (tick >> (MONGO_WHEEL_BITS * l)) & MONGO_WHEEL_MASK;
+                __mongoTimerCascade(w, l, i);
+                if (i != 0)
+                    break;
+            }
+        }
+        __mongoTimerSplice(&w->slots[0][idx], expired);
+        w->next++;
+    }
+}
+
+/* Milliseconds from now until the wheel needs to be advanced again, or -1
+ * when no timer is armed. This is the next deadline on the lowest level, or
+ * the next cascade of an upper level when that comes first, so timers far
+ * ahead cost at most one early wakeup every 64 ms. */
+int64_t mongoTimerWheelNext(mongoTimerWheel *w, uint64_t now) {
+    uint64_t tick = w->next;
+
+    if (w->count == 0)
+        return -1;
+    while ((tick & MONGO_WHEEL_MASK) != 0 &&
+           __slotEmpty(&w->slots[0][tick & MONGO_WHEEL_MASK]))
+        tick++;
+    return tick > now ? (int64_t)(tick - now) : 0;
+}
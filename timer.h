@@ -0,0 +1,49 @@
+#ifndef __HIMONGO_TIMER_H
+#define __HIMONGO_TIMER_H
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hierarchical timer wheel with a resolution of one millisecond. Every level
+ * has 64 slots and each slot of a level spans a whole turn of the level
+ * below, so the four levels cover 64^4 ms (about 4.6 hours) ahead of the
+ * wheel's clock. Later deadlines wait in the last level and are put back
+ * when it comes around. Adding and removing a timer is O(1), and advancing
+ * the wheel costs one slot per elapsed millisecond plus a cascade every 64. */
+#define MONGO_WHEEL_BITS 6
+#define MONGO_WHEEL_SLOTS (1 << MONGO_WHEEL_BITS)
+#define MONGO_WHEEL_MASK (MONGO_WHEEL_SLOTS - 1)
+#define MONGO_WHEEL_LEVELS 4
+
+typedef struct mongoTimer {
+    struct mongoTimer *next; /* circular list of the slot, NULL when unarmed */
+    struct mongoTimer *prev;
+    uint64_t expires; /* deadline in ms on the wheel's clock */
+    void *data;
+} mongoTimer;
+
+typedef struct mongoTimerWheel {
+    uint64_t next; /* next millisecond to be processed */
+    unsigned long count; /* number of armed timers */
+    mongoTimer slots[MONGO_WHEEL_LEVELS][MONGO_WHEEL_SLOTS]; /* list heads */
+} mongoTimerWheel;
+
+static inline int mongoTimerArmed(const mongoTimer *t) {
+    return t->next != NULL;
+}
+
+uint64_t mongoTimerNow(void);
+mongoTimerWheel *mongoTimerWheelCreate(uint64_t now);
+void mongoTimerWheelFree(mongoTimerWheel *w);
+void mongoTimerAdd(mongoTimerWheel *w, mongoTimer *t, uint64_t expires);
+void mongoTimerDel(mongoTimerWheel *w, mongoTimer *t);
+void mongoTimerWheelAdvance(mongoTimerWheel *w, uint64_t now, mongoTimer *expired);
+int64_t mongoTimerWheelNext(mongoTimerWheel *w, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
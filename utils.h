@@ -5,6 +5,8 @@
 #ifndef __HIMONGO_UTILS_H_
 #define __HIMONGO_UTILS_H_ 1
 
+#include <stdint.h>
+
 #include "sds.h"
 
 #define UNUSED(x) (void)(x)
@@ -17,5 +19,6 @@ int mongoSnpack(char *buf, size_t offset, size_t size, char const *fmt, ...);
 int mongoSnunpack(char *buf, size_t offset, size_t size, char const *fmt, ...);
 
 void mongoFreev(void **v);
+uint32_t mongoCrc32c(uint32_t crc, const char *buf, size_t len);
 
 #endif /* _UTILS_H_ */